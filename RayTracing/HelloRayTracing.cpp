@@ -11,11 +11,24 @@
 #include <DirectXMath.h>
 #include <d3dcompiler.h>
 #include <iostream>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include "helper/ImageDecoder.h"
 #include "helper/TextureLoader.h"
+#include "helper/VertexCompression.h"
 #include "core/D3DUtility.h"
 
 using namespace DirectX;
 
+namespace
+{
+    double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+}
+
 HelloRayTracing::HelloRayTracing(UINT width, UINT height, std::wstring name) 
     : DXSample(width, height, name), m_frameIndex(0),
     m_viewport(0.0f, 0.0f, static_cast<float>(width),static_cast<float>(height)),
@@ -24,6 +37,8 @@ HelloRayTracing::HelloRayTracing(UINT width, UINT height, std::wstring name)
 
 void HelloRayTracing::OnInit()
 {
+    m_loadStart = std::chrono::high_resolution_clock::now();
+
     //init camera
     nv_helpers_dx12::CameraManip.setWindowSize(GetWidth(), GetHeight());
     nv_helpers_dx12::CameraManip.setLookat(glm::vec3(1.5f, 1.5f, 1.5f), glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
@@ -54,13 +69,26 @@ void HelloRayTracing::OnInit()
 void HelloRayTracing::OnUpdate()
 {
     UpdateCameraBuffer();
+    UpdateSceneHierarchy();
 }
 
 void HelloRayTracing::OnRender()
 {
+    // The previous frame has finished
+    m_retiredResources.clear();
+
     ThrowIfFailed(m_commandAllocator->Reset());
     ThrowIfFailed(m_commandList->Reset(m_commandAllocator.Get(), m_rasterPiplineState.Get()));
 
+    if (m_modelStreamer)
+        StreamSceneGeometry();
+
+    // Visible instances for the raster loop and the page residency
+    if (m_meshCulling || m_geometryStore)
+        ClusterCulling::CullBounds(m_instanceBounds, m_instanceCount, m_cameraFrustum, m_visibleInstances, m_meshCullStats);
+    if (m_geometryStore)
+        UpdateGeometryResidency();
+
     // Set necessary state.
     m_commandList->SetGraphicsRootSignature(m_rasterRootSignature.Get());
     m_commandList->RSSetViewports(1, &m_viewport);
@@ -76,7 +104,11 @@ void HelloRayTracing::OnRender()
     CD3DX12_CPU_DESCRIPTOR_HANDLE dsvHandle(m_dsvHeap->GetCPUDescriptorHandleForHeapStart());
     m_commandList->OMSetRenderTargets(1, &rtvHandle, FALSE, &dsvHandle);
 
-    if (m_raster) {
+    if (m_topLevelASDirty && m_topLevelASBuffers.pResult && !m_instances.empty())
+        RefitTopLevelAS();
+
+    // Nothing to trace before the first streamed or paged in mesh
+    if (m_raster || !m_topLevelASBuffers.pResult || m_instances.empty()) {
         const float clearColor[] = { 0.0f, 0.2f, 0.4f, 1.0f };
         m_commandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
         m_commandList->ClearRenderTargetView(rtvHandle, clearColor, 0, nullptr);
@@ -86,10 +118,10 @@ void HelloRayTracing::OnRender()
         m_commandList->SetDescriptorHeaps(static_cast<UINT>(heaps.size()), heaps.data());
         m_commandList->SetGraphicsRootDescriptorTable(0, m_constHeap->GetGPUDescriptorHandleForHeapStart());
 
-        m_commandList->SetGraphicsRootConstantBufferView(1, m_rasterObjectCB->GetGPUVirtualAddress());
-
-        std::vector< ID3D12DescriptorHeap* > heaps2 = { m_srvTexHeap.Get() };
-        m_commandList->SetDescriptorHeaps(static_cast<UINT>(heaps2.size()), heaps2.data());
+        if (m_srvTexHeap) {
+            std::vector< ID3D12DescriptorHeap* > heaps2 = { m_srvTexHeap.Get() };
+            m_commandList->SetDescriptorHeaps(static_cast<UINT>(heaps2.size()), heaps2.data());
+        }
 
 
         //D3D12_VERTEX_BUFFER_VIEW vertexBufferView = m_meshes["tet"]->VertexBufferView();
@@ -98,20 +130,74 @@ void HelloRayTracing::OnRender()
         //m_commandList->IASetIndexBuffer(&indexBufferView);
         //m_commandList->DrawIndexedInstanced(m_meshes["tet"]->IndexCount, 1, 0, 0, 0);
 
+        const XMMATRIX view = XMLoadFloat4x4(&m_view);
+        const XMMATRIX projection = XMLoadFloat4x4(&m_projection);
+        m_cullStats = ClusterCullStats();
+
+        UINT objectIndex = 0;
         for (auto& mesh : m_sceneModel.Meshes) {
-            if (!mesh.second.empty()) {
-                CD3DX12_GPU_DESCRIPTOR_HANDLE srvTexHandle = CD3DX12_GPU_DESCRIPTOR_HANDLE(m_srvTexHeap->GetGPUDescriptorHandleForHeapStart());
-                srvTexHandle.Offset(m_sceneModel.Textures[mesh.second[0]]->SrvHeapIndex, m_cbvSrvUavDescriptorSize);
-                m_commandList->SetGraphicsRootDescriptorTable(2, srvTexHandle);
+            if (!mesh.first->IsResident()) {
+                objectIndex += static_cast<UINT>(mesh.first->Instances.size());
+                continue;
+            }
+            for (size_t instance = 0; instance < mesh.first->Instances.size(); ++instance, ++objectIndex) {
+                if (m_meshCulling && !IsInstanceVisible(objectIndex))
+                    continue;
+
+                // Culling and LOD selection run in the space of the instance
+                Frustum frustum;
+                XMFLOAT3 cameraPosition;
+                GetCullingFrustum(GetInstanceWorld(*mesh.first, instance), view, projection, frustum, cameraPosition);
+
+                const UINT lod = m_lodSelection ? SelectLod(*mesh.first, cameraPosition) : 0;
+                m_visibleRanges.clear();
+                if (lod > 0) {
+                    // Meshlets only cover the base range, simplified levels are culled as a whole
+                    if (m_clusterCulling && !frustum.IntersectsSphere(mesh.first->BoundsCenter, mesh.first->BoundsRadius))
+                        continue;
+                    m_visibleRanges.push_back({ mesh.first->Lods[lod].StartIndexLocation, mesh.first->Lods[lod].IndexCount });
+                }
+                else if (m_clusterCulling && !mesh.first->Meshlets.empty()) {
+                    ClusterCulling::CullMeshlets(mesh.first->Meshlets, frustum, cameraPosition, m_coneCulling && m_rasterCullsBackFaces, m_visibleRanges, m_cullStats);
+                    if (m_visibleRanges.empty())
+                        continue;
+                }
+                else {
+                    m_visibleRanges.push_back({ 0, mesh.first->IndexCount });
+                }
+
+                m_commandList->SetGraphicsRootConstantBufferView(1, m_rasterObjectCB->GetGPUVirtualAddress() + UINT64(objectIndex) * kRasterObjectStride);
+
+                if (!mesh.second.empty()) {
+                    CD3DX12_GPU_DESCRIPTOR_HANDLE srvTexHandle = CD3DX12_GPU_DESCRIPTOR_HANDLE(m_srvTexHeap->GetGPUDescriptorHandleForHeapStart());
+                    srvTexHandle.Offset(m_sceneModel.Textures[mesh.second[0]]->SrvHeapIndex, m_cbvSrvUavDescriptorSize);
+                    m_commandList->SetGraphicsRootDescriptorTable(2, srvTexHandle);
+                }
+
+                if (mesh.first->Format == VertexFormat::CompactQuantized) {
+                    // center.xyz, pad, extent.xyz, pad
+                    const VertexQuantization& q = mesh.first->Quantization;
+                    float dequantize[8] = { q.Center.x, q.Center.y, q.Center.z, 0.0f, q.Extent.x, q.Extent.y, q.Extent.z, 0.0f };
+                    m_commandList->SetGraphicsRoot32BitConstants(3, 8, dequantize, 0);
+                }
+
+                D3D12_VERTEX_BUFFER_VIEW vertexBufferView = mesh.first->VertexBufferView();
+                m_commandList->IASetVertexBuffers(0, 1,&vertexBufferView);
+                D3D12_INDEX_BUFFER_VIEW indexBufferView = mesh.first->IndexBufferView();
+                m_commandList->IASetIndexBuffer(&indexBufferView);
+                for (auto& range : m_visibleRanges)
+                    m_commandList->DrawIndexedInstanced(range.IndexCount, 1, range.StartIndexLocation, 0, 0);
             }
-
-            D3D12_VERTEX_BUFFER_VIEW vertexBufferView = mesh.first->VertexBufferView();
-            m_commandList->IASetVertexBuffers(0, 1,&vertexBufferView);
-            D3D12_INDEX_BUFFER_VIEW indexBufferView = mesh.first->IndexBufferView();
-            m_commandList->IASetIndexBuffer(&indexBufferView);
-            m_commandList->DrawIndexedInstanced(mesh.first->IndexCount, 1, 0, 0, 0);
         }
 
+        if (m_meshCulling && m_instanceCount > 0 && ++m_meshCullFrames == kMeshCullReportFrames) {
+            const MeshCullStats& stats = m_meshCullStats;
+            std::cout << "Mesh culling: " << double(stats.Instances - stats.FrustumCulled) / m_meshCullFrames << " of "
+                << m_instanceCount << " instances visible, " << double(stats.FrustumCulled) / m_meshCullFrames << " culled, "
+                << 1000.0 * stats.CullMs / m_meshCullFrames << " us per frame" << std::endl;
+            m_meshCullStats = MeshCullStats();
+            m_meshCullFrames = 0;
+        }
     }
     else { //DXR continue
         std::vector<ID3D12DescriptorHeap*> heaps = { m_rtSrvUavHeap.Get() };
@@ -170,10 +256,16 @@ void HelloRayTracing::OnRender()
     // Present the frame.
     ThrowIfFailed(m_swapChain->Present(1, 0));
     WaitForPreviousFrame();
+
+    if (m_frameCount++ == 0)
+        std::cout << "First frame after " << ElapsedMs(m_loadStart) << " ms" << std::endl;
 }
 
 void HelloRayTracing::OnDestroy()
 {
+    // Stops the loader threads
+    m_modelStreamer.reset();
+    m_geometryStore.reset();
     WaitForPreviousFrame();
 
     CloseHandle(m_fenceEvent);
@@ -207,6 +299,28 @@ void HelloRayTracing::OnKeyUp(UINT8 key)
     if (key == VK_SPACE) {
         m_raster = !m_raster;
     }
+    else if (key == 'C') {
+        m_clusterCulling = !m_clusterCulling;
+        std::cout << "Cluster culling " << (m_clusterCulling ? "on" : "off") << std::endl;
+    }
+    else if (key == 'V') {
+        m_meshCulling = !m_meshCulling;
+        std::cout << "Mesh frustum culling " << (m_meshCulling ? "on" : "off") << std::endl;
+    }
+    else if (key == 'B') {
+        // The cone test drops back facing clusters, only correct when the rasterizer would drop them too
+        m_coneCulling = !m_coneCulling;
+        std::cout << "Backface cone culling " << (m_coneCulling ? "on" : "off")
+            << (m_coneCulling && !m_rasterCullsBackFaces ? ", skipped: the raster pipeline draws back faces" : "") << std::endl;
+    }
+    else if (key == 'L') {
+        m_lodSelection = !m_lodSelection;
+        std::cout << "LOD selection " << (m_lodSelection ? "on" : "off") << std::endl;
+    }
+    else if (key == 'N') {
+        m_animateHierarchy = !m_animateHierarchy;
+        std::cout << "Node animation " << (m_animateHierarchy ? "on" : "off") << std::endl;
+    }
 }
 
 void HelloRayTracing::Initialize()
@@ -352,8 +466,9 @@ void HelloRayTracing::LoadAssets()
         tetrahedron->VertexCount = 4.;
         tetrahedron->VertexBufferGPU = helper::CreateDefaultBuffer(m_device.Get(), m_commandList.Get(),triangleVertices, vertexBufferSize,tetrahedron->VertexBufferUploader);
 
-        std::vector<UINT32> indices = { 0, 1, 2, 0, 3, 1, 0, 2, 3, 1, 3, 2 };
-        const UINT indexBufferSize = static_cast<UINT>(indices.size()) * sizeof(UINT32);
+        std::vector<UINT16> indices = { 0, 1, 2, 0, 3, 1, 0, 2, 3, 1, 3, 2 };
+        const UINT indexBufferSize = static_cast<UINT>(indices.size()) * sizeof(UINT16);
+        tetrahedron->IndexFormat = DXGI_FORMAT_R16_UINT;
         tetrahedron->IndexBufferByteSize = indexBufferSize;
         tetrahedron->IndexCount = indices.size();
         tetrahedron->IndexBufferGPU = helper::CreateDefaultBuffer(m_device.Get(), m_commandList.Get(), indices.data(), indexBufferSize,tetrahedron->IndexBufferUploader);
@@ -363,14 +478,186 @@ void HelloRayTracing::LoadAssets()
 
     m_textloader.Initialize(m_device.Get(), m_commandList.Get());
 
-    {
-        ModelLoader modelLoader(m_device.Get(),m_commandList.Get(), &m_textloader);
-        modelLoader.Load("Resource/Model/sponza/sponza.obj", m_sceneModel);           
+    const std::string sceneFile = "Resource/Model/sponza/sponza.obj";
+    m_modelLoader = std::make_unique<ModelLoader>(m_device.Get(), m_commandList.Get(), &m_textloader);
+    ModelLoadOptions loadOptions;
+    loadOptions.Format = m_vertexFormat;
+    // Only the hierarchy root moves ('N'), the nodes of the file can be merged across
+    loadOptions.StaticScene = true;
+    m_modelLoader->SetOptions(loadOptions);
+    m_sceneModel.Format = m_vertexFormat;
+    if (m_runBenchmarks) {
+        SceneHierarchy::RunBenchmark(100000, 0.01f);
+        TexturePathIndex::RunBenchmark(10000, 2000);
+        GeometryCodec::RunBenchmark(1024);
+        GeometryStore::RunStressTest(256, 600);
+    }
+
+    if (m_pagedGeometry) {
+        // Every mesh starts without buffers, OnRender uploads them as the store pages them in
+        GeometryStoreOptions storeOptions;
+        storeOptions.BudgetBytes = kGeometryBudget;
+        m_geometryStore = std::make_unique<GeometryStore>(storeOptions);
+        if (m_modelLoader->OpenPaged(sceneFile, m_sceneModel, *m_geometryStore)) {
+            if (m_runBenchmarks)
+                RunTextureBenchmarks();
+            m_srvTexHeap = m_textloader.GenerateHeap();
+            return;
+        }
+        m_geometryStore.reset();
+    }
+
+    if (m_asyncLoading) {
+        // The meshes are added in OnRender as they arrive
+        m_modelStreamer = std::make_unique<ModelStreamer>(m_modelLoader.get(), &m_textloader);
+        m_modelStreamer->Start(sceneFile);
+        return;
+    }
+
+    m_modelLoader->Load(sceneFile, m_sceneModel);
+    m_modelLoader.reset();
+    if (m_runBenchmarks) {
+        RunTextureBenchmarks();
+        RunClusterCullingBenchmark();
     }
 
     m_srvTexHeap = m_textloader.GenerateHeap();
 }
 
+// Uploads the meshes the loader thread has finished, at most kStreamedMeshesPerFrame per frame, and adds them
+// to the acceleration structures and the SBT. Records on the frame's command list before anything is drawn.
+void HelloRayTracing::StreamSceneGeometry()
+{
+    ModelStreamer& streamer = *m_modelStreamer;
+    if (!streamer.IsImported()) {
+        if (streamer.Failed()) {
+            std::cout << "ModelStreamer: the scene could not be loaded" << std::endl;
+            m_modelStreamer.reset();
+            m_modelLoader.reset();
+        }
+        return;
+    }
+
+    if (!m_streamImported) {
+        // Known before the first mesh, the descriptor heap gets room for every texture of the scene
+        m_sceneModel.Directory = streamer.GetDirectory();
+        m_sceneModel.Hierarchy = streamer.GetHierarchy();
+        m_srvTexHeap = m_textloader.GenerateHeap(streamer.GetTextureCount());
+        m_streamImported = true;
+    }
+
+    const size_t firstMesh = m_sceneModel.Meshes.size();
+    std::unique_ptr<StreamedMesh> mesh;
+    for (UINT i = 0; i < kStreamedMeshesPerFrame && streamer.TryPop(mesh); ++i) {
+        // Uploaded first, AddMesh finds them by file name
+        for (auto& texture : mesh->Textures) {
+            std::shared_ptr<Texture> loaded = std::make_shared<Texture>();
+            loaded->Type = texture.Type;
+            m_textloader.Upload(texture.Decoded, loaded);
+        }
+        m_modelLoader->AddMesh(mesh->Data, m_sceneModel);
+    }
+
+    if (m_sceneModel.Meshes.size() > firstMesh) {
+        if (firstMesh == 0)
+            m_firstMeshMs = ElapsedMs(m_loadStart);
+        m_textloader.UpdateHeap(m_srvTexHeap.Get());
+        CreateAccelerationStructures();
+        CreateShaderBindingTable();
+        WriteObjectConstants();
+    }
+
+    if (streamer.IsFinished()) {
+        const ModelStreamStats& stats = streamer.GetStats();
+        std::cout << "ModelStreamer: first mesh after " << m_firstMeshMs << " ms, full scene after " << ElapsedMs(m_loadStart)
+            << " ms (" << m_sceneModel.Meshes.size() << " meshes, " << stats.TextureCount << " textures, frame " << m_frameCount
+            << "), loader thread: import " << stats.ImportMs << " ms, texture decode " << stats.DecodeMs
+            << " ms, waited on the render thread " << stats.StallMs << " ms";
+        if (stats.FailedTextures)
+            std::cout << ", " << stats.FailedTextures << " textures failed";
+        std::cout << std::endl;
+        m_modelStreamer.reset();
+        m_modelLoader.reset();
+        if (m_runBenchmarks) {
+            RunTextureBenchmarks();
+            RunClusterCullingBenchmark();
+        }
+    }
+}
+
+// Feeds the visibility of every page to the residency manager, releases the evicted meshes and uploads
+// at most kPagesPerFrame pages the loader thread has read. Runs after the frustum culling and before
+// anything is drawn, the acceleration structures and the SBT are rebuilt over the resident meshes.
+void HelloRayTracing::UpdateGeometryResidency()
+{
+    GeometryStore& store = *m_geometryStore;
+    const UINT pageCount = store.GetPageCount();
+    XMMATRIX view = XMLoadFloat4x4(&m_view);
+    XMVECTOR eye = XMMatrixInverse(nullptr, view).r[3];
+
+    // A page is as visible and as close as its best instance, the bounds are in draw order
+    m_pageVisibility.resize(pageCount);
+    size_t objectIndex = 0;
+    for (UINT page = 0; page < pageCount; ++page) {
+        GeometryStore::PageVisibility& visibility = m_pageVisibility[page];
+        visibility.Visible = false;
+        visibility.Distance = FLT_MAX;
+        const size_t instances = m_sceneModel.Meshes[page].first->Instances.size();
+        for (size_t instance = 0; instance < instances; ++instance, ++objectIndex) {
+            const BoundsBlock& block = m_instanceBounds[objectIndex / 8];
+            const size_t lane = objectIndex % 8;
+            XMVECTOR center = XMVectorSet(block.CenterX[lane], block.CenterY[lane], block.CenterZ[lane], 1.0f);
+            float distance = XMVectorGetX(XMVector3Length(XMVectorSubtract(center, eye))) - block.Radius[lane];
+            visibility.Visible |= IsInstanceVisible(objectIndex);
+            visibility.Distance = (std::min)(visibility.Distance, (std::max)(distance, 0.0f));
+        }
+    }
+
+    m_evictedPages.clear();
+    store.Update(m_pageVisibility, m_evictedPages);
+    for (UINT page : m_evictedPages) {
+        // The last frame that used them has finished, the list is cleared after the next one
+        Mesh& mesh = *m_sceneModel.Meshes[page].first;
+        m_retiredResources.push_back(mesh.VertexBufferGPU);
+        m_retiredResources.push_back(mesh.IndexBufferGPU);
+        m_retiredResources.push_back(m_meshBottomLevelAS[page]);
+        mesh.VertexBufferGPU = nullptr;
+        mesh.IndexBufferGPU = nullptr;
+        m_meshBottomLevelAS[page] = nullptr;
+        std::vector<Meshlet>().swap(mesh.Meshlets);
+    }
+
+    std::unique_ptr<GeometryPageData> page;
+    UINT pagedIn = 0;
+    while (pagedIn < kPagesPerFrame && store.TryPop(page)) {
+        if (!page->Valid)
+            continue;
+        Mesh& mesh = *m_sceneModel.Meshes[page->Page].first;
+        m_modelLoader->UploadPage(*page, mesh);
+        // Copied on this frame's command list
+        m_retiredResources.push_back(mesh.VertexBufferUploader);
+        m_retiredResources.push_back(mesh.IndexBufferUploader);
+        mesh.VertexBufferUploader = nullptr;
+        mesh.IndexBufferUploader = nullptr;
+        ++pagedIn;
+    }
+
+    if (pagedIn > 0 || !m_evictedPages.empty()) {
+        CreateAccelerationStructures();
+        CreateShaderBindingTable();
+    }
+
+    if (++m_residencyFrames == kResidencyReportFrames) {
+        const GeometryStoreStats& stats = store.GetStats();
+        std::cout << "GeometryStore: " << stats.ResidentPages << "/" << stats.PageCount << " pages resident, "
+            << stats.ResidentBytes / (1024.0 * 1024.0) << " of " << kGeometryBudget / (1024.0 * 1024.0) << " MB, "
+            << stats.PageIns << " page ins, " << stats.PageOuts << " page outs, " << stats.Reloads << " reloads, "
+            << stats.BytesRead / (1024.0 * 1024.0) << " MB read, " << stats.BytesDecoded / (1024.0 * 1024.0) << " MB decoded, "
+            << double(stats.VisibleMisses) / stats.Updates << " visible pages missing per frame" << std::endl;
+        m_residencyFrames = 0;
+    }
+}
+
 void HelloRayTracing::WaitForPreviousFrame()
 {
     //This is code implemented as such for simplicity. use FRAME RESOURCE can be more efficient
@@ -391,7 +678,7 @@ void HelloRayTracing::LoadRasterPipeline()
 {
     // Create an empty root signature.
     {
-        CD3DX12_ROOT_PARAMETER rootParameter[3];
+        CD3DX12_ROOT_PARAMETER rootParameter[4];
         CD3DX12_DESCRIPTOR_RANGE range;
         range.Init(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, 1, 0);
         rootParameter[0].InitAsDescriptorTable(1, &range, D3D12_SHADER_VISIBILITY_ALL);
@@ -402,9 +689,12 @@ void HelloRayTracing::LoadRasterPipeline()
         srvTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);
         rootParameter[2].InitAsDescriptorTable(1, &srvTable, D3D12_SHADER_VISIBILITY_PIXEL);
 
+        // Per mesh dequantization for VertexFormat::CompactQuantized
+        rootParameter[3].InitAsConstants(8, 2, 0, D3D12_SHADER_VISIBILITY_VERTEX);
+
         auto staticSamplers = GetStaticSamplers();
         CD3DX12_ROOT_SIGNATURE_DESC rootSignatureDesc;
-        rootSignatureDesc.Init(3, rootParameter, (UINT)staticSamplers.size(), staticSamplers.data(), D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
+        rootSignatureDesc.Init(4, rootParameter, (UINT)staticSamplers.size(), staticSamplers.data(), D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
 
         ComPtr<ID3DBlob> signature;
         ComPtr<ID3DBlob> error;
@@ -427,8 +717,17 @@ void HelloRayTracing::LoadRasterPipeline()
         UINT compileFlags = 0;
 #endif
 
+        // The vertex shader decodes the compact layouts
+        D3D_SHADER_MACRO compactMacros[] = { {"COMPACT_VERTEX", "1"}, {nullptr, nullptr} };
+        D3D_SHADER_MACRO quantizedMacros[] = { {"COMPACT_VERTEX", "1"}, {"QUANTIZED_POSITION", "1"}, {nullptr, nullptr} };
+        const D3D_SHADER_MACRO* vertexMacros = nullptr;
+        if (m_sceneModel.Format == VertexFormat::Compact)
+            vertexMacros = compactMacros;
+        else if (m_sceneModel.Format == VertexFormat::CompactQuantized)
+            vertexMacros = quantizedMacros;
+
         ThrowIfFailed(D3DCompileFromFile(GetAssetFullPath(L"shaders.hlsl").c_str(),
-            nullptr, nullptr, "VSMain", "vs_5_0",
+            vertexMacros, nullptr, "VSMain", "vs_5_0",
             compileFlags, 0, &vertexShader, nullptr));
         ThrowIfFailed(D3DCompileFromFile(GetAssetFullPath(L"shaders.hlsl").c_str(),
             nullptr, nullptr, "PSMain", "ps_5_0",
@@ -447,14 +746,43 @@ void HelloRayTracing::LoadRasterPipeline()
             {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 24,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0}
         };
 
+        // Vertex_Tangent, the shaders don't read the tangent yet
+        D3D12_INPUT_ELEMENT_DESC tangentElementDescs[] = {
+            {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 24,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"TANGENT", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 32,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0}
+        };
+
+        // Vertex_Compact
+        D3D12_INPUT_ELEMENT_DESC compactElementDescs[] = {
+            {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"NORMAL", 0, DXGI_FORMAT_R16G16_SNORM, 0, 12,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"TEXCOORD", 0, DXGI_FORMAT_R16G16_FLOAT, 0, 16,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0}
+        };
+
+        // Vertex_Quantized
+        D3D12_INPUT_ELEMENT_DESC quantizedElementDescs[] = {
+            {"POSITION", 0, DXGI_FORMAT_R16G16B16A16_SNORM, 0, 0,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"NORMAL", 0, DXGI_FORMAT_R16G16_SNORM, 0, 8,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+            {"TEXCOORD", 0, DXGI_FORMAT_R16G16_FLOAT, 0, 12,D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0}
+        };
+
         // Describe and create the graphics pipeline state object (PSO).
         D3D12_GRAPHICS_PIPELINE_STATE_DESC psoDesc = {};
         psoDesc.InputLayout = { inputElementDescs, _countof(inputElementDescs) };
+        if (m_sceneModel.Format == VertexFormat::Compact)
+            psoDesc.InputLayout = { compactElementDescs, _countof(compactElementDescs) };
+        else if (m_sceneModel.Format == VertexFormat::CompactQuantized)
+            psoDesc.InputLayout = { quantizedElementDescs, _countof(quantizedElementDescs) };
+        else if (m_sceneModel.Format == VertexFormat::FullTangent)
+            psoDesc.InputLayout = { tangentElementDescs, _countof(tangentElementDescs) };
         psoDesc.pRootSignature = m_rasterRootSignature.Get();
         psoDesc.VS = CD3DX12_SHADER_BYTECODE(vertexShader.Get());
         psoDesc.PS = CD3DX12_SHADER_BYTECODE(pixelShader.Get());
         psoDesc.RasterizerState = CD3DX12_RASTERIZER_DESC(D3D12_DEFAULT);
         psoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+        m_rasterCullsBackFaces = psoDesc.RasterizerState.CullMode == D3D12_CULL_MODE_BACK;
         psoDesc.BlendState = CD3DX12_BLEND_DESC(D3D12_DEFAULT);
         psoDesc.DepthStencilState = CD3DX12_DEPTH_STENCIL_DESC(D3D12_DEFAULT);
         psoDesc.DSVFormat = DXGI_FORMAT_D32_FLOAT;
@@ -487,14 +815,80 @@ void HelloRayTracing::CreateCameraBuffer()
     m_device->CreateConstantBufferView(&cbvDesc, cbvHandle);
 
     //--------------------------------------------------
-    XMMATRIX world = DirectX::XMMatrixScaling(0.1, 0.1, 0.1);
-    m_rasterObjectCB = helper::CreateBuffer(m_device.Get(), sizeof(XMMATRIX), D3D12_RESOURCE_FLAG_NONE,
-        D3D12_RESOURCE_STATE_GENERIC_READ, helper::kUploadHeapProps);
-    helper::CopyDataToUploadBuffer(m_rasterObjectCB.Get(), &world, sizeof(XMMATRIX));
+    WriteObjectConstants();
     
 
 }
 
+void HelloRayTracing::WriteObjectConstants()
+{
+    UpdateInstanceBounds();
+
+    // One constant buffer slot per mesh instance, in the order OnRender draws them
+    size_t objectCount = 0;
+    for (auto& mesh : m_sceneModel.Meshes)
+        objectCount += mesh.first->Instances.size();
+    GrowBuffer(m_rasterObjectCB, (std::max)(objectCount, size_t(1)) * kRasterObjectStride,
+        D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ, helper::kUploadHeapProps);
+
+    // Only one frame is in flight, the buffer isn't read while we write it
+    UINT8* objectConstants;
+    ThrowIfFailed(m_rasterObjectCB->Map(0, nullptr, reinterpret_cast<void**>(&objectConstants)));
+    for (auto& mesh : m_sceneModel.Meshes) {
+        for (size_t instance = 0; instance < mesh.first->Instances.size(); ++instance) {
+            XMMATRIX world = GetInstanceWorld(*mesh.first, instance);
+            memcpy(objectConstants, &world, sizeof(XMMATRIX));
+            objectConstants += kRasterObjectStride;
+        }
+    }
+    m_rasterObjectCB->Unmap(0, nullptr);
+}
+
+void HelloRayTracing::UpdateInstanceBounds()
+{
+    m_instanceCount = 0;
+    for (auto& mesh : m_sceneModel.Meshes) {
+        for (size_t instance = 0; instance < mesh.first->Instances.size(); ++instance, ++m_instanceCount) {
+            ClusterCulling::SetBounds(m_instanceBounds, m_instanceCount, mesh.first->BoundsMin, mesh.first->BoundsMax,
+                mesh.first->BoundsRadius, GetInstanceWorld(*mesh.first, instance));
+        }
+    }
+    m_instanceBounds.resize((m_instanceCount + 7) / 8);
+}
+
+void HelloRayTracing::UpdateSceneHierarchy()
+{
+    SceneHierarchy& hierarchy = m_sceneModel.Hierarchy;
+    if (m_animateHierarchy) {
+        XMFLOAT4X4 local;
+        XMStoreFloat4x4(&local, XMLoadFloat4x4A(&hierarchy.GetLocal(SceneHierarchy::kRoot)) * DirectX::XMMatrixRotationY(0.005f));
+        hierarchy.SetLocal(SceneHierarchy::kRoot, local);
+    }
+    if (hierarchy.Update() == 0)
+        return;
+
+    WriteObjectConstants();
+
+    // TopLevelASGenerator keeps references to these matrices
+    size_t tlasInstance = 0;
+    for (auto& mesh : m_sceneModel.Meshes) {
+        if (!mesh.first->IsResident())
+            continue;
+        XMMATRIX dequantize = GetDequantizeTransform(*mesh.first);
+        for (size_t instance = 0; instance < mesh.first->Instances.size(); ++instance)
+            m_instances[tlasInstance++].second = dequantize * GetInstanceWorld(*mesh.first, instance);
+    }
+    m_topLevelASDirty = true;
+}
+
+// In place update of the instance transforms, the BLAS and the SBT stay as they are
+void HelloRayTracing::RefitTopLevelAS()
+{
+    m_topLevelASGenerator.Generate(m_commandList.Get(), m_topLevelASBuffers.pScratch.Get(),
+        m_topLevelASBuffers.pResult.Get(), m_topLevelASBuffers.pInstanceDesc.Get(), true, m_topLevelASBuffers.pResult.Get());
+    m_topLevelASDirty = false;
+}
+
 void HelloRayTracing::UpdateCameraBuffer()
 {
     std::vector<XMMATRIX> matrices(4);
@@ -511,8 +905,166 @@ void HelloRayTracing::UpdateCameraBuffer()
 
     // Copy the matrix contents
     helper::CopyDataToUploadBuffer(m_cameraBuffer.Get(), matrices.data(), m_cameraBufferSize);
+    XMStoreFloat4x4(&m_view, matrices[0]);
+    XMStoreFloat4x4(&m_projection, matrices[1]);
+    m_cameraFrustum = Frustum::FromMatrix(matrices[0] * matrices[1]);
+
+
+}
+
+// Placement of a mesh instance in model space, its own transform below the world matrix of its node
+XMMATRIX HelloRayTracing::GetInstanceTransform(const Mesh& mesh, size_t instance) const
+{
+    const MeshInstance& placement = mesh.Instances[instance];
+    return XMLoadFloat4x4(&placement.Transform) * XMLoadFloat4x4A(&m_sceneModel.Hierarchy.GetWorld(placement.Node));
+}
+
+// The scene is drawn at a tenth of its model size
+XMMATRIX HelloRayTracing::GetInstanceWorld(const Mesh& mesh, size_t instance) const
+{
+    return GetInstanceTransform(mesh, instance) * DirectX::XMMatrixScaling(0.1f, 0.1f, 0.1f);
+}
+
+void HelloRayTracing::GetCullingFrustum(FXMMATRIX world, CXMMATRIX view, CXMMATRIX projection, Frustum& frustum,
+    XMFLOAT3& cameraPosition) const
+{
+    // Meshlet and mesh bounds are in model space
+    XMMATRIX worldView = world * view;
+    frustum = Frustum::FromMatrix(worldView * projection);
 
+    XMVECTOR det;
+    XMStoreFloat3(&cameraPosition, DirectX::XMMatrixInverse(&det, worldView).r[3]);
+}
 
+// Coarsest level whose error stays within m_lodErrorPixels at the nearest point of the mesh bounds
+UINT HelloRayTracing::SelectLod(const Mesh& mesh, const XMFLOAT3& cameraPosition) const
+{
+    if (mesh.Lods.size() < 2)
+        return 0;
+
+    float dx = mesh.BoundsCenter.x - cameraPosition.x;
+    float dy = mesh.BoundsCenter.y - cameraPosition.y;
+    float dz = mesh.BoundsCenter.z - cameraPosition.z;
+    float distance = (std::max)(std::sqrt(dx * dx + dy * dy + dz * dz) - mesh.BoundsRadius, 0.0f);
+
+    // Error and distance are both in model units, the world scale cancels out
+    float pixelsPerUnit = m_projection._22 * 0.5f * GetHeight();
+    UINT lod = 0;
+    for (UINT i = 1; i < mesh.Lods.size(); ++i) {
+        if (mesh.Lods[i].Error * pixelsPerUnit > m_lodErrorPixels * distance)
+            break;
+        lod = i;
+    }
+    return lod;
+}
+
+// Culling rates on a fixed camera path: a walk down the long axis of the scene at eye height looking
+// ahead with some sway, then a full turn in the middle. Runs on the CPU only, the results go to the console.
+void HelloRayTracing::RunClusterCullingBenchmark()
+{
+    XMFLOAT3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    UINT64 meshletCount = 0;
+    for (auto& mesh : m_sceneModel.Meshes) {
+        for (size_t instance = 0; instance < mesh.first->Instances.size(); ++instance) {
+            XMMATRIX transform = GetInstanceTransform(*mesh.first, instance);
+            for (auto& meshlet : mesh.first->Meshlets) {
+                XMFLOAT3 c;
+                XMStoreFloat3(&c, XMVector3Transform(XMLoadFloat3(&meshlet.Center), transform));
+                lo = XMFLOAT3((std::min)(lo.x, c.x), (std::min)(lo.y, c.y), (std::min)(lo.z, c.z));
+                hi = XMFLOAT3((std::max)(hi.x, c.x), (std::max)(hi.y, c.y), (std::max)(hi.z, c.z));
+            }
+            meshletCount += mesh.first->Meshlets.size();
+        }
+    }
+    if (meshletCount == 0)
+        return;
+
+    const int kWalkFrames = 120;
+    const int kTurnFrames = 120;
+    const bool alongX = hi.x - lo.x >= hi.z - lo.z;
+    const XMFLOAT3 center((lo.x + hi.x) * 0.5f, lo.y + (hi.y - lo.y) * 0.1f, (lo.z + hi.z) * 0.5f);
+    const float halfWalk = 0.4f * (alongX ? hi.x - lo.x : hi.z - lo.z);
+    const XMMATRIX projection = DirectX::XMMatrixPerspectiveFovRH(45.0f * XM_PI / 180.0f, m_aspectRatio, 0.1f, 10000.0f);
+
+    UpdateInstanceBounds();
+
+    auto cullFrame = [&](const XMFLOAT3& eye, float yaw, ClusterCullStats& stats, MeshCullStats& meshStats) {
+        // yaw 0 looks down the walk direction
+        float forward = std::cos(yaw), side = std::sin(yaw);
+        XMVECTOR direction = alongX ? XMVectorSet(forward, 0.0f, side, 0.0f) : XMVectorSet(side, 0.0f, forward, 0.0f);
+        XMVECTOR eyeWorld = XMVectorScale(XMLoadFloat3(&eye), 0.1f);
+        XMMATRIX view = DirectX::XMMatrixLookToRH(eyeWorld, direction, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+        ClusterCulling::CullBounds(m_instanceBounds, m_instanceCount, Frustum::FromMatrix(view * projection), m_visibleInstances, meshStats);
+
+        size_t objectIndex = 0;
+        for (auto& mesh : m_sceneModel.Meshes) {
+            for (size_t instance = 0; instance < mesh.first->Instances.size(); ++instance, ++objectIndex) {
+                if (!IsInstanceVisible(objectIndex)) {
+                    // Every meshlet of the instance is outside as well
+                    stats.Meshlets += mesh.first->Meshlets.size();
+                    stats.FrustumCulled += mesh.first->Meshlets.size();
+                    for (auto& meshlet : mesh.first->Meshlets)
+                        stats.Triangles += meshlet.IndexCount / 3;
+                    continue;
+                }
+                Frustum frustum;
+                XMFLOAT3 cameraPosition;
+                GetCullingFrustum(GetInstanceWorld(*mesh.first, instance), view, projection, frustum, cameraPosition);
+                m_visibleRanges.clear();
+                ClusterCulling::CullMeshlets(mesh.first->Meshlets, frustum, cameraPosition, true, m_visibleRanges, stats);
+            }
+        }
+    };
+
+    auto report = [&](const char* name, const ClusterCullStats& stats, const MeshCullStats& meshStats, int frames, double ms) {
+        std::cout << "Mesh culling, " << name << ": " << 100.0 * meshStats.FrustumCulled / meshStats.Instances << "% of "
+            << m_instanceCount << " instances outside the frustum, " << 1000.0 * meshStats.CullMs / frames << " us per frame" << std::endl;
+        std::cout << "Cluster culling, " << name << ": " << 100.0 * stats.FrustumCulled / stats.Meshlets
+            << "% of meshlets outside the frustum, " << 100.0 * stats.ConeCulled / stats.Meshlets << "% backfacing, "
+            << 100.0 * stats.VisibleTriangles / stats.Triangles << "% of triangles drawn, "
+            << double(stats.Draws) / frames << " draws per frame for " << m_sceneModel.Meshes.size() << " meshes, "
+            << 1000.0 * ms / frames << " us per frame" << std::endl;
+    };
+
+    ClusterCullStats walk;
+    MeshCullStats walkMeshes;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int frame = 0; frame < kWalkFrames; ++frame) {
+        float t = float(frame) / (kWalkFrames - 1);
+        float offset = -halfWalk + 2.0f * halfWalk * t;
+        XMFLOAT3 eye = alongX ? XMFLOAT3(center.x + offset, center.y, center.z) : XMFLOAT3(center.x, center.y, center.z + offset);
+        cullFrame(eye, 0.5f * std::sin(4.0f * XM_PI * t), walk, walkMeshes);
+    }
+    double walkMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    ClusterCullStats turn;
+    MeshCullStats turnMeshes;
+    start = std::chrono::high_resolution_clock::now();
+    for (int frame = 0; frame < kTurnFrames; ++frame)
+        cullFrame(center, XM_2PI * frame / kTurnFrames, turn, turnMeshes);
+    double turnMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    std::cout << "Cluster culling: " << meshletCount << " meshlets, camera path of " << kWalkFrames << " walk and "
+        << kTurnFrames << " turn frames" << std::endl;
+    report("walk", walk, walkMeshes, kWalkFrames, walkMs);
+    report("turn", turn, turnMeshes, kTurnFrames, turnMs);
+}
+
+// Decoding benchmarks over the textures of the scene, run once every texture is loaded in any load mode
+void HelloRayTracing::RunTextureBenchmarks()
+{
+    m_textloader.RunBenchmark({ 1, 4, 16 });
+    m_textloader.RunCacheBenchmark();
+
+    std::vector<std::string> textureFiles;
+    std::vector<TextureUsage> textureUsages;
+    for (auto& texture : m_textloader.GetTextureLoaded()) {
+        textureFiles.push_back(texture->FileName);
+        textureUsages.push_back(BlockCompressor::GetUsage(texture->Type, texture->FileName));
+    }
+    ImageDecoder::RunBenchmark(textureFiles, 3);
+    BlockCompressor::RunBenchmark(textureFiles, textureUsages, ThreadPool::Default());
+    MipGenerator::RunBenchmark(textureFiles, ThreadPool::Default());
 }
 
 void HelloRayTracing::CheckRaytracingSupport()
@@ -527,17 +1079,18 @@ void HelloRayTracing::CheckRaytracingSupport()
 HelloRayTracing::AccelerationStructureBuffers
 HelloRayTracing::CreateBottomLevelAS(
     std::vector<std::pair<ComPtr<ID3D12Resource>, uint32_t>> vVertexBuffers, 
-    std::vector<std::pair<ComPtr<ID3D12Resource>, uint32_t>> vIndexBuffers)
+    std::vector<std::pair<ComPtr<ID3D12Resource>, uint32_t>> vIndexBuffers,
+    UINT vertexStride, DXGI_FORMAT positionFormat, DXGI_FORMAT indexFormat)
 {
     nv_helpers_dx12::BottomLevelASGenerator bottomLevelAS;
     // Adding all vertex buffers and not transforming their position.
     for (size_t i = 0; i < vVertexBuffers.size(); i++) {
         if (i < vIndexBuffers.size() && vIndexBuffers[i].second > 0)
             bottomLevelAS.AddVertexBuffer(
-                vVertexBuffers[i].first.Get(), 0,vVertexBuffers[i].second, sizeof(Vertex_Model),
-                vIndexBuffers[i].first.Get(), 0,vIndexBuffers[i].second, nullptr, 0, true);
+                vVertexBuffers[i].first.Get(), 0,vVertexBuffers[i].second, vertexStride,
+                vIndexBuffers[i].first.Get(), 0,vIndexBuffers[i].second, nullptr, 0, true, positionFormat, indexFormat);
         else
-            bottomLevelAS.AddVertexBuffer(vVertexBuffers[i].first.Get(), 0, vVertexBuffers[i].second, sizeof(Vertex_Model), 0, 0);
+            bottomLevelAS.AddVertexBuffer(vVertexBuffers[i].first.Get(), 0, vVertexBuffers[i].second, vertexStride, 0, 0);
     }
 
     UINT64 scratchSizeInBytes = 0;
@@ -558,53 +1111,113 @@ HelloRayTracing::CreateBottomLevelAS(
 
 void HelloRayTracing::CreateTopLevelAS(const std::vector<std::pair<ComPtr<ID3D12Resource>, DirectX::XMMATRIX>>& instances)
 {
-    // Gather all the instances into the builder helper
+    // Gather all the instances into the builder helper. The generator keeps references to the
+    // transforms, so every rebuild adds them again.
+    m_topLevelASGenerator.Reset();
     for (size_t i = 0; i < instances.size(); i++) {
+        UINT hitGroup = i < m_instanceHitGroups.size() ? m_instanceHitGroups[i] : static_cast<UINT>(i);
         m_topLevelASGenerator.AddInstance(instances[i].first.Get(),
-            instances[i].second, static_cast<UINT>(i),static_cast<UINT>(i));
+            instances[i].second, static_cast<UINT>(i), hitGroup);
     }
 
     UINT64 scratchSize, resultSize, instanceDescsSize;
     m_topLevelASGenerator.ComputeASBufferSizes(m_device.Get(), true, &scratchSize, &resultSize, &instanceDescsSize);
 
-    m_topLevelASBuffers.pScratch = helper::CreateBuffer(m_device.Get(), scratchSize, 
+    // Streaming rebuilds the TLAS whenever meshes arrive, the buffers are only replaced when they are too small
+    GrowBuffer(m_topLevelASBuffers.pScratch, scratchSize,
         D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,D3D12_RESOURCE_STATE_UNORDERED_ACCESS,helper::kDefaultHeapProps);
-    m_topLevelASBuffers.pResult = helper::CreateBuffer(m_device.Get(), resultSize, 
+    bool moved = GrowBuffer(m_topLevelASBuffers.pResult, resultSize,
         D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,helper::kDefaultHeapProps);
-    m_topLevelASBuffers.pInstanceDesc = helper::CreateBuffer(m_device.Get(), instanceDescsSize, 
+    GrowBuffer(m_topLevelASBuffers.pInstanceDesc, instanceDescsSize,
         D3D12_RESOURCE_FLAG_NONE,D3D12_RESOURCE_STATE_GENERIC_READ, helper::kUploadHeapProps);
 
     m_topLevelASGenerator.Generate(m_commandList.Get(),m_topLevelASBuffers.pScratch.Get(),
         m_topLevelASBuffers.pResult.Get(), m_topLevelASBuffers.pInstanceDesc.Get());
+    m_topLevelASDirty = false;
+
+    if (moved && m_rtSrvUavHeap)
+        WriteTopLevelASDescriptor();
+}
+
+// Keeps buffer if it holds size bytes, otherwise replaces it with one at least twice as big.
+// Returns true for a new buffer, views of the old one have to be written again.
+bool HelloRayTracing::GrowBuffer(ComPtr<ID3D12Resource>& buffer, UINT64 size, D3D12_RESOURCE_FLAGS flags,
+    D3D12_RESOURCE_STATES state, const D3D12_HEAP_PROPERTIES& heapProps)
+{
+    UINT64 capacity = size;
+    if (buffer) {
+        UINT64 width = buffer->GetDesc().Width;
+        if (width >= size)
+            return false;
+        capacity = (std::max)(size, width * 2);
+        m_retiredResources.push_back(buffer);
+    }
+    // CreateBuffer hands over its reference, the replaced buffers are actually released
+    buffer.Attach(helper::CreateBuffer(m_device.Get(), capacity, flags, state, heapProps));
+    return true;
 }
 
 void HelloRayTracing::CreateAccelerationStructures()
 {
     // Build the bottom AS from the Triangle vertex buffer
+    // One BLAS per unique geometry, one TLAS instance per placement using the hit group of its mesh.
+    // Streamed and paged in meshes only build their own BLAS, the TLAS is rebuilt over the instances
+    // of every resident mesh.
     UINT meshCount = m_sceneModel.Meshes.size();
-    std::vector<AccelerationStructureBuffers> bottomLevelBuffers(meshCount);
-    for (int i = 0; i < meshCount;++i) {
-        AccelerationStructureBuffers bottomLevelBuffers = CreateBottomLevelAS(
-            { {m_sceneModel.Meshes[i].first->VertexBufferGPU.Get(),m_sceneModel.Meshes[i].first->VertexCount} },
-            { {m_sceneModel.Meshes[i].first->IndexBufferGPU.Get(),m_sceneModel.Meshes[i].first->IndexCount} }
-           );
-        m_instances.push_back({ bottomLevelBuffers.pResult,DirectX::XMMatrixScaling(0.1, 0.1, 0.1) });
+    m_meshBottomLevelAS.resize(meshCount);
+    m_instances.clear();
+    m_instanceHitGroups.clear();
+    for (UINT i = 0; i < meshCount;++i) {
+        const Mesh& mesh = *m_sceneModel.Meshes[i].first;
+        if (!mesh.IsResident())
+            continue;
+        if (!m_meshBottomLevelAS[i]) {
+            AccelerationStructureBuffers bottomLevelBuffers = CreateBottomLevelAS(
+                { {mesh.VertexBufferGPU.Get(),mesh.VertexCount} },
+                { {mesh.IndexBufferGPU.Get(),mesh.IndexCount} },
+                mesh.VertexByteStride, VertexCompression::GetPositionFormat(mesh.Format), mesh.IndexFormat
+               );
+            // Recorded on this frame's command list
+            m_retiredResources.push_back(bottomLevelBuffers.pScratch);
+            m_meshBottomLevelAS[i] = bottomLevelBuffers.pResult;
+        }
+
+        XMMATRIX dequantize = GetDequantizeTransform(mesh);
+        for (size_t instance = 0; instance < mesh.Instances.size(); ++instance) {
+            m_instances.push_back({ m_meshBottomLevelAS[i], dequantize * GetInstanceWorld(mesh, instance) });
+            m_instanceHitGroups.push_back(i);
+        }
     }
 
-    CreateTopLevelAS(m_instances);
+    // The generator keeps references to the old instances, with none left nothing is traced
+    if (!m_instances.empty())
+        CreateTopLevelAS(m_instances);
+    else
+        m_topLevelASGenerator.Reset();
 
     // Store the AS buffers. The rest of the buffers will be released once we exit the function
     //m_bottomLevelAS = bottomLevelBuffers.pResult;
 
 }
 
+// Quantized positions are built in [-1, 1], the instance transform scales them back
+XMMATRIX HelloRayTracing::GetDequantizeTransform(const Mesh& mesh) const
+{
+    if (mesh.Format != VertexFormat::CompactQuantized)
+        return DirectX::XMMatrixIdentity();
+    const VertexQuantization& q = mesh.Quantization;
+    return DirectX::XMMatrixScaling(q.Extent.x, q.Extent.y, q.Extent.z) *
+        DirectX::XMMatrixTranslation(q.Center.x, q.Center.y, q.Center.z);
+}
+
 HelloRayTracing::RayTracingShaderLibrary 
 HelloRayTracing::CreateRayTracingShaderLibrary(std::string name, LPCWSTR shadername, 
-    std::vector<std::wstring> exportSymbols, ComPtr<ID3D12RootSignature> signature)
+    std::vector<std::wstring> exportSymbols, ComPtr<ID3D12RootSignature> signature,
+    const std::vector<DxcDefine>& defines)
 {
     HelloRayTracing::RayTracingShaderLibrary rtsl;
     rtsl.name = name;
-    rtsl.library = helper::CompileShaderLibrary(shadername);
+    rtsl.library = helper::CompileShaderLibrary(shadername, defines);
     rtsl.exportSymbols = exportSymbols;
     rtsl.signature = signature;
     return rtsl;
@@ -642,12 +1255,22 @@ void HelloRayTracing::CreateRaytracingPipeline()
     nv_helpers_dx12::RootSignatureGenerator hitRSG;
     hitRSG.AddRootParameter(D3D12_ROOT_PARAMETER_TYPE_SRV, 0); // vertex
     hitRSG.AddRootParameter(D3D12_ROOT_PARAMETER_TYPE_SRV, 1); // indices
+    hitRSG.AddRootParameter(D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS, 0); // index size in bytes
     hitRSG.AddHeapRangesParameter({                            //texture
             {2,1,0,D3D12_DESCRIPTOR_RANGE_TYPE_SRV,0 }
         });
 
+    // Hit.hlsl reads the vertex buffer directly, so it needs to know the layout
+    std::vector<DxcDefine> hitDefines;
+    if (m_sceneModel.Format == VertexFormat::Compact)
+        hitDefines.push_back({ L"COMPACT_VERTEX", L"1" });
+    else if (m_sceneModel.Format == VertexFormat::CompactQuantized)
+        hitDefines.push_back({ L"QUANTIZED_VERTEX", L"1" });
+    else if (m_sceneModel.Format == VertexFormat::FullTangent)
+        hitDefines.push_back({ L"TANGENT_VERTEX", L"1" });
+
     m_rtShaderLibrary.push_back(CreateRayTracingShaderLibrary(
-        "MyFirstHit", L"shaders/Hit.hlsl", { L"ClosestHit" }, hitRSG.Generate(m_device.Get(), true)));
+        "MyFirstHit", L"shaders/Hit.hlsl", { L"ClosestHit" }, hitRSG.Generate(m_device.Get(), true), hitDefines));
 
     for (auto& lib : m_rtShaderLibrary) {
         pipeline.AddLibrary(lib.library.Get(), lib.exportSymbols);
@@ -693,13 +1316,10 @@ void HelloRayTracing::CreateRayTracingResource()
         uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
         m_device->CreateUnorderedAccessView(m_outputResource.Get(), nullptr, &uavDesc,srvHandle);
 
+        // Streaming writes the TLAS view once the first mesh is in
         srvHandle.ptr += m_cbvSrvUavDescriptorSize;
-        D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc;
-        srvDesc.Format = DXGI_FORMAT_UNKNOWN;
-        srvDesc.ViewDimension = D3D12_SRV_DIMENSION_RAYTRACING_ACCELERATION_STRUCTURE;
-        srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-        srvDesc.RaytracingAccelerationStructure.Location = m_topLevelASBuffers.pResult->GetGPUVirtualAddress();
-        m_device->CreateShaderResourceView(nullptr, &srvDesc, srvHandle);
+        if (m_topLevelASBuffers.pResult)
+            WriteTopLevelASDescriptor();
 
         srvHandle.ptr += m_cbvSrvUavDescriptorSize;
         D3D12_CONSTANT_BUFFER_VIEW_DESC cbvDesc = {};
@@ -709,6 +1329,18 @@ void HelloRayTracing::CreateRayTracingResource()
     }
 }
 
+void HelloRayTracing::WriteTopLevelASDescriptor()
+{
+    D3D12_CPU_DESCRIPTOR_HANDLE srvHandle = m_rtSrvUavHeap->GetCPUDescriptorHandleForHeapStart();
+    srvHandle.ptr += m_cbvSrvUavDescriptorSize;
+    D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc;
+    srvDesc.Format = DXGI_FORMAT_UNKNOWN;
+    srvDesc.ViewDimension = D3D12_SRV_DIMENSION_RAYTRACING_ACCELERATION_STRUCTURE;
+    srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+    srvDesc.RaytracingAccelerationStructure.Location = m_topLevelASBuffers.pResult->GetGPUVirtualAddress();
+    m_device->CreateShaderResourceView(nullptr, &srvDesc, srvHandle);
+}
+
 void HelloRayTracing::CreateShaderBindingTable()
 {
     m_sbtHelper.Reset();
@@ -720,26 +1352,35 @@ void HelloRayTracing::CreateShaderBindingTable()
     m_sbtHelper.AddMissProgram(L"Miss", {});
 
     for (int i = 0; i < m_sceneModel.Meshes.size();++i) {
+        // Root constants take a whole 8 byte slot in the record
+        UINT64 indexSize = m_sceneModel.Meshes[i].first->IndexFormat == DXGI_FORMAT_R16_UINT ? 2 : 4;
+        // Paged out meshes keep their record so hit group indices stay the mesh index, no instance uses it
+        const Mesh& mesh = *m_sceneModel.Meshes[i].first;
+        void* vertexAddress = mesh.IsResident() ? (void*)mesh.VertexBufferGPU->GetGPUVirtualAddress() : nullptr;
+        void* indexAddress = mesh.IsResident() ? (void*)mesh.IndexBufferGPU->GetGPUVirtualAddress() : nullptr;
         if (!m_sceneModel.Meshes[i].second.empty()) {      
             CD3DX12_GPU_DESCRIPTOR_HANDLE srvTexHandle = CD3DX12_GPU_DESCRIPTOR_HANDLE(m_srvTexHeap->GetGPUDescriptorHandleForHeapStart());
             srvTexHandle.Offset(m_sceneModel.Textures[m_sceneModel.Meshes[i].second[0]]->SrvHeapIndex, m_cbvSrvUavDescriptorSize);
             auto texheapPointer = reinterpret_cast<UINT64*>(srvTexHandle.ptr);
             m_sbtHelper.AddHitGroup(L"HitGroup", {
-                    (void*)(m_sceneModel.Meshes[i].first->VertexBufferGPU->GetGPUVirtualAddress()),
-                    (void*)(m_sceneModel.Meshes[i].first->IndexBufferGPU->GetGPUVirtualAddress()),
+                    vertexAddress,
+                    indexAddress,
+                    (void*)indexSize,
                     texheapPointer
                 });
         }
         else {
             m_sbtHelper.AddHitGroup(L"HitGroup", {
-                    (void*)(m_sceneModel.Meshes[i].first->VertexBufferGPU->GetGPUVirtualAddress()),
-                    (void*)(m_sceneModel.Meshes[i].first->IndexBufferGPU->GetGPUVirtualAddress())
+                    vertexAddress,
+                    indexAddress,
+                    (void*)indexSize
                 });
         }
     }
 
+    // Regenerated for every batch of streamed meshes
     uint32_t sbtSize = m_sbtHelper.ComputeSBTSize();
-    m_sbtStorage = helper::CreateBuffer(m_device.Get(), sbtSize, D3D12_RESOURCE_FLAG_NONE,
+    GrowBuffer(m_sbtStorage, sbtSize, D3D12_RESOURCE_FLAG_NONE,
         D3D12_RESOURCE_STATE_GENERIC_READ, helper::kUploadHeapProps);
 
     if (!m_sbtStorage) {
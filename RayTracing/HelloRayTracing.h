@@ -2,10 +2,15 @@
 #include "core/DXSample.h"
 #include <dxcapi.h>
 #include <vector>
+#include <chrono>
 #include "core/D3DUtility.h"
 #include "helper/TextureLoader.h"
+#include "helper/ModelLoader.h"
+#include "helper/ModelStreamer.h"
+#include "helper/GeometryStore.h"
 #include "helper/TopLevelASGenerator.h"
 #include "helper/ShaderBindingTableGenerator.h"
+#include "helper/ClusterCulling.h"
 
 using Microsoft::WRL::ComPtr;
 
@@ -52,12 +57,90 @@ private:
 
 	std::unordered_map<std::string, std::unique_ptr<Mesh>> m_meshes;
 	Model m_sceneModel;
+	// GPU vertex layout of the scene, see ModelLoadOptions::Format
+	VertexFormat m_vertexFormat = VertexFormat::Full;
+
+	// The scene loads on a background thread and is drawn while it arrives, every frame uploads up to
+	// kStreamedMeshesPerFrame meshes. With m_asyncLoading off it is loaded before the first frame.
+	bool								m_asyncLoading = true;
+	static const UINT					kStreamedMeshesPerFrame = 8;
+	std::unique_ptr<ModelLoader>		m_modelLoader;
+	std::unique_ptr<ModelStreamer>		m_modelStreamer;
+	bool								m_streamImported = false;
+	std::chrono::high_resolution_clock::time_point m_loadStart;
+	double								m_firstMeshMs = 0.0;
+	UINT								m_frameCount = 0;
+	void StreamSceneGeometry();
+
+	// Out-of-core scene geometry instead of the streamer with m_pagedGeometry ("/paged"): the mesh cache is
+	// the page file and only the meshes the residency manager keeps within kGeometryBudget have buffers and
+	// a BLAS. The visibility and camera distance of every mesh drive it, up to kPagesPerFrame page ins are
+	// uploaded per frame.
+	static const UINT64					kGeometryBudget = 64ull << 20;
+	static const UINT					kPagesPerFrame = 4;
+	static const UINT					kResidencyReportFrames = 300;
+	std::unique_ptr<GeometryStore>		m_geometryStore;
+	std::vector<GeometryStore::PageVisibility> m_pageVisibility;
+	std::vector<UINT>					m_evictedPages;
+	UINT								m_residencyFrames = 0;
+	void UpdateGeometryResidency();
+
+	// Replaced buffers and BLAS scratch memory, released once the frame that recorded them has finished
+	std::vector<ComPtr<ID3D12Resource>>	m_retiredResources;
+	bool GrowBuffer(ComPtr<ID3D12Resource>& buffer, UINT64 size, D3D12_RESOURCE_FLAGS flags,
+		D3D12_RESOURCE_STATES state, const D3D12_HEAP_PROPERTIES& heapProps);
 
 	//raster Pipeline objects.
 	ComPtr<ID3D12RootSignature> m_rasterRootSignature;
 	ComPtr<ID3D12PipelineState> m_rasterPiplineState;
 	void LoadRasterPipeline();
+	// World matrix of every mesh instance in draw order, kRasterObjectStride bytes apart
 	ComPtr<ID3D12Resource>		m_rasterObjectCB;
+	static const UINT			kRasterObjectStride = D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT;
+	DirectX::XMMATRIX GetInstanceTransform(const Mesh& mesh, size_t instance) const;
+	DirectX::XMMATRIX GetInstanceWorld(const Mesh& mesh, size_t instance) const;
+	void WriteObjectConstants();
+
+	// Node animation, 'N' spins the scene root. Changed world matrices rewrite the object constants
+	// and refit the TLAS before the next frame.
+	bool						m_animateHierarchy = false;
+	bool						m_topLevelASDirty = false;
+	void UpdateSceneHierarchy();
+	void RefitTopLevelAS();
+
+	// Meshlet culling in the raster loop, 'C' toggles it and 'B' the backface cone test.
+	// The cone test only runs while the raster pipeline culls back faces, it draws both sides of every
+	// triangle so the test is skipped even when toggled on.
+	bool						m_clusterCulling = true;
+	bool						m_coneCulling = false;
+	bool						m_rasterCullsBackFaces = false;	// set with the PSO
+	std::vector<IndexRange>		m_visibleRanges;
+	ClusterCullStats			m_cullStats;	// last raster frame
+	void GetCullingFrustum(DirectX::FXMMATRIX world, DirectX::CXMMATRIX view, DirectX::CXMMATRIX projection,
+		Frustum& frustum, DirectX::XMFLOAT3& cameraPosition) const;
+	void RunClusterCullingBenchmark();
+	void RunTextureBenchmarks();
+
+	// Whole instances against the camera frustum before the meshlets, 'V' toggles it. The world space
+	// bounds of every instance, in draw order, are rebuilt with the object constants.
+	bool						m_meshCulling = true;
+	std::vector<BoundsBlock>	m_instanceBounds;
+	size_t						m_instanceCount = 0;
+	std::vector<UINT8>			m_visibleInstances;
+	Frustum						m_cameraFrustum;	// world space, set by UpdateCameraBuffer
+	MeshCullStats				m_meshCullStats;	// since the last report
+	UINT						m_meshCullFrames = 0;
+	static const UINT			kMeshCullReportFrames = 300;
+	void UpdateInstanceBounds();
+	bool IsInstanceVisible(size_t objectIndex) const
+	{
+		return (m_visibleInstances[objectIndex / 8] & (1u << (objectIndex % 8))) != 0;
+	}
+
+	// Per mesh LOD from projected error, 'L' toggles it
+	bool						m_lodSelection = true;
+	float						m_lodErrorPixels = 1.0f;
+	UINT SelectLod(const Mesh& mesh, const DirectX::XMFLOAT3& cameraPosition) const;
 
 	// Synchronization objects.
 	UINT				m_frameIndex;
@@ -69,6 +152,8 @@ private:
 	ComPtr<ID3D12Resource>			m_cameraBuffer;
 	ComPtr<ID3D12DescriptorHeap>	m_constHeap;
 	uint32_t						m_cameraBufferSize = 0;
+	DirectX::XMFLOAT4X4				m_view;
+	DirectX::XMFLOAT4X4				m_projection;
 	void CreateCameraBuffer();
 	void UpdateCameraBuffer();
 
@@ -88,15 +173,20 @@ private:
 	};
 
 	ComPtr<ID3D12Resource>					m_bottomLevelAS; 
+	std::vector<ComPtr<ID3D12Resource>>		m_meshBottomLevelAS;	// per mesh, null until it is resident
 	nv_helpers_dx12::TopLevelASGenerator	m_topLevelASGenerator;
 	AccelerationStructureBuffers			m_topLevelASBuffers;
 	std::vector<std::pair<ComPtr<ID3D12Resource>, DirectX::XMMATRIX>> m_instances;
+	std::vector<UINT>						m_instanceHitGroups;	// mesh of each instance
 
 	AccelerationStructureBuffers CreateBottomLevelAS(
 		std::vector<std::pair<ComPtr<ID3D12Resource>, uint32_t>> vVertexBuffers,
-		std::vector<std::pair<ComPtr<ID3D12Resource>, uint32_t>> vIndexBuffers = {});
+		std::vector<std::pair<ComPtr<ID3D12Resource>, uint32_t>> vIndexBuffers = {},
+		UINT vertexStride = sizeof(Vertex_Model), DXGI_FORMAT positionFormat = DXGI_FORMAT_R32G32B32_FLOAT,
+		DXGI_FORMAT indexFormat = DXGI_FORMAT_R32_UINT);
 	void CreateTopLevelAS(const std::vector<std::pair<ComPtr<ID3D12Resource>, DirectX::XMMATRIX>>& instances);
 	void CreateAccelerationStructures();
+	DirectX::XMMATRIX GetDequantizeTransform(const Mesh& mesh) const;
 
 
 	//dxr signature
@@ -109,7 +199,8 @@ private:
 	};
 	std::vector<RayTracingShaderLibrary> m_rtShaderLibrary;
 	RayTracingShaderLibrary CreateRayTracingShaderLibrary(std::string name, LPCWSTR shadername,
-		std::vector<std::wstring> exportSymbols, ComPtr<ID3D12RootSignature> signature);
+		std::vector<std::wstring> exportSymbols, ComPtr<ID3D12RootSignature> signature,
+		const std::vector<DxcDefine>& defines = {});
 
 	// Ray tracing pipeline state
 	ComPtr<ID3D12StateObject>			m_rtStateObject;
@@ -122,6 +213,7 @@ private:
 	nv_helpers_dx12::ShaderBindingTableGenerator	m_sbtHelper;
 	ComPtr<ID3D12Resource>							m_sbtStorage;
 	void CreateRayTracingResource();
+	void WriteTopLevelASDescriptor();
 	void CreateShaderBindingTable();
 
 
@@ -2,6 +2,7 @@
 
 #include "stdafx.h"
 #include <DirectXMath.h>
+#include "helper/SceneHierarchy.h"
 
 using namespace DirectX;
 
@@ -18,6 +19,116 @@ struct Vertex_Model
     XMFLOAT2 TexCoord;
 };
 
+// Layout of the GPU vertex buffers, picked at load time. The CPU side always works on Vertex_Model.
+enum class VertexFormat
+{
+    Full,               // Vertex_Model, 32 bytes
+    Compact,            // Vertex_Compact, 20 bytes
+    CompactQuantized,   // Vertex_Quantized, 16 bytes
+    FullTangent         // Vertex_Tangent, 48 bytes
+};
+
+// float position, octahedral normal as 2 x snorm16, half texcoord
+struct Vertex_Compact
+{
+    XMFLOAT3 Position;
+    INT16 Normal[2];
+    UINT16 TexCoord[2];
+};
+
+// snorm16 position inside the mesh bounds (w unused), octahedral normal, half texcoord
+struct Vertex_Quantized
+{
+    INT16 Position[4];
+    INT16 Normal[2];
+    UINT16 TexCoord[2];
+};
+
+// Vertex_Model followed by the tangent frame, bitangent = cross(Normal, Tangent.xyz) * Tangent.w
+struct Vertex_Tangent
+{
+    XMFLOAT3 Position;
+    XMFLOAT3 Normal;
+    XMFLOAT2 TexCoord;
+    XMFLOAT4 Tangent;
+};
+
+// position = Center + Extent * snorm position, identity for the unquantized formats
+struct VertexQuantization
+{
+    XMFLOAT3 Center = { 0.0f, 0.0f, 0.0f };
+    XMFLOAT3 Extent = { 1.0f, 1.0f, 1.0f };
+};
+
+// Texture referenced by a mesh, path relative to the model directory.
+struct TextureRef
+{
+    std::string Type;
+    std::string FileName;
+};
+
+// Part of a mesh that came from one source mesh. Indices are already rebased onto the
+// shared vertex buffer, the vertex range is kept for per part bounds.
+struct SubmeshGeometry
+{
+    UINT IndexCount = 0;
+    UINT StartIndexLocation = 0;
+    UINT VertexCount = 0;
+    UINT StartVertexLocation = 0;
+};
+
+// Cluster of at most 64 vertices and 124 triangles, a contiguous range of its mesh's index buffer.
+// Bounds are in model space. The cone covers the face normals: the cluster faces away from a viewer
+// at P when dot(normalize(ConeApex - P), ConeAxis) >= ConeCutoff, a cutoff of 1 disables the test.
+struct Meshlet
+{
+    UINT StartIndexLocation = 0;
+    UINT IndexCount = 0;
+    UINT VertexCount = 0;
+    XMFLOAT3 Center = { 0.0f, 0.0f, 0.0f };
+    float Radius = 0.0f;
+    XMFLOAT3 ConeApex = { 0.0f, 0.0f, 0.0f };
+    XMFLOAT3 ConeAxis = { 0.0f, 0.0f, 0.0f };
+    float ConeCutoff = 1.0f;
+};
+
+// Simplified version of a mesh, a range of its index buffer over the same vertices.
+// Error is the largest distance from the base mesh in model units, 0 for the base range.
+struct MeshLod
+{
+    UINT StartIndexLocation = 0;
+    UINT IndexCount = 0;
+    float Error = 0.0f;
+};
+
+// One placement of a mesh: model space vertices go through Transform, then the world matrix of Node
+// in Model::Hierarchy. Both are row vector transforms.
+struct MeshInstance
+{
+    XMFLOAT4X4 Transform = { 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+    UINT Node = SceneHierarchy::kRoot;
+};
+
+// CPU side mesh produced by the loaders, before it is uploaded to the GPU.
+struct MeshData
+{
+    std::vector<Vertex_Model> Vertices;
+    std::vector<UINT> Indices;
+    //vector[0] - diffuse map, vector[1] - specular
+    std::vector<TextureRef> Textures;
+    // Empty until meshes are merged
+    std::vector<SubmeshGeometry> Submeshes;
+    // Empty without a LOD chain. Otherwise Lods[0] is the base mesh and the other
+    // levels follow it in Indices, submeshes and meshlets only describe the base range.
+    std::vector<MeshLod> Lods;
+    // Scene nodes referencing the mesh and placements of identical copies found by
+    // MeshOptimizer::DeduplicateMeshes. Empty for a mesh drawn once below the root.
+    std::vector<MeshInstance> Instances;
+    // One per vertex for VertexFormat::FullTangent, empty otherwise. Built after every other pass,
+    // see TangentGenerator.
+    std::vector<XMFLOAT4> Tangents;
+};
+
 struct Mesh
 {
     // Give it a name so we can look it up by name.
@@ -38,10 +149,32 @@ struct Mesh
     UINT VertexByteStride = 0;
     UINT VertexBufferByteSize = 0;
     UINT VertexCount = 0;
+    VertexFormat Format = VertexFormat::Full;
+    VertexQuantization Quantization;
     DXGI_FORMAT IndexFormat = DXGI_FORMAT_R32_UINT;
     UINT IndexBufferByteSize = 0;
+    // Indices of the base mesh, the LOD ranges come after them in the same buffer
     UINT IndexCount = 0;
 
+    // Bounding box and sphere of the vertices in model space, the sphere is centered on the box
+    XMFLOAT3 BoundsMin = { 0.0f, 0.0f, 0.0f };
+    XMFLOAT3 BoundsMax = { 0.0f, 0.0f, 0.0f };
+    XMFLOAT3 BoundsCenter = { 0.0f, 0.0f, 0.0f };
+    float BoundsRadius = 0.0f;
+
+    // Ranges of the source meshes, a single range covering everything when nothing was merged
+    std::vector<SubmeshGeometry> Submeshes;
+    // Empty when ModelLoadOptions::BuildMeshlets is off
+    std::vector<Meshlet> Meshlets;
+    // Same as MeshData::Lods
+    std::vector<MeshLod> Lods;
+    // At least one, the identity below the root when the mesh isn't instanced. Every instance is
+    // a TLAS instance and a raster draw with its own world matrix.
+    std::vector<MeshInstance> Instances;
+
+    // Paged out meshes of a GeometryStore keep everything but their buffers
+    bool IsResident() const { return VertexBufferGPU != nullptr; }
+
     D3D12_VERTEX_BUFFER_VIEW VertexBufferView()const
     {
         D3D12_VERTEX_BUFFER_VIEW vbv;
@@ -91,7 +224,10 @@ struct Model
     //mesh --- textures id :vector[0] - diffuse map, vector[1] - specular
     std::vector<std::pair<std::unique_ptr<Mesh>, std::vector<UINT>>> Meshes;
     std::vector<std::shared_ptr<Texture>> Textures;
-
+    // Shared by every mesh, selects the input layout and shader variants
+    VertexFormat Format = VertexFormat::Full;
+    // Node transforms from the source file, just the root for formats without a scene graph
+    SceneHierarchy Hierarchy;
 
 };
 
@@ -18,7 +18,9 @@ DXSample::DXSample(UINT width, UINT height, std::wstring name) :
 	m_width(width),
 	m_height(height),
 	m_title(name),
-	m_useWarpDevice(false)
+	m_useWarpDevice(false),
+	m_runBenchmarks(false),
+	m_pagedGeometry(false)
 {
 	WCHAR assetsPath[512];
 	GetAssetsPath(assetsPath, _countof(assetsPath));
@@ -87,5 +89,15 @@ void DXSample::ParseCommandLineArgs(WCHAR* argv[], int argc)
 			m_useWarpDevice = true;
 			m_title = m_title + L" (WARP)";
 		}
+		else if (_wcsnicmp(argv[i], L"-benchmark", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/benchmark", wcslen(argv[i])) == 0)
+		{
+			m_runBenchmarks = true;
+		}
+		else if (_wcsnicmp(argv[i], L"-paged", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/paged", wcslen(argv[i])) == 0)
+		{
+			m_pagedGeometry = true;
+		}
 	}
 }
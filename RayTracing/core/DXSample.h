@@ -51,6 +51,12 @@ protected:
 	// Adapter info.
 	bool m_useWarpDevice;
 
+	// Run the loader and culling benchmarks during startup, pass "/benchmark" on the command line.
+	bool m_runBenchmarks;
+
+	// Page the scene geometry in and out instead of streaming all of it, pass "/paged" on the command line.
+	bool m_pagedGeometry;
+
 private:
 	// Root assets path.
 	std::wstring m_assetsPath;
@@ -0,0 +1,1093 @@
+#include "stdafx.h"
+#include "BlockCompressor.h"
+#include "ImageDecoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <tmmintrin.h>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// 4x4 pixels, one row of 4 RGBA8 pixels per register. Pixel i is row i / 4, column i % 4.
+	struct PixelBlock
+	{
+		__m128i	Rows[4];
+		alignas(16) uint8_t Bytes[64];
+	};
+
+	void LoadBlock(const uint8_t* rgba, size_t rowPitch, PixelBlock& block)
+	{
+		for (int r = 0; r < 4; ++r) {
+			block.Rows[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + r * rowPitch));
+			_mm_store_si128(reinterpret_cast<__m128i*>(block.Bytes + r * 16), block.Rows[r]);
+		}
+	}
+
+	// Block over the right or bottom edge, the missing pixels repeat the last column and row
+	void LoadEdgeBlock(const uint8_t* rgba, size_t rowPitch, uint32_t x, uint32_t y, uint32_t width, uint32_t height, PixelBlock& block)
+	{
+		for (uint32_t r = 0; r < 4; ++r) {
+			const uint8_t* row = rgba + size_t((std::min)(y + r, height - 1)) * rowPitch;
+			for (uint32_t c = 0; c < 4; ++c)
+				memcpy(block.Bytes + r * 16 + c * 4, row + size_t((std::min)(x + c, width - 1)) * 4, 4);
+			block.Rows[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(block.Bytes + r * 16));
+		}
+	}
+
+	// 16 bit lanes r, g, b, a, r, g, b, a for the distance functions
+	__m128i Color16(const int color[4])
+	{
+		return _mm_setr_epi16(static_cast<short>(color[0]), static_cast<short>(color[1]), static_cast<short>(color[2]), static_cast<short>(color[3]),
+			static_cast<short>(color[0]), static_cast<short>(color[1]), static_cast<short>(color[2]), static_cast<short>(color[3]));
+	}
+
+	// Squared distances of the 4 pixels in p to color, over the channels set in mask
+	__m128i Distances(__m128i p, __m128i color, __m128i mask)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i low = _mm_and_si128(_mm_sub_epi16(_mm_unpacklo_epi8(p, zero), color), mask);
+		__m128i high = _mm_and_si128(_mm_sub_epi16(_mm_unpackhi_epi8(p, zero), color), mask);
+		low = _mm_madd_epi16(low, low);
+		high = _mm_madd_epi16(high, high);
+		const __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1));
+		return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+	}
+
+	__m128i ChannelMask(int channels)
+	{
+		const short rgb = -1, a = channels == 4 ? -1 : 0;
+		return _mm_setr_epi16(rgb, rgb, rgb, a, rgb, rgb, rgb, a);
+	}
+
+	// Nearest palette entry of every pixel, returns the summed squared error of the pixels in members
+	uint32_t FindIndices(const PixelBlock& block, const __m128i* palette, uint32_t count, __m128i mask, uint8_t indices[16],
+		uint32_t members = 0xFFFF)
+	{
+		alignas(16) int32_t bestIndex[16], bestError[16];
+		for (int r = 0; r < 4; ++r) {
+			__m128i best = _mm_set1_epi32(0x7FFFFFFF), index = _mm_setzero_si128();
+			for (uint32_t i = 0; i < count; ++i) {
+				const __m128i d = Distances(block.Rows[r], palette[i], mask);
+				const __m128i less = _mm_cmplt_epi32(d, best);
+				best = _mm_or_si128(_mm_and_si128(less, d), _mm_andnot_si128(less, best));
+				index = _mm_or_si128(_mm_and_si128(less, _mm_set1_epi32(static_cast<int>(i))), _mm_andnot_si128(less, index));
+			}
+			_mm_store_si128(reinterpret_cast<__m128i*>(bestIndex + r * 4), index);
+			_mm_store_si128(reinterpret_cast<__m128i*>(bestError + r * 4), best);
+		}
+		uint32_t error = 0;
+		for (int i = 0; i < 16; ++i) {
+			if (members & (1u << i)) {
+				indices[i] = static_cast<uint8_t>(bestIndex[i]);
+				error += static_cast<uint32_t>(bestError[i]);
+			}
+		}
+		return error;
+	}
+
+	// Endpoints along the principal axis of the member pixels, in [0, 255]
+	void FitLine(const PixelBlock& block, uint32_t members, int channels, float lo[4], float hi[4])
+	{
+		float mean[4] = {}, n = 0.0f;
+		for (int i = 0; i < 16; ++i) {
+			if (!(members & (1u << i)))
+				continue;
+			for (int c = 0; c < channels; ++c)
+				mean[c] += block.Bytes[i * 4 + c];
+			n += 1.0f;
+		}
+		for (int c = 0; c < channels; ++c)
+			mean[c] /= n;
+
+		float cov[4][4] = {};
+		for (int i = 0; i < 16; ++i) {
+			if (!(members & (1u << i)))
+				continue;
+			float d[4];
+			for (int c = 0; c < channels; ++c)
+				d[c] = block.Bytes[i * 4 + c] - mean[c];
+			for (int a = 0; a < channels; ++a)
+				for (int b = a; b < channels; ++b)
+					cov[a][b] += d[a] * d[b];
+		}
+		for (int a = 0; a < channels; ++a)
+			for (int b = 0; b < a; ++b)
+				cov[a][b] = cov[b][a];
+
+		// Power iteration from the channel with the largest variance
+		float axis[4] = {};
+		int largest = 0;
+		for (int c = 1; c < channels; ++c)
+			largest = cov[c][c] > cov[largest][largest] ? c : largest;
+		axis[largest] = 1.0f;
+		for (int iteration = 0; iteration < 8; ++iteration) {
+			float next[4] = {}, length = 0.0f;
+			for (int a = 0; a < channels; ++a) {
+				for (int b = 0; b < channels; ++b)
+					next[a] += cov[a][b] * axis[b];
+				length = (std::max)(length, std::fabs(next[a]));
+			}
+			if (length < 1e-6f)
+				break;
+			for (int c = 0; c < channels; ++c)
+				axis[c] = next[c] / length;
+		}
+		float norm = 0.0f;
+		for (int c = 0; c < channels; ++c)
+			norm += axis[c] * axis[c];
+		norm = norm > 0.0f ? 1.0f / std::sqrt(norm) : 0.0f;
+
+		float tMin = 0.0f, tMax = 0.0f;
+		for (int i = 0; i < 16; ++i) {
+			if (!(members & (1u << i)))
+				continue;
+			float t = 0.0f;
+			for (int c = 0; c < channels; ++c)
+				t += (block.Bytes[i * 4 + c] - mean[c]) * axis[c] * norm;
+			tMin = (std::min)(tMin, t);
+			tMax = (std::max)(tMax, t);
+		}
+		for (int c = 0; c < 4; ++c) {
+			lo[c] = c < channels ? (std::min)(255.0f, (std::max)(0.0f, mean[c] + axis[c] * norm * tMin)) : 255.0f;
+			hi[c] = c < channels ? (std::min)(255.0f, (std::max)(0.0f, mean[c] + axis[c] * norm * tMax)) : 255.0f;
+		}
+	}
+
+	// Endpoints that minimize the squared error for fixed indices, weights[index] in [0, 1] toward hi
+	bool SolveEndpoints(const PixelBlock& block, uint32_t members, int channels, const uint8_t indices[16], const float* weights,
+		float lo[4], float hi[4])
+	{
+		float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax[4] = {}, bx[4] = {};
+		for (int i = 0; i < 16; ++i) {
+			if (!(members & (1u << i)))
+				continue;
+			const float b = weights[indices[i]], a = 1.0f - b;
+			aa += a * a;
+			bb += b * b;
+			ab += a * b;
+			for (int c = 0; c < channels; ++c) {
+				ax[c] += a * block.Bytes[i * 4 + c];
+				bx[c] += b * block.Bytes[i * 4 + c];
+			}
+		}
+		const float det = aa * bb - ab * ab;
+		if (std::fabs(det) < 1e-4f)
+			return false;
+		for (int c = 0; c < channels; ++c) {
+			lo[c] = (std::min)(255.0f, (std::max)(0.0f, (ax[c] * bb - bx[c] * ab) / det));
+			hi[c] = (std::min)(255.0f, (std::max)(0.0f, (bx[c] * aa - ax[c] * ab) / det));
+		}
+		return true;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// BC1
+
+	uint32_t Pack565(const float color[4])
+	{
+		const uint32_t r = static_cast<uint32_t>(color[0] * 31.0f / 255.0f + 0.5f);
+		const uint32_t g = static_cast<uint32_t>(color[1] * 63.0f / 255.0f + 0.5f);
+		const uint32_t b = static_cast<uint32_t>(color[2] * 31.0f / 255.0f + 0.5f);
+		return (r << 11) | (g << 5) | b;
+	}
+
+	void Unpack565(uint32_t packed, int color[4])
+	{
+		const int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+		color[0] = (r << 3) | (r >> 2);
+		color[1] = (g << 2) | (g >> 4);
+		color[2] = (b << 3) | (b >> 2);
+		color[3] = 255;
+	}
+
+	// Four color palette, always the one BC3 uses
+	void Bc1Palette(uint32_t c0, uint32_t c1, int palette[4][4])
+	{
+		Unpack565(c0, palette[0]);
+		Unpack565(c1, palette[1]);
+		for (int c = 0; c < 4; ++c) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+	}
+
+	uint32_t Bc1Indices(const PixelBlock& block, uint32_t c0, uint32_t c1, uint8_t indices[16])
+	{
+		int palette[4][4];
+		Bc1Palette(c0, c1, palette);
+		const __m128i colors[4] = { Color16(palette[0]), Color16(palette[1]), Color16(palette[2]), Color16(palette[3]) };
+		return FindIndices(block, colors, 4, ChannelMask(3), indices);
+	}
+
+	// Bounding box with the diagonal flipped to follow the covariance with green, inset by 1/16
+	void Bc1BoundingBox(const PixelBlock& block, float lo[4], float hi[4])
+	{
+		__m128i minimum = _mm_min_epu8(_mm_min_epu8(block.Rows[0], block.Rows[1]), _mm_min_epu8(block.Rows[2], block.Rows[3]));
+		__m128i maximum = _mm_max_epu8(_mm_max_epu8(block.Rows[0], block.Rows[1]), _mm_max_epu8(block.Rows[2], block.Rows[3]));
+		minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+		minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+		maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(1, 0, 3, 2)));
+		maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(2, 3, 0, 1)));
+		const uint32_t minPixel = static_cast<uint32_t>(_mm_cvtsi128_si32(minimum));
+		const uint32_t maxPixel = static_cast<uint32_t>(_mm_cvtsi128_si32(maximum));
+
+		float mean[3] = {};
+		for (int i = 0; i < 16; ++i)
+			for (int c = 0; c < 3; ++c)
+				mean[c] += block.Bytes[i * 4 + c] / 16.0f;
+		float rg = 0.0f, bg = 0.0f;
+		for (int i = 0; i < 16; ++i) {
+			const float g = block.Bytes[i * 4 + 1] - mean[1];
+			rg += (block.Bytes[i * 4] - mean[0]) * g;
+			bg += (block.Bytes[i * 4 + 2] - mean[2]) * g;
+		}
+
+		for (int c = 0; c < 3; ++c) {
+			const float low = static_cast<float>((minPixel >> (c * 8)) & 0xFF), high = static_cast<float>((maxPixel >> (c * 8)) & 0xFF);
+			const float inset = (high - low) / 16.0f;
+			lo[c] = low + inset;
+			hi[c] = high - inset;
+		}
+		if (rg < 0.0f)
+			std::swap(lo[0], hi[0]);
+		if (bg < 0.0f)
+			std::swap(lo[2], hi[2]);
+		lo[3] = hi[3] = 255.0f;
+	}
+
+	void WriteBc1(uint32_t c0, uint32_t c1, const uint8_t indices[16], uint8_t* out)
+	{
+		uint32_t bits = 0;
+		for (int i = 0; i < 16; ++i)
+			bits |= uint32_t(indices[i]) << (i * 2);
+		out[0] = static_cast<uint8_t>(c0);
+		out[1] = static_cast<uint8_t>(c0 >> 8);
+		out[2] = static_cast<uint8_t>(c1);
+		out[3] = static_cast<uint8_t>(c1 >> 8);
+		memcpy(out + 4, &bits, 4);
+	}
+
+	// 4 color mode only, so the block is also valid as the color half of BC3
+	void EncodeBc1(const PixelBlock& block, BlockQuality quality, uint8_t* out)
+	{
+		float lo[4], hi[4];
+		if (quality == BlockQuality::Fast)
+			Bc1BoundingBox(block, lo, hi);
+		else
+			FitLine(block, 0xFFFF, 3, lo, hi);
+
+		uint32_t c0 = Pack565(hi), c1 = Pack565(lo);
+		uint8_t indices[16] = {};
+		if (c0 == c1) {
+			WriteBc1(c0, c1, indices, out);
+			return;
+		}
+		if (c0 < c1)
+			std::swap(c0, c1);
+		uint32_t error = Bc1Indices(block, c0, c1, indices);
+
+		if (quality == BlockQuality::High) {
+			static const float kWeights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+			for (int iteration = 0; iteration < 2 && error > 0; ++iteration) {
+				float refinedLo[4], refinedHi[4];
+				if (!SolveEndpoints(block, 0xFFFF, 3, indices, kWeights, refinedLo, refinedHi))
+					break;
+				uint32_t r0 = Pack565(refinedLo), r1 = Pack565(refinedHi);
+				if (r0 == r1)
+					break;
+				if (r0 < r1)
+					std::swap(r0, r1);
+				uint8_t refined[16];
+				const uint32_t refinedError = Bc1Indices(block, r0, r1, refined);
+				if (refinedError >= error)
+					break;
+				c0 = r0;
+				c1 = r1;
+				error = refinedError;
+				memcpy(indices, refined, 16);
+			}
+		}
+		WriteBc1(c0, c1, indices, out);
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// BC4, one channel
+
+	// Palette in ascending order and the index of each entry. Nearest entries come from counting the
+	// midpoints below each value, 16 pixels at a time.
+	uint32_t Bc4Fit(__m128i values, const uint8_t ascending[8], const uint8_t indexOf[8], uint8_t indices[16])
+	{
+		__m128i position = _mm_setzero_si128();
+		for (int k = 0; k < 7; ++k) {
+			const __m128i mid = _mm_set1_epi8(static_cast<char>((ascending[k] + ascending[k + 1] + 1) >> 1));
+			position = _mm_sub_epi8(position, _mm_cmpeq_epi8(_mm_max_epu8(values, mid), values));
+		}
+		alignas(16) uint8_t table[16] = {}, map[16] = {};
+		memcpy(table, ascending, 8);
+		memcpy(map, indexOf, 8);
+		const __m128i chosen = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table)), position);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(indices), _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(map)), position));
+
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i diff = _mm_sub_epi8(_mm_max_epu8(values, chosen), _mm_min_epu8(values, chosen));
+		const __m128i low = _mm_unpacklo_epi8(diff, zero), high = _mm_unpackhi_epi8(diff, zero);
+		__m128i sum = _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+	}
+
+	// a0 > a1 interpolates 6 values, otherwise 4 plus 0 and 255
+	void Bc4Palette(uint32_t a0, uint32_t a1, uint8_t ascending[8], uint8_t indexOf[8])
+	{
+		if (a0 > a1) {
+			static const uint8_t kIndexOf[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+			ascending[0] = static_cast<uint8_t>(a1);
+			for (uint32_t i = 1; i < 7; ++i)
+				ascending[i] = static_cast<uint8_t>((i * a0 + (7 - i) * a1 + 3) / 7);
+			ascending[7] = static_cast<uint8_t>(a0);
+			memcpy(indexOf, kIndexOf, 8);
+		}
+		else {
+			static const uint8_t kIndexOf[8] = { 6, 0, 2, 3, 4, 5, 1, 7 };
+			ascending[0] = 0;
+			ascending[1] = static_cast<uint8_t>(a0);
+			for (uint32_t i = 1; i < 5; ++i)
+				ascending[i + 1] = static_cast<uint8_t>(((5 - i) * a0 + i * a1 + 2) / 5);
+			ascending[6] = static_cast<uint8_t>(a1);
+			ascending[7] = 255;
+			memcpy(indexOf, kIndexOf, 8);
+		}
+	}
+
+	uint32_t Bc4Try(__m128i values, uint32_t a0, uint32_t a1, uint8_t indices[16])
+	{
+		uint8_t ascending[8], indexOf[8];
+		Bc4Palette(a0, a1, ascending, indexOf);
+		return Bc4Fit(values, ascending, indexOf, indices);
+	}
+
+	void EncodeBc4(const PixelBlock& block, int channel, BlockQuality quality, uint8_t* out)
+	{
+		alignas(16) uint8_t bytes[16];
+		for (int i = 0; i < 16; ++i)
+			bytes[i] = block.Bytes[i * 4 + channel];
+		const __m128i values = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes));
+		const uint8_t minimum = *std::min_element(bytes, bytes + 16), maximum = *std::max_element(bytes, bytes + 16);
+
+		uint32_t a0 = maximum, a1 = minimum;
+		uint8_t indices[16] = {};
+		if (maximum != minimum) {
+			uint32_t error = Bc4Try(values, a0, a1, indices);
+			if (quality == BlockQuality::High && error > 0) {
+				// Pulled in endpoints, and the explicit 0 and 255 for the values between the extremes
+				const int range = maximum - minimum;
+				const int step = (std::max)(1, range / 14);
+				for (int low = 0; low <= 2; ++low) {
+					for (int high = 0; high <= 2; ++high) {
+						const int t0 = maximum - high * step, t1 = minimum + low * step;
+						if (t0 <= t1 || (low == 0 && high == 0))
+							continue;
+						uint8_t candidate[16];
+						const uint32_t candidateError = Bc4Try(values, t0, t1, candidate);
+						if (candidateError < error) {
+							error = candidateError;
+							a0 = t0;
+							a1 = t1;
+							memcpy(indices, candidate, 16);
+						}
+					}
+				}
+				uint8_t inner0 = 255, inner1 = 0;
+				for (int i = 0; i < 16; ++i) {
+					if (bytes[i] != 0 && bytes[i] != 255) {
+						inner0 = (std::min)(inner0, bytes[i]);
+						inner1 = (std::max)(inner1, bytes[i]);
+					}
+				}
+				if (inner0 <= inner1) {
+					uint8_t candidate[16];
+					const uint32_t candidateError = Bc4Try(values, inner0, inner1, candidate);
+					if (candidateError < error) {
+						a0 = inner0;
+						a1 = inner1;
+						memcpy(indices, candidate, 16);
+					}
+				}
+			}
+		}
+
+		uint64_t bits = 0;
+		for (int i = 0; i < 16; ++i)
+			bits |= uint64_t(indices[i]) << (i * 3);
+		out[0] = static_cast<uint8_t>(a0);
+		out[1] = static_cast<uint8_t>(a1);
+		for (int i = 0; i < 6; ++i)
+			out[2 + i] = static_cast<uint8_t>(bits >> (i * 8));
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// BC7 modes 1 and 6
+
+	const uint8_t kWeights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+	const uint8_t kWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	// Pixels of subset 1 for the 64 two subset partitions, and the anchor pixel of subset 1
+	const uint16_t kPartitions2[64] = {
+		0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80, 0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+		0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE, 0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C,
+		0xAAAA, 0xF0F0, 0x5A5A, 0x33CC, 0x3C3C, 0x55AA, 0x9696, 0xA55A, 0x73CE, 0x13C8, 0x324C, 0x3BDC, 0x6996, 0xC33C, 0x9966, 0x0660,
+		0x0272, 0x04E4, 0x4E40, 0x2720, 0xC936, 0x936C, 0x39C6, 0x639C, 0x9336, 0x9CC6, 0x817E, 0xE718, 0xCCF0, 0x0FCC, 0x7744, 0xEE22 };
+	const uint8_t kAnchors2[64] = {
+		15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 2, 8, 2, 2, 8, 8, 15, 2, 8, 2, 2, 8, 8, 2, 2,
+		15, 15, 6, 8, 2, 8, 15, 15, 2, 8, 2, 2, 2, 15, 15, 6, 6, 2, 6, 8, 15, 15, 2, 2, 15, 15, 15, 15, 15, 2, 2, 15 };
+
+	struct BitWriter
+	{
+		uint64_t Bits[2] = {};
+		uint32_t Position = 0;
+
+		void Put(uint32_t value, uint32_t count)
+		{
+			const uint64_t v = value & ((uint64_t(1) << count) - 1);
+			const uint32_t word = Position >> 6, shift = Position & 63;
+			Bits[word] |= v << shift;
+			if (shift + count > 64)
+				Bits[1] |= v >> (64 - shift);
+			Position += count;
+		}
+
+		void Write(uint8_t* out) const { memcpy(out, Bits, 16); }
+	};
+
+	struct BitReader
+	{
+		uint64_t Bits[2];
+		uint32_t Position = 0;
+
+		explicit BitReader(const uint8_t* block) { memcpy(Bits, block, 16); }
+
+		uint32_t Get(uint32_t count)
+		{
+			const uint32_t word = Position >> 6, shift = Position & 63;
+			uint64_t v = Bits[word] >> shift;
+			if (shift + count > 64)
+				v |= Bits[1] << (64 - shift);
+			Position += count;
+			return static_cast<uint32_t>(v & ((uint64_t(1) << count) - 1));
+		}
+	};
+
+	int Interpolate(int e0, int e1, int weight)
+	{
+		return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+	}
+
+	// Mode 6: 7 bit RGBA endpoints with a p-bit each, 4 bit indices
+	struct Mode6
+	{
+		int		Endpoints[2][4];	// 7 bit
+		int		PBits[2];
+		uint8_t	Indices[16];
+		uint32_t Error;
+
+		void Unquantized(int e, int color[4]) const
+		{
+			for (int c = 0; c < 4; ++c)
+				color[c] = (Endpoints[e][c] << 1) | PBits[e];
+		}
+
+		void Quantize(const float lo[4], const float hi[4], int p0, int p1)
+		{
+			const float* source[2] = { lo, hi };
+			const int p[2] = { p0, p1 };
+			for (int e = 0; e < 2; ++e) {
+				PBits[e] = p[e];
+				for (int c = 0; c < 4; ++c)
+					Endpoints[e][c] = (std::min)(127, (std::max)(0, static_cast<int>((source[e][c] - p[e]) * 0.5f + 0.5f)));
+			}
+		}
+
+		// Best p-bit of an endpoint alone, by the rounding error of its channels
+		static int ChoosePBit(const float color[4])
+		{
+			float error[2] = {};
+			for (int p = 0; p < 2; ++p) {
+				for (int c = 0; c < 4; ++c) {
+					const int q = (std::min)(127, (std::max)(0, static_cast<int>((color[c] - p) * 0.5f + 0.5f)));
+					const float d = color[c] - ((q << 1) | p);
+					error[p] += d * d;
+				}
+			}
+			return error[1] < error[0] ? 1 : 0;
+		}
+
+		void FindIndices(const PixelBlock& block)
+		{
+			int e0[4], e1[4];
+			Unquantized(0, e0);
+			Unquantized(1, e1);
+			__m128i palette[16];
+			for (int i = 0; i < 16; ++i) {
+				int color[4];
+				for (int c = 0; c < 4; ++c)
+					color[c] = Interpolate(e0[c], e1[c], kWeights4[i]);
+				palette[i] = Color16(color);
+			}
+			Error = ::FindIndices(block, palette, 16, ChannelMask(4), Indices);
+		}
+
+		void Write(uint8_t* out)
+		{
+			// The anchor index has an implicit zero top bit
+			if (Indices[0] & 8) {
+				std::swap(Endpoints[0], Endpoints[1]);
+				std::swap(PBits[0], PBits[1]);
+				for (int i = 0; i < 16; ++i)
+					Indices[i] = static_cast<uint8_t>(15 - Indices[i]);
+			}
+			BitWriter bits;
+			bits.Put(1 << 6, 7);
+			for (int c = 0; c < 4; ++c) {
+				bits.Put(Endpoints[0][c], 7);
+				bits.Put(Endpoints[1][c], 7);
+			}
+			bits.Put(PBits[0], 1);
+			bits.Put(PBits[1], 1);
+			for (int i = 0; i < 16; ++i)
+				bits.Put(Indices[i], i == 0 ? 3 : 4);
+			bits.Write(out);
+		}
+	};
+
+	Mode6 EncodeMode6(const PixelBlock& block, BlockQuality quality)
+	{
+		float lo[4], hi[4];
+		FitLine(block, 0xFFFF, 4, lo, hi);
+
+		Mode6 best;
+		best.Quantize(lo, hi, Mode6::ChoosePBit(lo), Mode6::ChoosePBit(hi));
+		best.FindIndices(block);
+		if (quality == BlockQuality::Fast || best.Error == 0)
+			return best;
+
+		// Every p-bit pair, then least squares endpoints for the indices found
+		for (int p = 0; p < 4; ++p) {
+			Mode6 candidate;
+			candidate.Quantize(lo, hi, p & 1, p >> 1);
+			candidate.FindIndices(block);
+			if (candidate.Error < best.Error)
+				best = candidate;
+		}
+		static const struct Weights { float Values[16]; Weights() { for (int i = 0; i < 16; ++i) Values[i] = kWeights4[i] / 64.0f; } } kWeights;
+		for (int iteration = 0; iteration < 2 && best.Error > 0; ++iteration) {
+			float refinedLo[4], refinedHi[4];
+			if (!SolveEndpoints(block, 0xFFFF, 4, best.Indices, kWeights.Values, refinedLo, refinedHi))
+				break;
+			bool improved = false;
+			for (int p = 0; p < 4; ++p) {
+				Mode6 candidate;
+				candidate.Quantize(refinedLo, refinedHi, p & 1, p >> 1);
+				candidate.FindIndices(block);
+				if (candidate.Error < best.Error) {
+					best = candidate;
+					improved = true;
+				}
+			}
+			if (!improved)
+				break;
+		}
+		return best;
+	}
+
+	// Mode 1: two subsets of 6 bit RGB endpoints with a shared p-bit per subset, 3 bit indices
+	struct Mode1
+	{
+		int		Partition;
+		int		Endpoints[2][2][3];	// [subset][endpoint], 6 bit
+		int		PBits[2];
+		uint8_t	Indices[16];
+		uint32_t Error;
+
+		static int Expand(int q, int p)
+		{
+			const int v = (q << 1) | p;
+			return (v << 1) | (v >> 6);
+		}
+
+		static int QuantizeChannel(float value, int p)
+		{
+			int best = 0, bestError = 1 << 30;
+			const int guess = static_cast<int>((value - 2 * p) * 0.25f + 0.5f);
+			for (int q = (std::max)(0, guess - 1); q <= (std::min)(63, guess + 1); ++q) {
+				const int d = std::abs(Expand(q, p) - static_cast<int>(value + 0.5f));
+				if (d < bestError) {
+					bestError = d;
+					best = q;
+				}
+			}
+			return best;
+		}
+
+		// Endpoints and indices of one subset for both p-bits, keeps the better
+		uint32_t FitSubset(const PixelBlock& block, int subset, uint32_t members, const float lo[4], const float hi[4])
+		{
+			uint32_t bestError = UINT32_MAX;
+			for (int p = 0; p < 2; ++p) {
+				int quantized[2][3], colors[2][4];
+				for (int c = 0; c < 3; ++c) {
+					quantized[0][c] = QuantizeChannel(lo[c], p);
+					quantized[1][c] = QuantizeChannel(hi[c], p);
+					colors[0][c] = Expand(quantized[0][c], p);
+					colors[1][c] = Expand(quantized[1][c], p);
+				}
+				colors[0][3] = colors[1][3] = 255;
+				__m128i palette[8];
+				for (int i = 0; i < 8; ++i) {
+					int color[4];
+					for (int c = 0; c < 4; ++c)
+						color[c] = Interpolate(colors[0][c], colors[1][c], kWeights3[i]);
+					palette[i] = Color16(color);
+				}
+				uint8_t indices[16];
+				const uint32_t error = FindIndices(block, palette, 8, ChannelMask(3), indices, members);
+				if (error < bestError) {
+					bestError = error;
+					PBits[subset] = p;
+					memcpy(Endpoints[subset], quantized, sizeof(quantized));
+					for (int i = 0; i < 16; ++i)
+						if (members & (1u << i))
+							Indices[i] = indices[i];
+				}
+			}
+			return bestError;
+		}
+
+		void Write(uint8_t* out)
+		{
+			const uint32_t subset1 = kPartitions2[Partition];
+			const int anchors[2] = { 0, kAnchors2[Partition] };
+			for (int s = 0; s < 2; ++s) {
+				if (!(Indices[anchors[s]] & 4))
+					continue;
+				std::swap(Endpoints[s][0], Endpoints[s][1]);
+				for (int i = 0; i < 16; ++i)
+					if (((subset1 >> i) & 1) == uint32_t(s))
+						Indices[i] = static_cast<uint8_t>(7 - Indices[i]);
+			}
+			BitWriter bits;
+			bits.Put(2, 2);
+			bits.Put(Partition, 6);
+			for (int c = 0; c < 3; ++c) {
+				for (int s = 0; s < 2; ++s) {
+					bits.Put(Endpoints[s][0][c], 6);
+					bits.Put(Endpoints[s][1][c], 6);
+				}
+			}
+			bits.Put(PBits[0], 1);
+			bits.Put(PBits[1], 1);
+			for (int i = 0; i < 16; ++i)
+				bits.Put(Indices[i], (i == anchors[0] || i == anchors[1]) ? 2 : 3);
+			bits.Write(out);
+		}
+	};
+
+	// Partitions ranked by the summed variance of their subsets, the best few are encoded
+	Mode1 EncodeMode1(const PixelBlock& block, uint32_t candidates)
+	{
+		float sum[16][3], square[16];
+		for (int i = 0; i < 16; ++i) {
+			square[i] = 0.0f;
+			for (int c = 0; c < 3; ++c) {
+				sum[i][c] = block.Bytes[i * 4 + c];
+				square[i] += sum[i][c] * sum[i][c];
+			}
+		}
+		std::pair<float, int> ranked[64];
+		for (int partition = 0; partition < 64; ++partition) {
+			float s[2][3] = {}, q[2] = {}, n[2] = {};
+			for (int i = 0; i < 16; ++i) {
+				const int subset = (kPartitions2[partition] >> i) & 1;
+				for (int c = 0; c < 3; ++c)
+					s[subset][c] += sum[i][c];
+				q[subset] += square[i];
+				n[subset] += 1.0f;
+			}
+			float variance = q[0] + q[1];
+			for (int subset = 0; subset < 2; ++subset)
+				for (int c = 0; c < 3; ++c)
+					variance -= s[subset][c] * s[subset][c] / n[subset];
+			ranked[partition] = { variance, partition };
+		}
+		std::partial_sort(ranked, ranked + candidates, ranked + 64);
+
+		Mode1 best;
+		best.Error = UINT32_MAX;
+		for (uint32_t k = 0; k < candidates; ++k) {
+			Mode1 candidate;
+			candidate.Partition = ranked[k].second;
+			candidate.Error = 0;
+			const uint32_t subset1 = kPartitions2[candidate.Partition];
+			for (int s = 0; s < 2; ++s) {
+				const uint32_t members = s ? subset1 : (~subset1 & 0xFFFF);
+				float lo[4], hi[4];
+				FitLine(block, members, 3, lo, hi);
+				candidate.Error += candidate.FitSubset(block, s, members, lo, hi);
+			}
+			if (candidate.Error < best.Error)
+				best = candidate;
+		}
+		return best;
+	}
+
+	void EncodeBc7(const PixelBlock& block, BlockQuality quality, uint8_t* out)
+	{
+		Mode6 mode6 = EncodeMode6(block, quality);
+		if (quality == BlockQuality::High && mode6.Error > 0) {
+			// Mode 1 has no alpha
+			const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+			__m128i opaque = _mm_and_si128(_mm_and_si128(block.Rows[0], block.Rows[1]), _mm_and_si128(block.Rows[2], block.Rows[3]));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(opaque, alpha), alpha)) == 0xFFFF) {
+				Mode1 mode1 = EncodeMode1(block, 4);
+				if (mode1.Error < mode6.Error) {
+					mode1.Write(out);
+					return;
+				}
+			}
+		}
+		mode6.Write(out);
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Decoding
+
+	void DecodeBc1(const uint8_t* in, uint8_t* pixels)
+	{
+		const uint32_t c0 = in[0] | (uint32_t(in[1]) << 8), c1 = in[2] | (uint32_t(in[3]) << 8);
+		uint32_t bits;
+		memcpy(&bits, in + 4, 4);
+		int palette[4][4];
+		Bc1Palette(c0, c1, palette);
+		for (int i = 0; i < 16; ++i) {
+			const int* color = palette[(bits >> (i * 2)) & 3];
+			for (int c = 0; c < 4; ++c)
+				pixels[i * 4 + c] = static_cast<uint8_t>(color[c]);
+		}
+	}
+
+	void DecodeBc4(const uint8_t* in, uint8_t* pixels, int channel)
+	{
+		uint8_t ascending[8], indexOf[8], palette[8];
+		Bc4Palette(in[0], in[1], ascending, indexOf);
+		for (int k = 0; k < 8; ++k)
+			palette[indexOf[k]] = ascending[k];
+		uint64_t bits = 0;
+		for (int i = 0; i < 6; ++i)
+			bits |= uint64_t(in[2 + i]) << (i * 8);
+		for (int i = 0; i < 16; ++i)
+			pixels[i * 4 + channel] = palette[(bits >> (i * 3)) & 7];
+	}
+
+	// The modes EncodeBc7 writes, other modes decode to magenta
+	void DecodeBc7(const uint8_t* in, uint8_t* pixels)
+	{
+		BitReader bits(in);
+		if ((in[0] & 0x7F) == 0x40) {
+			bits.Get(7);
+			int e[2][4];
+			for (int c = 0; c < 4; ++c) {
+				e[0][c] = bits.Get(7);
+				e[1][c] = bits.Get(7);
+			}
+			const int p0 = bits.Get(1), p1 = bits.Get(1);
+			for (int c = 0; c < 4; ++c) {
+				e[0][c] = (e[0][c] << 1) | p0;
+				e[1][c] = (e[1][c] << 1) | p1;
+			}
+			for (int i = 0; i < 16; ++i) {
+				const int index = bits.Get(i == 0 ? 3 : 4);
+				for (int c = 0; c < 4; ++c)
+					pixels[i * 4 + c] = static_cast<uint8_t>(Interpolate(e[0][c], e[1][c], kWeights4[index]));
+			}
+			return;
+		}
+		if ((in[0] & 3) == 2) {
+			bits.Get(2);
+			const int partition = bits.Get(6);
+			int e[2][2][3];
+			for (int c = 0; c < 3; ++c) {
+				for (int s = 0; s < 2; ++s) {
+					e[s][0][c] = bits.Get(6);
+					e[s][1][c] = bits.Get(6);
+				}
+			}
+			const int p[2] = { static_cast<int>(bits.Get(1)), static_cast<int>(bits.Get(1)) };
+			for (int i = 0; i < 16; ++i) {
+				const int s = (kPartitions2[partition] >> i) & 1;
+				const int index = bits.Get((i == 0 || i == kAnchors2[partition]) ? 2 : 3);
+				for (int c = 0; c < 3; ++c)
+					pixels[i * 4 + c] = static_cast<uint8_t>(Interpolate(Mode1::Expand(e[s][0][c], p[s]), Mode1::Expand(e[s][1][c], p[s]), kWeights3[index]));
+				pixels[i * 4 + 3] = 255;
+			}
+			return;
+		}
+		for (int i = 0; i < 16; ++i) {
+			pixels[i * 4 + 0] = pixels[i * 4 + 2] = pixels[i * 4 + 3] = 255;
+			pixels[i * 4 + 1] = 0;
+		}
+	}
+
+	int FormatChannels(BlockFormat format)
+	{
+		switch (format) {
+		case BlockFormat::BC1: return 3;
+		case BlockFormat::BC4: return 1;
+		case BlockFormat::BC5: return 2;
+		default: return 4;
+		}
+	}
+}
+
+TextureUsage BlockCompressor::GetUsage(const std::string& type, const std::string& fileName)
+{
+	auto contains = [](const std::string& text, const char* token) {
+		std::string lower(text);
+		std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return static_cast<char>(::tolower(static_cast<unsigned char>(c))); });
+		return lower.find(token) != std::string::npos;
+	};
+	if (contains(type, "normal") || contains(type, "height") || contains(type, "bump"))
+		return TextureUsage::Normal;
+	if (contains(type, "opacity") || contains(type, "mask"))
+		return TextureUsage::Mask;
+
+	const size_t slash = fileName.find_last_of("/\\");
+	const std::string name = slash == std::string::npos ? fileName : fileName.substr(slash + 1);
+	if (contains(name, "_bump") || contains(name, "_normal") || contains(name, "_ddn") || contains(name, "_nrm"))
+		return TextureUsage::Normal;
+	if (contains(name, "_mask"))
+		return TextureUsage::Mask;
+	return TextureUsage::Color;
+}
+
+BlockFormat BlockCompressor::ChooseFormat(TextureUsage usage, BlockQuality quality, const uint8_t* rgba, size_t rowPitch,
+	uint32_t width, uint32_t height)
+{
+	if (width == 0 || height == 0 || width % 4 != 0 || height % 4 != 0)
+		return BlockFormat::None;
+	if (usage == TextureUsage::Mask)
+		return BlockFormat::BC4;
+
+	bool alpha = false, gray = true;
+	for (uint32_t y = 0; y < height && (!alpha || gray); ++y) {
+		const uint8_t* p = rgba + size_t(y) * rowPitch;
+		for (uint32_t x = 0; x < width; ++x, p += 4) {
+			alpha = alpha || p[3] != 255;
+			gray = gray && p[0] == p[1] && p[1] == p[2];
+		}
+	}
+	if (usage == TextureUsage::Normal)
+		return gray ? BlockFormat::BC4 : BlockFormat::BC5;
+	// The BC7 encoder only tries mode 6 and the opaque mode 1, BC3 keeps alpha the better of the two
+	if (alpha)
+		return BlockFormat::BC3;
+	return quality == BlockQuality::High ? BlockFormat::BC7 : BlockFormat::BC1;
+}
+
+uint32_t BlockCompressor::GetBlockBytes(BlockFormat format)
+{
+	switch (format) {
+	case BlockFormat::BC1:
+	case BlockFormat::BC4:
+		return 8;
+	case BlockFormat::None:
+		return 64;
+	default:
+		return 16;
+	}
+}
+
+size_t BlockCompressor::GetRowBytes(BlockFormat format, uint32_t width)
+{
+	return size_t((width + 3) / 4) * GetBlockBytes(format);
+}
+
+const char* BlockCompressor::GetName(BlockFormat format)
+{
+	switch (format) {
+	case BlockFormat::BC1: return "BC1";
+	case BlockFormat::BC3: return "BC3";
+	case BlockFormat::BC4: return "BC4";
+	case BlockFormat::BC5: return "BC5";
+	case BlockFormat::BC7: return "BC7";
+	default: return "RGBA8";
+	}
+}
+
+void BlockCompressor::Compress(const uint8_t* rgba, size_t rowPitch, uint32_t width, uint32_t height, BlockFormat format,
+	BlockQuality quality, uint8_t* out, size_t outRowPitch, ThreadPool& pool)
+{
+	const uint32_t blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	const uint32_t blockBytes = GetBlockBytes(format);
+	pool.ParallelFor(blocksY, [&](size_t by) {
+		PixelBlock block;
+		uint8_t* dst = out + by * outRowPitch;
+		for (uint32_t bx = 0; bx < blocksX; ++bx, dst += blockBytes) {
+			if (bx * 4 + 4 <= width && by * 4 + 4 <= height)
+				LoadBlock(rgba + by * 4 * rowPitch + size_t(bx) * 16, rowPitch, block);
+			else
+				LoadEdgeBlock(rgba, rowPitch, bx * 4, static_cast<uint32_t>(by) * 4, width, height, block);
+			switch (format) {
+			case BlockFormat::BC1:
+				EncodeBc1(block, quality, dst);
+				break;
+			case BlockFormat::BC3:
+				EncodeBc4(block, 3, quality, dst);
+				EncodeBc1(block, quality, dst + 8);
+				break;
+			case BlockFormat::BC4:
+				EncodeBc4(block, 0, quality, dst);
+				break;
+			case BlockFormat::BC5:
+				EncodeBc4(block, 0, quality, dst);
+				EncodeBc4(block, 1, quality, dst + 8);
+				break;
+			case BlockFormat::BC7:
+				EncodeBc7(block, quality, dst);
+				break;
+			default:
+				for (int r = 0; r < 4; ++r)
+					memcpy(dst + r * 16, block.Bytes + r * 16, 16);
+				break;
+			}
+		}
+	});
+}
+
+void BlockCompressor::Decompress(const uint8_t* blocks, size_t rowPitch, uint32_t width, uint32_t height, BlockFormat format,
+	uint8_t* rgba, size_t outRowPitch)
+{
+	const uint32_t blockBytes = GetBlockBytes(format);
+	for (uint32_t by = 0; by < (height + 3) / 4; ++by) {
+		for (uint32_t bx = 0; bx < (width + 3) / 4; ++bx) {
+			const uint8_t* in = blocks + size_t(by) * rowPitch + size_t(bx) * blockBytes;
+			uint8_t pixels[64];
+			for (int i = 0; i < 16; ++i) {
+				pixels[i * 4 + 0] = pixels[i * 4 + 1] = pixels[i * 4 + 2] = 0;
+				pixels[i * 4 + 3] = 255;
+			}
+			switch (format) {
+			case BlockFormat::BC1: DecodeBc1(in, pixels); break;
+			case BlockFormat::BC3: DecodeBc1(in + 8, pixels); DecodeBc4(in, pixels, 3); break;
+			case BlockFormat::BC4: DecodeBc4(in, pixels, 0); break;
+			case BlockFormat::BC5: DecodeBc4(in, pixels, 0); DecodeBc4(in + 8, pixels, 1); break;
+			case BlockFormat::BC7: DecodeBc7(in, pixels); break;
+			default: memcpy(pixels, in, 64); break;
+			}
+			const uint32_t columns = (std::min)(4u, width - bx * 4), rows = (std::min)(4u, height - by * 4);
+			for (uint32_t r = 0; r < rows; ++r)
+				memcpy(rgba + (size_t(by) * 4 + r) * outRowPitch + size_t(bx) * 16, pixels + r * 16, columns * 4);
+		}
+	}
+}
+
+void BlockCompressor::Measure(const uint8_t* source, const uint8_t* decoded, size_t rowPitch, uint32_t width, uint32_t height,
+	BlockFormat format, BlockCompressStats& stats)
+{
+	const int channels = FormatChannels(format);
+	double error = 0.0;
+	for (uint32_t y = 0; y < height; ++y) {
+		const uint8_t* a = source + size_t(y) * rowPitch;
+		const uint8_t* b = decoded + size_t(y) * rowPitch;
+		for (uint32_t x = 0; x < width; ++x) {
+			for (int c = 0; c < channels; ++c) {
+				const int d = a[x * 4 + c] - b[x * 4 + c];
+				error += d * d;
+			}
+		}
+	}
+	stats.SquaredError += error;
+	stats.Samples += uint64_t(width) * height * channels;
+}
+
+void BlockCompressor::RunBenchmark(const std::vector<std::string>& files, const std::vector<TextureUsage>& usages, ThreadPool& pool)
+{
+	// Decoded once, every mode compresses the same pixels
+	struct Image
+	{
+		uint32_t Width = 0;
+		uint32_t Height = 0;
+		TextureUsage Usage = TextureUsage::Color;
+		std::vector<uint8_t> Pixels;
+	};
+	std::vector<Image> images;
+	for (size_t i = 0; i < files.size(); ++i) {
+		std::ifstream stream(files[i], std::ios::binary | std::ios::ate);
+		if (!stream)
+			continue;
+		std::vector<uint8_t> data(static_cast<size_t>(stream.tellg()));
+		stream.seekg(0);
+		stream.read(reinterpret_cast<char*>(data.data()), data.size());
+		ImageInfo info;
+		if (!ImageDecoder::ReadInfo(data.data(), data.size(), info))
+			continue;
+		Image image;
+		image.Width = info.Width;
+		image.Height = info.Height;
+		image.Usage = i < usages.size() ? usages[i] : TextureUsage::Color;
+		image.Pixels.resize(size_t(info.Width) * 4 * info.Height);
+		if (ImageDecoder::Decode(data.data(), data.size(), info, image.Pixels.data(), size_t(info.Width) * 4))
+			images.push_back(std::move(image));
+	}
+	if (images.empty())
+		return;
+
+	const BlockQuality qualities[2] = { BlockQuality::Fast, BlockQuality::High };
+	for (BlockQuality quality : qualities) {
+		BlockCompressStats perFormat[6], total;
+		std::vector<uint8_t> blocks, decoded;
+		for (auto& image : images) {
+			const size_t rowPitch = size_t(image.Width) * 4;
+			const BlockFormat format = ChooseFormat(image.Usage, quality, image.Pixels.data(), rowPitch, image.Width, image.Height);
+			if (format == BlockFormat::None)
+				continue;
+			const size_t blockPitch = GetRowBytes(format, image.Width);
+			blocks.resize(blockPitch * (image.Height / 4));
+			auto start = std::chrono::high_resolution_clock::now();
+			Compress(image.Pixels.data(), rowPitch, image.Width, image.Height, format, quality, blocks.data(), blockPitch, pool);
+			const double ms = ElapsedMs(start);
+
+			decoded.resize(image.Pixels.size());
+			Decompress(blocks.data(), blockPitch, image.Width, image.Height, format, decoded.data(), rowPitch);
+			for (BlockCompressStats* stats : { &perFormat[static_cast<size_t>(format)], &total }) {
+				++stats->Textures;
+				stats->Pixels += uint64_t(image.Width) * image.Height;
+				stats->SourceBytes += image.Pixels.size();
+				stats->CompressedBytes += blocks.size();
+				stats->EncodeMs += ms;
+				Measure(image.Pixels.data(), decoded.data(), rowPitch, image.Width, image.Height, format, *stats);
+			}
+		}
+
+		const char* mode = quality == BlockQuality::Fast ? "fast" : "high";
+		auto print = [&](const char* name, const BlockCompressStats& stats) {
+			const double psnr = stats.SquaredError > 0.0 ? 10.0 * std::log10(255.0 * 255.0 * stats.Samples / stats.SquaredError) : 99.0;
+			std::cout << "BlockCompressor benchmark (" << mode << ", " << pool.GetThreadCount() << " threads): " << name << " "
+				<< stats.Textures << " textures, " << stats.Pixels / 1e6 / (stats.EncodeMs / 1000.0) << " MP/s, PSNR " << psnr << " dB, "
+				<< stats.SourceBytes / (1024 * 1024) << " MB -> " << stats.CompressedBytes / (1024 * 1024) << " MB" << std::endl;
+		};
+		for (size_t format = 1; format < 6; ++format) {
+			if (perFormat[format].Textures)
+				print(GetName(static_cast<BlockFormat>(format)), perFormat[format]);
+		}
+		print("total", total);
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ThreadPool.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class BlockFormat : uint8_t
+{
+	None,	// stays RGBA8
+	BC1,	// RGB, 4 bpp
+	BC3,	// RGBA, BC1 color plus a BC4 alpha block, 8 bpp
+	BC4,	// one channel, 4 bpp
+	BC5,	// two channels, 8 bpp
+	BC7,	// RGBA, 8 bpp
+};
+
+enum class BlockQuality : uint8_t
+{
+	Fast,	// at load time
+	High,	// offline cooking, around 50 times slower
+};
+
+// What the texture is sampled for, decides the format
+enum class TextureUsage : uint8_t
+{
+	Color,
+	Mask,	// single channel: opacity, cutout
+	Normal,	// bump, height and normal maps
+};
+
+struct BlockCompressStats
+{
+	uint32_t	Textures = 0;
+	uint64_t	Pixels = 0;
+	uint64_t	SourceBytes = 0;		// RGBA8
+	uint64_t	CompressedBytes = 0;
+	double		EncodeMs = 0.0;
+	double		SquaredError = 0.0;		// over the channels the format keeps
+	uint64_t	Samples = 0;
+};
+
+// CPU encoder for the block compressed formats D3D12 samples natively. Images are RGBA8 rows of any
+// pitch. The top mip of a BC resource has to be a multiple of 4 wide and high, the smaller mips end in
+// partial blocks that repeat the edge pixels. Rows of blocks go out at the caller's pitch, like the
+// copy footprint of the upload path.
+//
+// BC1 endpoints come from the bounding box in fast mode and from the principal axis with least squares
+// refinement in high mode. BC4 indices are picked with 16 byte compares, BC7 writes mode 6 blocks in
+// fast mode and adds the two subset mode 1 in high mode. Pixel distances and palette searches are
+// SSE2. Block rows are spread over a thread pool; calls from inside a pool job run serially.
+class BlockCompressor
+{
+public:
+	// Type is the texture type of the model loader ("texture_diffuse", ...), the file name is the
+	// fallback for types that don't say (a "_bump" or "_mask" suffix)
+	static TextureUsage GetUsage(const std::string& type, const std::string& fileName);
+	// Color: BC1, BC7 in high mode, BC3 with alpha in either mode. Mask: BC4 of red. Normal: BC5 of red and green,
+	// BC4 when the image is grayscale (height maps). None when the size isn't a multiple of 4.
+	static BlockFormat ChooseFormat(TextureUsage usage, BlockQuality quality, const uint8_t* rgba, size_t rowPitch,
+		uint32_t width, uint32_t height);
+
+	static uint32_t GetBlockBytes(BlockFormat format);
+	// Bytes of one row of blocks, without padding
+	static size_t GetRowBytes(BlockFormat format, uint32_t width);
+	static const char* GetName(BlockFormat format);
+
+	static void Compress(const uint8_t* rgba, size_t rowPitch, uint32_t width, uint32_t height, BlockFormat format,
+		BlockQuality quality, uint8_t* out, size_t outRowPitch, ThreadPool& pool);
+	// Blocks back to RGBA8, channels the format doesn't store are 0 (alpha 255)
+	static void Decompress(const uint8_t* blocks, size_t rowPitch, uint32_t width, uint32_t height, BlockFormat format,
+		uint8_t* rgba, size_t outRowPitch);
+	// Squared error and sample count over the channels format keeps
+	static void Measure(const uint8_t* source, const uint8_t* decoded, size_t rowPitch, uint32_t width, uint32_t height,
+		BlockFormat format, BlockCompressStats& stats);
+
+	// Compresses every file in both modes, prints throughput, PSNR and memory saved per format
+	static void RunBenchmark(const std::vector<std::string>& files, const std::vector<TextureUsage>& usages, ThreadPool& pool);
+};
@@ -89,23 +89,26 @@ void BottomLevelASGenerator::AddVertexBuffer(
                                      // vertices. This buffer cannot be nullptr
     UINT64 transformOffsetInBytes,   // Offset of the transform matrix in the
                                      // transform buffer
-    bool isOpaque /* = true */ // If true, the geometry is considered opaque,
-                               // optimizing the search for a closest hit
+    bool isOpaque /* = true */, // If true, the geometry is considered opaque,
+                                // optimizing the search for a closest hit
+    DXGI_FORMAT vertexFormat /* = DXGI_FORMAT_R32G32B32_FLOAT */, // Format of
+                                // the position at the start of each vertex
+    DXGI_FORMAT indexFormat /* = DXGI_FORMAT_R32_UINT */ // R32_UINT or R16_UINT
 ) {
   // Create the DX12 descriptor representing the input data, assumed to be
-  // opaque triangles, with 3xf32 vertex coordinates and 32-bit indices
+  // opaque triangles, with vertexFormat coordinates and indexFormat indices
   D3D12_RAYTRACING_GEOMETRY_DESC descriptor = {};
   descriptor.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
   descriptor.Triangles.VertexBuffer.StartAddress =
       vertexBuffer->GetGPUVirtualAddress() + vertexOffsetInBytes;
   descriptor.Triangles.VertexBuffer.StrideInBytes = vertexSizeInBytes;
   descriptor.Triangles.VertexCount = vertexCount;
-  descriptor.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+  descriptor.Triangles.VertexFormat = vertexFormat;
   descriptor.Triangles.IndexBuffer =
       indexBuffer ? (indexBuffer->GetGPUVirtualAddress() + indexOffsetInBytes)
                   : 0;
   descriptor.Triangles.IndexFormat =
-      indexBuffer ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_UNKNOWN;
+      indexBuffer ? indexFormat : DXGI_FORMAT_UNKNOWN;
   descriptor.Triangles.IndexCount = indexCount;
   descriptor.Triangles.Transform3x4 =
       transformBuffer
@@ -101,8 +101,8 @@ public:
   );
 
   /// Add a vertex buffer along with its index buffer in GPU memory into the acceleration structure.
-  /// The vertices are supposed to be represented by 3 float32 value, and the indices are 32-bit
-  /// unsigned ints
+  /// The vertices are represented by 3 float32 values unless another position format is given,
+  /// and the indices are 32-bit unsigned ints unless indexFormat says otherwise
   void AddVertexBuffer(ID3D12Resource* vertexBuffer, /// Buffer containing the vertex coordinates,
                                                      /// possibly interleaved with other vertex data
                        UINT64 vertexOffsetInBytes,   /// Offset of the first vertex in the vertex
@@ -123,8 +123,11 @@ public:
                                                         /// be nullptr
                        UINT64 transformOffsetInBytes,   /// Offset of the transform matrix in the
                                                         /// transform buffer
-                       bool isOpaque = true /// If true, the geometry is considered opaque,
-                                            /// optimizing the search for a closest hit
+                       bool isOpaque = true, /// If true, the geometry is considered opaque,
+                                             /// optimizing the search for a closest hit
+                       DXGI_FORMAT vertexFormat = DXGI_FORMAT_R32G32B32_FLOAT, /// Format of the position,
+                                             /// the first member of each vertex
+                       DXGI_FORMAT indexFormat = DXGI_FORMAT_R32_UINT /// R32_UINT or R16_UINT
   );
 
   /// Compute the size of the scratch space required to build the acceleration structure, as well as
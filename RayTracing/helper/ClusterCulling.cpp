@@ -0,0 +1,154 @@
+#include "stdafx.h"
+#include "ClusterCulling.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <xmmintrin.h>
+
+Frustum Frustum::FromMatrix(FXMMATRIX matrix)
+{
+	// Columns of the row vector matrix, a clip space coordinate is dot(v, column)
+	XMMATRIX columns = XMMatrixTranspose(matrix);
+	const XMVECTOR x = columns.r[0], y = columns.r[1], z = columns.r[2], w = columns.r[3];
+	const XMVECTOR planes[6] = {
+		XMVectorAdd(w, x),			// left
+		XMVectorSubtract(w, x),		// right
+		XMVectorAdd(w, y),			// bottom
+		XMVectorSubtract(w, y),		// top
+		z,							// near, depth starts at 0
+		XMVectorSubtract(w, z),		// far
+	};
+
+	Frustum frustum;
+	for (int i = 0; i < 6; ++i)
+		XMStoreFloat4(&frustum.Planes[i], XMPlaneNormalize(planes[i]));
+	return frustum;
+}
+
+bool Frustum::IntersectsSphere(const XMFLOAT3& center, float radius) const
+{
+	for (const XMFLOAT4& p : Planes) {
+		if (p.x * center.x + p.y * center.y + p.z * center.z + p.w < -radius)
+			return false;
+	}
+	return true;
+}
+
+bool ClusterCulling::IsBackfacing(const Meshlet& meshlet, const XMFLOAT3& cameraPosition)
+{
+	XMFLOAT3 d(meshlet.ConeApex.x - cameraPosition.x, meshlet.ConeApex.y - cameraPosition.y, meshlet.ConeApex.z - cameraPosition.z);
+	float projected = d.x * meshlet.ConeAxis.x + d.y * meshlet.ConeAxis.y + d.z * meshlet.ConeAxis.z;
+	// dot(normalize(d), axis) >= cutoff without the division, cutoff is never negative
+	return projected > 0.0f && projected * projected >= meshlet.ConeCutoff * meshlet.ConeCutoff * (d.x * d.x + d.y * d.y + d.z * d.z);
+}
+
+void ClusterCulling::CullMeshlets(const std::vector<Meshlet>& meshlets, const Frustum& frustum, const XMFLOAT3& cameraPosition,
+	bool coneCulling, std::vector<IndexRange>& ranges, ClusterCullStats& stats)
+{
+	stats.Meshlets += meshlets.size();
+	for (const Meshlet& meshlet : meshlets) {
+		stats.Triangles += meshlet.IndexCount / 3;
+		if (!frustum.IntersectsSphere(meshlet.Center, meshlet.Radius)) {
+			++stats.FrustumCulled;
+			continue;
+		}
+		if (coneCulling && meshlet.ConeCutoff < 1.0f && IsBackfacing(meshlet, cameraPosition)) {
+			++stats.ConeCulled;
+			continue;
+		}
+
+		stats.VisibleTriangles += meshlet.IndexCount / 3;
+		if (!ranges.empty() && ranges.back().StartIndexLocation + ranges.back().IndexCount == meshlet.StartIndexLocation) {
+			ranges.back().IndexCount += meshlet.IndexCount;
+		}
+		else {
+			ranges.push_back({ meshlet.StartIndexLocation, meshlet.IndexCount });
+			++stats.Draws;
+		}
+	}
+}
+
+void ClusterCulling::SetBounds(std::vector<BoundsBlock>& blocks, size_t index, const XMFLOAT3& boundsMin,
+	const XMFLOAT3& boundsMax, float radius, FXMMATRIX world)
+{
+	if (blocks.size() <= index / 8)
+		blocks.resize(index / 8 + 1, BoundsBlock());
+
+	XMVECTOR lo = XMLoadFloat3(&boundsMin), hi = XMLoadFloat3(&boundsMax);
+	XMVECTOR center = XMVector3TransformCoord(XMVectorScale(XMVectorAdd(lo, hi), 0.5f), world);
+	XMVECTOR extent = XMVectorScale(XMVectorSubtract(hi, lo), 0.5f);
+	// Box around the transformed box, each world axis gets |row| . extent from every model axis
+	XMVECTOR worldExtent = XMVectorAdd(XMVectorAdd(
+		XMVectorMultiply(XMVectorSplatX(extent), XMVectorAbs(world.r[0])),
+		XMVectorMultiply(XMVectorSplatY(extent), XMVectorAbs(world.r[1]))),
+		XMVectorMultiply(XMVectorSplatZ(extent), XMVectorAbs(world.r[2])));
+	float scale = std::sqrt((std::max)((std::max)(XMVectorGetX(XMVector3LengthSq(world.r[0])),
+		XMVectorGetX(XMVector3LengthSq(world.r[1]))), XMVectorGetX(XMVector3LengthSq(world.r[2]))));
+
+	BoundsBlock& block = blocks[index / 8];
+	const size_t lane = index % 8;
+	block.CenterX[lane] = XMVectorGetX(center);
+	block.CenterY[lane] = XMVectorGetY(center);
+	block.CenterZ[lane] = XMVectorGetZ(center);
+	block.ExtentX[lane] = XMVectorGetX(worldExtent);
+	block.ExtentY[lane] = XMVectorGetY(worldExtent);
+	block.ExtentZ[lane] = XMVectorGetZ(worldExtent);
+	block.Radius[lane] = radius * scale;
+}
+
+void ClusterCulling::CullBounds(const std::vector<BoundsBlock>& blocks, size_t count, const Frustum& frustum,
+	std::vector<UINT8>& visibleMasks, MeshCullStats& stats)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	const size_t blockCount = (count + 7) / 8;
+	visibleMasks.resize(blockCount);
+
+	__m128 planes[6][7];
+	for (int p = 0; p < 6; ++p) {
+		const XMFLOAT4& plane = frustum.Planes[p];
+		planes[p][0] = _mm_set1_ps(plane.x);
+		planes[p][1] = _mm_set1_ps(plane.y);
+		planes[p][2] = _mm_set1_ps(plane.z);
+		planes[p][3] = _mm_set1_ps(plane.w);
+		planes[p][4] = _mm_set1_ps(std::fabs(plane.x));
+		planes[p][5] = _mm_set1_ps(std::fabs(plane.y));
+		planes[p][6] = _mm_set1_ps(std::fabs(plane.z));
+	}
+	const __m128 zero = _mm_setzero_ps();
+
+	UINT64 visibleCount = 0;
+	for (size_t b = 0; b < blockCount; ++b) {
+		const BoundsBlock& block = blocks[b];
+		int mask = 0;
+		// The 8 lanes as two halves of 4
+		for (int half = 0; half < 8; half += 4) {
+			const __m128 cx = _mm_load_ps(block.CenterX + half);
+			const __m128 cy = _mm_load_ps(block.CenterY + half);
+			const __m128 cz = _mm_load_ps(block.CenterZ + half);
+			const __m128 ex = _mm_load_ps(block.ExtentX + half);
+			const __m128 ey = _mm_load_ps(block.ExtentY + half);
+			const __m128 ez = _mm_load_ps(block.ExtentZ + half);
+			const __m128 radius = _mm_load_ps(block.Radius + half);
+			__m128 outside = zero;
+			for (int p = 0; p < 6; ++p) {
+				const __m128* plane = planes[p];
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[0], cx), _mm_mul_ps(plane[1], cy)),
+					_mm_add_ps(_mm_mul_ps(plane[2], cz), plane[3]));
+				__m128 boxReach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[4], ex), _mm_mul_ps(plane[5], ey)), _mm_mul_ps(plane[6], ez));
+				__m128 reach = _mm_min_ps(boxReach, radius);
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), zero));
+			}
+			mask |= (~_mm_movemask_ps(outside) & 0xF) << half;
+		}
+		// Padding lanes of the last block stay invisible
+		if (b == blockCount - 1 && count % 8 != 0)
+			mask &= (1 << (count % 8)) - 1;
+		visibleMasks[b] = static_cast<UINT8>(mask);
+		for (int bits = mask; bits != 0; bits &= bits - 1)
+			++visibleCount;
+	}
+
+	stats.Instances += count;
+	stats.FrustumCulled += count - visibleCount;
+	stats.CullMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
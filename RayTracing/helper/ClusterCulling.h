@@ -0,0 +1,76 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+// View frustum as six inward facing planes (xyz normal, w offset), normalized.
+struct Frustum
+{
+	XMFLOAT4 Planes[6];
+
+	// Planes in the space matrix maps from, clip = v * matrix with the D3D depth range [0, 1].
+	// Pass world * view * projection to get model space planes.
+	static Frustum FromMatrix(FXMMATRIX matrix);
+
+	bool IntersectsSphere(const XMFLOAT3& center, float radius) const;
+};
+
+// Part of an index buffer, drawn with DrawIndexedInstanced(IndexCount, 1, StartIndexLocation, 0, 0)
+struct IndexRange
+{
+	UINT StartIndexLocation = 0;
+	UINT IndexCount = 0;
+};
+
+struct ClusterCullStats
+{
+	UINT64	Meshlets = 0;
+	UINT64	FrustumCulled = 0;
+	UINT64	ConeCulled = 0;
+	UINT64	Triangles = 0;
+	UINT64	VisibleTriangles = 0;
+	UINT64	Draws = 0;			// ranges left after merging neighbouring visible meshlets
+};
+
+// Bounds of 8 mesh instances as structure of arrays, a box and a sphere around the same center.
+// Lanes past the instance count are empty boxes at the origin.
+struct alignas(16) BoundsBlock
+{
+	float CenterX[8];
+	float CenterY[8];
+	float CenterZ[8];
+	float ExtentX[8];
+	float ExtentY[8];
+	float ExtentZ[8];
+	float Radius[8];
+};
+
+struct MeshCullStats
+{
+	UINT64	Instances = 0;
+	UINT64	FrustumCulled = 0;
+	double	CullMs = 0.0;
+};
+
+// CPU visibility of the meshlets built by MeshOptimizer::BuildMeshlets, and of whole mesh instances.
+class ClusterCulling
+{
+public:
+	// Stores the model space box (min, max) of instance index, placed with the row vector matrix world,
+	// as a world space box and sphere. The sphere is centered on the box, radius is its model space radius.
+	static void SetBounds(std::vector<BoundsBlock>& blocks, size_t index, const XMFLOAT3& boundsMin,
+		const XMFLOAT3& boundsMax, float radius, FXMMATRIX world);
+	// Tests 8 instances per step against the frustum, in the space of the bounds. An instance is culled
+	// when its box or its sphere, whichever is tighter for the plane, lies behind one of the planes.
+	// Bit i of visibleMasks[b] is set when instance 8 * b + i is visible.
+	static void CullBounds(const std::vector<BoundsBlock>& blocks, size_t count, const Frustum& frustum,
+		std::vector<UINT8>& visibleMasks, MeshCullStats& stats);
+
+	// Appends the ranges of the meshlets that pass the frustum test and, with coneCulling, the normal cone
+	// test. Meshlets that follow each other in the index buffer are merged into one range.
+	// The frustum and cameraPosition have to be in the model space of the meshlet bounds.
+	static void CullMeshlets(const std::vector<Meshlet>& meshlets, const Frustum& frustum, const XMFLOAT3& cameraPosition,
+		bool coneCulling, std::vector<IndexRange>& ranges, ClusterCullStats& stats);
+
+	static bool IsBackfacing(const Meshlet& meshlet, const XMFLOAT3& cameraPosition);
+};
@@ -184,7 +184,7 @@ namespace helper {
 	// Specifies the default heap. This heap type experiences the most bandwidth for the GPU, but cannot provide CPU access.
 	static const D3D12_HEAP_PROPERTIES kDefaultHeapProps = { D3D12_HEAP_TYPE_DEFAULT, D3D12_CPU_PAGE_PROPERTY_UNKNOWN, D3D12_MEMORY_POOL_UNKNOWN, 0, 0 };
 
-	inline IDxcBlob* CompileShaderLibrary(LPCWSTR fileName)
+	inline IDxcBlob* CompileShaderLibrary(LPCWSTR fileName, const std::vector<DxcDefine>& defines = {})
 	{
 		static IDxcCompiler* pCompiler = nullptr;
 		static IDxcLibrary* pLibrary = nullptr;
@@ -216,8 +216,8 @@ namespace helper {
 
 		// Compile
 		IDxcOperationResult* pResult;
-		ThrowIfFailed(pCompiler->Compile(pTextBlob, fileName, L"", L"lib_6_3", nullptr, 0, nullptr, 0,
-			dxcIncludeHandler, &pResult));
+		ThrowIfFailed(pCompiler->Compile(pTextBlob, fileName, L"", L"lib_6_3", nullptr, 0,
+			defines.empty() ? nullptr : defines.data(), static_cast<UINT32>(defines.size()), dxcIncludeHandler, &pResult));
 
 		// Verify the result
 		HRESULT resultCode;
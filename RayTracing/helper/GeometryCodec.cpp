@@ -0,0 +1,276 @@
+#include "stdafx.h"
+#include "GeometryCodec.h"
+#include "MeshOptimizer.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <tmmintrin.h>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	uint32_t ZigZag(uint32_t delta)
+	{
+		return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+	}
+
+	// pshufb controls that spread the first popcount(mask) bytes of a load onto the set bits of an
+	// 8 bit mask, 0x80 clears the other bytes
+	struct ExpandTables
+	{
+		alignas(16) UINT8 Shuffle[256][8];
+		UINT8 Count[256];
+
+		ExpandTables()
+		{
+			for (int mask = 0; mask < 256; ++mask) {
+				UINT8 next = 0;
+				for (int bit = 0; bit < 8; ++bit)
+					Shuffle[mask][bit] = (mask & (1 << bit)) ? next++ : 0x80;
+				Count[mask] = next;
+			}
+		}
+	};
+
+	const ExpandTables& GetExpandTables()
+	{
+		static const ExpandTables tables;
+		return tables;
+	}
+
+	// One plane of 16 bytes, p points at its mask
+	__m128i ExpandPlane(const UINT8*& p, const ExpandTables& tables)
+	{
+		const UINT mask = p[0] | (UINT(p[1]) << 8);
+		const UINT8* bytes = p + 2;
+		const UINT lowCount = tables.Count[mask & 0xFF];
+		__m128i low = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(bytes)),
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(tables.Shuffle[mask & 0xFF])));
+		__m128i high = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(bytes + lowCount)),
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(tables.Shuffle[mask >> 8])));
+		p = bytes + lowCount + tables.Count[mask >> 8];
+		return _mm_unpacklo_epi64(low, high);
+	}
+
+	// Zigzag decode and running sum of 4 differences, carry holds the previous value in every lane
+	__m128i Accumulate(__m128i zigzag, __m128i& carry)
+	{
+		const __m128i one = _mm_set1_epi32(1);
+		__m128i delta = _mm_xor_si128(_mm_srli_epi32(zigzag, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(zigzag, one)));
+		delta = _mm_add_epi32(delta, _mm_slli_si128(delta, 4));
+		delta = _mm_add_epi32(delta, _mm_slli_si128(delta, 8));
+		__m128i value = _mm_add_epi32(delta, carry);
+		carry = _mm_shuffle_epi32(value, _MM_SHUFFLE(3, 3, 3, 3));
+		return value;
+	}
+
+	// Elements [0, count) of one chunk. Plane loads may run up to 16 bytes into the next chunk or the padding.
+	bool DecodeChunk(const UINT8* p, const UINT8* end, size_t count, UINT words, uint32_t* target)
+	{
+		const UINT kGroupSize = GeometryCodec::kGroupSize;
+		const ExpandTables& tables = GetExpandTables();
+		// Running values per word, and the decoded group as words x 16 for the interleave
+		__m128i carries[GeometryCodec::kMaxWords];
+		for (UINT w = 0; w < words; ++w)
+			carries[w] = _mm_setzero_si128();
+		alignas(16) uint32_t tile[GeometryCodec::kMaxWords * GeometryCodec::kGroupSize];
+
+		for (size_t first = 0; first < count; first += kGroupSize) {
+			for (UINT w = 0; w < words; ++w) {
+				__m128i planes[4];
+				for (int b = 0; b < 4; ++b) {
+					// Mask and at least one byte per set bit still inside the chunk
+					if (end - p < 2)
+						return false;
+					planes[b] = ExpandPlane(p, tables);
+				}
+
+				// Byte planes back to words, bytes 0 and 1 then 2 and 3 side by side
+				const __m128i low01 = _mm_unpacklo_epi8(planes[0], planes[1]);
+				const __m128i high01 = _mm_unpackhi_epi8(planes[0], planes[1]);
+				const __m128i low23 = _mm_unpacklo_epi8(planes[2], planes[3]);
+				const __m128i high23 = _mm_unpackhi_epi8(planes[2], planes[3]);
+				__m128i* row = reinterpret_cast<__m128i*>(tile + w * kGroupSize);
+				_mm_store_si128(row + 0, Accumulate(_mm_unpacklo_epi16(low01, low23), carries[w]));
+				_mm_store_si128(row + 1, Accumulate(_mm_unpackhi_epi16(low01, low23), carries[w]));
+				_mm_store_si128(row + 2, Accumulate(_mm_unpacklo_epi16(high01, high23), carries[w]));
+				_mm_store_si128(row + 3, Accumulate(_mm_unpackhi_epi16(high01, high23), carries[w]));
+			}
+
+			const size_t groupCount = (std::min)(size_t(kGroupSize), count - first);
+			uint32_t* element = target + first * words;
+			if (words == 1) {
+				memcpy(element, tile, groupCount * sizeof(uint32_t));
+			}
+			else if (words % 4 == 0 && groupCount == kGroupSize) {
+				// 4 x 4 transposes, 4 words of 4 elements at a time
+				for (UINT w = 0; w < words; w += 4) {
+					for (UINT i = 0; i < kGroupSize; i += 4) {
+						__m128 r0 = _mm_load_ps(reinterpret_cast<const float*>(tile + (w + 0) * kGroupSize + i));
+						__m128 r1 = _mm_load_ps(reinterpret_cast<const float*>(tile + (w + 1) * kGroupSize + i));
+						__m128 r2 = _mm_load_ps(reinterpret_cast<const float*>(tile + (w + 2) * kGroupSize + i));
+						__m128 r3 = _mm_load_ps(reinterpret_cast<const float*>(tile + (w + 3) * kGroupSize + i));
+						_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+						_mm_storeu_ps(reinterpret_cast<float*>(element + (i + 0) * words + w), r0);
+						_mm_storeu_ps(reinterpret_cast<float*>(element + (i + 1) * words + w), r1);
+						_mm_storeu_ps(reinterpret_cast<float*>(element + (i + 2) * words + w), r2);
+						_mm_storeu_ps(reinterpret_cast<float*>(element + (i + 3) * words + w), r3);
+					}
+				}
+			}
+			else {
+				for (size_t i = 0; i < groupCount; ++i, element += words) {
+					for (UINT w = 0; w < words; ++w)
+						element[w] = tile[w * kGroupSize + i];
+				}
+			}
+		}
+		// Anything left over means the count doesn't belong to this stream
+		return p == end;
+	}
+}
+
+void GeometryCodec::Encode(const void* elements, size_t count, UINT words, std::vector<UINT8>& out)
+{
+	const uint32_t* source = static_cast<const uint32_t*>(elements);
+	const size_t chunkCount = (count + kChunkSize - 1) / kChunkSize;
+	const size_t base = out.size();
+
+	// Chunk count and the end of every chunk, relative to the first chunk
+	out.resize(base + sizeof(uint32_t) * (1 + chunkCount));
+	const uint32_t header = static_cast<uint32_t>(chunkCount);
+	memcpy(out.data() + base, &header, sizeof(header));
+	const size_t payload = out.size();
+
+	std::vector<uint32_t> previous(words);
+	UINT8 planes[4][kGroupSize];
+	for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+		std::fill(previous.begin(), previous.end(), 0u);
+		const size_t chunkEnd = (std::min)((chunk + 1) * kChunkSize, count);
+		for (size_t first = chunk * kChunkSize; first < chunkEnd; first += kGroupSize) {
+			const size_t groupCount = (std::min)(size_t(kGroupSize), chunkEnd - first);
+			for (UINT w = 0; w < words; ++w) {
+				for (size_t i = 0; i < kGroupSize; ++i) {
+					// The differences after the last element are 0 and cost one mask per plane
+					uint32_t zigzag = 0;
+					if (i < groupCount) {
+						uint32_t value = source[(first + i) * words + w];
+						zigzag = ZigZag(value - previous[w]);
+						previous[w] = value;
+					}
+					for (int b = 0; b < 4; ++b)
+						planes[b][i] = static_cast<UINT8>(zigzag >> (8 * b));
+				}
+
+				for (int b = 0; b < 4; ++b) {
+					UINT mask = 0;
+					for (UINT i = 0; i < kGroupSize; ++i)
+						mask |= planes[b][i] != 0 ? 1u << i : 0u;
+					out.push_back(static_cast<UINT8>(mask));
+					out.push_back(static_cast<UINT8>(mask >> 8));
+					for (UINT i = 0; i < kGroupSize; ++i) {
+						if (planes[b][i] != 0)
+							out.push_back(planes[b][i]);
+					}
+				}
+			}
+		}
+		const uint32_t chunkBytes = static_cast<uint32_t>(out.size() - payload);
+		memcpy(out.data() + base + sizeof(uint32_t) * (1 + chunk), &chunkBytes, sizeof(chunkBytes));
+	}
+	out.insert(out.end(), kPadding, 0);
+}
+
+bool GeometryCodec::Decode(const UINT8* data, size_t size, size_t count, UINT words, void* out)
+{
+	if (words == 0 || words > kMaxWords || size < sizeof(uint32_t) + kPadding)
+		return false;
+	uint32_t chunkCount;
+	memcpy(&chunkCount, data, sizeof(chunkCount));
+	const size_t headerSize = sizeof(uint32_t) * (size_t(chunkCount) + 1);
+	if (chunkCount != (count + kChunkSize - 1) / kChunkSize || headerSize + kPadding > size)
+		return false;
+
+	const UINT8* payload = data + headerSize;
+	const size_t payloadSize = size - headerSize - kPadding;
+	std::vector<uint32_t> ends(chunkCount);
+	if (chunkCount > 0)
+		memcpy(ends.data(), data + sizeof(uint32_t), sizeof(uint32_t) * chunkCount);
+	for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+		if (ends[chunk] > payloadSize || (chunk > 0 && ends[chunk] < ends[chunk - 1]))
+			return false;
+	}
+	if (chunkCount > 0 && ends.back() != payloadSize)
+		return false;
+
+	// Chunks are independent, large meshes decode on the whole pool
+	std::atomic<bool> valid(true);
+	ThreadPool::Default().ParallelFor(chunkCount, [&](size_t chunk) {
+		const UINT8* begin = payload + (chunk > 0 ? ends[chunk - 1] : 0);
+		const size_t first = chunk * kChunkSize;
+		const size_t chunkElements = (std::min)(size_t(kChunkSize), count - first);
+		if (!DecodeChunk(begin, payload + ends[chunk], chunkElements, words, static_cast<uint32_t*>(out) + first * words))
+			valid = false;
+	});
+	return valid;
+}
+
+void GeometryCodec::RunBenchmark(UINT gridSize)
+{
+	// Rolling terrain with smooth normals and a texture stretched over it, indices in vertex cache order
+	MeshData mesh;
+	mesh.Vertices.resize(size_t(gridSize) * gridSize);
+	for (UINT y = 0; y < gridSize; ++y) {
+		for (UINT x = 0; x < gridSize; ++x) {
+			float fx = x * 0.05f, fy = y * 0.05f;
+			float height = std::sin(fx) * std::cos(fy * 0.7f) * 2.0f;
+			float dx = std::cos(fx) * std::cos(fy * 0.7f) * 2.0f, dy = -std::sin(fx) * std::sin(fy * 0.7f) * 1.4f;
+			float length = std::sqrt(dx * dx + dy * dy + 1.0f);
+			Vertex_Model& v = mesh.Vertices[size_t(y) * gridSize + x];
+			v.Position = XMFLOAT3(fx, height, fy);
+			v.Normal = XMFLOAT3(-dx / length, 1.0f / length, -dy / length);
+			v.TexCoord = XMFLOAT2(float(x) / (gridSize - 1), float(y) / (gridSize - 1));
+		}
+	}
+	for (UINT y = 0; y + 1 < gridSize; ++y) {
+		for (UINT x = 0; x + 1 < gridSize; ++x) {
+			UINT a = y * gridSize + x, b = a + 1, c = a + gridSize, d = c + 1;
+			UINT quad[6] = { a, c, b, b, c, d };
+			mesh.Indices.insert(mesh.Indices.end(), quad, quad + 6);
+		}
+	}
+	MeshOptimizer::OptimizeVertexCache(mesh);
+
+	auto measure = [](const char* name, const void* elements, size_t count, UINT words) {
+		std::vector<UINT8> encoded;
+		auto start = std::chrono::high_resolution_clock::now();
+		GeometryCodec::Encode(elements, count, words, encoded);
+		double encodeMs = ElapsedMs(start);
+
+		const size_t rawBytes = count * words * sizeof(uint32_t);
+		std::vector<uint32_t> decoded(count * words);
+		const int kRuns = 5;
+		bool exact = true;
+		start = std::chrono::high_resolution_clock::now();
+		for (int run = 0; run < kRuns; ++run)
+			exact = GeometryCodec::Decode(encoded.data(), encoded.size(), count, words, decoded.data()) && exact;
+		double decodeMs = ElapsedMs(start) / kRuns;
+		exact = exact && memcmp(decoded.data(), elements, rawBytes) == 0;
+
+		std::cout << "GeometryCodec: " << name << " " << rawBytes / 1024 << " KB -> " << encoded.size() / 1024 << " KB, ratio "
+			<< double(rawBytes) / encoded.size() << ", encode " << encodeMs << " ms, decode " << decodeMs << " ms ("
+			<< rawBytes / (1024.0 * 1024.0 * 1024.0) / (std::max)(decodeMs / 1000.0, 1e-9) << " GB/s)"
+			<< (exact ? "" : ", MISMATCH") << std::endl;
+	};
+	std::cout << "GeometryCodec: synthetic " << gridSize << " x " << gridSize << " grid, " << mesh.Indices.size() / 3 << " triangles" << std::endl;
+	measure("vertices", mesh.Vertices.data(), mesh.Vertices.size(), sizeof(Vertex_Model) / 4);
+	measure("indices", mesh.Indices.data(), mesh.Indices.size(), 1);
+}
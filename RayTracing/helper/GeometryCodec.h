@@ -0,0 +1,53 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct GeometryCodecStats
+{
+	UINT64	RawBytes = 0;
+	UINT64	EncodedBytes = 0;
+	double	EncodeMs = 0.0;
+	UINT64	DecodedBytes = 0;
+	double	DecodeMs = 0.0;
+};
+
+// Lossless codec for vertex, tangent and index arrays, seen as elements of 32 bit words: 8 for
+// Vertex_Model, 4 for a tangent, 1 for an index.
+//
+// Every word is stored as the difference to the same word of the previous element, zigzag coded so
+// small negative steps stay small. Positions, normals and texture coordinates of neighbouring vertices
+// share their high bits, and after the vertex cache pass an index is close to the one before it,
+// both along the edges of a triangle and from one triangle to the next. Elements are coded in groups
+// of 16: per word, the 4 bytes of the 16 differences are split into byte planes and every plane is
+// stored as a 16 bit mask of its non-zero bytes followed by those bytes.
+//
+// The decoder expands each plane with two SSSE3 byte shuffles, interleaves the planes back into words
+// and undoes the zigzag and the differences with a 4 wide prefix sum. Every kChunkSize elements the
+// differences restart, a table of chunk ends up front lets the chunks decode in parallel. Streams end
+// with kPadding bytes so plane loads never read past them.
+class GeometryCodec
+{
+public:
+	static const UINT kGroupSize = 16;
+	static const UINT kPadding = 16;
+	static const UINT kMaxWords = 16;
+	static const UINT kChunkSize = 16 * 1024;
+
+	// Appends the stream for count elements of words (at most kMaxWords) 32 bit words each to out
+	static void Encode(const void* elements, size_t count, UINT words, std::vector<UINT8>& out);
+	// Fails when the stream doesn't hold exactly count elements, out receives count * words * 4 bytes
+	static bool Decode(const UINT8* data, size_t size, size_t count, UINT words, void* out);
+
+	static void EncodeVertices(const Vertex_Model* vertices, size_t count, std::vector<UINT8>& out)
+	{
+		Encode(vertices, count, sizeof(Vertex_Model) / 4, out);
+	}
+	static void EncodeIndices(const UINT* indices, size_t count, std::vector<UINT8>& out)
+	{
+		Encode(indices, count, 1, out);
+	}
+
+	// Compression ratio and decode throughput on a wavy grid of gridSize x gridSize vertices
+	static void RunBenchmark(UINT gridSize);
+};
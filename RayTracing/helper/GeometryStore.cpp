@@ -0,0 +1,358 @@
+#include "stdafx.h"
+#include "GeometryStore.h"
+#include "SceneHierarchy.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Visible pages first, then the nearer one
+	bool Outranks(const GeometryStore::PageVisibility& a, const GeometryStore::PageVisibility& b)
+	{
+		if (a.Visible != b.Visible)
+			return a.Visible;
+		return a.Distance < b.Distance;
+	}
+}
+
+const UINT GeometryStore::kNoPage;
+
+GeometryStore::GeometryStore(const GeometryStoreOptions& options)
+	: m_options(options), m_loaded((std::max)(options.MaxPendingPages, 1u))
+{
+}
+
+GeometryStore::~GeometryStore()
+{
+	Close();
+}
+
+bool GeometryStore::Open(const std::string& cacheName, const MeshCacheKey& key)
+{
+	Close();
+	if (!m_cache.Open(cacheName, key))
+		return false;
+
+	m_pages.assign(m_cache.GetEntries().size(), Page());
+	m_stats = GeometryStoreStats();
+	m_stats.PageCount = static_cast<UINT>(m_pages.size());
+	m_thread = std::thread(&GeometryStore::Run, this);
+	return true;
+}
+
+void GeometryStore::Close()
+{
+	if (m_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		m_thread.join();
+	}
+
+	std::unique_ptr<GeometryPageData> page;
+	while (m_loaded.TryPop(page)) {}
+	m_requests.clear();
+	m_stop = false;
+	m_pages.clear();
+	m_lru.clear();
+	m_update = 0;
+	m_cache.Close();
+}
+
+void GeometryStore::SetPageBytes(UINT page, UINT64 bytes)
+{
+	Page& p = m_pages[page];
+	m_stats.TotalBytes += bytes - p.Bytes;
+	if (p.Bytes > m_options.BudgetBytes)
+		--m_stats.OversizedPages;
+	if (bytes > m_options.BudgetBytes)
+		++m_stats.OversizedPages;
+	p.Bytes = bytes;
+}
+
+void GeometryStore::Update(const std::vector<PageVisibility>& visibility, std::vector<UINT>& evicted)
+{
+	++m_update;
+	++m_stats.Updates;
+
+	// Wanted pages that are resident move to the front of the LRU list, the others are candidates
+	m_candidates.clear();
+	for (UINT i = 0; i < m_pages.size(); ++i) {
+		const PageVisibility& v = visibility[i];
+		if (!v.Visible && !(v.Distance <= m_options.PrefetchDistance))
+			continue;
+		Page& page = m_pages[i];
+		page.LastWanted = m_update;
+		if (page.State == PageState::Resident) {
+			m_lru.splice(m_lru.begin(), m_lru, page.LruPosition);
+			continue;
+		}
+		if (v.Visible)
+			++m_stats.VisibleMisses;
+		if (page.State == PageState::Unloaded && page.Bytes <= m_options.BudgetBytes)
+			m_candidates.push_back(i);
+	}
+	std::sort(m_candidates.begin(), m_candidates.end(), [&](UINT a, UINT b) { return Outranks(visibility[a], visibility[b]); });
+
+	size_t requested = 0;
+	for (UINT candidate : m_candidates) {
+		if (m_stats.PendingPages >= m_options.MaxPendingPages)
+			break;
+		Page& page = m_pages[candidate];
+		while (m_stats.ResidentBytes + m_stats.PendingBytes + page.Bytes > m_options.BudgetBytes) {
+			UINT victim = FindVictim(candidate, visibility);
+			if (victim == kNoPage)
+				break;
+			Evict(victim, evicted);
+		}
+		// The rest ranks lower still, it waits until the camera moves
+		if (m_stats.ResidentBytes + m_stats.PendingBytes + page.Bytes > m_options.BudgetBytes) {
+			++m_stats.BudgetStalls;
+			break;
+		}
+
+		page.State = PageState::Pending;
+		++m_stats.PendingPages;
+		m_stats.PendingBytes += page.Bytes;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_requests.push_back(candidate);
+		++requested;
+	}
+	if (requested > 0)
+		m_wake.notify_one();
+}
+
+// Least recently wanted page, or when the current update wants all of them the one ranking lowest
+// if the candidate outranks it
+UINT GeometryStore::FindVictim(UINT candidate, const std::vector<PageVisibility>& visibility) const
+{
+	if (m_lru.empty())
+		return kNoPage;
+	if (m_pages[m_lru.back()].LastWanted != m_update)
+		return m_lru.back();
+
+	UINT lowest = kNoPage;
+	for (UINT page : m_lru) {
+		if (lowest == kNoPage || Outranks(visibility[lowest], visibility[page]))
+			lowest = page;
+	}
+	return Outranks(visibility[candidate], visibility[lowest]) ? lowest : kNoPage;
+}
+
+void GeometryStore::Evict(UINT page, std::vector<UINT>& evicted)
+{
+	Page& p = m_pages[page];
+	m_lru.erase(p.LruPosition);
+	p.State = PageState::Unloaded;
+	p.WasEvicted = true;
+	--m_stats.ResidentPages;
+	m_stats.ResidentBytes -= p.Bytes;
+	++m_stats.PageOuts;
+	evicted.push_back(page);
+}
+
+bool GeometryStore::TryPop(std::unique_ptr<GeometryPageData>& data)
+{
+	while (m_loaded.TryPop(data)) {
+		Page& page = m_pages[data->Page];
+		--m_stats.PendingPages;
+		m_stats.PendingBytes -= page.Bytes;
+		m_stats.BytesRead += data->BytesRead;
+		m_stats.ReadMs += data->ReadMs;
+		if (!data->Valid) {
+			std::cout << "GeometryStore: page " << data->Page << " is corrupted in the page file" << std::endl;
+			page.State = PageState::Failed;
+			++m_stats.FailedPages;
+			continue;
+		}
+
+		page.State = PageState::Resident;
+		m_lru.push_front(data->Page);
+		page.LruPosition = m_lru.begin();
+		++m_stats.ResidentPages;
+		m_stats.ResidentBytes += page.Bytes;
+		m_stats.PeakResidentBytes = (std::max)(m_stats.PeakResidentBytes, m_stats.ResidentBytes);
+		++m_stats.PageIns;
+		m_stats.Reloads += page.WasEvicted ? 1 : 0;
+		m_stats.BytesDecoded += sizeof(Vertex_Model) * data->Vertices.size() + sizeof(UINT) * data->Indices.size() +
+			sizeof(XMFLOAT4) * data->Tangents.size();
+		return true;
+	}
+	return false;
+}
+
+// Loader thread, the entries and the mapping don't change while it runs
+bool GeometryStore::Read(UINT page, GeometryPageData& data) const
+{
+	const MeshCache::Entry& entry = m_cache.GetEntries()[page];
+	data.Vertices.resize(entry.VertexCount);
+	data.Indices.resize(entry.IndexCount);
+	data.Tangents.resize(entry.HasTangents ? entry.VertexCount : 0);
+	if (m_cache.IsCompressed()) {
+		data.BytesRead = entry.EncodedVertexBytes + entry.EncodedIndexBytes + entry.EncodedTangentBytes;
+		return MeshCache::Decode(entry, data.Vertices.data(), data.Indices.data(), data.Tangents.data());
+	}
+
+	std::copy(entry.Vertices, entry.Vertices + entry.VertexCount, data.Vertices.begin());
+	std::copy(entry.Indices, entry.Indices + entry.IndexCount, data.Indices.begin());
+	if (entry.Tangents)
+		std::copy(entry.Tangents, entry.Tangents + entry.VertexCount, data.Tangents.begin());
+	data.BytesRead = sizeof(Vertex_Model) * data.Vertices.size() + sizeof(UINT) * data.Indices.size() + sizeof(XMFLOAT4) * data.Tangents.size();
+	return true;
+}
+
+void GeometryStore::Run()
+{
+	// Page decoding runs on workers of its own, a ParallelFor of the render thread never waits behind it
+	ThreadPool pool;
+	ThreadPool::SetThreadDefault(&pool);
+
+	for (;;) {
+		UINT page;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+			if (m_stop)
+				return;
+			page = m_requests.front();
+			m_requests.pop_front();
+		}
+
+		std::unique_ptr<GeometryPageData> data = std::make_unique<GeometryPageData>();
+		auto start = std::chrono::high_resolution_clock::now();
+		data->Page = page;
+		data->Valid = Read(page, *data);
+		data->ReadMs = ElapsedMs(start);
+
+		// Only full when the render thread stopped popping, there is a slot for every pending page
+		while (!m_loaded.TryPush(data)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stop)
+				return;
+		}
+	}
+}
+
+void GeometryStore::RunStressTest(UINT pageCount, UINT frames)
+{
+	// Square of grid patches, one page each, 1 unit apart on the xz plane
+	const UINT kPatchSize = 48;
+	const UINT side = static_cast<UINT>(std::ceil(std::sqrt(double(pageCount))));
+	std::vector<MeshData> meshes(pageCount);
+	for (UINT page = 0; page < pageCount; ++page) {
+		MeshData& mesh = meshes[page];
+		const float originX = float(page % side), originZ = float(page / side);
+		for (UINT y = 0; y < kPatchSize; ++y) {
+			for (UINT x = 0; x < kPatchSize; ++x) {
+				Vertex_Model v;
+				float fx = float(x) / (kPatchSize - 1), fz = float(y) / (kPatchSize - 1);
+				v.Position = XMFLOAT3(originX + fx, 0.05f * std::sin(7.0f * (originX + fx)) * std::cos(5.0f * (originZ + fz)), originZ + fz);
+				v.Normal = XMFLOAT3(0.0f, 1.0f, 0.0f);
+				v.TexCoord = XMFLOAT2(fx, fz);
+				mesh.Vertices.push_back(v);
+			}
+		}
+		for (UINT y = 0; y + 1 < kPatchSize; ++y) {
+			for (UINT x = 0; x + 1 < kPatchSize; ++x) {
+				UINT a = y * kPatchSize + x, b = a + 1, c = a + kPatchSize, d = c + 1;
+				UINT quad[6] = { a, c, b, b, c, d };
+				mesh.Indices.insert(mesh.Indices.end(), quad, quad + 6);
+			}
+		}
+	}
+
+	// Written to the temp directory, not next to the application
+	char tempPath[MAX_PATH] = {};
+	const DWORD tempLength = GetTempPathA(MAX_PATH, tempPath);
+	const std::string cacheName = std::string(tempPath, tempLength <= MAX_PATH ? tempLength : 0) + "geometry_stress.meshcache";
+	MeshCacheKey key;
+	key.SourceHash = 0x5354524553535445ull;
+	SceneHierarchy hierarchy;
+	if (!MeshCache::Write(cacheName, key, ".", meshes, hierarchy, true)) {
+		std::cout << "GeometryStore: failed to write " << cacheName << std::endl;
+		return;
+	}
+
+	UINT64 totalBytes = 0;
+	std::vector<UINT64> pageBytes(pageCount);
+	for (UINT page = 0; page < pageCount; ++page) {
+		pageBytes[page] = sizeof(Vertex_Model) * meshes[page].Vertices.size() + sizeof(UINT) * meshes[page].Indices.size();
+		totalBytes += pageBytes[page];
+	}
+	meshes.clear();
+
+	GeometryStoreOptions options;
+	options.BudgetBytes = totalBytes / 4;
+	options.PrefetchDistance = 1.5f;
+	{
+		GeometryStore store(options);
+		if (!store.Open(cacheName, key)) {
+			std::cout << "GeometryStore: failed to open " << cacheName << std::endl;
+			std::remove(cacheName.c_str());
+			return;
+		}
+		for (UINT page = 0; page < pageCount; ++page)
+			store.SetPageBytes(page, pageBytes[page]);
+
+		// The camera circles the center looking along its path with a 90 degree cone that reaches 4 units
+		const float center = side * 0.5f, radius = side * 0.3f, viewDistance = 4.0f, cosHalfAngle = std::cos(XM_PI / 4.0f);
+		std::vector<PageVisibility> visibility(pageCount);
+		std::vector<UINT> evicted;
+		std::unique_ptr<GeometryPageData> data;
+		UINT64 visiblePages = 0, overBudget = 0;
+		double updateMs = 0.0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (UINT frame = 0; frame < frames; ++frame) {
+			float angle = XM_2PI * 2.0f * frame / frames;
+			float eyeX = center + radius * std::cos(angle), eyeZ = center + radius * std::sin(angle);
+			float dirX = -std::sin(angle), dirZ = std::cos(angle);
+			for (UINT page = 0; page < pageCount; ++page) {
+				// Patch spheres: center of the unit square, radius half its diagonal
+				float dx = float(page % side) + 0.5f - eyeX, dz = float(page / side) + 0.5f - eyeZ;
+				float length = std::sqrt(dx * dx + dz * dz);
+				PageVisibility& v = visibility[page];
+				v.Distance = (std::max)(length - 0.7071f, 0.0f);
+				v.Visible = v.Distance < viewDistance && (length < 0.7071f || (dx * dirX + dz * dirZ) / length > cosHalfAngle - 0.7071f / length);
+				visiblePages += v.Visible ? 1 : 0;
+			}
+
+			auto updateStart = std::chrono::high_resolution_clock::now();
+			evicted.clear();
+			store.Update(visibility, evicted);
+			updateMs += ElapsedMs(updateStart);
+			// Uploads would happen here, the data is dropped
+			while (store.TryPop(data)) {}
+
+			const GeometryStoreStats& stats = store.GetStats();
+			overBudget += stats.ResidentBytes + stats.PendingBytes > options.BudgetBytes ? 1 : 0;
+			// Leaves the loader thread some time, as rendering the frame would
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		double totalMs = ElapsedMs(start);
+
+		const GeometryStoreStats& stats = store.GetStats();
+		const double mb = 1024.0 * 1024.0;
+		std::cout << "GeometryStore: stress test, " << pageCount << " pages with " << totalBytes / mb << " MB, budget "
+			<< options.BudgetBytes / mb << " MB, " << frames << " frames in " << totalMs << " ms" << std::endl;
+		std::cout << "GeometryStore: " << stats.PageIns << " page ins, " << stats.PageOuts << " page outs, " << stats.Reloads
+			<< " reloads, peak " << stats.PeakResidentBytes / mb << " MB resident, " << overBudget << " frames over budget, "
+			<< stats.BudgetStalls << " budget stalls" << std::endl;
+		std::cout << "GeometryStore: read " << stats.BytesRead / mb << " MB, decoded " << stats.BytesDecoded / mb << " MB in "
+			<< stats.ReadMs << " ms (" << stats.BytesDecoded / mb / (std::max)(stats.ReadMs / 1000.0, 1e-9) << " MB/s), "
+			<< 100.0 * stats.VisibleMisses / (std::max)(visiblePages, UINT64(1)) << "% of visible pages missing, update "
+			<< 1000.0 * updateMs / frames << " us per frame" << std::endl;
+	}
+	std::remove(cacheName.c_str());
+}
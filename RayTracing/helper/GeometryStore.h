@@ -0,0 +1,144 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+#include "MeshCache.h"
+#include "SpscQueue.h"
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+
+struct GeometryStoreOptions
+{
+	// Vertex and index buffers of the resident and requested pages
+	UINT64	BudgetBytes = 256ull << 20;
+	// Pages outside the frustum but closer than this are loaded ahead, in world units
+	float	PrefetchDistance = 0.0f;
+	// Requests on the loader thread at once, also bounds the pages decoded ahead of the render thread
+	UINT	MaxPendingPages = 8;
+};
+
+struct GeometryStoreStats
+{
+	UINT	PageCount = 0;
+	UINT64	TotalBytes = 0;			// every page resident at once
+	UINT	ResidentPages = 0;
+	UINT64	ResidentBytes = 0;
+	UINT64	PeakResidentBytes = 0;
+	UINT	PendingPages = 0;
+	UINT64	PendingBytes = 0;		// requested, not resident yet
+	UINT	OversizedPages = 0;		// larger than the budget on their own, never loaded
+	UINT	FailedPages = 0;		// corrupted in the page file, never loaded again
+	UINT64	Updates = 0;
+	UINT64	PageIns = 0;
+	UINT64	PageOuts = 0;
+	UINT64	Reloads = 0;			// page ins of pages that were evicted before
+	UINT64	BytesRead = 0;			// from the page file, the stream size for a compressed cache
+	UINT64	BytesDecoded = 0;
+	double	ReadMs = 0.0;			// loader thread, read and decode
+	UINT64	VisibleMisses = 0;		// visible pages that weren't resident, summed over the updates
+	UINT64	BudgetStalls = 0;		// updates that put loads off because every resident page ranked higher
+};
+
+// Geometry of one page as the loader thread read it
+struct GeometryPageData
+{
+	UINT Page = 0;
+	bool Valid = false;
+	std::vector<Vertex_Model> Vertices;
+	std::vector<UINT> Indices;
+	std::vector<XMFLOAT4> Tangents;		// empty without tangent frames
+	UINT64 BytesRead = 0;
+	double ReadMs = 0.0;
+};
+
+// Out-of-core scene geometry. The mesh cache is the page file and every cached mesh is a page, which
+// after merging is a cluster of the source meshes sharing a material. Only the pages picked by the
+// residency manager are in memory.
+//
+// Update runs once per frame on the render thread with the visibility and camera distance of every
+// page. Visible pages rank first, nearest first, then pages within the prefetch distance. Requests
+// go to a loader thread that reads and decodes them from the mapped file, TryPop hands them to the
+// render thread for upload. A request that doesn't fit the budget evicts the least recently wanted
+// pages. Once every resident page is wanted by the current update it only evicts pages that rank
+// lower than itself, so a camera standing still never makes pages thrash.
+class GeometryStore
+{
+public:
+	static const UINT kNoPage = UINT_MAX;
+
+	struct PageVisibility
+	{
+		bool	Visible = false;
+		float	Distance = 0.0f;	// camera to the closest instance sphere, 0 inside one
+	};
+
+	explicit GeometryStore(const GeometryStoreOptions& options = GeometryStoreOptions());
+	GeometryStore(const GeometryStore&) = delete;
+	GeometryStore& operator=(const GeometryStore&) = delete;
+	~GeometryStore();
+
+	// Fails if the mesh cache is missing or was built with another key. Starts the loader thread.
+	bool Open(const std::string& cacheName, const MeshCacheKey& key);
+	// Stops the loader thread, pages still queued are dropped
+	void Close();
+
+	const MeshCache& GetCache() const { return m_cache; }
+	UINT GetPageCount() const { return static_cast<UINT>(m_pages.size()); }
+	// Memory the page takes once resident, set for every page before the first Update
+	void SetPageBytes(UINT page, UINT64 bytes);
+
+	// Render thread. visibility has an entry per page. Pages that lost their residency are appended
+	// to evicted, their buffers have to be released.
+	void Update(const std::vector<PageVisibility>& visibility, std::vector<UINT>& evicted);
+	// Render thread. A popped page is resident and has to be uploaded.
+	bool TryPop(std::unique_ptr<GeometryPageData>& page);
+
+	const GeometryStoreStats& GetStats() const { return m_stats; }
+
+	// Synthetic scene of pageCount grid patches, four times the budget, seen from a camera circling
+	// above it for the given number of frames, about 1 ms each. Prints the I/O and residency statistics.
+	// The scene goes to a mesh cache in the temp directory, removed afterwards.
+	static void RunStressTest(UINT pageCount, UINT frames);
+
+private:
+	enum class PageState : UINT8
+	{
+		Unloaded,
+		Pending,
+		Resident,
+		Failed,
+	};
+
+	struct Page
+	{
+		UINT64		Bytes = 0;
+		PageState	State = PageState::Unloaded;
+		bool		WasEvicted = false;
+		UINT64		LastWanted = 0;		// update that last wanted the page
+		std::list<UINT>::iterator LruPosition;
+	};
+
+	void Run();
+	bool Read(UINT page, GeometryPageData& data) const;
+	void Evict(UINT page, std::vector<UINT>& evicted);
+	UINT FindVictim(UINT candidate, const std::vector<PageVisibility>& visibility) const;
+
+	GeometryStoreOptions	m_options;
+	MeshCache				m_cache;
+	std::vector<Page>		m_pages;
+	std::list<UINT>			m_lru;			// resident pages, most recently wanted first
+	std::vector<UINT>		m_candidates;
+	UINT64					m_update = 0;
+	GeometryStoreStats		m_stats;
+
+	// Requests to the loader thread and the pages it finished
+	std::thread				m_thread;
+	std::mutex				m_mutex;
+	std::condition_variable	m_wake;
+	std::deque<UINT>		m_requests;
+	bool					m_stop = false;
+	SpscQueue<std::unique_ptr<GeometryPageData>> m_loaded;
+};
@@ -0,0 +1,1989 @@
+#include "stdafx.h"
+#include "ImageDecoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <tmmintrin.h>
+
+namespace
+{
+	thread_local const char* t_error = "";
+
+	bool Fail(const char* error)
+	{
+		t_error = error;
+		return false;
+	}
+
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	uint32_t ReadBE32(const uint8_t* p)
+	{
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+	}
+
+	uint32_t ReadBE16(const uint8_t* p)
+	{
+		return (uint32_t(p[0]) << 8) | p[1];
+	}
+
+	uint32_t ReadLE16(const uint8_t* p)
+	{
+		return p[0] | (uint32_t(p[1]) << 8);
+	}
+
+	uint8_t Clamp8(int value)
+	{
+		return static_cast<uint8_t>(value < 0 ? 0 : (value > 255 ? 255 : value));
+	}
+
+	__m128i Load32(const uint8_t* p)
+	{
+		int32_t value;
+		memcpy(&value, p, 4);
+		return _mm_cvtsi32_si128(value);
+	}
+
+	void Store32(uint8_t* p, __m128i v)
+	{
+		int32_t value = _mm_cvtsi128_si32(v);
+		memcpy(p, &value, 4);
+	}
+
+	// Pixel loads and stores of 3 or 4 bytes
+	__m128i LoadPixel(const uint8_t* p, uint32_t bpp)
+	{
+		if (bpp == 4)
+			return Load32(p);
+		int32_t value = 0;
+		memcpy(&value, p, 3);
+		return _mm_cvtsi32_si128(value);
+	}
+
+	void StorePixel(uint8_t* p, __m128i v, uint32_t bpp)
+	{
+		int32_t value = _mm_cvtsi128_si32(v);
+		memcpy(p, &value, bpp);
+	}
+
+	__m128i Select(__m128i mask, __m128i a, __m128i b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Rows of count pixels to RGBA8. The SIMD loops stop before they could read past the source row.
+
+	void ExpandRGB(const uint8_t* src, size_t count, uint8_t* dst, bool bgr)
+	{
+		const __m128i shuffle = bgr ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+			: _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i opaque = _mm_set1_epi32(static_cast<int>(0xFF000000));
+		size_t i = 0;
+		for (; i + 6 <= count; i += 4) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), opaque));
+		}
+		const size_t r = bgr ? 2 : 0, b = bgr ? 0 : 2;
+		for (; i < count; ++i) {
+			dst[i * 4 + 0] = src[i * 3 + r];
+			dst[i * 4 + 1] = src[i * 3 + 1];
+			dst[i * 4 + 2] = src[i * 3 + b];
+			dst[i * 4 + 3] = 255;
+		}
+	}
+
+	void SwizzleBGRA(const uint8_t* src, size_t count, uint8_t* dst)
+	{
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_shuffle_epi8(v, shuffle));
+		}
+		for (; i < count; ++i) {
+			dst[i * 4 + 0] = src[i * 4 + 2];
+			dst[i * 4 + 1] = src[i * 4 + 1];
+			dst[i * 4 + 2] = src[i * 4 + 0];
+			dst[i * 4 + 3] = src[i * 4 + 3];
+		}
+	}
+
+	void ExpandGray(const uint8_t* src, size_t count, uint8_t* dst)
+	{
+		const __m128i opaque = _mm_set1_epi8(-1);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			__m128i gg0 = _mm_unpacklo_epi8(g, g), gg1 = _mm_unpackhi_epi8(g, g);
+			__m128i ga0 = _mm_unpacklo_epi8(g, opaque), ga1 = _mm_unpackhi_epi8(g, opaque);
+			__m128i* out = reinterpret_cast<__m128i*>(dst + i * 4);
+			_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(gg0, ga0));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(gg0, ga0));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(gg1, ga1));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(gg1, ga1));
+		}
+		for (; i < count; ++i) {
+			dst[i * 4 + 0] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i];
+			dst[i * 4 + 3] = 255;
+		}
+	}
+
+	void ExpandGrayAlpha(const uint8_t* src, size_t count, uint8_t* dst)
+	{
+		const __m128i low = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+		const __m128i high = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+			__m128i* out = reinterpret_cast<__m128i*>(dst + i * 4);
+			_mm_storeu_si128(out + 0, _mm_shuffle_epi8(v, low));
+			_mm_storeu_si128(out + 1, _mm_shuffle_epi8(v, high));
+		}
+		for (; i < count; ++i) {
+			dst[i * 4 + 0] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i * 2];
+			dst[i * 4 + 3] = src[i * 2 + 1];
+		}
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// Inflate (RFC 1950/1951)
+
+	// Canonical Huffman code read LSB first. Codes up to kFastBits long resolve with one table lookup.
+	struct InflateHuffman
+	{
+		static const uint32_t kFastBits = 10;
+
+		uint16_t	Fast[1 << kFastBits];	// (length << 9) | symbol, 0 for longer codes
+		uint32_t	MaxCode[17];			// one past the last code of each length, left aligned to 16 bits
+		uint16_t	FirstCode[16];
+		uint16_t	FirstSymbol[16];
+		uint16_t	Symbols[288];
+
+		bool Build(const uint8_t* lengths, uint32_t count)
+		{
+			uint32_t counts[16] = {};
+			for (uint32_t i = 0; i < count; ++i)
+				++counts[lengths[i]];
+			counts[0] = 0;
+
+			int left = 1;
+			for (uint32_t len = 1; len < 16; ++len) {
+				left = (left << 1) - static_cast<int>(counts[len]);
+				if (left < 0)
+					return false;
+			}
+
+			uint32_t code = 0, symbol = 0;
+			uint16_t nextCode[16];
+			for (uint32_t len = 1; len < 16; ++len) {
+				nextCode[len] = static_cast<uint16_t>(code);
+				FirstCode[len] = static_cast<uint16_t>(code);
+				FirstSymbol[len] = static_cast<uint16_t>(symbol);
+				code += counts[len];
+				MaxCode[len] = code << (16 - len);
+				code <<= 1;
+				symbol += counts[len];
+			}
+			MaxCode[16] = 0x10000;
+
+			memset(Fast, 0, sizeof(Fast));
+			for (uint32_t i = 0; i < count; ++i) {
+				const uint32_t len = lengths[i];
+				if (len == 0)
+					continue;
+				const uint32_t c = nextCode[len]++;
+				Symbols[FirstSymbol[len] + c - FirstCode[len]] = static_cast<uint16_t>(i);
+				if (len <= kFastBits) {
+					uint32_t reversed = 0;
+					for (uint32_t bit = 0; bit < len; ++bit)
+						reversed |= ((c >> bit) & 1) << (len - 1 - bit);
+					for (uint32_t j = reversed; j < (1u << kFastBits); j += 1u << len)
+						Fast[j] = static_cast<uint16_t>((len << 9) | i);
+				}
+			}
+			return true;
+		}
+	};
+
+	class InflateReader
+	{
+	public:
+		InflateReader(const uint8_t* data, size_t size) : m_cur(data), m_end(data + size) {}
+
+		// At least 56 bits buffered afterwards, zeros past the end of the stream
+		void Refill()
+		{
+			if (m_end - m_cur >= 8) {
+				uint64_t word;
+				memcpy(&word, m_cur, 8);
+				m_bits |= word << m_count;
+				m_cur += (63 - m_count) >> 3;
+				m_count |= 56;
+				return;
+			}
+			while (m_count <= 56) {
+				if (m_cur < m_end)
+					m_bits |= uint64_t(*m_cur++) << m_count;
+				else
+					++m_padding;
+				m_count += 8;
+			}
+		}
+
+		uint32_t Peek(uint32_t count) const { return static_cast<uint32_t>(m_bits & ((uint64_t(1) << count) - 1)); }
+		void Consume(uint32_t count) { m_bits >>= count; m_count -= count; }
+		uint32_t Read(uint32_t count)
+		{
+			uint32_t value = Peek(count);
+			Consume(count);
+			return value;
+		}
+
+		// Buffered symbols need at most 15 bits
+		int Decode(const InflateHuffman& huffman)
+		{
+			uint32_t fast = huffman.Fast[Peek(InflateHuffman::kFastBits)];
+			if (fast) {
+				Consume(fast >> 9);
+				return fast & 511;
+			}
+
+			uint32_t code = Peek(16), reversed = 0;
+			for (uint32_t bit = 0; bit < 16; ++bit)
+				reversed |= ((code >> bit) & 1) << (15 - bit);
+			uint32_t len = InflateHuffman::kFastBits + 1;
+			while (len < 16 && reversed >= huffman.MaxCode[len])
+				++len;
+			if (len == 16)
+				return -1;
+			const uint32_t index = huffman.FirstSymbol[len] + (reversed >> (16 - len)) - huffman.FirstCode[len];
+			Consume(len);
+			return huffman.Symbols[index];
+		}
+
+		// Stored blocks start on a byte boundary. The whole bytes still buffered come first.
+		bool CopyStored(uint8_t*& out, const uint8_t* outEnd)
+		{
+			Consume(m_count & 7);
+			uint8_t header[4];
+			uint32_t got = 0;
+			while (got < 4 && m_count >= 8) {
+				header[got++] = static_cast<uint8_t>(m_bits);
+				Consume(8);
+			}
+			const uint8_t* cur = RewindToBytes();
+			for (; got < 4; ++got) {
+				if (cur == m_end)
+					return Fail("truncated stored block");
+				header[got] = *cur++;
+			}
+			const uint32_t len = ReadLE16(header), nlen = ReadLE16(header + 2);
+			if ((len ^ 0xFFFF) != nlen)
+				return Fail("corrupted stored block length");
+			if (size_t(m_end - cur) < len)
+				return Fail("truncated stored block");
+			if (size_t(outEnd - out) < len)
+				return Fail("more image data than the header allows");
+			memcpy(out, cur, len);
+			out += len;
+			m_cur = cur + len;
+			return true;
+		}
+
+		// Bits were read that aren't in the stream
+		bool Overrun() const { return m_padding * 8 > m_count; }
+
+	private:
+		// Byte position of the first unread bit, the buffer has to be at a byte boundary
+		const uint8_t* RewindToBytes()
+		{
+			const uint8_t* cur = m_cur - (m_count >> 3) + m_padding;
+			m_bits = 0;
+			m_count = 0;
+			m_padding = 0;
+			m_cur = cur;
+			return cur;
+		}
+
+		const uint8_t*	m_cur;
+		const uint8_t*	m_end;
+		uint64_t		m_bits = 0;
+		uint32_t		m_count = 0;
+		uint32_t		m_padding = 0;	// zero bytes fed past the end
+	};
+
+	const uint16_t kLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+		67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint8_t kLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const uint16_t kDistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+		1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const uint8_t kDistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	struct FixedHuffman
+	{
+		InflateHuffman Literals;
+		InflateHuffman Distances;
+
+		FixedHuffman()
+		{
+			uint8_t lengths[288];
+			memset(lengths, 8, 144);
+			memset(lengths + 144, 9, 112);
+			memset(lengths + 256, 7, 24);
+			memset(lengths + 280, 8, 8);
+			Literals.Build(lengths, 288);
+			memset(lengths, 5, 30);
+			Distances.Build(lengths, 30);
+		}
+	};
+
+	bool ReadDynamicHuffman(InflateReader& reader, InflateHuffman& literals, InflateHuffman& distances)
+	{
+		static const uint8_t kOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+		reader.Refill();
+		const uint32_t literalCount = reader.Read(5) + 257;
+		const uint32_t distanceCount = reader.Read(5) + 1;
+		const uint32_t codeCount = reader.Read(4) + 4;
+		if (literalCount > 286 || distanceCount > 30)
+			return Fail("corrupted deflate block header");
+
+		uint8_t codeLengths[19] = {};
+		for (uint32_t i = 0; i < codeCount; ++i) {
+			if ((i & 7) == 0)
+				reader.Refill();
+			codeLengths[kOrder[i]] = static_cast<uint8_t>(reader.Read(3));
+		}
+		InflateHuffman codeHuffman;
+		if (!codeHuffman.Build(codeLengths, 19))
+			return Fail("corrupted deflate code lengths");
+
+		uint8_t lengths[286 + 30];
+		const uint32_t total = literalCount + distanceCount;
+		for (uint32_t i = 0; i < total;) {
+			reader.Refill();
+			const int symbol = reader.Decode(codeHuffman);
+			if (symbol < 0)
+				return Fail("corrupted deflate code lengths");
+			if (symbol < 16) {
+				lengths[i++] = static_cast<uint8_t>(symbol);
+				continue;
+			}
+			uint32_t repeat;
+			uint8_t value = 0;
+			if (symbol == 16) {
+				if (i == 0)
+					return Fail("corrupted deflate code lengths");
+				value = lengths[i - 1];
+				repeat = reader.Read(2) + 3;
+			}
+			else if (symbol == 17) {
+				repeat = reader.Read(3) + 3;
+			}
+			else {
+				repeat = reader.Read(7) + 11;
+			}
+			if (i + repeat > total)
+				return Fail("corrupted deflate code lengths");
+			memset(lengths + i, value, repeat);
+			i += repeat;
+		}
+		if (lengths[256] == 0)
+			return Fail("deflate block without end code");
+		if (!literals.Build(lengths, literalCount) || !distances.Build(lengths + literalCount, distanceCount))
+			return Fail("corrupted deflate code lengths");
+		return true;
+	}
+
+	// zlib stream into exactly outSize bytes. The Adler-32 checksum isn't checked, PNG has its own CRCs.
+	bool Inflate(const uint8_t* data, size_t size, uint8_t* out, size_t outSize)
+	{
+		if (size < 2 || (data[0] & 15) != 8 || (data[0] >> 4) > 7 || ReadBE16(data) % 31 != 0 || (data[1] & 0x20))
+			return Fail("invalid zlib header");
+
+		static const FixedHuffman fixed;
+		InflateHuffman dynamicLiterals, dynamicDistances;
+		InflateReader reader(data + 2, size - 2);
+		uint8_t* const outStart = out;
+		uint8_t* const outEnd = out + outSize;
+
+		bool final = false;
+		while (!final) {
+			reader.Refill();
+			final = reader.Read(1) != 0;
+			const uint32_t type = reader.Read(2);
+			if (type == 0) {
+				if (!reader.CopyStored(out, outEnd))
+					return false;
+				continue;
+			}
+			if (type == 3)
+				return Fail("invalid deflate block type");
+
+			const InflateHuffman* literals = &fixed.Literals;
+			const InflateHuffman* distances = &fixed.Distances;
+			if (type == 2) {
+				if (!ReadDynamicHuffman(reader, dynamicLiterals, dynamicDistances))
+					return false;
+				literals = &dynamicLiterals;
+				distances = &dynamicDistances;
+			}
+
+			for (;;) {
+				// 15 + 5 length bits and 15 + 13 distance bits fit one refill
+				reader.Refill();
+				int symbol = reader.Decode(*literals);
+				if (symbol < 256) {
+					if (symbol < 0)
+						return Fail("corrupted deflate data");
+					if (out == outEnd)
+						return Fail("more image data than the header allows");
+					*out++ = static_cast<uint8_t>(symbol);
+					continue;
+				}
+				if (symbol == 256)
+					break;
+
+				symbol -= 257;
+				if (symbol >= 29)
+					return Fail("corrupted deflate data");
+				const size_t length = kLengthBase[symbol] + reader.Read(kLengthExtra[symbol]);
+				const int distanceSymbol = reader.Decode(*distances);
+				if (distanceSymbol < 0 || distanceSymbol >= 30)
+					return Fail("corrupted deflate data");
+				const size_t distance = kDistanceBase[distanceSymbol] + reader.Read(kDistanceExtra[distanceSymbol]);
+				if (distance > size_t(out - outStart))
+					return Fail("deflate distance before the start of the data");
+				if (length > size_t(outEnd - out))
+					return Fail("more image data than the header allows");
+
+				const uint8_t* from = out - distance;
+				if (distance >= 8 && size_t(outEnd - out) >= length + 8) {
+					// Every 8 byte step reads bytes written before it, the last one may write past length
+					for (size_t i = 0; i < length; i += 8)
+						memcpy(out + i, from + i, 8);
+				}
+				else if (distance == 1) {
+					memset(out, *from, length);
+				}
+				else {
+					for (size_t i = 0; i < length; ++i)
+						out[i] = from[i];
+				}
+				out += length;
+			}
+			if (reader.Overrun())
+				return Fail("truncated deflate data");
+		}
+		if (reader.Overrun())
+			return Fail("truncated deflate data");
+		if (out != outEnd)
+			return Fail("less image data than the header needs");
+		return true;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// PNG
+
+	struct PngHeader
+	{
+		uint32_t	Width = 0;
+		uint32_t	Height = 0;
+		uint32_t	BitDepth = 0;
+		uint32_t	ColorType = 0;
+		uint32_t	Channels = 0;
+		bool		Interlaced = false;
+		bool		SRGB = false;
+		uint32_t	PaletteSize = 0;
+		uint8_t		Palette[256][4];
+		bool		HasColorKey = false;
+		uint32_t	ColorKey[3] = {};
+		// Where the compressed data is, a single IDAT chunk is used in place
+		std::vector<std::pair<const uint8_t*, size_t>> Data;
+	};
+
+	const uint8_t kPngSignature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+
+	bool ParsePng(const uint8_t* data, size_t size, PngHeader& png, bool headerOnly)
+	{
+		if (size < 8 || memcmp(data, kPngSignature, 8) != 0)
+			return Fail("not a PNG file");
+
+		size_t offset = 8;
+		bool header = false;
+		for (;;) {
+			if (size - offset < 12)
+				return Fail("truncated PNG chunk");
+			const uint32_t length = ReadBE32(data + offset);
+			const uint8_t* type = data + offset + 4;
+			const uint8_t* body = data + offset + 8;
+			if (length > size - offset - 12)
+				return Fail("truncated PNG chunk");
+			offset += 12 + size_t(length);
+
+			if (memcmp(type, "IHDR", 4) == 0) {
+				if (length != 13)
+					return Fail("invalid PNG header");
+				png.Width = ReadBE32(body);
+				png.Height = ReadBE32(body + 4);
+				png.BitDepth = body[8];
+				png.ColorType = body[9];
+				png.Interlaced = body[12] == 1;
+				if (body[10] != 0 || body[11] != 0 || body[12] > 1)
+					return Fail("unknown PNG compression, filter or interlace method");
+				static const uint32_t kChannels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+				png.Channels = png.ColorType < 7 ? kChannels[png.ColorType] : 0;
+				const uint32_t depth = png.BitDepth;
+				const bool validDepth = (depth == 8 || depth == 16) || (depth < 8 && (depth & (depth - 1)) == 0 &&
+					(png.ColorType == 0 || png.ColorType == 3));
+				if (png.Channels == 0 || !validDepth || (png.ColorType == 3 && depth == 16))
+					return Fail("invalid PNG color type and bit depth");
+				if (png.Width == 0 || png.Height == 0 || png.Width > ImageDecoder::kMaxDimension || png.Height > ImageDecoder::kMaxDimension)
+					return Fail("unsupported PNG dimensions");
+				header = true;
+				if (headerOnly)
+					continue;
+			}
+			else if (!header) {
+				return Fail("PNG without header");
+			}
+			else if (memcmp(type, "sRGB", 4) == 0) {
+				png.SRGB = true;
+			}
+			else if (memcmp(type, "PLTE", 4) == 0) {
+				if (length % 3 != 0 || length > 768)
+					return Fail("invalid PNG palette");
+				png.PaletteSize = length / 3;
+				for (uint32_t i = 0; i < png.PaletteSize; ++i) {
+					png.Palette[i][0] = body[i * 3];
+					png.Palette[i][1] = body[i * 3 + 1];
+					png.Palette[i][2] = body[i * 3 + 2];
+					png.Palette[i][3] = 255;
+				}
+			}
+			else if (memcmp(type, "tRNS", 4) == 0) {
+				if (png.ColorType == 3) {
+					if (length > png.PaletteSize)
+						return Fail("invalid PNG transparency");
+					for (uint32_t i = 0; i < length; ++i)
+						png.Palette[i][3] = body[i];
+				}
+				else if (png.ColorType == 0 || png.ColorType == 2) {
+					if (length != png.Channels * 2)
+						return Fail("invalid PNG transparency");
+					for (uint32_t c = 0; c < png.Channels; ++c)
+						png.ColorKey[c] = ReadBE16(body + c * 2);
+					png.HasColorKey = true;
+				}
+			}
+			else if (memcmp(type, "IDAT", 4) == 0) {
+				if (headerOnly)
+					return true;
+				if (png.ColorType == 3 && png.PaletteSize == 0)
+					return Fail("PNG palette missing");
+				if (length > 0)
+					png.Data.push_back({ body, length });
+			}
+			else if (memcmp(type, "IEND", 4) == 0) {
+				break;
+			}
+			else if ((type[0] & 0x20) == 0) {
+				return Fail("unknown critical PNG chunk");
+			}
+		}
+		if (png.Data.empty())
+			return Fail("PNG without image data");
+		return true;
+	}
+
+	// Filtered row bytes, without the filter type byte
+	size_t PngRowBytes(const PngHeader& png, uint32_t width)
+	{
+		return (size_t(width) * png.Channels * png.BitDepth + 7) / 8;
+	}
+
+	void UnfilterSub(uint8_t* row, size_t bytes, uint32_t bpp)
+	{
+		size_t i = 0;
+		if (bpp == 4) {
+			__m128i a = _mm_setzero_si128();
+			for (; i + 16 <= bytes; i += 16) {
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+				d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+				d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+				d = _mm_add_epi8(d, a);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), d);
+				a = _mm_shuffle_epi32(d, _MM_SHUFFLE(3, 3, 3, 3));
+			}
+		}
+		else if (bpp == 3) {
+			// 4 pixels per 16 byte load, the last 4 bytes are only read
+			const __m128i pixelMask = _mm_setr_epi32(0x00FFFFFF, 0, 0, 0);
+			__m128i a = _mm_setzero_si128();
+			for (; i + 16 <= bytes; i += 12) {
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+				d = _mm_add_epi8(d, _mm_slli_si128(d, 3));
+				d = _mm_add_epi8(d, _mm_slli_si128(d, 6));
+				__m128i carry = _mm_or_si128(_mm_or_si128(a, _mm_slli_si128(a, 3)), _mm_or_si128(_mm_slli_si128(a, 6), _mm_slli_si128(a, 9)));
+				d = _mm_add_epi8(d, carry);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(row + i), d);
+				Store32(row + i + 8, _mm_srli_si128(d, 8));
+				a = _mm_and_si128(_mm_srli_si128(d, 9), pixelMask);
+			}
+		}
+		for (i = (std::max)(i, size_t(bpp)); i < bytes; ++i)
+			row[i] = static_cast<uint8_t>(row[i] + row[i - bpp]);
+	}
+
+	void UnfilterUp(uint8_t* row, const uint8_t* prior, size_t bytes)
+	{
+		size_t i = 0;
+		for (; i + 16 <= bytes; i += 16) {
+			__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(d, b));
+		}
+		for (; i < bytes; ++i)
+			row[i] = static_cast<uint8_t>(row[i] + prior[i]);
+	}
+
+	void UnfilterAverage(uint8_t* row, const uint8_t* prior, size_t bytes, uint32_t bpp)
+	{
+		if (bpp == 3 || bpp == 4) {
+			// _mm_avg_epu8 rounds up, the filter rounds down
+			const __m128i one = _mm_set1_epi8(1);
+			__m128i a = _mm_setzero_si128();
+			for (size_t i = 0; i < bytes; i += bpp) {
+				__m128i b = LoadPixel(prior + i, bpp);
+				__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+				a = _mm_add_epi8(LoadPixel(row + i, bpp), average);
+				StorePixel(row + i, a, bpp);
+			}
+			return;
+		}
+		for (size_t i = 0; i < bpp && i < bytes; ++i)
+			row[i] = static_cast<uint8_t>(row[i] + (prior[i] >> 1));
+		for (size_t i = bpp; i < bytes; ++i)
+			row[i] = static_cast<uint8_t>(row[i] + ((row[i - bpp] + prior[i]) >> 1));
+	}
+
+	uint8_t Paeth(int a, int b, int c)
+	{
+		const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+		if (pa <= pb && pa <= pc)
+			return static_cast<uint8_t>(a);
+		return static_cast<uint8_t>(pb <= pc ? b : c);
+	}
+
+	__m128i Abs16(__m128i x)
+	{
+		return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+	}
+
+	void UnfilterPaeth(uint8_t* row, const uint8_t* prior, size_t bytes, uint32_t bpp)
+	{
+		if (bpp == 3 || bpp == 4) {
+			// One pixel at a time in 16 bit lanes, a is the pixel just written
+			const __m128i zero = _mm_setzero_si128();
+			__m128i a = zero, c = zero;
+			for (size_t i = 0; i < bytes; i += bpp) {
+				__m128i b = _mm_unpacklo_epi8(LoadPixel(prior + i, bpp), zero);
+				__m128i x = _mm_unpacklo_epi8(LoadPixel(row + i, bpp), zero);
+				__m128i toA = _mm_sub_epi16(b, c), toB = _mm_sub_epi16(a, c);
+				__m128i pa = Abs16(toA), pb = Abs16(toB), pc = Abs16(_mm_add_epi16(toA, toB));
+				__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+				__m128i nearest = Select(_mm_cmpeq_epi16(smallest, pa), a, Select(_mm_cmpeq_epi16(smallest, pb), b, c));
+				a = _mm_and_si128(_mm_add_epi16(x, nearest), _mm_set1_epi16(0xFF));
+				StorePixel(row + i, _mm_packus_epi16(a, a), bpp);
+				c = b;
+			}
+			return;
+		}
+		for (size_t i = 0; i < bpp && i < bytes; ++i)
+			row[i] = static_cast<uint8_t>(row[i] + prior[i]);
+		for (size_t i = bpp; i < bytes; ++i)
+			row[i] = static_cast<uint8_t>(row[i] + Paeth(row[i - bpp], prior[i], prior[i - bpp]));
+	}
+
+	bool Unfilter(uint8_t filter, uint8_t* row, const uint8_t* prior, size_t bytes, uint32_t bpp)
+	{
+		switch (filter) {
+		case 0: return true;
+		case 1: UnfilterSub(row, bytes, bpp); return true;
+		case 2: UnfilterUp(row, prior, bytes); return true;
+		case 3: UnfilterAverage(row, prior, bytes, bpp); return true;
+		case 4: UnfilterPaeth(row, prior, bytes, bpp); return true;
+		default: return Fail("invalid PNG filter type");
+		}
+	}
+
+	// Any layout, pixel i goes to dst + i * step * 4
+	void ConvertPngRowGeneric(const PngHeader& png, const uint8_t* src, uint32_t count, uint8_t* dst, uint32_t step)
+	{
+		const uint32_t depth = png.BitDepth;
+		const uint32_t mask = (1u << depth) - 1;
+		const uint32_t scale = depth < 8 ? 255 / mask : 1;
+		auto sample = [&](size_t index) -> uint32_t {
+			if (depth == 8)
+				return src[index];
+			if (depth == 16)
+				return ReadBE16(src + index * 2);
+			const size_t bit = index * depth;
+			return (src[bit >> 3] >> (8 - depth - (bit & 7))) & mask;
+		};
+		auto to8 = [&](uint32_t value) -> uint8_t {
+			return static_cast<uint8_t>(depth == 16 ? value >> 8 : value * scale);
+		};
+
+		for (uint32_t i = 0; i < count; ++i, dst += step * 4) {
+			const size_t first = size_t(i) * png.Channels;
+			switch (png.ColorType) {
+			case 0: {
+				const uint32_t g = sample(first);
+				dst[0] = dst[1] = dst[2] = to8(g);
+				dst[3] = png.HasColorKey && g == png.ColorKey[0] ? 0 : 255;
+				break;
+			}
+			case 2: {
+				const uint32_t r = sample(first), g = sample(first + 1), b = sample(first + 2);
+				dst[0] = to8(r);
+				dst[1] = to8(g);
+				dst[2] = to8(b);
+				dst[3] = png.HasColorKey && r == png.ColorKey[0] && g == png.ColorKey[1] && b == png.ColorKey[2] ? 0 : 255;
+				break;
+			}
+			case 3: {
+				// Out of range indices are black, like libpng
+				const uint32_t index = sample(first);
+				static const uint8_t kBlack[4] = { 0, 0, 0, 255 };
+				memcpy(dst, index < png.PaletteSize ? png.Palette[index] : kBlack, 4);
+				break;
+			}
+			case 4:
+				dst[0] = dst[1] = dst[2] = to8(sample(first));
+				dst[3] = to8(sample(first + 1));
+				break;
+			default:
+				for (uint32_t c = 0; c < 4; ++c)
+					dst[c] = to8(sample(first + c));
+				break;
+			}
+		}
+	}
+
+	void ConvertPngRow(const PngHeader& png, const uint8_t* src, uint32_t count, uint8_t* dst)
+	{
+		if (png.BitDepth != 8 || png.HasColorKey) {
+			ConvertPngRowGeneric(png, src, count, dst, 1);
+			return;
+		}
+		switch (png.ColorType) {
+		case 0: ExpandGray(src, count, dst); break;
+		case 2: ExpandRGB(src, count, dst, false); break;
+		case 4: ExpandGrayAlpha(src, count, dst); break;
+		case 6: memcpy(dst, src, size_t(count) * 4); break;
+		default: ConvertPngRowGeneric(png, src, count, dst, 1); break;
+		}
+	}
+
+	bool DecodePng(const uint8_t* data, size_t size, uint8_t* out, size_t rowPitch)
+	{
+		PngHeader png;
+		if (!ParsePng(data, size, png, false))
+			return false;
+
+		// Adam7 passes, a single one without interlacing
+		static const uint32_t kX0[7] = { 0, 4, 0, 2, 0, 1, 0 }, kY0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+		static const uint32_t kDX[7] = { 8, 8, 4, 4, 2, 2, 1 }, kDY[7] = { 8, 8, 8, 4, 4, 2, 2 };
+		const uint32_t passCount = png.Interlaced ? 7 : 1;
+		uint32_t passWidth[7], passHeight[7];
+		size_t rawSize = 0, maxRowBytes = 0;
+		for (uint32_t pass = 0; pass < passCount; ++pass) {
+			const uint32_t x0 = png.Interlaced ? kX0[pass] : 0, y0 = png.Interlaced ? kY0[pass] : 0;
+			const uint32_t dx = png.Interlaced ? kDX[pass] : 1, dy = png.Interlaced ? kDY[pass] : 1;
+			passWidth[pass] = png.Width > x0 ? (png.Width - x0 + dx - 1) / dx : 0;
+			passHeight[pass] = png.Height > y0 ? (png.Height - y0 + dy - 1) / dy : 0;
+			if (passWidth[pass] == 0 || passHeight[pass] == 0)
+				continue;
+			const size_t rowBytes = PngRowBytes(png, passWidth[pass]);
+			rawSize += (rowBytes + 1) * passHeight[pass];
+			maxRowBytes = (std::max)(maxRowBytes, rowBytes);
+		}
+
+		std::vector<uint8_t> compressed;
+		const uint8_t* zlib = png.Data[0].first;
+		size_t zlibSize = png.Data[0].second;
+		if (png.Data.size() > 1) {
+			for (auto& chunk : png.Data)
+				compressed.insert(compressed.end(), chunk.first, chunk.first + chunk.second);
+			zlib = compressed.data();
+			zlibSize = compressed.size();
+		}
+		std::vector<uint8_t> raw(rawSize + 16);
+		if (!Inflate(zlib, zlibSize, raw.data(), rawSize))
+			return false;
+
+		const uint32_t bpp = (std::max)(1u, png.Channels * png.BitDepth / 8);
+		std::vector<uint8_t> zeros(maxRowBytes + 16, 0);
+		uint8_t* row = raw.data();
+		for (uint32_t pass = 0; pass < passCount; ++pass) {
+			if (passWidth[pass] == 0 || passHeight[pass] == 0)
+				continue;
+			const size_t rowBytes = PngRowBytes(png, passWidth[pass]);
+			const uint8_t* prior = zeros.data();
+			for (uint32_t y = 0; y < passHeight[pass]; ++y) {
+				if (!Unfilter(row[0], row + 1, prior, rowBytes, bpp))
+					return false;
+				if (!png.Interlaced) {
+					ConvertPngRow(png, row + 1, png.Width, out + size_t(y) * rowPitch);
+				}
+				else {
+					uint8_t* dst = out + size_t(kY0[pass] + y * kDY[pass]) * rowPitch + size_t(kX0[pass]) * 4;
+					ConvertPngRowGeneric(png, row + 1, passWidth[pass], dst, kDX[pass]);
+				}
+				prior = row + 1;
+				row += rowBytes + 1;
+			}
+		}
+		return true;
+	}
+
+	//----------------------------------------------------------------------------------------------
+	// JPEG, baseline and progressive Huffman coding with 8 bit samples
+
+	const uint8_t kDezigzag[64] = {
+		0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+		35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+	// Read MSB first. Codes up to kFastBits long resolve with one table lookup.
+	struct JpegHuffman
+	{
+		static const uint32_t kFastBits = 9;
+
+		uint8_t		Fast[1 << kFastBits];	// index into the code arrays, 255 for longer codes
+		uint16_t	Codes[256];
+		uint8_t		Sizes[257];
+		uint8_t		Values[256];
+		uint32_t	MaxCode[18];			// one past the last code of each length, left aligned to 16 bits
+		int			Delta[17];				// value index minus code for each length
+		bool		Defined = false;
+
+		bool Build(const uint8_t* counts, const uint8_t* values)
+		{
+			Defined = false;
+			uint32_t k = 0;
+			for (uint32_t len = 1; len <= 16; ++len) {
+				for (uint32_t i = 0; i < counts[len - 1]; ++i) {
+					if (k == 256)
+						return false;
+					Sizes[k++] = static_cast<uint8_t>(len);
+				}
+			}
+			Sizes[k] = 0;
+			memcpy(Values, values, k);
+
+			uint32_t code = 0;
+			k = 0;
+			for (uint32_t len = 1; len <= 16; ++len) {
+				Delta[len] = static_cast<int>(k) - static_cast<int>(code);
+				while (Sizes[k] == len)
+					Codes[k++] = static_cast<uint16_t>(code++);
+				if (code - 1 >= (1u << len) && Sizes[k - (k > 0)] == len)
+					return false;
+				MaxCode[len] = code << (16 - len);
+				code <<= 1;
+			}
+			MaxCode[17] = 0xFFFFFFFF;
+
+			memset(Fast, 255, sizeof(Fast));
+			for (uint32_t i = 0; i < k; ++i) {
+				const uint32_t size = Sizes[i];
+				if (size <= kFastBits) {
+					const uint32_t first = uint32_t(Codes[i]) << (kFastBits - size);
+					for (uint32_t j = 0; j < (1u << (kFastBits - size)); ++j)
+						Fast[first + j] = static_cast<uint8_t>(i);
+				}
+			}
+			Defined = true;
+			return true;
+		}
+	};
+
+	struct JpegComponent
+	{
+		uint32_t	Id = 0;
+		uint32_t	H = 1, V = 1;
+		uint32_t	Quant = 0;
+		uint32_t	DcTable = 0, AcTable = 0;
+		int			DcPred = 0;
+		uint32_t	BlocksX = 0, BlocksY = 0;	// padded to whole MCUs
+		uint32_t	Width = 0, Height = 0;		// samples covering the image
+		std::vector<uint8_t> Plane;				// BlocksX * 8 wide
+		std::vector<int16_t> Coefficients;		// progressive only, natural order, not dequantized
+	};
+
+	class JpegDecoder
+	{
+	public:
+		JpegDecoder(const uint8_t* data, size_t size) : m_data(data), m_end(data + size), m_cur(data) {}
+
+		bool ReadInfo(ImageInfo& info)
+		{
+			if (!ReadHeader())
+				return false;
+			info.Format = ImageFormat::Jpeg;
+			info.Width = m_width;
+			info.Height = m_height;
+			info.Channels = m_componentCount;
+			return true;
+		}
+
+		bool Decode(uint8_t* out, size_t rowPitch)
+		{
+			if (!ReadHeader())
+				return false;
+			for (auto& component : m_components) {
+				component.Plane.resize(size_t(component.BlocksX) * component.BlocksY * 64);
+				if (m_progressive)
+					component.Coefficients.assign(size_t(component.BlocksX) * component.BlocksY * 64, 0);
+			}
+
+			// Scans and the tables between them until EOI
+			for (;;) {
+				uint32_t marker;
+				if (!NextMarker(marker))
+					return false;
+				if (marker == 0xD9)
+					break;
+				if (marker == 0xDA) {
+					if (!ReadScan())
+						return false;
+					continue;
+				}
+				if (!ReadSegment(marker))
+					return false;
+			}
+
+			if (m_progressive) {
+				for (auto& component : m_components) {
+					const uint16_t* quant = m_quant[component.Quant];
+					int16_t* coefficients = component.Coefficients.data();
+					for (uint32_t by = 0; by < component.BlocksY; ++by) {
+						for (uint32_t bx = 0; bx < component.BlocksX; ++bx) {
+							int16_t* block = coefficients + (size_t(by) * component.BlocksX + bx) * 64;
+							for (uint32_t i = 0; i < 64; ++i)
+								block[i] = Dequantize(block[i], quant[i]);
+							InverseDct(block, &component.Plane[(size_t(by) * 8 * component.BlocksX + bx) * 8], component.BlocksX * 8);
+						}
+					}
+				}
+			}
+			return Convert(out, rowPitch);
+		}
+
+	private:
+		bool ReadHeader()
+		{
+			m_cur = m_data;
+			if (m_end - m_data < 4 || m_data[0] != 0xFF || m_data[1] != 0xD8)
+				return Fail("not a JPEG file");
+			m_cur += 2;
+			for (;;) {
+				uint32_t marker;
+				if (!NextMarker(marker))
+					return false;
+				if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2)
+					return ReadFrame(marker == 0xC2);
+				if ((marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC))
+					return Fail("unsupported JPEG coding (lossless, hierarchical or arithmetic)");
+				if (marker == 0xD9 || marker == 0xDA)
+					return Fail("JPEG without frame header");
+				if (!ReadSegment(marker))
+					return false;
+			}
+		}
+
+		bool NextMarker(uint32_t& marker)
+		{
+			// Skips anything up to the next marker, entropy coded data ends without one
+			while (m_cur + 1 < m_end) {
+				if (m_cur[0] == 0xFF && m_cur[1] != 0x00 && m_cur[1] != 0xFF && !(m_cur[1] >= 0xD0 && m_cur[1] <= 0xD7)) {
+					marker = m_cur[1];
+					m_cur += 2;
+					return true;
+				}
+				++m_cur;
+			}
+			return Fail("truncated JPEG file");
+		}
+
+		// Segment payload after the marker, m_cur moves past it
+		bool SegmentBody(const uint8_t*& body, uint32_t& length)
+		{
+			if (m_end - m_cur < 2)
+				return Fail("truncated JPEG segment");
+			length = ReadBE16(m_cur);
+			if (length < 2 || size_t(m_end - m_cur) < length)
+				return Fail("truncated JPEG segment");
+			body = m_cur + 2;
+			length -= 2;
+			m_cur += length + 2;
+			return true;
+		}
+
+		bool ReadSegment(uint32_t marker)
+		{
+			const uint8_t* body;
+			uint32_t length;
+			if (!SegmentBody(body, length))
+				return false;
+			const uint8_t* end = body + length;
+
+			if (marker == 0xDB) {
+				while (body < end) {
+					const uint32_t precision = body[0] >> 4, table = body[0] & 15;
+					const uint32_t bytes = precision ? 128 : 64;
+					if (table > 3 || precision > 1 || size_t(end - body) < bytes + 1)
+						return Fail("invalid JPEG quantization table");
+					for (uint32_t i = 0; i < 64; ++i)
+						m_quant[table][kDezigzag[i]] = static_cast<uint16_t>(precision ? ReadBE16(body + 1 + i * 2) : body[1 + i]);
+					body += bytes + 1;
+				}
+			}
+			else if (marker == 0xC4) {
+				while (body < end) {
+					if (end - body < 17)
+						return Fail("invalid JPEG Huffman table");
+					const uint32_t type = body[0] >> 4, table = body[0] & 15;
+					uint32_t total = 0;
+					for (uint32_t i = 0; i < 16; ++i)
+						total += body[1 + i];
+					if (type > 1 || table > 3 || total > 256 || size_t(end - body) < 17 + total)
+						return Fail("invalid JPEG Huffman table");
+					JpegHuffman& huffman = type == 0 ? m_dc[table] : m_ac[table];
+					if (!huffman.Build(body + 1, body + 17))
+						return Fail("invalid JPEG Huffman table");
+					body += 17 + total;
+				}
+			}
+			else if (marker == 0xDD) {
+				if (length < 2)
+					return Fail("invalid JPEG restart interval");
+				m_restartInterval = ReadBE16(body);
+			}
+			else if (marker == 0xEE && length >= 12 && memcmp(body, "Adobe", 5) == 0) {
+				m_adobeTransform = body[11];
+			}
+			return true;
+		}
+
+		bool ReadFrame(bool progressive)
+		{
+			const uint8_t* body;
+			uint32_t length;
+			if (!SegmentBody(body, length))
+				return false;
+			if (length < 6)
+				return Fail("invalid JPEG frame header");
+			if (body[0] != 8)
+				return Fail("unsupported JPEG sample precision");
+			m_height = ReadBE16(body + 1);
+			m_width = ReadBE16(body + 3);
+			m_componentCount = body[5];
+			if (m_width == 0 || m_height == 0)
+				return Fail("unsupported JPEG dimensions (DNL marker or empty)");
+			if (m_width > ImageDecoder::kMaxDimension || m_height > ImageDecoder::kMaxDimension)
+				return Fail("unsupported JPEG dimensions");
+			if (m_componentCount != 1 && m_componentCount != 3)
+				return Fail("unsupported JPEG component count");
+			if (length < 6 + 3 * m_componentCount)
+				return Fail("invalid JPEG frame header");
+
+			m_progressive = progressive;
+			m_components.resize(m_componentCount);
+			m_maxH = m_maxV = 1;
+			for (uint32_t i = 0; i < m_componentCount; ++i) {
+				JpegComponent& component = m_components[i];
+				component.Id = body[6 + i * 3];
+				component.H = body[7 + i * 3] >> 4;
+				component.V = body[7 + i * 3] & 15;
+				component.Quant = body[8 + i * 3];
+				if (component.H == 0 || component.H > 4 || component.V == 0 || component.V > 4 || component.Quant > 3)
+					return Fail("invalid JPEG component");
+				m_maxH = (std::max)(m_maxH, component.H);
+				m_maxV = (std::max)(m_maxV, component.V);
+			}
+			m_mcusX = (m_width + m_maxH * 8 - 1) / (m_maxH * 8);
+			m_mcusY = (m_height + m_maxV * 8 - 1) / (m_maxV * 8);
+			for (auto& component : m_components) {
+				if (m_maxH % component.H != 0 || m_maxV % component.V != 0)
+					return Fail("unsupported JPEG sampling factors");
+				component.BlocksX = m_mcusX * component.H;
+				component.BlocksY = m_mcusY * component.V;
+				component.Width = (m_width * component.H + m_maxH - 1) / m_maxH;
+				component.Height = (m_height * component.V + m_maxV - 1) / m_maxV;
+			}
+			return true;
+		}
+
+		//------------------------------------------------------------------------------------------
+		// Entropy coded data
+
+		void ResetBits()
+		{
+			m_bits = 0;
+			m_bitCount = 0;
+			m_markerHit = false;
+		}
+
+		// At least 25 bits buffered afterwards, zeros once a marker is reached
+		void Fill()
+		{
+			while (m_bitCount <= 24) {
+				uint32_t byte = 0;
+				if (!m_markerHit && m_cur < m_end) {
+					byte = *m_cur;
+					if (byte == 0xFF) {
+						const uint8_t* next = m_cur + 1;
+						while (next < m_end && *next == 0xFF)
+							++next;
+						if (next < m_end && *next == 0x00) {
+							m_cur = next + 1;
+						}
+						else {
+							// m_cur stays on the marker
+							m_markerHit = true;
+							byte = 0;
+						}
+					}
+					else {
+						++m_cur;
+					}
+				}
+				m_bits |= byte << (24 - m_bitCount);
+				m_bitCount += 8;
+			}
+		}
+
+		int DecodeHuffman(const JpegHuffman& huffman)
+		{
+			Fill();
+			uint32_t k = huffman.Fast[m_bits >> (32 - JpegHuffman::kFastBits)];
+			if (k < 255) {
+				const uint32_t size = huffman.Sizes[k];
+				m_bits <<= size;
+				m_bitCount -= size;
+				return huffman.Values[k];
+			}
+
+			const uint32_t top = m_bits >> 16;
+			uint32_t len = JpegHuffman::kFastBits + 1;
+			while (top >= huffman.MaxCode[len])
+				++len;
+			if (len == 17)
+				return -1;
+			const int index = static_cast<int>(m_bits >> (32 - len)) + huffman.Delta[len];
+			if (index < 0 || index > 255 || huffman.Sizes[index] != len)
+				return -1;
+			m_bits <<= len;
+			m_bitCount -= len;
+			return huffman.Values[index];
+		}
+
+		uint32_t ReadBits(uint32_t count)
+		{
+			if (count == 0)
+				return 0;
+			Fill();
+			const uint32_t value = m_bits >> (32 - count);
+			m_bits <<= count;
+			m_bitCount -= count;
+			return value;
+		}
+
+		// Magnitude category count to a signed value
+		int Receive(uint32_t count)
+		{
+			const int value = static_cast<int>(ReadBits(count));
+			return count && value < (1 << (count - 1)) ? value - (1 << count) + 1 : value;
+		}
+
+		bool ReadScan()
+		{
+			const uint8_t* body;
+			uint32_t length;
+			if (!SegmentBody(body, length))
+				return false;
+			const uint32_t count = length > 0 ? body[0] : 0;
+			if (count == 0 || count > m_componentCount || length != 4 + 2 * count)
+				return Fail("invalid JPEG scan header");
+
+			const uint8_t* spectral = body + 1 + count * 2;
+			m_spectralStart = spectral[0];
+			m_spectralEnd = spectral[1];
+			m_successiveHigh = spectral[2] >> 4;
+			m_successiveLow = spectral[2] & 15;
+			if (m_progressive) {
+				if (m_spectralStart > 63 || m_spectralEnd > 63 || m_spectralStart > m_spectralEnd || m_successiveLow > 13 ||
+					(m_spectralStart == 0 && m_spectralEnd != 0) || (m_spectralStart != 0 && count != 1))
+					return Fail("invalid JPEG progressive scan");
+			}
+			else if (m_spectralStart != 0) {
+				return Fail("invalid JPEG scan header");
+			}
+			const bool needsDc = !m_progressive || (m_spectralStart == 0 && m_successiveHigh == 0);
+			const bool needsAc = !m_progressive || m_spectralStart != 0;
+
+			m_scanComponents.clear();
+			for (uint32_t i = 0; i < count; ++i) {
+				const uint32_t id = body[1 + i * 2];
+				auto component = std::find_if(m_components.begin(), m_components.end(), [id](const JpegComponent& c) { return c.Id == id; });
+				if (component == m_components.end())
+					return Fail("JPEG scan of an unknown component");
+				component->DcTable = body[2 + i * 2] >> 4;
+				component->AcTable = body[2 + i * 2] & 15;
+				if (component->DcTable > 3 || component->AcTable > 3)
+					return Fail("invalid JPEG scan header");
+				if ((needsDc && !m_dc[component->DcTable].Defined) || (needsAc && !m_ac[component->AcTable].Defined))
+					return Fail("JPEG scan without Huffman table");
+				m_scanComponents.push_back(static_cast<uint32_t>(component - m_components.begin()));
+			}
+
+			ResetBits();
+			m_eobRun = 0;
+			for (auto& component : m_components)
+				component.DcPred = 0;
+
+			// A single component scan covers only the blocks inside the image, in raster order
+			const bool interleaved = count > 1;
+			uint32_t unitsX = m_mcusX, unitsY = m_mcusY;
+			if (!interleaved) {
+				const JpegComponent& component = m_components[m_scanComponents[0]];
+				unitsX = (component.Width + 7) / 8;
+				unitsY = (component.Height + 7) / 8;
+			}
+
+			uint32_t untilRestart = m_restartInterval;
+			for (uint32_t uy = 0; uy < unitsY; ++uy) {
+				for (uint32_t ux = 0; ux < unitsX; ++ux) {
+					if (interleaved) {
+						for (uint32_t index : m_scanComponents) {
+							JpegComponent& component = m_components[index];
+							for (uint32_t y = 0; y < component.V; ++y) {
+								for (uint32_t x = 0; x < component.H; ++x) {
+									if (!DecodeBlock(component, ux * component.H + x, uy * component.V + y))
+										return false;
+								}
+							}
+						}
+					}
+					else if (!DecodeBlock(m_components[m_scanComponents[0]], ux, uy)) {
+						return false;
+					}
+
+					if (m_restartInterval && --untilRestart == 0) {
+						untilRestart = m_restartInterval;
+						if (!Restart())
+							return false;
+					}
+				}
+			}
+			return true;
+		}
+
+		bool Restart()
+		{
+			// The marker may be behind padding bits, anything before it is dropped
+			while (m_cur + 1 < m_end && !(m_cur[0] == 0xFF && m_cur[1] >= 0xD0 && m_cur[1] <= 0xD7)) {
+				if (m_cur[0] == 0xFF && m_cur[1] != 0x00 && m_cur[1] != 0xFF)
+					return true;	// EOI or the next scan, the interval ended with the data
+				++m_cur;
+			}
+			if (m_cur + 1 < m_end)
+				m_cur += 2;
+			ResetBits();
+			m_eobRun = 0;
+			for (auto& component : m_components)
+				component.DcPred = 0;
+			return true;
+		}
+
+		bool DecodeBlock(JpegComponent& component, uint32_t bx, uint32_t by)
+		{
+			if (bx >= component.BlocksX || by >= component.BlocksY)
+				return Fail("corrupted JPEG scan");
+			if (m_progressive) {
+				int16_t* block = &component.Coefficients[(size_t(by) * component.BlocksX + bx) * 64];
+				if (m_spectralStart == 0)
+					return DecodeDcProgressive(component, block);
+				return m_successiveHigh == 0 ? DecodeAcFirst(component, block) : DecodeAcRefine(component, block);
+			}
+
+			alignas(16) int16_t block[64] = {};
+			const uint16_t* quant = m_quant[component.Quant];
+			const int dcCategory = DecodeHuffman(m_dc[component.DcTable]);
+			if (dcCategory < 0 || dcCategory > 11)
+				return Fail("corrupted JPEG data");
+			component.DcPred = ClampDc(component.DcPred + Receive(dcCategory));
+			block[0] = Dequantize(component.DcPred, quant[0]);
+
+			const JpegHuffman& ac = m_ac[component.AcTable];
+			for (uint32_t k = 1; k < 64;) {
+				const int rs = DecodeHuffman(ac);
+				if (rs < 0)
+					return Fail("corrupted JPEG data");
+				const uint32_t run = rs >> 4, category = rs & 15;
+				if (category == 0) {
+					if (run != 15)
+						break;
+					k += 16;
+					continue;
+				}
+				k += run;
+				if (k > 63)
+					return Fail("corrupted JPEG data");
+				const uint32_t zig = kDezigzag[k++];
+				block[zig] = Dequantize(Receive(category), quant[zig]);
+			}
+			InverseDct(block, &component.Plane[(size_t(by) * 8 * component.BlocksX + bx) * 8], component.BlocksX * 8);
+			return true;
+		}
+
+		bool DecodeDcProgressive(JpegComponent& component, int16_t* block)
+		{
+			if (m_successiveHigh == 0) {
+				const int category = DecodeHuffman(m_dc[component.DcTable]);
+				if (category < 0 || category > 11)
+					return Fail("corrupted JPEG data");
+				component.DcPred = ClampDc(component.DcPred + Receive(category));
+				block[0] = static_cast<int16_t>(component.DcPred * (1 << m_successiveLow));
+			}
+			else if (ReadBits(1)) {
+				block[0] = static_cast<int16_t>(block[0] + (1 << m_successiveLow));
+			}
+			return true;
+		}
+
+		bool DecodeAcFirst(JpegComponent& component, int16_t* block)
+		{
+			if (m_eobRun) {
+				--m_eobRun;
+				return true;
+			}
+			const JpegHuffman& ac = m_ac[component.AcTable];
+			for (uint32_t k = m_spectralStart; k <= m_spectralEnd;) {
+				const int rs = DecodeHuffman(ac);
+				if (rs < 0)
+					return Fail("corrupted JPEG data");
+				const uint32_t run = rs >> 4, category = rs & 15;
+				if (category == 0) {
+					if (run < 15) {
+						m_eobRun = (1u << run) - 1 + ReadBits(run);
+						break;
+					}
+					k += 16;
+					continue;
+				}
+				k += run;
+				if (k > 63)
+					return Fail("corrupted JPEG data");
+				block[kDezigzag[k++]] = static_cast<int16_t>(Receive(category) * (1 << m_successiveLow));
+			}
+			return true;
+		}
+
+		bool DecodeAcRefine(JpegComponent& component, int16_t* block)
+		{
+			const int bit = 1 << m_successiveLow;
+			auto refine = [&](int16_t& coefficient) {
+				if (ReadBits(1) && (coefficient & bit) == 0)
+					coefficient = static_cast<int16_t>(coefficient > 0 ? coefficient + bit : coefficient - bit);
+			};
+
+			uint32_t k = m_spectralStart;
+			if (m_eobRun == 0) {
+				const JpegHuffman& ac = m_ac[component.AcTable];
+				while (k <= m_spectralEnd) {
+					const int rs = DecodeHuffman(ac);
+					if (rs < 0)
+						return Fail("corrupted JPEG data");
+					int run = rs >> 4, value = 0;
+					const uint32_t category = rs & 15;
+					if (category == 0) {
+						if (run < 15) {
+							// The rest of this block is refined below as the first block of the run
+							m_eobRun = (1u << run) + ReadBits(run);
+							break;
+						}
+					}
+					else {
+						if (category != 1)
+							return Fail("corrupted JPEG data");
+						value = ReadBits(1) ? bit : -bit;
+					}
+
+					// Skip run zero coefficients, refining the nonzero ones on the way
+					while (k <= m_spectralEnd) {
+						int16_t& coefficient = block[kDezigzag[k++]];
+						if (coefficient != 0) {
+							refine(coefficient);
+						}
+						else if (run == 0) {
+							coefficient = static_cast<int16_t>(value);
+							break;
+						}
+						else {
+							--run;
+						}
+					}
+				}
+				if (m_eobRun == 0)
+					return true;
+			}
+
+			// Inside an end of band run only the nonzero coefficients get a bit
+			for (; k <= m_spectralEnd; ++k) {
+				int16_t& coefficient = block[kDezigzag[k]];
+				if (coefficient != 0)
+					refine(coefficient);
+			}
+			--m_eobRun;
+			return true;
+		}
+
+		// Coefficients of 8 bit samples need 12 bits, more come from damaged data only
+		static int16_t Dequantize(int value, uint32_t quant)
+		{
+			return static_cast<int16_t>((std::max)(-16384, (std::min)(16383, value * static_cast<int>(quant))));
+		}
+
+		// Valid predictions need 11 bits, damaged data can't make the sums overflow
+		static int ClampDc(int value)
+		{
+			return (std::max)(-32767, (std::min)(32767, value));
+		}
+
+		// Integer IDCT with 12 fractional bits, the islow transform of the IJG library
+		static void InverseDct(const int16_t* in, uint8_t* out, size_t stride)
+		{
+			#define FIX(x) static_cast<int>((x) * 4096 + 0.5)
+			int v[64];
+			auto idct1d = [](int s0, int s1, int s2, int s3, int s4, int s5, int s6, int s7, int* x, int* t) {
+				int p2 = s2, p3 = s6;
+				int p1 = (p2 + p3) * FIX(0.5411961f);
+				int t2 = p1 + p3 * FIX(-1.847759065f);
+				int t3 = p1 + p2 * FIX(0.765366865f);
+				int t0 = (s0 + s4) * 4096;
+				int t1 = (s0 - s4) * 4096;
+				x[0] = t0 + t3;
+				x[3] = t0 - t3;
+				x[1] = t1 + t2;
+				x[2] = t1 - t2;
+
+				t0 = s7;
+				t1 = s5;
+				t2 = s3;
+				t3 = s1;
+				p3 = t0 + t2;
+				int p4 = t1 + t3;
+				p1 = t0 + t3;
+				p2 = t1 + t2;
+				int p5 = (p3 + p4) * FIX(1.175875602f);
+				t0 *= FIX(0.298631336f);
+				t1 *= FIX(2.053119869f);
+				t2 *= FIX(3.072711026f);
+				t3 *= FIX(1.501321110f);
+				p1 = p5 + p1 * FIX(-0.899976223f);
+				p2 = p5 + p2 * FIX(-2.562915447f);
+				p3 *= FIX(-1.961570560f);
+				p4 *= FIX(-0.390180644f);
+				t[3] = t3 + p1 + p4;
+				t[2] = t2 + p2 + p3;
+				t[1] = t1 + p2 + p4;
+				t[0] = t0 + p1 + p3;
+			};
+			#undef FIX
+
+			// Columns, keeping 2 more bits than the input. Valid data stays within 13 bits here (IJG jidctint.c),
+			// damaged data is clamped so the rows can't overflow.
+			for (int i = 0; i < 8; ++i) {
+				const int16_t* d = in + i;
+				if (d[8] == 0 && d[16] == 0 && d[24] == 0 && d[32] == 0 && d[40] == 0 && d[48] == 0 && d[56] == 0) {
+					const int dc = (std::max)(-16384, (std::min)(16383, d[0] * 4));
+					for (int r = 0; r < 8; ++r)
+						v[i + r * 8] = dc;
+					continue;
+				}
+				int x[4], t[4];
+				idct1d(d[0], d[8], d[16], d[24], d[32], d[40], d[48], d[56], x, t);
+				for (int j = 0; j < 4; ++j)
+					x[j] += 512;
+				auto descale = [](int value) { return (std::max)(-16384, (std::min)(16383, value >> 10)); };
+				v[i + 0] = descale(x[0] + t[3]);
+				v[i + 56] = descale(x[0] - t[3]);
+				v[i + 8] = descale(x[1] + t[2]);
+				v[i + 48] = descale(x[1] - t[2]);
+				v[i + 16] = descale(x[2] + t[1]);
+				v[i + 40] = descale(x[2] - t[1]);
+				v[i + 24] = descale(x[3] + t[0]);
+				v[i + 32] = descale(x[3] - t[0]);
+			}
+
+			// Rows, with the level shift folded into the rounding
+			for (int r = 0; r < 8; ++r, out += stride) {
+				const int* s = v + r * 8;
+				int x[4], t[4];
+				idct1d(s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], x, t);
+				for (int j = 0; j < 4; ++j)
+					x[j] += 65536 + (128 << 17);
+				out[0] = Clamp8((x[0] + t[3]) >> 17);
+				out[7] = Clamp8((x[0] - t[3]) >> 17);
+				out[1] = Clamp8((x[1] + t[2]) >> 17);
+				out[6] = Clamp8((x[1] - t[2]) >> 17);
+				out[2] = Clamp8((x[2] + t[1]) >> 17);
+				out[5] = Clamp8((x[2] - t[1]) >> 17);
+				out[3] = Clamp8((x[3] + t[0]) >> 17);
+				out[4] = Clamp8((x[3] - t[0]) >> 17);
+			}
+		}
+
+		//------------------------------------------------------------------------------------------
+		// Upsampling and color conversion
+
+		// Row y of a component at full resolution, triangle filtered for 2x subsampling like libjpeg
+		const uint8_t* UpsampleRow(const JpegComponent& component, uint32_t y, uint8_t* scratch) const
+		{
+			const size_t stride = size_t(component.BlocksX) * 8;
+			const uint32_t hs = m_maxH / component.H, vs = m_maxV / component.V;
+			if (hs == 1 && vs == 1)
+				return &component.Plane[size_t(y) * stride];
+
+			const uint32_t width = component.Width;
+			const uint32_t lastRow = component.Height - 1;
+			if ((hs == 2 || hs == 1) && (vs == 2 || vs == 1)) {
+				const uint32_t cy = y / vs;
+				uint32_t farY = cy;
+				if (vs == 2)
+					farY = (y & 1) ? (std::min)(cy + 1, lastRow) : (cy > 0 ? cy - 1 : 0);
+				const uint8_t* nearRow = &component.Plane[size_t(cy) * stride];
+				const uint8_t* farRow = &component.Plane[size_t(farY) * stride];
+				// Vertical weights 3:1 in 2 fraction bits, or 4:0 without vertical subsampling
+				auto column = [&](uint32_t x) -> int { return vs == 2 ? 3 * nearRow[x] + farRow[x] : 4 * nearRow[x]; };
+				if (hs == 1) {
+					for (uint32_t x = 0; x < width; ++x)
+						scratch[x] = static_cast<uint8_t>((column(x) + 2) >> 2);
+					return scratch;
+				}
+				int t1 = column(0);
+				if (width == 1) {
+					scratch[0] = scratch[1] = static_cast<uint8_t>((t1 + 2) >> 2);
+					return scratch;
+				}
+				scratch[0] = static_cast<uint8_t>((t1 + 2) >> 2);
+				for (uint32_t x = 1; x < width; ++x) {
+					const int t0 = t1;
+					t1 = column(x);
+					scratch[x * 2 - 1] = static_cast<uint8_t>((3 * t0 + t1 + 8) >> 4);
+					scratch[x * 2] = static_cast<uint8_t>((3 * t1 + t0 + 8) >> 4);
+				}
+				scratch[width * 2 - 1] = static_cast<uint8_t>((t1 + 2) >> 2);
+				return scratch;
+			}
+
+			// Other factors replicate samples
+			const uint8_t* row = &component.Plane[size_t(y / vs) * stride];
+			for (uint32_t x = 0; x < m_width; ++x)
+				scratch[x] = row[x / hs];
+			return scratch;
+		}
+
+		static void YCbCrToRGBA(const uint8_t* yRow, const uint8_t* cbRow, const uint8_t* crRow, uint32_t count, uint8_t* dst)
+		{
+			// Q15 factors, 1.402 and 1.772 are split into 1 + fraction
+			const __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(128);
+			const __m128i crR = _mm_set1_epi16(13173), cbG = _mm_set1_epi16(-11277), crG = _mm_set1_epi16(-23401), cbB = _mm_set1_epi16(25297);
+			const __m128i opaque = _mm_set1_epi8(-1);
+			uint32_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				__m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(yRow + i)), zero);
+				__m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(cbRow + i)), zero), bias);
+				__m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(crRow + i)), zero), bias);
+				__m128i r = _mm_add_epi16(_mm_add_epi16(y, cr), _mm_mulhrs_epi16(cr, crR));
+				__m128i g = _mm_add_epi16(y, _mm_add_epi16(_mm_mulhrs_epi16(cb, cbG), _mm_mulhrs_epi16(cr, crG)));
+				__m128i b = _mm_add_epi16(_mm_add_epi16(y, cb), _mm_mulhrs_epi16(cb, cbB));
+				__m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+				__m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), opaque);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_unpacklo_epi16(rg, ba));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+			}
+			for (; i < count; ++i) {
+				const int y = yRow[i], cb = cbRow[i] - 128, cr = crRow[i] - 128;
+				dst[i * 4 + 0] = Clamp8(y + ((91881 * cr + 32768) >> 16));
+				dst[i * 4 + 1] = Clamp8(y - ((22554 * cb + 46802 * cr + 32768) >> 16));
+				dst[i * 4 + 2] = Clamp8(y + ((116130 * cb + 32768) >> 16));
+				dst[i * 4 + 3] = 255;
+			}
+		}
+
+		bool Convert(uint8_t* out, size_t rowPitch) const
+		{
+			if (m_componentCount == 1) {
+				for (uint32_t y = 0; y < m_height; ++y)
+					ExpandGray(&m_components[0].Plane[size_t(y) * m_components[0].BlocksX * 8], m_width, out + size_t(y) * rowPitch);
+				return true;
+			}
+
+			// Adobe files say whether the samples are YCbCr, JFIF ones always are unless the ids spell RGB
+			const bool rgb = m_adobeTransform == 0 ||
+				(m_adobeTransform < 0 && m_components[0].Id == 'R' && m_components[1].Id == 'G' && m_components[2].Id == 'B');
+			std::vector<uint8_t> scratch(size_t(m_maxH * m_mcusX * 8) * 3 + 16);
+			uint8_t* scratchRows[3] = { scratch.data(), scratch.data() + scratch.size() / 3, scratch.data() + scratch.size() / 3 * 2 };
+			for (uint32_t y = 0; y < m_height; ++y) {
+				const uint8_t* rows[3];
+				for (uint32_t c = 0; c < 3; ++c)
+					rows[c] = UpsampleRow(m_components[c], y, scratchRows[c]);
+				uint8_t* dst = out + size_t(y) * rowPitch;
+				if (!rgb) {
+					YCbCrToRGBA(rows[0], rows[1], rows[2], m_width, dst);
+					continue;
+				}
+				for (uint32_t x = 0; x < m_width; ++x) {
+					dst[x * 4 + 0] = rows[0][x];
+					dst[x * 4 + 1] = rows[1][x];
+					dst[x * 4 + 2] = rows[2][x];
+					dst[x * 4 + 3] = 255;
+				}
+			}
+			return true;
+		}
+
+		const uint8_t*	m_data;
+		const uint8_t*	m_end;
+		const uint8_t*	m_cur;
+
+		uint32_t		m_width = 0, m_height = 0;
+		uint32_t		m_componentCount = 0;
+		uint32_t		m_maxH = 1, m_maxV = 1;
+		uint32_t		m_mcusX = 0, m_mcusY = 0;
+		bool			m_progressive = false;
+		int				m_adobeTransform = -1;
+		uint32_t		m_restartInterval = 0;
+		std::vector<JpegComponent> m_components;
+		uint16_t		m_quant[4][64] = {};	// natural order
+		JpegHuffman		m_dc[4];
+		JpegHuffman		m_ac[4];
+
+		// Current scan
+		std::vector<uint32_t> m_scanComponents;
+		uint32_t		m_spectralStart = 0, m_spectralEnd = 63;
+		uint32_t		m_successiveHigh = 0, m_successiveLow = 0;
+		uint32_t		m_eobRun = 0;
+		uint32_t		m_bits = 0;
+		uint32_t		m_bitCount = 0;
+		bool			m_markerHit = false;
+	};
+
+	//----------------------------------------------------------------------------------------------
+	// TGA, uncompressed and RLE color mapped, true color and grayscale images
+
+	struct TgaHeader
+	{
+		uint32_t	Type = 0;
+		uint32_t	Width = 0;
+		uint32_t	Height = 0;
+		uint32_t	PixelBits = 0;
+		bool		TopDown = false;
+		bool		RightToLeft = false;
+		bool		Rle = false;
+		uint32_t	MapFirst = 0;
+		uint32_t	MapLength = 0;
+		uint32_t	MapBits = 0;
+		size_t		MapOffset = 0;
+		size_t		DataOffset = 0;
+	};
+
+	bool ParseTga(const uint8_t* data, size_t size, TgaHeader& tga)
+	{
+		if (size < 18)
+			return Fail("not a TGA file");
+		const uint32_t idLength = data[0], mapType = data[1];
+		tga.Type = data[2];
+		tga.Rle = tga.Type >= 9;
+		const uint32_t baseType = tga.Rle ? tga.Type - 8 : tga.Type;
+		tga.MapFirst = ReadLE16(data + 3);
+		tga.MapLength = ReadLE16(data + 5);
+		tga.MapBits = data[7];
+		tga.Width = ReadLE16(data + 12);
+		tga.Height = ReadLE16(data + 14);
+		tga.PixelBits = data[16];
+		tga.TopDown = (data[17] & 0x20) != 0;
+		tga.RightToLeft = (data[17] & 0x10) != 0;
+
+		if (mapType > 1 || baseType < 1 || baseType > 3 || (baseType == 1) != (mapType == 1))
+			return Fail("not a TGA file");
+		const uint32_t bits = tga.PixelBits;
+		const bool validBits = baseType == 1 ? bits == 8 : (baseType == 3 ? bits == 8 :
+			(bits == 15 || bits == 16 || bits == 24 || bits == 32));
+		if (!validBits)
+			return Fail("unsupported TGA pixel size");
+		if (mapType == 1 && tga.MapBits != 15 && tga.MapBits != 16 && tga.MapBits != 24 && tga.MapBits != 32)
+			return Fail("unsupported TGA color map");
+		if (tga.Width == 0 || tga.Height == 0 || tga.Width > ImageDecoder::kMaxDimension || tga.Height > ImageDecoder::kMaxDimension)
+			return Fail("unsupported TGA dimensions");
+
+		tga.MapOffset = 18 + idLength;
+		tga.DataOffset = tga.MapOffset + (mapType ? size_t(tga.MapLength) * ((tga.MapBits + 7) / 8) : 0);
+		if (tga.DataOffset > size)
+			return Fail("truncated TGA file");
+		return true;
+	}
+
+	// Little endian BGR(A) or A1R5G5B5 pixel of bits bits to RGBA
+	void TgaColor(const uint8_t* p, uint32_t bits, uint8_t* rgba)
+	{
+		if (bits == 15 || bits == 16) {
+			const uint32_t v = ReadLE16(p);
+			rgba[0] = static_cast<uint8_t>(((v >> 10) & 31) * 255 / 31);
+			rgba[1] = static_cast<uint8_t>(((v >> 5) & 31) * 255 / 31);
+			rgba[2] = static_cast<uint8_t>((v & 31) * 255 / 31);
+			rgba[3] = 255;
+			return;
+		}
+		rgba[0] = p[2];
+		rgba[1] = p[1];
+		rgba[2] = p[0];
+		rgba[3] = bits == 32 ? p[3] : 255;
+	}
+
+	bool DecodeTga(const uint8_t* data, size_t size, uint8_t* out, size_t rowPitch)
+	{
+		TgaHeader tga;
+		if (!ParseTga(data, size, tga))
+			return false;
+
+		const uint32_t baseType = tga.Rle ? tga.Type - 8 : tga.Type;
+		const uint32_t pixelBytes = (tga.PixelBits + 7) / 8;
+		std::vector<uint8_t> palette;
+		if (baseType == 1) {
+			const uint32_t entryBytes = (tga.MapBits + 7) / 8;
+			palette.resize(size_t(tga.MapLength) * 4);
+			for (uint32_t i = 0; i < tga.MapLength; ++i)
+				TgaColor(data + tga.MapOffset + size_t(i) * entryBytes, tga.MapBits, &palette[size_t(i) * 4]);
+		}
+		auto rowOf = [&](uint32_t y) { return out + size_t(tga.TopDown ? y : tga.Height - 1 - y) * rowPitch; };
+
+		const uint8_t* src = data + tga.DataOffset;
+		const uint8_t* end = data + size;
+		if (!tga.Rle && !tga.RightToLeft && (tga.PixelBits == 24 || tga.PixelBits == 32 || baseType == 3)) {
+			// Whole rows through the shuffles
+			const size_t rowBytes = size_t(tga.Width) * pixelBytes;
+			if (size_t(end - src) < rowBytes * tga.Height)
+				return Fail("truncated TGA file");
+			for (uint32_t y = 0; y < tga.Height; ++y, src += rowBytes) {
+				if (baseType == 3)
+					ExpandGray(src, tga.Width, rowOf(y));
+				else if (tga.PixelBits == 24)
+					ExpandRGB(src, tga.Width, rowOf(y), true);
+				else
+					SwizzleBGRA(src, tga.Width, rowOf(y));
+			}
+			return true;
+		}
+
+		// Pixel by pixel, RLE packets may cross rows
+		auto decodePixel = [&](const uint8_t* p, uint8_t* rgba) {
+			if (baseType == 1) {
+				const uint32_t index = p[0] - tga.MapFirst;
+				static const uint8_t kBlack[4] = { 0, 0, 0, 255 };
+				memcpy(rgba, p[0] >= tga.MapFirst && index < tga.MapLength ? &palette[size_t(index) * 4] : kBlack, 4);
+			}
+			else if (baseType == 3) {
+				rgba[0] = rgba[1] = rgba[2] = p[0];
+				rgba[3] = 255;
+			}
+			else {
+				TgaColor(p, tga.PixelBits, rgba);
+			}
+		};
+		const size_t pixelCount = size_t(tga.Width) * tga.Height;
+		uint32_t repeat = 0, literal = 0;
+		uint8_t color[4];
+		for (size_t i = 0; i < pixelCount; ++i) {
+			if (tga.Rle && repeat == 0 && literal == 0) {
+				if (src == end)
+					return Fail("truncated TGA file");
+				const uint32_t packet = *src++;
+				if (packet & 0x80) {
+					if (size_t(end - src) < pixelBytes)
+						return Fail("truncated TGA file");
+					decodePixel(src, color);
+					src += pixelBytes;
+					repeat = (packet & 0x7F) + 1;
+				}
+				else {
+					literal = packet + 1;
+				}
+			}
+			if (repeat) {
+				--repeat;
+			}
+			else {
+				if (size_t(end - src) < pixelBytes)
+					return Fail("truncated TGA file");
+				decodePixel(src, color);
+				src += pixelBytes;
+				if (literal)
+					--literal;
+			}
+			const uint32_t x = static_cast<uint32_t>(i % tga.Width), y = static_cast<uint32_t>(i / tga.Width);
+			memcpy(rowOf(y) + size_t(tga.RightToLeft ? tga.Width - 1 - x : x) * 4, color, 4);
+		}
+		return true;
+	}
+
+	ImageFormat DetectFormat(const uint8_t* data, size_t size)
+	{
+		if (size >= 8 && memcmp(data, kPngSignature, 8) == 0)
+			return ImageFormat::Png;
+		if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+			return ImageFormat::Jpeg;
+		// TGA has no signature, the header has to make sense
+		TgaHeader tga;
+		return ParseTga(data, size, tga) ? ImageFormat::Tga : ImageFormat::Unknown;
+	}
+
+	const char* FormatName(ImageFormat format)
+	{
+		switch (format) {
+		case ImageFormat::Png: return "PNG";
+		case ImageFormat::Jpeg: return "JPEG";
+		case ImageFormat::Tga: return "TGA";
+		default: return "unknown";
+		}
+	}
+}
+
+bool ImageDecoder::ReadInfo(const uint8_t* data, size_t size, ImageInfo& info)
+{
+	info = ImageInfo();
+	switch (DetectFormat(data, size)) {
+	case ImageFormat::Png: {
+		PngHeader png;
+		if (!ParsePng(data, size, png, true))
+			return false;
+		info.Format = ImageFormat::Png;
+		info.Width = png.Width;
+		info.Height = png.Height;
+		info.Channels = png.Channels;
+		info.SRGB = png.SRGB;
+		return true;
+	}
+	case ImageFormat::Jpeg: {
+		JpegDecoder jpeg(data, size);
+		return jpeg.ReadInfo(info);
+	}
+	case ImageFormat::Tga: {
+		TgaHeader tga;
+		ParseTga(data, size, tga);
+		info.Format = ImageFormat::Tga;
+		info.Width = tga.Width;
+		info.Height = tga.Height;
+		info.Channels = tga.PixelBits == 32 ? 4 : (tga.Type == 3 || tga.Type == 11 ? 1 : 3);
+		return true;
+	}
+	default:
+		return Fail("unknown image format");
+	}
+}
+
+bool ImageDecoder::Decode(const uint8_t* data, size_t size, const ImageInfo& info, uint8_t* out, size_t rowPitch)
+{
+	if (rowPitch < size_t(info.Width) * 4)
+		return Fail("row pitch smaller than a row");
+	switch (info.Format) {
+	case ImageFormat::Png:
+		return DecodePng(data, size, out, rowPitch);
+	case ImageFormat::Jpeg: {
+		JpegDecoder jpeg(data, size);
+		return jpeg.Decode(out, rowPitch);
+	}
+	case ImageFormat::Tga:
+		return DecodeTga(data, size, out, rowPitch);
+	default:
+		return Fail("unknown image format");
+	}
+}
+
+const char* ImageDecoder::GetLastError()
+{
+	return t_error;
+}
+
+void ImageDecoder::RunBenchmark(const std::vector<std::string>& files, uint32_t repeats)
+{
+	struct FormatTotals
+	{
+		uint32_t	Files = 0;
+		uint64_t	InputBytes = 0;
+		uint64_t	OutputBytes = 0;
+		double		Ms = 0.0;
+	};
+	FormatTotals totals[4];
+	std::vector<uint8_t> data, pixels;
+	uint32_t failed = 0;
+
+	for (auto& file : files) {
+		std::ifstream stream(file, std::ios::binary | std::ios::ate);
+		if (!stream) {
+			++failed;
+			continue;
+		}
+		data.resize(static_cast<size_t>(stream.tellg()));
+		stream.seekg(0);
+		stream.read(reinterpret_cast<char*>(data.data()), data.size());
+
+		ImageInfo info;
+		if (!ReadInfo(data.data(), data.size(), info)) {
+			std::cout << "ImageDecoder benchmark: " << file << ": " << GetLastError() << std::endl;
+			++failed;
+			continue;
+		}
+		const size_t rowPitch = size_t(info.Width) * 4;
+		pixels.resize(rowPitch * info.Height);
+
+		bool decoded = true;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < repeats && decoded; ++i)
+			decoded = Decode(data.data(), data.size(), info, pixels.data(), rowPitch);
+		const double ms = ElapsedMs(start);
+		if (!decoded) {
+			std::cout << "ImageDecoder benchmark: " << file << ": " << GetLastError() << std::endl;
+			++failed;
+			continue;
+		}
+
+		FormatTotals& total = totals[static_cast<size_t>(info.Format)];
+		++total.Files;
+		total.InputBytes += uint64_t(data.size()) * repeats;
+		total.OutputBytes += uint64_t(pixels.size()) * repeats;
+		total.Ms += ms;
+	}
+
+	for (size_t format = 1; format < 4; ++format) {
+		const FormatTotals& total = totals[format];
+		if (total.Files == 0)
+			continue;
+		const double seconds = total.Ms / 1000.0;
+		std::cout << "ImageDecoder benchmark: " << total.Files << " " << FormatName(static_cast<ImageFormat>(format)) << " files x" << repeats
+			<< ", " << total.Ms / repeats << " ms per pass, " << total.InputBytes / (1024.0 * 1024.0) / seconds << " MB/s in, "
+			<< total.OutputBytes / (1024.0 * 1024.0) / seconds << " MB/s out" << std::endl;
+	}
+	if (failed)
+		std::cout << "ImageDecoder benchmark: " << failed << " of " << files.size() << " files not decoded" << std::endl;
+}
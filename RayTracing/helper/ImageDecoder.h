@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class ImageFormat : uint8_t
+{
+	Unknown,
+	Png,
+	Jpeg,
+	Tga,
+};
+
+struct ImageInfo
+{
+	ImageFormat	Format = ImageFormat::Unknown;
+	uint32_t	Width = 0;
+	uint32_t	Height = 0;
+	uint32_t	Channels = 0;		// stored in the file, the decoded image is always RGBA8
+	bool		SRGB = false;		// PNG sRGB chunk, the files WIC loads as an _SRGB format
+};
+
+// Texture decoding without WIC, for PNG, baseline and progressive JPEG and TGA. Uses nothing but the
+// standard library and SSE up to SSSE3, so the asset pipeline and its benchmarks also build off Windows.
+//
+// Every image decodes to RGBA8, straight into rows of the caller's pitch so the pixels are laid out
+// like the copy footprint of the upload path. PNG rows are unfiltered with SSE2 (Up for any pixel size,
+// Sub, Average and Paeth for 3 and 4 byte pixels) and expanded to RGBA with byte shuffles, as are the
+// BGR rows of TGA files and the grayscale rows of every format. JPEG color conversion is SSSE3.
+//
+// Functions return false on damaged or unsupported files (12 bit or arithmetic coded JPEG, CMYK),
+// GetLastError says why. They keep no state and can run on any number of threads.
+class ImageDecoder
+{
+public:
+	static const uint32_t kMaxDimension = 16384;	// D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION
+
+	// Reads the header only
+	static bool ReadInfo(const uint8_t* data, size_t size, ImageInfo& info);
+	// out holds info.Height rows of rowPitch bytes, rowPitch is at least info.Width * 4
+	static bool Decode(const uint8_t* data, size_t size, const ImageInfo& info, uint8_t* out, size_t rowPitch);
+	// Reason of the last failure on the calling thread
+	static const char* GetLastError();
+
+	// Decodes every file repeats times, prints input and output MB/s per format
+	static void RunBenchmark(const std::vector<std::string>& files, uint32_t repeats);
+};
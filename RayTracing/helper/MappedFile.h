@@ -0,0 +1,26 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Read only view of a whole file mapped into the address space.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	bool IsOpen() const { return m_data != nullptr; }
+	const uint8_t* Data() const { return m_data; }
+	size_t Size() const { return m_size; }
+
+private:
+	HANDLE			m_file = INVALID_HANDLE_VALUE;
+	HANDLE			m_mapping = nullptr;
+	const uint8_t*	m_data = nullptr;
+	size_t			m_size = 0;
+};
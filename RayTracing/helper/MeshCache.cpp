@@ -0,0 +1,486 @@
+#include "stdafx.h"
+#include "MeshCache.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <cstdio>
+
+namespace
+{
+	struct MeshCacheHeader
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint64_t SourceHash;
+		uint32_t LoadFlags;
+		uint32_t Options;
+		uint64_t StaticNodesHash;
+		float WeldPositionEpsilon;
+		float WeldNormalEpsilon;
+		float WeldTexCoordEpsilon;
+		uint32_t MeshCount;
+		uint32_t DirectoryLength;
+		uint32_t NodeCount;
+		uint32_t Flags;
+		uint64_t FileSize;
+	};
+
+	const uint32_t kFlagCompressedGeometry = 1;
+
+	// Hierarchy nodes in depth first order, the root isn't stored
+	struct MeshCacheNode
+	{
+		uint32_t Parent;
+		XMFLOAT4X4 Local;
+	};
+
+	struct MeshCacheRecord
+	{
+		uint64_t VertexOffset;
+		uint64_t IndexOffset;
+		uint64_t TextureOffset;
+		uint64_t SubmeshOffset;
+		uint64_t LodOffset;
+		uint64_t InstanceOffset;
+		uint64_t TangentOffset;
+		// Stored sizes, the raw array sizes unless the cache is compressed
+		uint64_t VertexBytes;
+		uint64_t IndexBytes;
+		uint64_t TangentBytes;
+		uint32_t VertexCount;
+		uint32_t IndexCount;
+		uint32_t TextureCount;
+		uint32_t SubmeshCount;
+		uint32_t LodCount;
+		uint32_t InstanceCount;
+		uint32_t TangentCount;		// 0 or VertexCount
+		float BoundsRadius;
+		XMFLOAT3 BoundsMin;
+		XMFLOAT3 BoundsMax;
+	};
+
+	const uint64_t kDataAlignment = 16;
+
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// What goes into the file for one mesh: either the arrays of the mesh or their streams
+	struct MeshGeometry
+	{
+		const void* Data[3] = {};
+		uint64_t Bytes[3] = {};
+		std::vector<UINT8> Encoded[3];
+		XMFLOAT3 BoundsMin = { 0.0f, 0.0f, 0.0f };
+		XMFLOAT3 BoundsMax = { 0.0f, 0.0f, 0.0f };
+		float BoundsRadius = 0.0f;
+	};
+
+	// Box of the vertices and the sphere around its center holding all of them
+	void ComputeBounds(const std::vector<Vertex_Model>& vertices, MeshGeometry& g)
+	{
+		if (vertices.empty())
+			return;
+		XMFLOAT3 lo = vertices[0].Position, hi = lo;
+		for (auto& v : vertices) {
+			const XMFLOAT3& p = v.Position;
+			lo = XMFLOAT3((std::min)(lo.x, p.x), (std::min)(lo.y, p.y), (std::min)(lo.z, p.z));
+			hi = XMFLOAT3((std::max)(hi.x, p.x), (std::max)(hi.y, p.y), (std::max)(hi.z, p.z));
+		}
+		XMFLOAT3 center((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+		float radiusSq = 0.0f;
+		for (auto& v : vertices) {
+			float dx = v.Position.x - center.x, dy = v.Position.y - center.y, dz = v.Position.z - center.z;
+			radiusSq = (std::max)(radiusSq, dx * dx + dy * dy + dz * dz);
+		}
+		g.BoundsMin = lo;
+		g.BoundsMax = hi;
+		g.BoundsRadius = std::sqrt(radiusSq);
+	}
+
+	uint64_t AlignUp(uint64_t v)
+	{
+		return (v + kDataAlignment - 1) & ~(kDataAlignment - 1);
+	}
+
+	// FNV-1a over 8 byte words, good enough to detect a changed source file
+	uint64_t HashBytes(const uint8_t* data, size_t size)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		const uint64_t prime = 1099511628211ull;
+
+		size_t words = size / sizeof(uint64_t);
+		for (size_t i = 0; i < words; ++i) {
+			uint64_t w;
+			memcpy(&w, data + i * sizeof(uint64_t), sizeof(uint64_t));
+			hash = (hash ^ w) * prime;
+		}
+		for (size_t i = words * sizeof(uint64_t); i < size; ++i) {
+			hash = (hash ^ data[i]) * prime;
+		}
+		return (hash ^ size) * prime;
+	}
+
+	// Names after every "mtllib" keyword at the start of a line of an OBJ file
+	std::vector<std::string> FindMaterialLibs(const uint8_t* data, size_t size)
+	{
+		std::vector<std::string> libs;
+		const char* p = reinterpret_cast<const char*>(data);
+		const char* end = p + size;
+		while (p < end) {
+			const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+			if (!lineEnd)
+				lineEnd = end;
+			while (p < lineEnd && (*p == ' ' || *p == '\t'))
+				++p;
+			if (lineEnd - p > 6 && memcmp(p, "mtllib", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+				const char* name = p + 7;
+				const char* nameEnd = lineEnd;
+				while (name < nameEnd && (*name == ' ' || *name == '\t'))
+					++name;
+				while (nameEnd > name && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t' || nameEnd[-1] == '\r'))
+					--nameEnd;
+				if (name < nameEnd)
+					libs.emplace_back(name, nameEnd);
+			}
+			p = lineEnd + 1;
+		}
+		return libs;
+	}
+
+	void WritePadding(std::ofstream& out, uint64_t& offset)
+	{
+		static const char zeros[kDataAlignment] = {};
+		uint64_t aligned = AlignUp(offset);
+		out.write(zeros, static_cast<std::streamsize>(aligned - offset));
+		offset = aligned;
+	}
+}
+
+uint64_t MeshCache::HashFile(const std::string& filename)
+{
+	MappedFile file;
+	if (!file.Open(filename))
+		return 0;
+
+	uint64_t hash = HashBytes(file.Data(), file.Size());
+
+	// The materials of an OBJ live in the libraries it references, an edited .mtl changes the key too.
+	// A missing library hashes as empty, so the key changes once it shows up.
+	std::string extension = filename.size() >= 4 ? filename.substr(filename.size() - 4) : std::string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	if (extension == ".obj") {
+		const std::string directory = filename.substr(0, filename.find_last_of('/'));
+		for (auto& lib : FindMaterialLibs(file.Data(), file.Size())) {
+			MappedFile libFile;
+			const uint64_t libHash = libFile.Open(directory + "/" + lib) ? HashBytes(libFile.Data(), libFile.Size()) : 0;
+			hash = (hash ^ libHash) * 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+bool MeshCache::Write(const std::string& cacheName, const MeshCacheKey& key,
+	const std::string& directory, const std::vector<MeshData>& meshes, const SceneHierarchy& hierarchy,
+	bool compress, GeometryCodecStats* stats)
+{
+	// Layout: header, records, directory, hierarchy nodes, texture strings, submesh and LOD ranges, instances,
+	// then 16 byte aligned geometry: vertices, indices and tangents per mesh
+	std::vector<MeshGeometry> geometry(meshes.size());
+	auto start = std::chrono::high_resolution_clock::now();
+	ThreadPool::Default().ParallelFor(meshes.size(), [&](size_t i) {
+		const MeshData& mesh = meshes[i];
+		MeshGeometry& g = geometry[i];
+		g.Data[0] = mesh.Vertices.data();
+		g.Bytes[0] = sizeof(Vertex_Model) * mesh.Vertices.size();
+		g.Data[1] = mesh.Indices.data();
+		g.Bytes[1] = sizeof(UINT) * mesh.Indices.size();
+		g.Data[2] = mesh.Tangents.data();
+		g.Bytes[2] = sizeof(XMFLOAT4) * mesh.Tangents.size();
+		ComputeBounds(mesh.Vertices, g);
+		if (!compress)
+			return;
+
+		GeometryCodec::EncodeVertices(mesh.Vertices.data(), mesh.Vertices.size(), g.Encoded[0]);
+		GeometryCodec::EncodeIndices(mesh.Indices.data(), mesh.Indices.size(), g.Encoded[1]);
+		if (!mesh.Tangents.empty())
+			GeometryCodec::Encode(mesh.Tangents.data(), mesh.Tangents.size(), sizeof(XMFLOAT4) / 4, g.Encoded[2]);
+		for (int s = 0; s < 3; ++s) {
+			g.Data[s] = g.Encoded[s].data();
+			g.Bytes[s] = g.Encoded[s].size();
+		}
+	});
+	if (stats) {
+		for (auto& mesh : meshes)
+			stats->RawBytes += sizeof(Vertex_Model) * mesh.Vertices.size() + sizeof(UINT) * mesh.Indices.size() + sizeof(XMFLOAT4) * mesh.Tangents.size();
+		for (auto& g : geometry)
+			stats->EncodedBytes += g.Bytes[0] + g.Bytes[1] + g.Bytes[2];
+		stats->EncodeMs += ElapsedMs(start);
+	}
+
+	std::vector<MeshCacheNode> nodes(hierarchy.GetNodeCount() - 1);
+	for (UINT i = 0; i < nodes.size(); ++i) {
+		nodes[i].Parent = hierarchy.GetParent(i + 1);
+		nodes[i].Local = hierarchy.GetLocal(i + 1);
+	}
+
+	std::vector<MeshCacheRecord> records(meshes.size());
+	uint64_t offset = sizeof(MeshCacheHeader) + sizeof(MeshCacheRecord) * meshes.size() + directory.size() +
+		sizeof(MeshCacheNode) * nodes.size();
+
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		records[i].TextureOffset = offset;
+		records[i].TextureCount = static_cast<uint32_t>(meshes[i].Textures.size());
+		for (auto& tex : meshes[i].Textures)
+			offset += 2 * sizeof(uint32_t) + tex.Type.size() + tex.FileName.size();
+	}
+
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		records[i].SubmeshOffset = offset;
+		records[i].SubmeshCount = static_cast<uint32_t>(meshes[i].Submeshes.size());
+		offset += sizeof(SubmeshGeometry) * meshes[i].Submeshes.size();
+	}
+
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		records[i].LodOffset = offset;
+		records[i].LodCount = static_cast<uint32_t>(meshes[i].Lods.size());
+		offset += sizeof(MeshLod) * meshes[i].Lods.size();
+	}
+
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		records[i].InstanceOffset = offset;
+		records[i].InstanceCount = static_cast<uint32_t>(meshes[i].Instances.size());
+		offset += sizeof(MeshInstance) * meshes[i].Instances.size();
+	}
+
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		offset = AlignUp(offset);
+		records[i].VertexOffset = offset;
+		records[i].VertexCount = static_cast<uint32_t>(meshes[i].Vertices.size());
+		records[i].VertexBytes = geometry[i].Bytes[0];
+		offset += geometry[i].Bytes[0];
+
+		offset = AlignUp(offset);
+		records[i].IndexOffset = offset;
+		records[i].IndexCount = static_cast<uint32_t>(meshes[i].Indices.size());
+		records[i].IndexBytes = geometry[i].Bytes[1];
+		offset += geometry[i].Bytes[1];
+
+		offset = AlignUp(offset);
+		records[i].TangentOffset = offset;
+		records[i].TangentCount = static_cast<uint32_t>(meshes[i].Tangents.size());
+		records[i].TangentBytes = geometry[i].Bytes[2];
+		offset += geometry[i].Bytes[2];
+
+		records[i].BoundsMin = geometry[i].BoundsMin;
+		records[i].BoundsMax = geometry[i].BoundsMax;
+		records[i].BoundsRadius = geometry[i].BoundsRadius;
+	}
+
+	MeshCacheHeader header = {};
+	header.Magic = kMagic;
+	header.Version = kVersion;
+	header.SourceHash = key.SourceHash;
+	header.LoadFlags = key.LoadFlags;
+	header.Options = key.Options;
+	header.StaticNodesHash = key.StaticNodesHash;
+	header.WeldPositionEpsilon = key.WeldPositionEpsilon;
+	header.WeldNormalEpsilon = key.WeldNormalEpsilon;
+	header.WeldTexCoordEpsilon = key.WeldTexCoordEpsilon;
+	header.MeshCount = static_cast<uint32_t>(meshes.size());
+	header.DirectoryLength = static_cast<uint32_t>(directory.size());
+	header.NodeCount = static_cast<uint32_t>(nodes.size());
+	header.Flags = compress ? kFlagCompressedGeometry : 0;
+	header.FileSize = offset;
+
+	std::ofstream out(cacheName, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(records.data()), sizeof(MeshCacheRecord) * records.size());
+	out.write(directory.data(), directory.size());
+	out.write(reinterpret_cast<const char*>(nodes.data()), sizeof(MeshCacheNode) * nodes.size());
+	offset = sizeof(MeshCacheHeader) + sizeof(MeshCacheRecord) * records.size() + directory.size() + sizeof(MeshCacheNode) * nodes.size();
+
+	for (auto& mesh : meshes) {
+		for (auto& tex : mesh.Textures) {
+			uint32_t lengths[2] = { static_cast<uint32_t>(tex.Type.size()), static_cast<uint32_t>(tex.FileName.size()) };
+			out.write(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+			out.write(tex.Type.data(), tex.Type.size());
+			out.write(tex.FileName.data(), tex.FileName.size());
+			offset += sizeof(lengths) + tex.Type.size() + tex.FileName.size();
+		}
+	}
+
+	for (auto& mesh : meshes) {
+		out.write(reinterpret_cast<const char*>(mesh.Submeshes.data()), sizeof(SubmeshGeometry) * mesh.Submeshes.size());
+		offset += sizeof(SubmeshGeometry) * mesh.Submeshes.size();
+	}
+
+	for (auto& mesh : meshes) {
+		out.write(reinterpret_cast<const char*>(mesh.Lods.data()), sizeof(MeshLod) * mesh.Lods.size());
+		offset += sizeof(MeshLod) * mesh.Lods.size();
+	}
+
+	for (auto& mesh : meshes) {
+		out.write(reinterpret_cast<const char*>(mesh.Instances.data()), sizeof(MeshInstance) * mesh.Instances.size());
+		offset += sizeof(MeshInstance) * mesh.Instances.size();
+	}
+
+	for (auto& g : geometry) {
+		for (int s = 0; s < 3; ++s) {
+			WritePadding(out, offset);
+			out.write(static_cast<const char*>(g.Data[s]), static_cast<std::streamsize>(g.Bytes[s]));
+			offset += g.Bytes[s];
+		}
+	}
+
+	if (!out.good()) {
+		out.close();
+		std::remove(cacheName.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MeshCache::Open(const std::string& cacheName, const MeshCacheKey& key)
+{
+	Close();
+	if (!m_file.Open(cacheName))
+		return false;
+
+	const uint8_t* data = m_file.Data();
+	const uint64_t size = m_file.Size();
+	if (size < sizeof(MeshCacheHeader)) {
+		Close();
+		return false;
+	}
+
+	MeshCacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (header.Magic != kMagic || header.Version != kVersion || header.FileSize != size ||
+		header.SourceHash != key.SourceHash || header.LoadFlags != key.LoadFlags || header.Options != key.Options ||
+		header.StaticNodesHash != key.StaticNodesHash || header.WeldPositionEpsilon != key.WeldPositionEpsilon ||
+		header.WeldNormalEpsilon != key.WeldNormalEpsilon || header.WeldTexCoordEpsilon != key.WeldTexCoordEpsilon) {
+		Close();
+		return false;
+	}
+
+	uint64_t recordsEnd = sizeof(MeshCacheHeader) + sizeof(MeshCacheRecord) * uint64_t(header.MeshCount);
+	uint64_t nodeOffset = recordsEnd + header.DirectoryLength;
+	if (nodeOffset + sizeof(MeshCacheNode) * uint64_t(header.NodeCount) > size) {
+		Close();
+		return false;
+	}
+	const MeshCacheRecord* records = reinterpret_cast<const MeshCacheRecord*>(data + sizeof(MeshCacheHeader));
+	m_directory.assign(reinterpret_cast<const char*>(data + recordsEnd), header.DirectoryLength);
+
+	for (uint32_t i = 0; i < header.NodeCount; ++i) {
+		MeshCacheNode node;
+		memcpy(&node, data + nodeOffset + sizeof(MeshCacheNode) * i, sizeof(node));
+		if (m_hierarchy.AddNode(node.Parent, node.Local) == SceneHierarchy::kNoParent) {
+			Close();
+			return false;
+		}
+	}
+
+	m_compressed = (header.Flags & kFlagCompressedGeometry) != 0;
+	m_entries.resize(header.MeshCount);
+	for (uint32_t i = 0; i < header.MeshCount; ++i) {
+		const MeshCacheRecord& record = records[i];
+		// The stream sizes are checked by the decoder
+		const bool rawSizes = m_compressed || (record.VertexBytes == sizeof(Vertex_Model) * uint64_t(record.VertexCount) &&
+			record.IndexBytes == sizeof(UINT) * uint64_t(record.IndexCount) &&
+			record.TangentBytes == sizeof(XMFLOAT4) * uint64_t(record.TangentCount));
+		if (!rawSizes || record.VertexOffset + record.VertexBytes > size ||
+			record.IndexOffset + record.IndexBytes > size ||
+			record.SubmeshOffset + sizeof(SubmeshGeometry) * uint64_t(record.SubmeshCount) > size ||
+			record.LodOffset + sizeof(MeshLod) * uint64_t(record.LodCount) > size ||
+			record.InstanceOffset + sizeof(MeshInstance) * uint64_t(record.InstanceCount) > size ||
+			record.TangentOffset + record.TangentBytes > size ||
+			(record.TangentCount != 0 && record.TangentCount != record.VertexCount)) {
+			Close();
+			return false;
+		}
+
+		Entry& entry = m_entries[i];
+		entry.VertexCount = record.VertexCount;
+		entry.IndexCount = record.IndexCount;
+		entry.HasTangents = record.TangentCount > 0;
+		entry.BoundsMin = record.BoundsMin;
+		entry.BoundsMax = record.BoundsMax;
+		entry.BoundsRadius = record.BoundsRadius;
+		if (m_compressed) {
+			entry.EncodedVertices = data + record.VertexOffset;
+			entry.EncodedVertexBytes = record.VertexBytes;
+			entry.EncodedIndices = data + record.IndexOffset;
+			entry.EncodedIndexBytes = record.IndexBytes;
+			entry.EncodedTangents = data + record.TangentOffset;
+			entry.EncodedTangentBytes = record.TangentBytes;
+		}
+		else {
+			entry.Vertices = reinterpret_cast<const Vertex_Model*>(data + record.VertexOffset);
+			entry.Indices = reinterpret_cast<const UINT*>(data + record.IndexOffset);
+			entry.Tangents = entry.HasTangents ? reinterpret_cast<const XMFLOAT4*>(data + record.TangentOffset) : nullptr;
+		}
+		// Follows the texture strings, so it isn't aligned
+		entry.Submeshes.resize(record.SubmeshCount);
+		memcpy(entry.Submeshes.data(), data + record.SubmeshOffset, sizeof(SubmeshGeometry) * record.SubmeshCount);
+		entry.Lods.resize(record.LodCount);
+		memcpy(entry.Lods.data(), data + record.LodOffset, sizeof(MeshLod) * record.LodCount);
+		entry.Instances.resize(record.InstanceCount);
+		memcpy(entry.Instances.data(), data + record.InstanceOffset, sizeof(MeshInstance) * record.InstanceCount);
+		for (auto& instance : entry.Instances) {
+			if (instance.Node >= m_hierarchy.GetNodeCount()) {
+				Close();
+				return false;
+			}
+		}
+
+		uint64_t texOffset = record.TextureOffset;
+		for (uint32_t t = 0; t < record.TextureCount; ++t) {
+			uint32_t lengths[2];
+			if (texOffset + sizeof(lengths) > size) {
+				Close();
+				return false;
+			}
+			memcpy(lengths, data + texOffset, sizeof(lengths));
+			texOffset += sizeof(lengths);
+			if (texOffset + uint64_t(lengths[0]) + lengths[1] > size) {
+				Close();
+				return false;
+			}
+
+			TextureRef ref;
+			ref.Type.assign(reinterpret_cast<const char*>(data + texOffset), lengths[0]);
+			texOffset += lengths[0];
+			ref.FileName.assign(reinterpret_cast<const char*>(data + texOffset), lengths[1]);
+			texOffset += lengths[1];
+			entry.Textures.push_back(std::move(ref));
+		}
+	}
+
+	return true;
+}
+
+bool MeshCache::Decode(const Entry& entry, Vertex_Model* vertices, UINT* indices, XMFLOAT4* tangents)
+{
+	if (!GeometryCodec::Decode(entry.EncodedVertices, entry.EncodedVertexBytes, entry.VertexCount, sizeof(Vertex_Model) / 4, vertices) ||
+		!GeometryCodec::Decode(entry.EncodedIndices, entry.EncodedIndexBytes, entry.IndexCount, 1, indices))
+		return false;
+	return !entry.HasTangents ||
+		GeometryCodec::Decode(entry.EncodedTangents, entry.EncodedTangentBytes, entry.VertexCount, sizeof(XMFLOAT4) / 4, tangents);
+}
+
+void MeshCache::Close()
+{
+	m_compressed = false;
+	m_entries.clear();
+	m_directory.clear();
+	m_hierarchy.Clear();
+	m_file.Close();
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+#include "helper/MappedFile.h"
+#include "helper/GeometryCodec.h"
+
+// Everything the cached geometry depends on. A cache whose key differs is rebuilt.
+struct MeshCacheKey
+{
+	uint64_t SourceHash = 0;
+	uint32_t LoadFlags = 0;
+	uint32_t Options = 0;
+	// The static node settings, they decide which node every mesh is attached to
+	uint64_t StaticNodesHash = 0;
+	// WeldOptions epsilons when welding is on, stored as they are so any change rebuilds the cache
+	float WeldPositionEpsilon = 0.0f;
+	float WeldNormalEpsilon = 0.0f;
+	float WeldTexCoordEpsilon = 0.0f;
+};
+
+// Versioned binary cache holding the final vertex/index arrays of a model.
+// A warm load maps the file and hands the arrays straight to buffer creation. Compressed caches
+// store the arrays as GeometryCodec streams, they stay compressed in the mapping until Decode.
+class MeshCache
+{
+public:
+	static const uint32_t kMagic = 0x434D5452; // "RTMC"
+	static const uint32_t kVersion = 11;
+
+	// Geometry of one cached mesh, pointing into the mapped file.
+	struct Entry
+	{
+		const Vertex_Model* Vertices = nullptr;
+		UINT VertexCount = 0;
+		const UINT* Indices = nullptr;
+		UINT IndexCount = 0;
+		// VertexCount entries or nullptr, see MeshData::Tangents
+		const XMFLOAT4* Tangents = nullptr;
+		bool HasTangents = false;
+		// Model space box and sphere of the vertices as CreateMesh computes them, known without decoding
+		XMFLOAT3 BoundsMin = { 0.0f, 0.0f, 0.0f };
+		XMFLOAT3 BoundsMax = { 0.0f, 0.0f, 0.0f };
+		float BoundsRadius = 0.0f;
+		// Set instead of the arrays above in a compressed cache
+		const UINT8* EncodedVertices = nullptr;
+		UINT64 EncodedVertexBytes = 0;
+		const UINT8* EncodedIndices = nullptr;
+		UINT64 EncodedIndexBytes = 0;
+		const UINT8* EncodedTangents = nullptr;
+		UINT64 EncodedTangentBytes = 0;
+		std::vector<TextureRef> Textures;
+		std::vector<SubmeshGeometry> Submeshes;
+		std::vector<MeshLod> Lods;
+		std::vector<MeshInstance> Instances;
+	};
+
+	MeshCache() = default;
+	MeshCache(const MeshCache&) = delete;
+	MeshCache& operator=(const MeshCache&) = delete;
+
+	// 0 if the file can't be read. An OBJ hashes the material libraries it references along with it.
+	static uint64_t HashFile(const std::string& filename);
+	// compress encodes the geometry of every mesh with GeometryCodec, stats receives sizes and timing
+	static bool Write(const std::string& cacheName, const MeshCacheKey& key,
+		const std::string& directory, const std::vector<MeshData>& meshes, const SceneHierarchy& hierarchy,
+		bool compress = false, GeometryCodecStats* stats = nullptr);
+	// Fills VertexCount vertices, IndexCount indices and with HasTangents VertexCount tangents from a
+	// compressed entry. Fails on a corrupted stream.
+	static bool Decode(const Entry& entry, Vertex_Model* vertices, UINT* indices, XMFLOAT4* tangents);
+
+	// Fails if the file is missing, corrupted or was built with another key
+	bool Open(const std::string& cacheName, const MeshCacheKey& key);
+	void Close();
+
+	const std::string& GetDirectory() const { return m_directory; }
+	const std::vector<Entry>& GetEntries() const { return m_entries; }
+	const SceneHierarchy& GetHierarchy() const { return m_hierarchy; }
+	bool IsCompressed() const { return m_compressed; }
+
+private:
+	MappedFile			m_file;
+	std::string			m_directory;
+	std::vector<Entry>	m_entries;
+	SceneHierarchy		m_hierarchy;
+	bool				m_compressed = false;
+};
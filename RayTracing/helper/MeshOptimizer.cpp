@@ -0,0 +1,750 @@
+#include "stdafx.h"
+#include "MeshOptimizer.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	std::string TextureSetKey(const std::vector<TextureRef>& textures)
+	{
+		std::string key;
+		for (auto& tex : textures) {
+			key += tex.Type;
+			key += '\n';
+			key += tex.FileName;
+			key += '\n';
+		}
+		return key;
+	}
+
+	// FNV-1a, only used to bucket candidates, matches are verified vertex by vertex
+	uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+	{
+		const UINT8* bytes = static_cast<const UINT8*>(data);
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		return hash;
+	}
+
+	// A rigid transform keeps the topology and the texture coordinates, so copies share this key
+	uint64_t GeometryKey(const MeshData& mesh)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		uint64_t counts[2] = { mesh.Vertices.size(), mesh.Indices.size() };
+		hash = HashBytes(hash, counts, sizeof(counts));
+		hash = HashBytes(hash, mesh.Indices.data(), mesh.Indices.size() * sizeof(UINT));
+		for (auto& v : mesh.Vertices)
+			hash = HashBytes(hash, &v.TexCoord, sizeof(v.TexCoord));
+		std::string textures = TextureSetKey(mesh.Textures);
+		return HashBytes(hash, textures.data(), textures.size());
+	}
+
+	// Forsyth vertex scoring, see "Linear-Speed Vertex Cache Optimisation"
+	const int kCacheSize = 32;
+	const UINT kMaxValence = 32;
+
+	struct ScoreTables
+	{
+		float Cache[kCacheSize];
+		float Valence[kMaxValence + 1];
+
+		ScoreTables()
+		{
+			for (int i = 0; i < kCacheSize; ++i) {
+				// The last triangle's vertices get a fixed score so the next one doesn't prefer them
+				Cache[i] = i < 3 ? 0.75f : std::pow(1.0f - float(i - 3) / float(kCacheSize - 3), 1.5f);
+			}
+			Valence[0] = 0.0f;
+			for (UINT i = 1; i <= kMaxValence; ++i)
+				Valence[i] = 2.0f / std::sqrt(float(i));
+		}
+	};
+
+	float VertexScore(const ScoreTables& tables, int cachePosition, UINT valence)
+	{
+		if (valence == 0)
+			return -1.0f;
+		float score = cachePosition >= 0 ? tables.Cache[cachePosition] : 0.0f;
+		return score + tables.Valence[(std::min)(valence, kMaxValence)];
+	}
+
+	// indices are local to the range, in [0, vertexCount)
+	void ReorderTriangles(UINT* indices, size_t triangleCount, UINT vertexCount)
+	{
+		static const ScoreTables tables;
+		const size_t kNone = SIZE_MAX;
+
+		// Triangles using each vertex, the first Valence[v] entries are the ones not emitted yet
+		std::vector<UINT> valence(vertexCount, 0);
+		for (size_t i = 0; i < triangleCount * 3; ++i)
+			++valence[indices[i]];
+		std::vector<UINT> adjacencyStart(size_t(vertexCount) + 1, 0);
+		for (UINT v = 0; v < vertexCount; ++v)
+			adjacencyStart[v + 1] = adjacencyStart[v] + valence[v];
+		std::vector<UINT> adjacency(triangleCount * 3);
+		std::vector<UINT> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+		for (size_t t = 0; t < triangleCount; ++t) {
+			for (int k = 0; k < 3; ++k)
+				adjacency[fill[indices[t * 3 + k]]++] = static_cast<UINT>(t);
+		}
+
+		std::vector<int> cachePosition(vertexCount, -1);
+		std::vector<float> vertexScore(vertexCount);
+		for (UINT v = 0; v < vertexCount; ++v)
+			vertexScore[v] = VertexScore(tables, -1, valence[v]);
+
+		std::vector<float> triangleScore(triangleCount);
+		std::vector<char> emitted(triangleCount, 0);
+		size_t best = kNone;
+		float bestScore = -1.0f;
+		for (size_t t = 0; t < triangleCount; ++t) {
+			triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+			if (triangleScore[t] > bestScore) {
+				bestScore = triangleScore[t];
+				best = t;
+			}
+		}
+
+		std::vector<UINT> output;
+		output.reserve(triangleCount * 3);
+		UINT cache[kCacheSize + 3];
+		int cacheCount = 0;
+		size_t scan = 0;
+
+		for (size_t n = 0; n < triangleCount; ++n) {
+			if (best == kNone) {
+				// Nothing adjacent to the cache left, continue with the next unemitted triangle
+				while (emitted[scan])
+					++scan;
+				best = scan;
+			}
+
+			const size_t t = best;
+			emitted[t] = 1;
+			const UINT* tri = indices + t * 3;
+			output.insert(output.end(), tri, tri + 3);
+
+			UINT newCache[kCacheSize + 3];
+			int newCount = 0;
+			for (int k = 0; k < 3; ++k) {
+				UINT v = tri[k];
+				UINT* list = adjacency.data() + adjacencyStart[v];
+				for (UINT i = 0; i < valence[v]; ++i) {
+					if (list[i] == t) {
+						list[i] = list[--valence[v]];
+						break;
+					}
+				}
+				if (std::find(newCache, newCache + newCount, v) == newCache + newCount)
+					newCache[newCount++] = v;
+			}
+			for (int i = 0; i < cacheCount; ++i) {
+				if (std::find(newCache, newCache + newCount, cache[i]) == newCache + newCount)
+					newCache[newCount++] = cache[i];
+			}
+
+			// Vertices pushed past the cache size are evicted but still rescored
+			for (int i = 0; i < newCount; ++i) {
+				UINT v = newCache[i];
+				cachePosition[v] = i < kCacheSize ? i : -1;
+				vertexScore[v] = VertexScore(tables, cachePosition[v], valence[v]);
+			}
+
+			best = kNone;
+			bestScore = -1.0f;
+			for (int i = 0; i < newCount; ++i) {
+				UINT v = newCache[i];
+				const UINT* list = adjacency.data() + adjacencyStart[v];
+				for (UINT j = 0; j < valence[v]; ++j) {
+					UINT other = list[j];
+					const UINT* o = indices + size_t(other) * 3;
+					float score = vertexScore[o[0]] + vertexScore[o[1]] + vertexScore[o[2]];
+					triangleScore[other] = score;
+					if (score > bestScore) {
+						bestScore = score;
+						best = other;
+					}
+				}
+			}
+
+			cacheCount = (std::min)(newCount, kCacheSize);
+			std::copy(newCache, newCache + cacheCount, cache);
+		}
+
+		std::copy(output.begin(), output.end(), indices);
+	}
+
+	void AppendMesh(const MeshData& source, MeshData& merged)
+	{
+		const UINT baseVertex = static_cast<UINT>(merged.Vertices.size());
+		const UINT baseIndex = static_cast<UINT>(merged.Indices.size());
+
+		if (source.Submeshes.empty()) {
+			SubmeshGeometry submesh;
+			submesh.IndexCount = static_cast<UINT>(source.Indices.size());
+			submesh.StartIndexLocation = baseIndex;
+			submesh.VertexCount = static_cast<UINT>(source.Vertices.size());
+			submesh.StartVertexLocation = baseVertex;
+			merged.Submeshes.push_back(submesh);
+		}
+		else {
+			for (auto submesh : source.Submeshes) {
+				submesh.StartIndexLocation += baseIndex;
+				submesh.StartVertexLocation += baseVertex;
+				merged.Submeshes.push_back(submesh);
+			}
+		}
+
+		merged.Vertices.insert(merged.Vertices.end(), source.Vertices.begin(), source.Vertices.end());
+		merged.Indices.resize(baseIndex + source.Indices.size());
+		UINT* dst = merged.Indices.data() + baseIndex;
+		for (size_t i = 0; i < source.Indices.size(); ++i)
+			dst[i] = source.Indices[i] + baseVertex;
+	}
+
+	float Dot(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		return a.x * b.x + a.y * b.y + a.z * b.z;
+	}
+
+	XMFLOAT3 Sub(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		return XMFLOAT3(a.x - b.x, a.y - b.y, a.z - b.z);
+	}
+
+	// Bounding sphere around the box center and a normal cone following "Optimizing the Graphics
+	// Pipeline with Compute" (Wihlidal), the apex sits behind every triangle plane of the cluster
+	void ComputeMeshletBounds(const Vertex_Model* vertices, const UINT* indices, const std::vector<UINT>& cluster,
+		Meshlet& meshlet)
+	{
+		meshlet.VertexCount = static_cast<UINT>(cluster.size());
+
+		XMFLOAT3 lo = vertices[cluster[0]].Position, hi = lo;
+		for (UINT v : cluster) {
+			const XMFLOAT3& p = vertices[v].Position;
+			lo = XMFLOAT3((std::min)(lo.x, p.x), (std::min)(lo.y, p.y), (std::min)(lo.z, p.z));
+			hi = XMFLOAT3((std::max)(hi.x, p.x), (std::max)(hi.y, p.y), (std::max)(hi.z, p.z));
+		}
+		meshlet.Center = XMFLOAT3((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+		float radiusSq = 0.0f;
+		for (UINT v : cluster) {
+			XMFLOAT3 d = Sub(vertices[v].Position, meshlet.Center);
+			radiusSq = (std::max)(radiusSq, Dot(d, d));
+		}
+		meshlet.Radius = std::sqrt(radiusSq);
+
+		// Face normals are flipped to the side of the vertex normals, the raster pipeline doesn't cull
+		// by winding and the scene isn't guaranteed to be wound consistently
+		XMFLOAT3 normals[MeshOptimizer::kMaxMeshletTriangles];
+		XMFLOAT3 corners[MeshOptimizer::kMaxMeshletTriangles];
+		UINT faceCount = 0;
+		XMFLOAT3 axis(0.0f, 0.0f, 0.0f);
+		const UINT* tri = indices + meshlet.StartIndexLocation;
+		for (UINT i = 0; i < meshlet.IndexCount; i += 3) {
+			const Vertex_Model& a = vertices[tri[i]];
+			const Vertex_Model& b = vertices[tri[i + 1]];
+			const Vertex_Model& c = vertices[tri[i + 2]];
+			XMFLOAT3 e1 = Sub(b.Position, a.Position);
+			XMFLOAT3 e2 = Sub(c.Position, a.Position);
+			XMFLOAT3 n(e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x);
+			float length = std::sqrt(Dot(n, n));
+			if (length <= 1e-12f)
+				continue;
+			XMFLOAT3 shading(a.Normal.x + b.Normal.x + c.Normal.x, a.Normal.y + b.Normal.y + c.Normal.y,
+				a.Normal.z + b.Normal.z + c.Normal.z);
+			if (Dot(n, shading) < 0.0f)
+				length = -length;
+			n = XMFLOAT3(n.x / length, n.y / length, n.z / length);
+			normals[faceCount] = n;
+			corners[faceCount] = a.Position;
+			++faceCount;
+			axis = XMFLOAT3(axis.x + n.x, axis.y + n.y, axis.z + n.z);
+		}
+
+		float axisLength = std::sqrt(Dot(axis, axis));
+		if (faceCount == 0 || axisLength <= 1e-6f)
+			return;
+		axis = XMFLOAT3(axis.x / axisLength, axis.y / axisLength, axis.z / axisLength);
+
+		float minDot = 1.0f;
+		for (UINT i = 0; i < faceCount; ++i)
+			minDot = (std::min)(minDot, Dot(normals[i], axis));
+		// Close to a hemisphere of normals the cone can hardly ever cull, and the apex goes to infinity
+		if (minDot <= 0.1f)
+			return;
+
+		float apexOffset = 0.0f;
+		for (UINT i = 0; i < faceCount; ++i) {
+			float distance = Dot(Sub(meshlet.Center, corners[i]), normals[i]);
+			apexOffset = (std::max)(apexOffset, distance / Dot(axis, normals[i]));
+		}
+		meshlet.ConeApex = XMFLOAT3(meshlet.Center.x - axis.x * apexOffset, meshlet.Center.y - axis.y * apexOffset,
+			meshlet.Center.z - axis.z * apexOffset);
+		meshlet.ConeAxis = axis;
+		meshlet.ConeCutoff = std::sqrt(1.0f - minDot * minDot);
+	}
+
+	XMFLOAT4X4 Multiply(const XMFLOAT4X4& a, const XMFLOAT4X4& b)
+	{
+		XMFLOAT4X4 result;
+		for (int r = 0; r < 4; ++r) {
+			for (int c = 0; c < 4; ++c)
+				result.m[r][c] = a.m[r][0] * b.m[0][c] + a.m[r][1] * b.m[1][c] + a.m[r][2] * b.m[2][c] + a.m[r][3] * b.m[3][c];
+		}
+		return result;
+	}
+
+	bool IsIdentity(const XMFLOAT4X4& m)
+	{
+		for (int r = 0; r < 4; ++r) {
+			for (int c = 0; c < 4; ++c) {
+				if (m.m[r][c] != (r == c ? 1.0f : 0.0f))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Scene node of a mesh with one untransformed placement, which merging can keep. False for
+	// anything else, merging would bake one placement into the vertices.
+	bool GetMergeNode(const MeshData& mesh, UINT& node)
+	{
+		node = SceneHierarchy::kRoot;
+		if (mesh.Instances.empty())
+			return true;
+		if (mesh.Instances.size() > 1 || !IsIdentity(mesh.Instances[0].Transform))
+			return false;
+		node = mesh.Instances[0].Node;
+		return true;
+	}
+
+	XMFLOAT3 Centroid(const std::vector<Vertex_Model>& vertices)
+	{
+		double x = 0.0, y = 0.0, z = 0.0;
+		for (auto& v : vertices) {
+			x += v.Position.x;
+			y += v.Position.y;
+			z += v.Position.z;
+		}
+		double n = double(vertices.size());
+		return XMFLOAT3(float(x / n), float(y / n), float(z / n));
+	}
+
+	// Orthonormal right handed axes from two directions, false if they are (nearly) parallel
+	bool MakeFrame(const XMFLOAT3& x, const XMFLOAT3& y, XMFLOAT3 axes[3])
+	{
+		float lx = std::sqrt(Dot(x, x));
+		if (lx <= 0.0f)
+			return false;
+		axes[0] = XMFLOAT3(x.x / lx, x.y / lx, x.z / lx);
+		float d = Dot(y, axes[0]);
+		XMFLOAT3 o(y.x - axes[0].x * d, y.y - axes[0].y * d, y.z - axes[0].z * d);
+		float lo = std::sqrt(Dot(o, o));
+		if (lo <= 1e-3f * lx)
+			return false;
+		axes[1] = XMFLOAT3(o.x / lo, o.y / lo, o.z / lo);
+		axes[2] = XMFLOAT3(axes[0].y * axes[1].z - axes[0].z * axes[1].y, axes[0].z * axes[1].x - axes[0].x * axes[1].z,
+			axes[0].x * axes[1].y - axes[0].y * axes[1].x);
+		return true;
+	}
+
+	XMFLOAT3 Transform(const XMFLOAT3& p, const float m[3][3])
+	{
+		return XMFLOAT3(p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0],
+			p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1],
+			p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2]);
+	}
+
+	// Row vector transform with to = from * transform for every vertex, found from two reference
+	// vertices and then checked on all positions and normals
+	bool FindRigidTransform(const MeshData& from, const MeshData& to, XMFLOAT4X4& transform)
+	{
+		const size_t n = from.Vertices.size();
+		if (n == 0 || n != to.Vertices.size() || from.Indices != to.Indices || TextureSetKey(from.Textures) != TextureSetKey(to.Textures))
+			return false;
+		for (size_t i = 0; i < n; ++i) {
+			if (from.Vertices[i].TexCoord.x != to.Vertices[i].TexCoord.x || from.Vertices[i].TexCoord.y != to.Vertices[i].TexCoord.y)
+				return false;
+		}
+
+		const XMFLOAT3 centerFrom = Centroid(from.Vertices);
+		const XMFLOAT3 centerTo = Centroid(to.Vertices);
+
+		// The vertex farthest from the centroid, then the one farthest from that axis
+		size_t first = 0, second = 0;
+		float best = -1.0f;
+		for (size_t i = 0; i < n; ++i) {
+			XMFLOAT3 d = Sub(from.Vertices[i].Position, centerFrom);
+			if (Dot(d, d) > best) {
+				best = Dot(d, d);
+				first = i;
+			}
+		}
+		const float radius = std::sqrt(best);
+		const XMFLOAT3 axis = Sub(from.Vertices[first].Position, centerFrom);
+		best = -1.0f;
+		for (size_t i = 0; i < n; ++i) {
+			XMFLOAT3 d = Sub(from.Vertices[i].Position, centerFrom);
+			XMFLOAT3 c(axis.y * d.z - axis.z * d.y, axis.z * d.x - axis.x * d.z, axis.x * d.y - axis.y * d.x);
+			if (Dot(c, c) > best) {
+				best = Dot(c, c);
+				second = i;
+			}
+		}
+
+		// Rotation taking the source frame onto the target frame, identity when the frame is degenerate
+		float rotation[3][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } };
+		XMFLOAT3 frameFrom[3], frameTo[3];
+		if (MakeFrame(axis, Sub(from.Vertices[second].Position, centerFrom), frameFrom)) {
+			if (!MakeFrame(Sub(to.Vertices[first].Position, centerTo), Sub(to.Vertices[second].Position, centerTo), frameTo))
+				return false;
+			const float* a = &frameFrom[0].x;
+			const float* b = &frameTo[0].x;
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c)
+					rotation[r][c] = a[r] * b[c] + a[3 + r] * b[3 + c] + a[6 + r] * b[6 + c];
+			}
+		}
+		XMFLOAT3 rotatedCenter = Transform(centerFrom, rotation);
+		XMFLOAT3 translation = Sub(centerTo, rotatedCenter);
+
+		const float tolerance = 1e-4f * (std::max)(radius, 1.0f);
+		for (size_t i = 0; i < n; ++i) {
+			const Vertex_Model& a = from.Vertices[i];
+			const Vertex_Model& b = to.Vertices[i];
+			XMFLOAT3 p = Transform(a.Position, rotation);
+			XMFLOAT3 dp(p.x + translation.x - b.Position.x, p.y + translation.y - b.Position.y, p.z + translation.z - b.Position.z);
+			XMFLOAT3 dn = Sub(Transform(a.Normal, rotation), b.Normal);
+			if (Dot(dp, dp) > tolerance * tolerance || Dot(dn, dn) > 1e-4f)
+				return false;
+		}
+
+		transform = XMFLOAT4X4(rotation[0][0], rotation[0][1], rotation[0][2], 0.0f,
+			rotation[1][0], rotation[1][1], rotation[1][2], 0.0f,
+			rotation[2][0], rotation[2][1], rotation[2][2], 0.0f,
+			translation.x, translation.y, translation.z, 1.0f);
+		return true;
+	}
+}
+
+void MeshOptimizer::DeduplicateMeshes(std::vector<MeshData>& meshes, MeshDedupeStats& stats)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	stats = MeshDedupeStats();
+	stats.MeshesBefore = static_cast<UINT>(meshes.size());
+	for (auto& mesh : meshes)
+		stats.BytesBefore += mesh.Vertices.size() * sizeof(Vertex_Model) + mesh.Indices.size() * sizeof(UINT);
+
+	std::vector<uint64_t> keys(meshes.size());
+	ThreadPool::Default().ParallelFor(meshes.size(), [&](size_t i) {
+		keys[i] = GeometryKey(meshes[i]);
+	});
+
+	// Unique meshes per key in mesh order, so the result doesn't depend on scheduling
+	std::unordered_map<uint64_t, std::vector<size_t>> uniques;
+	std::vector<char> duplicate(meshes.size(), 0);
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		std::vector<size_t>& candidates = uniques[keys[i]];
+		for (size_t u : candidates) {
+			XMFLOAT4X4 transform;
+			if (FindRigidTransform(meshes[u], meshes[i], transform)) {
+				// The copy keeps its own placements, the transform goes in front of them
+				if (meshes[u].Instances.empty())
+					meshes[u].Instances.push_back(MeshInstance());
+				if (meshes[i].Instances.empty())
+					meshes[i].Instances.push_back(MeshInstance());
+				for (auto& placement : meshes[i].Instances) {
+					MeshInstance instance;
+					instance.Transform = Multiply(transform, placement.Transform);
+					instance.Node = placement.Node;
+					meshes[u].Instances.push_back(instance);
+				}
+				duplicate[i] = 1;
+				break;
+			}
+		}
+		if (!duplicate[i])
+			candidates.push_back(i);
+	}
+
+	size_t write = 0;
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		if (duplicate[i])
+			continue;
+		if (write != i)
+			meshes[write] = std::move(meshes[i]);
+		++write;
+	}
+	meshes.resize(write);
+
+	stats.MeshesAfter = static_cast<UINT>(meshes.size());
+	for (auto& mesh : meshes) {
+		stats.InstancedMeshes += mesh.Instances.size() > 1 ? 1 : 0;
+		stats.BytesAfter += mesh.Vertices.size() * sizeof(Vertex_Model) + mesh.Indices.size() * sizeof(UINT);
+	}
+	stats.DedupeMs = ElapsedMs(start);
+}
+
+void MeshOptimizer::MergeByMaterial(std::vector<MeshData>& meshes, MeshMergeStats& stats)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	stats = MeshMergeStats();
+	stats.MeshesBefore = static_cast<UINT>(meshes.size());
+	for (auto& mesh : meshes)
+		stats.TexturedBefore += mesh.Textures.empty() ? 0 : 1;
+
+	std::unordered_map<std::string, size_t> groupOfKey;
+	std::vector<std::vector<size_t>> groups;
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		UINT node;
+		if (!GetMergeNode(meshes[i], node)) {
+			groups.emplace_back(1, i);
+			continue;
+		}
+		// Meshes of different scene nodes move independently
+		auto inserted = groupOfKey.emplace(TextureSetKey(meshes[i].Textures) + '#' + std::to_string(node), groups.size());
+		if (inserted.second)
+			groups.emplace_back();
+		groups[inserted.first->second].push_back(i);
+	}
+
+	if (groups.size() < meshes.size()) {
+		std::vector<MeshData> merged(groups.size());
+		ThreadPool::Default().ParallelFor(groups.size(), [&](size_t g) {
+			const std::vector<size_t>& members = groups[g];
+			MeshData& target = merged[g];
+
+			size_t vertexCount = 0, indexCount = 0;
+			for (size_t m : members) {
+				vertexCount += meshes[m].Vertices.size();
+				indexCount += meshes[m].Indices.size();
+			}
+			target.Vertices.reserve(vertexCount);
+			target.Indices.reserve(indexCount);
+			target.Textures = meshes[members[0]].Textures;
+			target.Instances = meshes[members[0]].Instances;
+
+			for (size_t m : members) {
+				AppendMesh(meshes[m], target);
+				std::vector<Vertex_Model>().swap(meshes[m].Vertices);
+				std::vector<UINT>().swap(meshes[m].Indices);
+			}
+		});
+		meshes.swap(merged);
+	}
+
+	stats.MeshesAfter = static_cast<UINT>(meshes.size());
+	for (auto& mesh : meshes)
+		stats.TexturedAfter += mesh.Textures.empty() ? 0 : 1;
+	stats.MergeMs = ElapsedMs(start);
+}
+
+void MeshOptimizer::SplitFor16BitIndices(std::vector<MeshData>& meshes)
+{
+	const UINT kMaxVertices = 65536;
+
+	std::vector<MeshData> result;
+	result.reserve(meshes.size());
+	for (auto& mesh : meshes) {
+		if (mesh.Vertices.size() <= kMaxVertices) {
+			result.push_back(std::move(mesh));
+			continue;
+		}
+
+		std::vector<SubmeshGeometry> ranges = mesh.Submeshes;
+		if (ranges.empty()) {
+			SubmeshGeometry whole;
+			whole.IndexCount = static_cast<UINT>(mesh.Indices.size());
+			whole.VertexCount = static_cast<UINT>(mesh.Vertices.size());
+			ranges.push_back(whole);
+		}
+
+		// Vertex -> index in the current piece, valid when the stamp matches the piece number
+		std::vector<UINT> local(mesh.Vertices.size());
+		std::vector<UINT> stamp(mesh.Vertices.size(), 0);
+		UINT piece = 0;
+
+		auto startPiece = [&]() {
+			result.emplace_back();
+			result.back().Textures = mesh.Textures;
+			result.back().Instances = mesh.Instances;
+			++piece;
+		};
+		auto startRange = [&]() {
+			MeshData& current = result.back();
+			SubmeshGeometry submesh;
+			submesh.StartIndexLocation = static_cast<UINT>(current.Indices.size());
+			submesh.StartVertexLocation = static_cast<UINT>(current.Vertices.size());
+			current.Submeshes.push_back(submesh);
+		};
+		auto closeRange = [&]() {
+			MeshData& current = result.back();
+			SubmeshGeometry& submesh = current.Submeshes.back();
+			submesh.IndexCount = static_cast<UINT>(current.Indices.size()) - submesh.StartIndexLocation;
+			submesh.VertexCount = static_cast<UINT>(current.Vertices.size()) - submesh.StartVertexLocation;
+		};
+
+		startPiece();
+		for (auto& range : ranges) {
+			startRange();
+			for (UINT t = 0; t + 2 < range.IndexCount; t += 3) {
+				const UINT* tri = mesh.Indices.data() + range.StartIndexLocation + t;
+				UINT added = 0;
+				for (int k = 0; k < 3; ++k)
+					added += stamp[tri[k]] != piece ? 1 : 0;
+				if (result.back().Vertices.size() + added > kMaxVertices) {
+					closeRange();
+					startPiece();
+					startRange();
+				}
+				MeshData& current = result.back();
+				for (int k = 0; k < 3; ++k) {
+					UINT v = tri[k];
+					if (stamp[v] != piece) {
+						stamp[v] = piece;
+						local[v] = static_cast<UINT>(current.Vertices.size());
+						current.Vertices.push_back(mesh.Vertices[v]);
+					}
+					current.Indices.push_back(local[v]);
+				}
+			}
+			closeRange();
+		}
+
+		std::vector<Vertex_Model>().swap(mesh.Vertices);
+		std::vector<UINT>().swap(mesh.Indices);
+	}
+	meshes.swap(result);
+}
+
+void MeshOptimizer::OptimizeVertexCache(MeshData& mesh)
+{
+	std::vector<SubmeshGeometry> ranges = mesh.Submeshes;
+	if (ranges.empty()) {
+		SubmeshGeometry whole;
+		whole.IndexCount = static_cast<UINT>(mesh.Indices.size());
+		whole.VertexCount = static_cast<UINT>(mesh.Vertices.size());
+		ranges.push_back(whole);
+	}
+
+	// Submeshes own disjoint index and vertex ranges, nested in the loader's per mesh loop this runs inline
+	ThreadPool::Default().ParallelFor(ranges.size(), [&](size_t r) {
+		const SubmeshGeometry& range = ranges[r];
+		UINT* indices = mesh.Indices.data() + range.StartIndexLocation;
+		const size_t triangleCount = range.IndexCount / 3;
+		if (triangleCount == 0 || range.VertexCount == 0)
+			return;
+
+		for (size_t i = 0; i < range.IndexCount; ++i) {
+			if (indices[i] < range.StartVertexLocation || indices[i] - range.StartVertexLocation >= range.VertexCount)
+				return;	// not a self contained range, leave it as is
+		}
+		for (size_t i = 0; i < triangleCount * 3; ++i)
+			indices[i] -= range.StartVertexLocation;
+
+		ReorderTriangles(indices, triangleCount, range.VertexCount);
+
+		// First use order, unreferenced vertices keep their relative order at the end of the range
+		std::vector<UINT> remap(range.VertexCount, UINT_MAX);
+		UINT next = 0;
+		for (size_t i = 0; i < triangleCount * 3; ++i) {
+			UINT& index = indices[i];
+			if (remap[index] == UINT_MAX)
+				remap[index] = next++;
+			index = remap[index] + range.StartVertexLocation;
+		}
+		for (auto& slot : remap) {
+			if (slot == UINT_MAX)
+				slot = next++;
+		}
+		for (size_t i = triangleCount * 3; i < range.IndexCount; ++i)
+			indices[i] = remap[indices[i] - range.StartVertexLocation] + range.StartVertexLocation;
+
+		Vertex_Model* vertices = mesh.Vertices.data() + range.StartVertexLocation;
+		std::vector<Vertex_Model> reordered(range.VertexCount);
+		for (UINT v = 0; v < range.VertexCount; ++v)
+			reordered[remap[v]] = vertices[v];
+		std::copy(reordered.begin(), reordered.end(), vertices);
+	});
+}
+
+void MeshOptimizer::OptimizeTriangleOrder(UINT* indices, size_t indexCount, UINT vertexCount)
+{
+	if (indexCount >= 3 && vertexCount > 0)
+		ReorderTriangles(indices, indexCount / 3, vertexCount);
+}
+
+VertexCacheStats MeshOptimizer::AnalyzeVertexCache(const std::vector<UINT>& indices, UINT vertexCount, UINT cacheSize)
+{
+	VertexCacheStats stats;
+	if (indices.size() < 3 || vertexCount == 0)
+		return stats;
+
+	// A vertex is a hit while fewer than cacheSize misses happened since it entered the FIFO
+	std::vector<uint64_t> insertedAt(vertexCount, 0);
+	std::vector<char> seen(vertexCount, 0);
+	uint64_t misses = 0;
+	UINT used = 0;
+	for (UINT index : indices) {
+		if (index >= vertexCount)
+			continue;
+		if (!seen[index]) {
+			seen[index] = 1;
+			++used;
+		}
+		else if (misses - insertedAt[index] < cacheSize) {
+			continue;
+		}
+		insertedAt[index] = ++misses;
+	}
+
+	stats.Acmr = float(misses) / float(indices.size() / 3);
+	stats.Atvr = float(misses) / float(used);
+	return stats;
+}
+
+void MeshOptimizer::BuildMeshlets(const Vertex_Model* vertices, UINT vertexCount, const UINT* indices, UINT indexCount,
+	std::vector<Meshlet>& meshlets)
+{
+	meshlets.clear();
+	if (indexCount < 3 || vertexCount == 0)
+		return;
+
+	// Last meshlet that used a vertex, as meshlets.size() + 1 at the time
+	std::vector<UINT> owner(vertexCount, 0);
+	std::vector<UINT> cluster;
+	cluster.reserve(kMaxMeshletVertices);
+	Meshlet current;
+
+	const UINT triangleEnd = indexCount - indexCount % 3;
+	for (UINT i = 0; i < triangleEnd; i += 3) {
+		const UINT a = indices[i], b = indices[i + 1], c = indices[i + 2];
+		UINT id = static_cast<UINT>(meshlets.size()) + 1;
+		UINT added = (owner[a] != id) + (owner[b] != id && b != a) + (owner[c] != id && c != a && c != b);
+		if (cluster.size() + added > kMaxMeshletVertices || current.IndexCount == kMaxMeshletTriangles * 3) {
+			ComputeMeshletBounds(vertices, indices, cluster, current);
+			meshlets.push_back(current);
+			current = Meshlet();
+			current.StartIndexLocation = i;
+			cluster.clear();
+			++id;
+		}
+
+		for (UINT v : { a, b, c }) {
+			if (owner[v] != id) {
+				owner[v] = id;
+				cluster.push_back(v);
+			}
+		}
+		current.IndexCount += 3;
+	}
+	ComputeMeshletBounds(vertices, indices, cluster, current);
+	meshlets.push_back(current);
+}
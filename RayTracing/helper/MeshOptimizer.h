@@ -0,0 +1,71 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct MeshMergeStats
+{
+	UINT	MeshesBefore = 0;
+	UINT	MeshesAfter = 0;
+	UINT	TexturedBefore = 0;		// meshes that bind a texture table
+	UINT	TexturedAfter = 0;
+	double	MergeMs = 0.0;
+};
+
+struct MeshDedupeStats
+{
+	UINT	MeshesBefore = 0;
+	UINT	MeshesAfter = 0;		// unique geometries, one BLAS each
+	UINT	InstancedMeshes = 0;	// unique geometries with more than one placement
+	UINT64	BytesBefore = 0;		// vertex and index data
+	UINT64	BytesAfter = 0;
+	double	DedupeMs = 0.0;
+};
+
+// Post-transform cache efficiency of an index stream under a FIFO cache model.
+struct VertexCacheStats
+{
+	float	Acmr = 0.0f;	// vertex shader invocations per triangle, 0.5 is the best case on a regular grid
+	float	Atvr = 0.0f;	// vertex shader invocations per vertex, 1.0 is optimal
+};
+
+// CPU passes run on the loaded MeshData before anything is uploaded.
+class MeshOptimizer
+{
+public:
+	// Finds meshes that are rigid copies (translated and/or rotated) of an earlier mesh with the same
+	// topology, texture coordinates and textures. The first copy keeps its geometry and gets one
+	// Instances entry per placement, the others are removed. Copies have to list their vertices in
+	// the same order, which is what exporters write for duplicated objects.
+	static void DeduplicateMeshes(std::vector<MeshData>& meshes, MeshDedupeStats& stats);
+
+	// Concatenates meshes that use the same texture set into one vertex/index array.
+	// Every source mesh becomes a SubmeshGeometry of the merged one, groups keep the
+	// order of their first mesh so the result doesn't depend on scheduling. Meshes are only merged with others
+	// of the same scene node, instanced meshes are left alone. Hierarchical scenes only merge across nodes
+	// marked static, see ModelLoadOptions::StaticNodes.
+	static void MergeByMaterial(std::vector<MeshData>& meshes, MeshMergeStats& stats);
+
+	// Reorders the triangles of every submesh for the post-transform cache (Forsyth's linear speed
+	// algorithm on a 32 entry LRU model), then renumbers the vertices in first use order so hit shaders
+	// and the input assembler walk the vertex buffer mostly forward. Submesh ranges stay valid.
+	static void OptimizeVertexCache(MeshData& mesh);
+
+	// Forsyth triangle order for one index range without touching the vertices, indices in [0, vertexCount)
+	static void OptimizeTriangleOrder(UINT* indices, size_t indexCount, UINT vertexCount);
+
+	// Splits meshes with more than 65536 vertices into pieces that can use 16 bit indices.
+	// Triangles keep their order, so this should run after OptimizeVertexCache.
+	static void SplitFor16BitIndices(std::vector<MeshData>& meshes);
+
+	static const UINT kMaxMeshletVertices = 64;
+	static const UINT kMaxMeshletTriangles = 124;
+
+	// Cuts the index buffer into meshlets in triangle order, so each one is a contiguous index range
+	// that can be drawn on its own. Run it on the final triangle order, the vertex cache pass keeps
+	// neighbouring triangles together and gives tight clusters.
+	static void BuildMeshlets(const Vertex_Model* vertices, UINT vertexCount, const UINT* indices, UINT indexCount,
+		std::vector<Meshlet>& meshlets);
+
+	static VertexCacheStats AnalyzeVertexCache(const std::vector<UINT>& indices, UINT vertexCount, UINT cacheSize);
+};
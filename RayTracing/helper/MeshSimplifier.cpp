@@ -0,0 +1,324 @@
+#include "stdafx.h"
+#include "MeshSimplifier.h"
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Sum of squared distances to a set of planes, weighted by triangle area
+	struct Quadric
+	{
+		double A00 = 0, A01 = 0, A02 = 0, A11 = 0, A12 = 0, A22 = 0;
+		double B0 = 0, B1 = 0, B2 = 0;
+		double C = 0;
+		double Weight = 0;
+
+		void AddPlane(double a, double b, double c, double d, double w)
+		{
+			A00 += w * a * a; A01 += w * a * b; A02 += w * a * c;
+			A11 += w * b * b; A12 += w * b * c; A22 += w * c * c;
+			B0 += w * a * d; B1 += w * b * d; B2 += w * c * d;
+			C += w * d * d;
+			Weight += w;
+		}
+
+		void Add(const Quadric& q)
+		{
+			A00 += q.A00; A01 += q.A01; A02 += q.A02; A11 += q.A11; A12 += q.A12; A22 += q.A22;
+			B0 += q.B0; B1 += q.B1; B2 += q.B2;
+			C += q.C;
+			Weight += q.Weight;
+		}
+
+		double Evaluate(const XMFLOAT3& p) const
+		{
+			double x = p.x, y = p.y, z = p.z;
+			double r = x * (A00 * x + 2 * (A01 * y + A02 * z + B0)) + y * (A11 * y + 2 * (A12 * z + B1)) + z * (A22 * z + 2 * B2) + C;
+			return (std::max)(r, 0.0);
+		}
+	};
+
+	struct Collapse
+	{
+		UINT From;
+		UINT To;
+		float Error;	// mean squared distance of the merged quadric
+		float Cost;		// Error plus the attribute penalty, collapses are sorted by it
+	};
+
+	XMFLOAT3 Cross(const XMFLOAT3& p0, const XMFLOAT3& p1, const XMFLOAT3& p2)
+	{
+		XMFLOAT3 e1(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z);
+		XMFLOAT3 e2(p2.x - p0.x, p2.y - p0.y, p2.z - p0.z);
+		return XMFLOAT3(e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x);
+	}
+
+	float Dot(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		return a.x * b.x + a.y * b.y + a.z * b.z;
+	}
+
+	// Squared edge length times the normal and texture coordinate change, so moving a vertex across
+	// a crease or a stretch of texture costs like moving it off the surface
+	float AttributePenalty(const Vertex_Model& a, const Vertex_Model& b)
+	{
+		XMFLOAT3 edge(b.Position.x - a.Position.x, b.Position.y - a.Position.y, b.Position.z - a.Position.z);
+		XMFLOAT3 dn(b.Normal.x - a.Normal.x, b.Normal.y - a.Normal.y, b.Normal.z - a.Normal.z);
+		float du = b.TexCoord.x - a.TexCoord.x, dv = b.TexCoord.y - a.TexCoord.y;
+		return Dot(edge, edge) * (0.25f * Dot(dn, dn) + (std::min)(du * du + dv * dv, 1.0f));
+	}
+
+	bool IsDegenerate(const UINT* tri)
+	{
+		return tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2];
+	}
+
+	// Locks vertices whose position is shared with another vertex (attribute seams) and the ends of
+	// edges that don't have exactly two triangles when seams are welded (borders, non-manifold)
+	void FindLockedVertices(const Vertex_Model* vertices, UINT vertexCount, const std::vector<UINT>& indices,
+		std::vector<char>& locked)
+	{
+		std::vector<UINT> order(vertexCount);
+		std::iota(order.begin(), order.end(), 0u);
+		auto less = [&](UINT a, UINT b) {
+			const XMFLOAT3& p = vertices[a].Position;
+			const XMFLOAT3& q = vertices[b].Position;
+			if (p.x != q.x) return p.x < q.x;
+			if (p.y != q.y) return p.y < q.y;
+			return p.z < q.z;
+		};
+		std::sort(order.begin(), order.end(), less);
+
+		std::vector<UINT> group(vertexCount);
+		locked.assign(vertexCount, 0);
+		for (size_t i = 0; i < order.size();) {
+			size_t end = i + 1;
+			while (end < order.size() && !less(order[i], order[end]))
+				++end;
+			for (size_t k = i; k < end; ++k) {
+				group[order[k]] = order[i];
+				locked[order[k]] = end - i > 1;
+			}
+			i = end;
+		}
+
+		std::vector<uint64_t> edges;
+		edges.reserve(indices.size());
+		for (size_t i = 0; i < indices.size(); i += 3) {
+			for (int k = 0; k < 3; ++k) {
+				UINT a = group[indices[i + k]], b = group[indices[i + (k + 1) % 3]];
+				edges.push_back(uint64_t((std::min)(a, b)) << 32 | (std::max)(a, b));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+
+		std::vector<char> lockedGroup(vertexCount, 0);
+		for (size_t i = 0; i < edges.size();) {
+			size_t end = i + 1;
+			while (end < edges.size() && edges[end] == edges[i])
+				++end;
+			if (end - i != 2) {
+				lockedGroup[edges[i] >> 32] = 1;
+				lockedGroup[edges[i] & 0xffffffffu] = 1;
+			}
+			i = end;
+		}
+		for (UINT v = 0; v < vertexCount; ++v)
+			locked[v] |= lockedGroup[group[v]];
+	}
+
+	// Rejects collapses that turn a remaining triangle of from by more than ~75 degrees
+	bool FlipsTriangle(const Vertex_Model* vertices, const std::vector<UINT>& indices, const UINT* adjacency, UINT adjacencyCount,
+		UINT from, UINT to)
+	{
+		for (UINT i = 0; i < adjacencyCount; ++i) {
+			const UINT* tri = indices.data() + adjacency[i] * 3;
+			if (IsDegenerate(tri) || tri[0] == to || tri[1] == to || tri[2] == to)
+				continue;
+
+			XMFLOAT3 p[3], q[3];
+			for (int k = 0; k < 3; ++k) {
+				p[k] = vertices[tri[k]].Position;
+				q[k] = tri[k] == from ? vertices[to].Position : p[k];
+			}
+			XMFLOAT3 before = Cross(p[0], p[1], p[2]);
+			XMFLOAT3 after = Cross(q[0], q[1], q[2]);
+			if (Dot(before, after) < 0.25f * std::sqrt(Dot(before, before) * Dot(after, after)))
+				return true;
+		}
+		return false;
+	}
+}
+
+float MeshSimplifier::Simplify(const Vertex_Model* vertices, UINT vertexCount, const UINT* indices, size_t indexCount,
+	size_t targetIndexCount, std::vector<UINT>& result)
+{
+	result.assign(indices, indices + indexCount - indexCount % 3);
+	if (result.size() <= targetIndexCount || vertexCount == 0)
+		return 0.0f;
+
+	std::vector<char> locked;
+	FindLockedVertices(vertices, vertexCount, result, locked);
+
+	std::vector<Quadric> quadrics(vertexCount);
+	for (size_t i = 0; i < result.size(); i += 3) {
+		const XMFLOAT3& p0 = vertices[result[i]].Position;
+		XMFLOAT3 n = Cross(p0, vertices[result[i + 1]].Position, vertices[result[i + 2]].Position);
+		double length = std::sqrt(double(Dot(n, n)));
+		if (length <= 0.0)
+			continue;
+		double a = n.x / length, b = n.y / length, c = n.z / length;
+		double d = -(a * p0.x + b * p0.y + c * p0.z);
+		for (int k = 0; k < 3; ++k)
+			quadrics[result[i + k]].AddPlane(a, b, c, d, length * 0.5);
+	}
+
+	std::vector<UINT> adjacencyStart(size_t(vertexCount) + 1);
+	std::vector<UINT> adjacency;
+	std::vector<char> touched(vertexCount);
+	std::vector<Collapse> collapses;
+	float maxError = 0.0f;
+
+	while (result.size() > targetIndexCount) {
+		const size_t triangleCount = result.size() / 3;
+
+		std::fill(adjacencyStart.begin(), adjacencyStart.end(), 0u);
+		for (UINT index : result)
+			++adjacencyStart[index + 1];
+		for (UINT v = 0; v < vertexCount; ++v)
+			adjacencyStart[v + 1] += adjacencyStart[v];
+		adjacency.resize(result.size());
+		std::vector<UINT> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+		for (size_t t = 0; t < triangleCount; ++t) {
+			for (int k = 0; k < 3; ++k)
+				adjacency[fill[result[t * 3 + k]]++] = static_cast<UINT>(t);
+		}
+
+		collapses.clear();
+		for (size_t i = 0; i < result.size(); i += 3) {
+			for (int k = 0; k < 3; ++k) {
+				// An interior edge shows up once in each winding, take it from the triangle where a < b
+				// and keep the cheaper direction
+				UINT a = result[i + k], b = result[i + (k + 1) % 3];
+				if (a > b || (locked[a] && locked[b]))
+					continue;
+
+				Quadric merged = quadrics[a];
+				merged.Add(quadrics[b]);
+				const float penalty = AttributePenalty(vertices[a], vertices[b]);
+				Collapse best = { 0, 0, 0.0f, FLT_MAX };
+				if (!locked[a]) {
+					float error = static_cast<float>(merged.Evaluate(vertices[b].Position) / (std::max)(merged.Weight, 1e-12));
+					best = { a, b, error, error + penalty };
+				}
+				if (!locked[b]) {
+					float error = static_cast<float>(merged.Evaluate(vertices[a].Position) / (std::max)(merged.Weight, 1e-12));
+					if (error + penalty < best.Cost)
+						best = { b, a, error, error + penalty };
+				}
+				collapses.push_back(best);
+			}
+		}
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.Cost < b.Cost; });
+
+		// Each collapse removes about two triangles. Only the cheaper part of the list is used per pass,
+		// the costs of the rest are stale once their neighbourhood changed.
+		const size_t goal = triangleCount - targetIndexCount / 3;
+		const float costLimit = collapses[(std::min)(collapses.size() - 1, goal)].Cost * 1.5f;
+		std::fill(touched.begin(), touched.end(), 0);
+		size_t removed = 0;
+		for (const Collapse& collapse : collapses) {
+			if (removed >= goal || collapse.Cost > costLimit)
+				break;
+			if (touched[collapse.From] || touched[collapse.To])
+				continue;
+
+			const UINT* around = adjacency.data() + adjacencyStart[collapse.From];
+			const UINT aroundCount = adjacencyStart[collapse.From + 1] - adjacencyStart[collapse.From];
+			if (FlipsTriangle(vertices, result, around, aroundCount, collapse.From, collapse.To))
+				continue;
+
+			for (UINT i = 0; i < aroundCount; ++i) {
+				UINT* tri = result.data() + around[i] * 3;
+				if (IsDegenerate(tri))
+					continue;
+				for (int k = 0; k < 3; ++k) {
+					if (tri[k] == collapse.From)
+						tri[k] = collapse.To;
+				}
+				removed += IsDegenerate(tri);
+			}
+			quadrics[collapse.To].Add(quadrics[collapse.From]);
+			touched[collapse.From] = touched[collapse.To] = 1;
+			maxError = (std::max)(maxError, collapse.Error);
+		}
+		if (removed == 0)
+			break;
+
+		size_t write = 0;
+		for (size_t i = 0; i < result.size(); i += 3) {
+			if (IsDegenerate(&result[i]))
+				continue;
+			result[write++] = result[i];
+			result[write++] = result[i + 1];
+			result[write++] = result[i + 2];
+		}
+		result.resize(write);
+	}
+
+	return std::sqrt(maxError);
+}
+
+void MeshSimplifier::BuildLodChain(MeshData& mesh, UINT lodCount, float reduction, MeshLodStats& stats)
+{
+	const size_t baseCount = mesh.Indices.size();
+	mesh.Lods.clear();
+	if (stats.Triangles.size() < lodCount + 1)
+		stats.Triangles.resize(lodCount + 1, 0);
+	stats.Triangles[0] += baseCount / 3;
+	if (lodCount == 0 || baseCount < 3)
+		return;
+
+	MeshLod base;
+	base.IndexCount = static_cast<UINT>(baseCount);
+	mesh.Lods.push_back(base);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	const UINT vertexCount = static_cast<UINT>(mesh.Vertices.size());
+	std::vector<UINT> source(mesh.Indices.begin(), mesh.Indices.end());
+	std::vector<UINT> simplified;
+	for (UINT lod = 1; lod <= lodCount; ++lod) {
+		size_t target = static_cast<size_t>(source.size() / 3 * reduction) * 3;
+		stats.InputTriangles += source.size() / 3;
+		float error = Simplify(mesh.Vertices.data(), vertexCount, source.data(), source.size(), target, simplified);
+		if (simplified.empty() || simplified.size() * 10 > source.size() * 9)
+			break;
+
+		// Errors of the steps add up since each one starts from the previous LOD
+		MeshLod level;
+		level.StartIndexLocation = static_cast<UINT>(mesh.Indices.size());
+		level.IndexCount = static_cast<UINT>(simplified.size());
+		level.Error = mesh.Lods.back().Error + error;
+		mesh.Lods.push_back(level);
+		stats.Triangles[lod] += simplified.size() / 3;
+
+		source.swap(simplified);
+		mesh.Indices.insert(mesh.Indices.end(), source.begin(), source.end());
+		MeshOptimizer::OptimizeTriangleOrder(mesh.Indices.data() + level.StartIndexLocation, level.IndexCount, vertexCount);
+	}
+	stats.SimplifyMs += ElapsedMs(start);
+
+	if (mesh.Lods.size() == 1)
+		mesh.Lods.clear();
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct MeshLodStats
+{
+	std::vector<UINT64>	Triangles;				// per LOD, index 0 is the base mesh
+	UINT64				InputTriangles = 0;		// triangles fed to Simplify, for the throughput
+	double				SimplifyMs = 0.0;		// summed over threads
+};
+
+// Quadric error edge collapse (Garland and Heckbert) that only moves vertices onto their neighbours,
+// so every LOD indexes the vertex buffer of the base mesh.
+// Vertices on attribute seams, open borders and non-manifold edges stay in place, and the collapse cost
+// adds a penalty for the normal and texture coordinate change so flat, uniformly mapped areas go first.
+class MeshSimplifier
+{
+public:
+	// Writes at most targetIndexCount indices when the mesh can be reduced that far, fewer collapses
+	// happen otherwise. Returns the largest distance from the input surface in model units.
+	static float Simplify(const Vertex_Model* vertices, UINT vertexCount, const UINT* indices, size_t indexCount,
+		size_t targetIndexCount, std::vector<UINT>& result);
+
+	// Appends lodCount simplified index ranges to mesh.Indices, each reduction times the triangles of
+	// the previous one, and fills mesh.Lods with the base range first. The chain stops early once a
+	// step removes less than 10% of the triangles.
+	static void BuildLodChain(MeshData& mesh, UINT lodCount, float reduction, MeshLodStats& stats);
+};
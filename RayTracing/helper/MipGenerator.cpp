@@ -0,0 +1,314 @@
+#include "stdafx.h"
+#include "MipGenerator.h"
+#include "ImageDecoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <emmintrin.h>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	const uint32_t kRowsPerJob = 16;
+	const int kMaxTaps = 16;			// Kaiser at the largest scale, 3 texels to 1
+	const double kKaiserAlpha = 4.0;
+	const double kKaiserRadius = 2.0;	// in destination texels
+
+	// Source texels and weights of one destination texel along one axis
+	struct Taps
+	{
+		int		Count = 0;
+		int		Index[kMaxTaps];
+		float	Weight[kMaxTaps];
+	};
+
+	double BesselI0(double x)
+	{
+		double sum = 1.0, term = 1.0;
+		for (int k = 1; k < 25; ++k) {
+			const double f = x / (2.0 * k);
+			term *= f * f;
+			sum += term;
+		}
+		return sum;
+	}
+
+	double KaiserSinc(double x)
+	{
+		const double t = x / kKaiserRadius;
+		if (t <= -1.0 || t >= 1.0)
+			return 0.0;
+		const double pi = 3.14159265358979323846;
+		const double sinc = x == 0.0 ? 1.0 : std::sin(pi * x) / (pi * x);
+		return sinc * BesselI0(kKaiserAlpha * std::sqrt(1.0 - t * t)) / BesselI0(kKaiserAlpha);
+	}
+
+	std::vector<Taps> ComputeTaps(uint32_t source, uint32_t destination, MipFilter filter)
+	{
+		std::vector<Taps> taps(destination);
+		const double scale = double(source) / destination;
+		for (uint32_t x = 0; x < destination; ++x) {
+			Taps& t = taps[x];
+			if (source == destination) {
+				t.Count = 1;
+				t.Index[0] = static_cast<int>(x);
+				t.Weight[0] = 1.0f;
+				continue;
+			}
+
+			double weights[kMaxTaps], sum = 0.0;
+			int first, last;
+			if (filter == MipFilter::Box) {
+				const double start = x * scale, end = (x + 1) * scale;
+				first = static_cast<int>(std::floor(start));
+				last = static_cast<int>(std::ceil(end)) - 1;
+				for (int i = first; i <= last && i - first < kMaxTaps; ++i)
+					weights[i - first] = (std::min)(end, i + 1.0) - (std::max)(start, double(i));
+			}
+			else {
+				const double center = (x + 0.5) * scale;
+				first = static_cast<int>(std::floor(center - kKaiserRadius * scale));
+				last = static_cast<int>(std::ceil(center + kKaiserRadius * scale));
+				for (int i = first; i <= last && i - first < kMaxTaps; ++i)
+					weights[i - first] = KaiserSinc((i + 0.5 - center) / scale);
+			}
+			for (int i = first; i <= last && i - first < kMaxTaps; ++i) {
+				if (weights[i - first] == 0.0)
+					continue;
+				t.Index[t.Count] = (std::min)((std::max)(i, 0), static_cast<int>(source) - 1);
+				t.Weight[t.Count] = static_cast<float>(weights[i - first]);
+				sum += weights[i - first];
+				++t.Count;
+			}
+			for (int i = 0; i < t.Count; ++i)
+				t.Weight[i] = static_cast<float>(t.Weight[i] / sum);
+		}
+		return taps;
+	}
+
+	struct GammaTables
+	{
+		float	ToLinear[256];
+		uint8_t	ToSrgb[4096];	// by linear value * 4095
+
+		GammaTables()
+		{
+			for (int i = 0; i < 256; ++i) {
+				const double c = i / 255.0;
+				ToLinear[i] = static_cast<float>(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+			}
+			for (int i = 0; i < 4096; ++i) {
+				const double l = i / 4095.0;
+				const double c = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+				ToSrgb[i] = static_cast<uint8_t>(c * 255.0 + 0.5);
+			}
+		}
+	};
+
+	const GammaTables& GetGammaTables()
+	{
+		static const GammaTables tables;
+		return tables;
+	}
+
+	// Rows are kept as four floats per pixel, read and written with unaligned loads and stores
+	void LoadRow(const uint8_t* src, uint32_t width, bool srgb, float* out)
+	{
+		const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+		if (srgb) {
+			const float* toLinear = GetGammaTables().ToLinear;
+			for (uint32_t x = 0; x < width; ++x, src += 4)
+				_mm_storeu_ps(out + 4 * x, _mm_setr_ps(toLinear[src[0]], toLinear[src[1]], toLinear[src[2]], src[3] * (1.0f / 255.0f)));
+			return;
+		}
+		const __m128i zero = _mm_setzero_si128();
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4, src += 16) {
+			const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+			const __m128i low = _mm_unpacklo_epi8(pixels, zero), high = _mm_unpackhi_epi8(pixels, zero);
+			_mm_storeu_ps(out + 4 * x + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)), scale));
+			_mm_storeu_ps(out + 4 * x + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)), scale));
+			_mm_storeu_ps(out + 4 * x + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)), scale));
+			_mm_storeu_ps(out + 4 * x + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)), scale));
+		}
+		for (; x < width; ++x, src += 4)
+			_mm_storeu_ps(out + 4 * x, _mm_mul_ps(_mm_setr_ps(src[0], src[1], src[2], src[3]), scale));
+	}
+
+	void StoreRow(const float* in, uint32_t width, bool srgb, uint8_t* dst)
+	{
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+		const __m128 scale255 = _mm_set1_ps(255.0f);
+		if (srgb) {
+			const uint8_t* toSrgb = GetGammaTables().ToSrgb;
+			const __m128 scale4095 = _mm_set1_ps(4095.0f);
+			alignas(16) int32_t color[4], alpha[4];
+			for (uint32_t x = 0; x < width; ++x, dst += 4) {
+				const __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + 4 * x), zero), one);
+				_mm_store_si128(reinterpret_cast<__m128i*>(color), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale4095), half)));
+				_mm_store_si128(reinterpret_cast<__m128i*>(alpha), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale255), half)));
+				dst[0] = toSrgb[color[0]];
+				dst[1] = toSrgb[color[1]];
+				dst[2] = toSrgb[color[2]];
+				dst[3] = static_cast<uint8_t>(alpha[3]);
+			}
+			return;
+		}
+		auto quantize = [&](__m128 v) {
+			return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(v, zero), one), scale255), half));
+		};
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4, dst += 16) {
+			const __m128i low = _mm_packs_epi32(quantize(_mm_loadu_ps(in + 4 * x)), quantize(_mm_loadu_ps(in + 4 * x + 4)));
+			const __m128i high = _mm_packs_epi32(quantize(_mm_loadu_ps(in + 4 * x + 8)), quantize(_mm_loadu_ps(in + 4 * x + 12)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(low, high));
+		}
+		for (; x < width; ++x, dst += 4) {
+			const __m128i v = quantize(_mm_loadu_ps(in + 4 * x));
+			const int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(v, v), v));
+			memcpy(dst, &packed, 4);
+		}
+	}
+
+	size_t JobCount(uint32_t rows)
+	{
+		return (rows + kRowsPerJob - 1) / kRowsPerJob;
+	}
+}
+
+uint32_t MipGenerator::GetLevelCount(uint32_t width, uint32_t height)
+{
+	uint32_t levels = 1;
+	for (uint32_t size = (std::max)(width, height); size > 1; size >>= 1)
+		++levels;
+	return levels;
+}
+
+void MipGenerator::Generate(const MipLevel* levels, uint32_t count, bool srgb, MipFilter filter, ThreadPool& pool)
+{
+	if (count < 2)
+		return;
+
+	uint32_t width = levels[0].Width, height = levels[0].Height;
+	std::unique_ptr<float[]> source(new float[size_t(width) * height * 4]);
+	pool.ParallelFor(JobCount(height), [&](size_t job) {
+		const uint32_t end = (std::min)(height, static_cast<uint32_t>(job + 1) * kRowsPerJob);
+		for (uint32_t y = static_cast<uint32_t>(job) * kRowsPerJob; y < end; ++y)
+			LoadRow(levels[0].Data + y * levels[0].RowPitch, width, srgb, source.get() + size_t(y) * width * 4);
+	});
+
+	for (uint32_t level = 1; level < count; ++level) {
+		const MipLevel& out = levels[level];
+		const std::vector<Taps> columns = ComputeTaps(width, out.Width, filter);
+		const std::vector<Taps> rows = ComputeTaps(height, out.Height, filter);
+
+		// Horizontal pass to the new width, then whole weighted rows to the new height
+		std::unique_ptr<float[]> horizontal(new float[size_t(out.Width) * height * 4]);
+		pool.ParallelFor(JobCount(height), [&](size_t job) {
+			const uint32_t end = (std::min)(height, static_cast<uint32_t>(job + 1) * kRowsPerJob);
+			for (uint32_t y = static_cast<uint32_t>(job) * kRowsPerJob; y < end; ++y) {
+				const float* src = source.get() + size_t(y) * width * 4;
+				float* dst = horizontal.get() + size_t(y) * out.Width * 4;
+				for (uint32_t x = 0; x < out.Width; ++x) {
+					const Taps& t = columns[x];
+					__m128 sum = _mm_mul_ps(_mm_loadu_ps(src + 4 * t.Index[0]), _mm_set1_ps(t.Weight[0]));
+					for (int i = 1; i < t.Count; ++i)
+						sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(src + 4 * t.Index[i]), _mm_set1_ps(t.Weight[i])));
+					_mm_storeu_ps(dst + 4 * x, sum);
+				}
+			}
+		});
+
+		std::unique_ptr<float[]> destination(new float[size_t(out.Width) * out.Height * 4]);
+		pool.ParallelFor(JobCount(out.Height), [&](size_t job) {
+			const uint32_t end = (std::min)(out.Height, static_cast<uint32_t>(job + 1) * kRowsPerJob);
+			for (uint32_t y = static_cast<uint32_t>(job) * kRowsPerJob; y < end; ++y) {
+				const Taps& t = rows[y];
+				float* dst = destination.get() + size_t(y) * out.Width * 4;
+				const float* src = horizontal.get() + size_t(t.Index[0]) * out.Width * 4;
+				const __m128 first = _mm_set1_ps(t.Weight[0]);
+				for (uint32_t x = 0; x < out.Width; ++x)
+					_mm_storeu_ps(dst + 4 * x, _mm_mul_ps(_mm_loadu_ps(src + 4 * x), first));
+				for (int i = 1; i < t.Count; ++i) {
+					src = horizontal.get() + size_t(t.Index[i]) * out.Width * 4;
+					const __m128 weight = _mm_set1_ps(t.Weight[i]);
+					for (uint32_t x = 0; x < out.Width; ++x)
+						_mm_storeu_ps(dst + 4 * x, _mm_add_ps(_mm_loadu_ps(dst + 4 * x), _mm_mul_ps(_mm_loadu_ps(src + 4 * x), weight)));
+				}
+				StoreRow(dst, out.Width, srgb, out.Data + y * out.RowPitch);
+			}
+		});
+
+		source = std::move(destination);
+		width = out.Width;
+		height = out.Height;
+	}
+}
+
+void MipGenerator::RunBenchmark(const std::vector<std::string>& files, ThreadPool& pool)
+{
+	struct Image
+	{
+		ImageInfo Info;
+		std::vector<uint8_t> Pixels;
+	};
+	std::vector<Image> images;
+	uint64_t pixels = 0;
+	for (auto& file : files) {
+		std::ifstream stream(file, std::ios::binary | std::ios::ate);
+		if (!stream)
+			continue;
+		std::vector<uint8_t> data(static_cast<size_t>(stream.tellg()));
+		stream.seekg(0);
+		stream.read(reinterpret_cast<char*>(data.data()), data.size());
+		Image image;
+		if (!ImageDecoder::ReadInfo(data.data(), data.size(), image.Info))
+			continue;
+		image.Pixels.resize(size_t(image.Info.Width) * 4 * image.Info.Height);
+		if (!ImageDecoder::Decode(data.data(), data.size(), image.Info, image.Pixels.data(), size_t(image.Info.Width) * 4))
+			continue;
+		pixels += uint64_t(image.Info.Width) * image.Info.Height;
+		images.push_back(std::move(image));
+	}
+	if (images.empty())
+		return;
+
+	auto measure = [&](MipFilter filter, bool srgb) {
+		std::vector<MipLevel> levels;
+		std::vector<uint8_t> chain;
+		double ms = 0.0;
+		for (auto& image : images) {
+			const uint32_t count = GetLevelCount(image.Info.Width, image.Info.Height);
+			levels.assign(count, MipLevel());
+			levels[0] = { image.Pixels.data(), size_t(image.Info.Width) * 4, image.Info.Width, image.Info.Height };
+			size_t bytes = 0;
+			for (uint32_t level = 1; level < count; ++level)
+				bytes += size_t(GetLevelSize(image.Info.Width, level)) * 4 * GetLevelSize(image.Info.Height, level);
+			chain.resize(bytes);
+			uint8_t* data = chain.data();
+			for (uint32_t level = 1; level < count; ++level) {
+				const uint32_t width = GetLevelSize(image.Info.Width, level), height = GetLevelSize(image.Info.Height, level);
+				levels[level] = { data, size_t(width) * 4, width, height };
+				data += size_t(width) * 4 * height;
+			}
+			auto start = std::chrono::high_resolution_clock::now();
+			Generate(levels.data(), count, srgb, filter, pool);
+			ms += ElapsedMs(start);
+		}
+		std::cout << "MipGenerator benchmark (" << (filter == MipFilter::Box ? "box" : "kaiser") << (srgb ? ", srgb, " : ", linear, ")
+			<< pool.GetThreadCount() << " threads): " << images.size() << " textures, " << pixels / 1e6 << " MP in " << ms << " ms, "
+			<< ms / (pixels / 1e6) << " ms per MP" << std::endl;
+	};
+	measure(MipFilter::Box, false);
+	measure(MipFilter::Box, true);
+	measure(MipFilter::Kaiser, false);
+	measure(MipFilter::Kaiser, true);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ThreadPool.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class MipFilter : uint8_t
+{
+	Box,		// average of the pixels each texel covers
+	Kaiser,		// Kaiser windowed sinc, 8 taps per axis at half size, sharper
+};
+
+// One level of an RGBA8 chain, the rows can have any pitch
+struct MipLevel
+{
+	uint8_t*	Data = nullptr;
+	size_t		RowPitch = 0;
+	uint32_t	Width = 0;
+	uint32_t	Height = 0;
+};
+
+// CPU mip chain generation. Every level is filtered from the one above it, kept in float so the error
+// doesn't add up over the chain: one SSE register per pixel, the horizontal pass reads the taps of each
+// texel, the vertical pass adds whole weighted rows. Odd sizes round down like D3D12 does and the taps
+// follow the real scale, edges clamp. Rows are spread over a thread pool; calls from inside a pool job
+// run serially.
+//
+// With srgb the color channels are filtered in linear light and converted back, alpha stays linear.
+// Without it an sRGB image comes out too dark in the small levels.
+class MipGenerator
+{
+public:
+	// Full chain down to 1x1
+	static uint32_t GetLevelCount(uint32_t width, uint32_t height);
+	static uint32_t GetLevelSize(uint32_t size, uint32_t level) { return size >> level ? size >> level : 1; }
+
+	// levels[0] is the source, fills levels[1, count)
+	static void Generate(const MipLevel* levels, uint32_t count, bool srgb, MipFilter filter, ThreadPool& pool);
+
+	// Generates the chain of every file with both filters, linear and sRGB, prints ms per megapixel
+	static void RunBenchmark(const std::vector<std::string>& files, ThreadPool& pool);
+};
@@ -2,8 +2,150 @@
 #include "core/D3DUtility.h"
 #include "helper/DXSampleHelper.h"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <xmmintrin.h>
 #include "ModelLoader.h"
 #include "TextureLoader.h"
+#include "MeshCache.h"
+#include "GeometryStore.h"
+#include "ThreadPool.h"
+#include "ObjParser.h"
+#include "MeshOptimizer.h"
+#include "SceneHierarchy.h"
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Interleaves assimp's attribute streams into Vertex_Model, 2 SSE stores per vertex.
+	// Missing normals/texcoords read from a zero vector with a stride of 0.
+	void ConvertVertices(const aiVector3D* positions, const aiVector3D* normals, const aiVector3D* texCoords,
+		size_t begin, size_t end, size_t count, Vertex_Model* out)
+	{
+		static const float kZero[4] = {};
+		const float* pos = &positions[0].x;
+		const float* nrm = normals ? &normals[0].x : kZero;
+		const float* uv = texCoords ? &texCoords[0].x : kZero;
+		const size_t nrmStep = normals ? 3 : 0;
+		const size_t uvStep = texCoords ? 3 : 0;
+		float* dst = reinterpret_cast<float*>(out);
+
+		// The 16 byte loads read one float past each vec3, so the very last vertex goes scalar
+		size_t simdEnd = (std::min)(end, count - 1);
+		size_t i = begin;
+		for (; i < simdEnd; ++i) {
+			__m128 p = _mm_loadu_ps(pos + 3 * i);
+			__m128 n = _mm_loadu_ps(nrm + nrmStep * i);
+			__m128 t = _mm_loadu_ps(uv + uvStep * i);
+			__m128 zn = _mm_shuffle_ps(p, n, _MM_SHUFFLE(0, 0, 2, 2));					// pz pz nx nx
+			_mm_storeu_ps(dst + 8 * i, _mm_shuffle_ps(p, zn, _MM_SHUFFLE(2, 0, 1, 0)));	// px py pz nx
+			_mm_storeu_ps(dst + 8 * i + 4, _mm_shuffle_ps(n, t, _MM_SHUFFLE(1, 0, 2, 1)));	// ny nz u v
+		}
+		for (; i < end; ++i) {
+			Vertex_Model& vertex = out[i];
+			vertex.Position = XMFLOAT3(pos[3 * i], pos[3 * i + 1], pos[3 * i + 2]);
+			vertex.Normal = XMFLOAT3(nrm[nrmStep * i], nrm[nrmStep * i + 1], nrm[nrmStep * i + 2]);
+			vertex.TexCoord = XMFLOAT2(uv[uvStep * i], uv[uvStep * i + 1]);
+		}
+	}
+
+	// Single pass over the faces, triangles are copied without looking at the index count twice
+	void FlattenFaces(const aiFace* faces, UINT faceCount, std::vector<UINT>& indices)
+	{
+		indices.resize(size_t(faceCount) * 3);
+		size_t cursor = 0;
+		for (UINT i = 0; i < faceCount; i++) {
+			const aiFace& ai_face = faces[i];
+			if (ai_face.mNumIndices == 3) {
+				UINT* dst = indices.data() + cursor;
+				dst[0] = ai_face.mIndices[0];
+				dst[1] = ai_face.mIndices[1];
+				dst[2] = ai_face.mIndices[2];
+				cursor += 3;
+				continue;
+			}
+
+			// Points, lines and untriangulated polygons, keep room for the remaining faces as triangles
+			size_t required = cursor + ai_face.mNumIndices + size_t(faceCount - i - 1) * 3;
+			if (required > indices.size())
+				indices.resize(required);
+			for (UINT j = 0; j < ai_face.mNumIndices; j++)
+				indices[cursor++] = ai_face.mIndices[j];
+		}
+		indices.resize(cursor);
+	}
+
+	const size_t kVerticesPerTask = 64 * 1024;
+
+	// MeshCacheKey::Options bits, anything that changes the produced geometry
+	enum MeshCacheOption : uint32_t
+	{
+		MeshCacheOption_NativeObj = 1 << 0,
+		MeshCacheOption_MergeByMaterial = 1 << 1,
+		MeshCacheOption_VertexCache = 1 << 2,
+		MeshCacheOption_Split16BitIndices = 1 << 3,
+		MeshCacheOption_Lods = 1 << 4,
+		MeshCacheOption_Dedupe = 1 << 5,
+		MeshCacheOption_Weld = 1 << 6,
+		MeshCacheOption_Tangents = 1 << 7,
+		MeshCacheOption_WeldDegenerates = 1 << 24,
+		// LOD count in bits 8-15, reduction in percent in bits 16-23, the weld epsilons have fields of their own
+		MeshCacheOption_LodCountShift = 8,
+		MeshCacheOption_LodReductionShift = 16,
+	};
+
+	bool IsIdentity(const XMFLOAT4X4& m)
+	{
+		for (int r = 0; r < 4; ++r) {
+			for (int c = 0; c < 4; ++c) {
+				if (m.m[r][c] != (r == c ? 1.0f : 0.0f))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Positions and normals into the space of the node the mesh is attached to, the winding is
+	// kept when the transform mirrors
+	void BakeTransform(const XMFLOAT4X4& transform, MeshData& mesh)
+	{
+		XMMATRIX m = XMLoadFloat4x4(&transform);
+		XMMATRIX normalMatrix = XMMatrixTranspose(XMMatrixInverse(nullptr, m));
+		for (auto& v : mesh.Vertices) {
+			XMStoreFloat3(&v.Position, XMVector3TransformCoord(XMLoadFloat3(&v.Position), m));
+			XMStoreFloat3(&v.Normal, XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat3(&v.Normal), normalMatrix)));
+		}
+		if (XMVectorGetX(XMMatrixDeterminant(m)) < 0.0f) {
+			for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+				std::swap(mesh.Indices[i + 1], mesh.Indices[i + 2]);
+		}
+	}
+
+	// FNV-1a over the sorted names, the same set gives the same hash in any order
+	uint64_t HashStaticNodes(const std::unordered_set<std::string>& staticNodes)
+	{
+		std::vector<std::string> names(staticNodes.begin(), staticNodes.end());
+		std::sort(names.begin(), names.end());
+		uint64_t hash = 14695981039346656037ull;
+		for (auto& name : names) {
+			for (char c : name)
+				hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+			hash = (hash ^ 0xFF) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	double Throughput(UINT64 bytes, double ms)
+	{
+		return ms > 0.0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0.0;
+	}
+}
 
 ModelLoader::ModelLoader(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList,TextureLoader* textureLoader)
 	: m_device ( device),m_cmdList (cmdList),m_textureLoader(textureLoader)
@@ -11,96 +153,638 @@ ModelLoader::ModelLoader(ID3D12Device* device, ID3D12GraphicsCommandList* cmdLis
 }
 
 bool ModelLoader::Load(std::string filename, Model& model, unsigned int loadFlag)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	m_stats = ModelLoadStats();
+	m_scratch.ResetStats();
+
+	model.Directory = filename.substr(0, filename.find_last_of('/'));
+	model.Format = m_options.Format;
+	m_modelDic = model.Directory;
+
+	m_indexInTextureLoader = 0;
+
+	const bool nativeObj = UseObjParser(filename);
+
+	MeshCacheKey cacheKey = GetCacheKey(filename, loadFlag, nativeObj);
+	std::string cacheName = filename + ".meshcache";
+	m_stats.ImportMs = ElapsedMs(start);
+	if (cacheKey.SourceHash != 0 && LoadFromCache(cacheName, cacheKey, model)) {
+		std::cout << "ModelLoader: " << filename << " loaded from mesh cache, map " << m_stats.ImportMs
+			<< " ms, upload " << m_stats.UploadMs << " ms" << std::endl;
+		ReleaseScratch();
+		PrintMemoryReport();
+		return true;
+	}
+
+	std::vector<MeshData> meshes;
+	SceneHierarchy hierarchy;
+	if (!ImportSource(filename, loadFlag, nativeObj, cacheKey, model.Directory, meshes, hierarchy)) {
+		ReleaseScratch();
+		return false;
+	}
+	m_stats.ImportMs = ElapsedMs(start);
+
+	model.Hierarchy = std::move(hierarchy);
+
+	start = std::chrono::high_resolution_clock::now();
+	PreloadTextures(meshes);
+	for (auto& data : meshes) {
+		CreateMesh(data.Vertices.data(), static_cast<UINT>(data.Vertices.size()), data.Tangents.empty() ? nullptr : data.Tangents.data(),
+			data.Indices.data(), static_cast<UINT>(data.Indices.size()), data.Textures, data.Submeshes, data.Lods, data.Instances, model);
+	}
+	m_stats.UploadMs = ElapsedMs(start);
+	m_stats.MeshCount = static_cast<UINT>(meshes.size());
+
+	std::cout << "ModelLoader: " << filename << " imported with " << (nativeObj ? "ObjParser" : "assimp")
+		<< " in " << m_stats.ImportMs << " ms (" << Throughput(m_stats.SourceBytes, m_stats.ImportMs - m_stats.PostPassMs)
+		<< " MB/s, post passes " << m_stats.PostPassMs << " ms), upload " << m_stats.UploadMs << " ms" << std::endl;
+	ReleaseScratch();
+	PrintMemoryReport();
+
+	return true;
+}
+
+bool ModelLoader::Import(const std::string& filename, std::vector<MeshData>& meshes, SceneHierarchy& hierarchy,
+	std::string& directory, unsigned int loadFlag)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	m_stats = ModelLoadStats();
+	m_scratch.ResetStats();
+
+	directory = filename.substr(0, filename.find_last_of('/'));
+	const bool nativeObj = UseObjParser(filename);
+	MeshCacheKey cacheKey = GetCacheKey(filename, loadFlag, nativeObj);
+
+	MeshCache cache;
+	const bool cacheOpened = cacheKey.SourceHash != 0 && cache.Open(filename + ".meshcache", cacheKey);
+	bool fromCache = cacheOpened;
+	if (cacheOpened) {
+		// The meshes outlive the mapping, so the arrays are copied out
+		directory = cache.GetDirectory();
+		hierarchy = cache.GetHierarchy();
+		meshes.resize(cache.GetEntries().size());
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			const MeshCache::Entry& entry = cache.GetEntries()[i];
+			MeshData& data = meshes[i];
+			if (cache.IsCompressed()) {
+				auto decodeStart = std::chrono::high_resolution_clock::now();
+				data.Vertices.resize(entry.VertexCount);
+				data.Indices.resize(entry.IndexCount);
+				data.Tangents.resize(entry.HasTangents ? entry.VertexCount : 0);
+				if (!MeshCache::Decode(entry, data.Vertices.data(), data.Indices.data(), data.Tangents.data())) {
+					// Same as Load, the source file is imported instead
+					std::cout << "ModelLoader: corrupted geometry in mesh cache of " << filename << std::endl;
+					fromCache = false;
+					break;
+				}
+				m_stats.Codec.DecodedBytes += sizeof(Vertex_Model) * data.Vertices.size() + sizeof(UINT) * data.Indices.size() +
+					sizeof(XMFLOAT4) * data.Tangents.size();
+				m_stats.Codec.DecodeMs += ElapsedMs(decodeStart);
+			}
+			else {
+				data.Vertices.assign(entry.Vertices, entry.Vertices + entry.VertexCount);
+				data.Indices.assign(entry.Indices, entry.Indices + entry.IndexCount);
+				if (entry.Tangents)
+					data.Tangents.assign(entry.Tangents, entry.Tangents + entry.VertexCount);
+			}
+			data.Textures = entry.Textures;
+			data.Submeshes = entry.Submeshes;
+			data.Lods = entry.Lods;
+			data.Instances = entry.Instances;
+			m_stats.SourceMeshCount += (std::max)(1u, static_cast<UINT>(entry.Submeshes.size()));
+		}
+		m_stats.FromCache = fromCache;
+	}
+	if (!fromCache) {
+		if (cacheOpened) {
+			// Unmapped first, the import writes a new cache over it
+			cache.Close();
+			meshes.clear();
+			hierarchy.Clear();
+			directory = filename.substr(0, filename.find_last_of('/'));
+			m_stats = ModelLoadStats();
+		}
+		if (!ImportSource(filename, loadFlag, nativeObj, cacheKey, directory, meshes, hierarchy))
+			return false;
+	}
+	m_stats.ImportMs = ElapsedMs(start);
+	m_stats.MeshCount = static_cast<UINT>(meshes.size());
+
+	std::cout << "ModelLoader: " << filename << (m_stats.FromCache ? " read from mesh cache" : " imported") << " in "
+		<< m_stats.ImportMs << " ms, " << meshes.size() << " meshes" << std::endl;
+	return true;
+}
+
+void ModelLoader::AddMesh(const MeshData& data, Model& model)
+{
+	m_modelDic = model.Directory;
+	CreateMesh(data.Vertices.data(), static_cast<UINT>(data.Vertices.size()), data.Tangents.empty() ? nullptr : data.Tangents.data(),
+		data.Indices.data(), static_cast<UINT>(data.Indices.size()), data.Textures, data.Submeshes, data.Lods, data.Instances, model);
+	// The arena stays allocated between the meshes of a stream, it goes with the loader
+	m_stats.Scratch = m_scratch.GetStats();
+}
+
+bool ModelLoader::ImportSource(const std::string& filename, unsigned int loadFlag, bool nativeObj, const MeshCacheKey& cacheKey,
+	const std::string& directory, std::vector<MeshData>& meshes, SceneHierarchy& hierarchy)
+{
+	// The welder replaces assimp's vertex joining, it runs on the raw meshes of either importer
+	const unsigned int importFlag = m_options.WeldVertices ? loadFlag & ~aiProcess_JoinIdenticalVertices : loadFlag;
+	bool result = nativeObj ? ImportWithObjParser(filename, importFlag, meshes) : ImportWithAssimp(filename, importFlag, meshes, hierarchy);
+	if (!result)
+		return false;
+	m_stats.SourceMeshCount = static_cast<UINT>(meshes.size());
+
+	if (m_options.WeldVertices) {
+		WeldStats& weld = m_stats.Weld;
+		VertexWelder::WeldMeshes(meshes, m_options.Weld, weld);
+		std::cout << "ModelLoader: welded " << weld.VerticesBefore << " vertices into " << weld.VerticesAfter << " ("
+			<< 100.0 * (weld.VerticesBefore - weld.VerticesAfter) / (std::max)(weld.VerticesBefore, UINT64(1)) << "% merged), "
+			<< weld.DegenerateTriangles << " of " << weld.TrianglesBefore << " triangles degenerate, "
+			<< weld.SkippedMeshes << " meshes skipped, " << weld.WeldMs << " ms" << std::endl;
+	}
+
+	RunPostPasses(meshes);
+	m_stats.NativeObj = nativeObj;
+
+	if (cacheKey.SourceHash != 0) {
+		std::string cacheName = filename + ".meshcache";
+		GeometryCodecStats& codec = m_stats.Codec;
+		if (!MeshCache::Write(cacheName, cacheKey, directory, meshes, hierarchy, m_options.CompressMeshCache, &codec))
+			std::cout << "ModelLoader: failed to write mesh cache " << cacheName << std::endl;
+		else if (m_options.CompressMeshCache)
+			std::cout << "ModelLoader: mesh cache geometry " << codec.RawBytes / 1024 << " KB -> " << codec.EncodedBytes / 1024
+				<< " KB (ratio " << double(codec.RawBytes) / (std::max)(codec.EncodedBytes, UINT64(1)) << ") in " << codec.EncodeMs << " ms" << std::endl;
+	}
+	return true;
+}
+
+// SourceHash stays 0 when the cache is off or the file can't be read
+MeshCacheKey ModelLoader::GetCacheKey(const std::string& filename, unsigned int loadFlag, bool nativeObj) const
+{
+	MeshCacheKey cacheKey;
+	if (m_options.UseMeshCache) {
+		cacheKey.SourceHash = MeshCache::HashFile(filename);
+		cacheKey.LoadFlags = loadFlag;
+		cacheKey.Options = GetCacheOptions(nativeObj);
+		if (!nativeObj)
+			cacheKey.StaticNodesHash = m_options.StaticScene ? 1 : HashStaticNodes(m_options.StaticNodes);
+		if (m_options.WeldVertices) {
+			cacheKey.WeldPositionEpsilon = m_options.Weld.PositionEpsilon;
+			cacheKey.WeldNormalEpsilon = m_options.Weld.NormalEpsilon;
+			cacheKey.WeldTexCoordEpsilon = m_options.Weld.TexCoordEpsilon;
+		}
+	}
+	return cacheKey;
+}
+
+uint32_t ModelLoader::GetCacheOptions(bool nativeObj) const
+{
+	uint32_t options = 0;
+	if (nativeObj)
+		options |= MeshCacheOption_NativeObj;
+	if (m_options.DeduplicateMeshes)
+		options |= MeshCacheOption_Dedupe;
+	if (m_options.Format == VertexFormat::FullTangent)
+		options |= MeshCacheOption_Tangents;
+	if (m_options.WeldVertices) {
+		options |= MeshCacheOption_Weld;
+		if (m_options.Weld.RemoveDegenerates)
+			options |= MeshCacheOption_WeldDegenerates;
+	}
+	if (m_options.MergeByMaterial)
+		options |= MeshCacheOption_MergeByMaterial;
+	if (m_options.OptimizeVertexCache)
+		options |= MeshCacheOption_VertexCache;
+	if (m_options.Use16BitIndices && m_options.Split16BitIndices)
+		options |= MeshCacheOption_Split16BitIndices;
+	if (m_options.LodCount > 0) {
+		options |= MeshCacheOption_Lods;
+		options |= (std::min)(m_options.LodCount, 255u) << MeshCacheOption_LodCountShift;
+		options |= static_cast<uint32_t>((std::min)(std::lround(m_options.LodReduction * 100.0f), 255l)) << MeshCacheOption_LodReductionShift;
+	}
+	return options;
+}
+
+void ModelLoader::RunPostPasses(std::vector<MeshData>& meshes)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if (m_options.DeduplicateMeshes) {
+		MeshDedupeStats& dedupe = m_stats.Dedupe;
+		MeshOptimizer::DeduplicateMeshes(meshes, dedupe);
+		// Every unique geometry gets one BLAS, the copies become TLAS instances
+		std::cout << "ModelLoader: " << dedupe.MeshesBefore << " meshes are " << dedupe.MeshesAfter << " unique geometries ("
+			<< dedupe.InstancedMeshes << " instanced), dedupe ratio " << double(dedupe.MeshesBefore) / (std::max)(dedupe.MeshesAfter, 1u)
+			<< ", geometry " << dedupe.BytesBefore / 1024 << " KB -> " << dedupe.BytesAfter / 1024 << " KB in "
+			<< dedupe.DedupeMs << " ms" << std::endl;
+	}
+
+	if (m_options.MergeByMaterial) {
+		MeshMergeStats merge;
+		MeshOptimizer::MergeByMaterial(meshes, merge);
+		// Each mesh is one draw, one BLAS and one hit group record
+		std::cout << "ModelLoader: merged " << merge.MeshesBefore << " meshes into " << merge.MeshesAfter
+			<< " in " << merge.MergeMs << " ms, draws/BLAS/hit groups " << merge.MeshesBefore << " -> " << merge.MeshesAfter
+			<< ", texture table switches " << merge.TexturedBefore << " -> " << merge.TexturedAfter << std::endl;
+	}
+
+	if (m_options.OptimizeVertexCache) {
+		// FIFO simulation at two common post-transform cache sizes, before and after the pass
+		const UINT kSimulatedCaches[2] = { 16, 32 };
+		std::vector<std::array<VertexCacheStats, 4>> report(meshes.size());
+		auto optimizeStart = std::chrono::high_resolution_clock::now();
+		ThreadPool::Default().ParallelFor(meshes.size(), [&](size_t i) {
+			MeshData& mesh = meshes[i];
+			const UINT vertexCount = static_cast<UINT>(mesh.Vertices.size());
+			report[i][0] = MeshOptimizer::AnalyzeVertexCache(mesh.Indices, vertexCount, kSimulatedCaches[0]);
+			report[i][1] = MeshOptimizer::AnalyzeVertexCache(mesh.Indices, vertexCount, kSimulatedCaches[1]);
+			MeshOptimizer::OptimizeVertexCache(mesh);
+			report[i][2] = MeshOptimizer::AnalyzeVertexCache(mesh.Indices, vertexCount, kSimulatedCaches[0]);
+			report[i][3] = MeshOptimizer::AnalyzeVertexCache(mesh.Indices, vertexCount, kSimulatedCaches[1]);
+		});
+		double optimizeMs = ElapsedMs(optimizeStart);
+
+		// Whole model figures, ACMR weighted by triangles and ATVR by vertices
+		size_t triangles = 0, vertices = 0;
+		double acmr[4] = {}, atvr[4] = {};
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			const size_t meshTriangles = meshes[i].Indices.size() / 3, meshVertices = meshes[i].Vertices.size();
+			triangles += meshTriangles;
+			vertices += meshVertices;
+			for (int k = 0; k < 4; ++k) {
+				acmr[k] += double(report[i][k].Acmr) * meshTriangles;
+				atvr[k] += double(report[i][k].Atvr) * meshVertices;
+			}
+		}
+		for (int k = 0; k < 4; ++k) {
+			acmr[k] /= (std::max)(triangles, size_t(1));
+			atvr[k] /= (std::max)(vertices, size_t(1));
+		}
+		std::cout << "ModelLoader: vertex cache pass " << optimizeMs << " ms for " << triangles << " triangles, ACMR "
+			<< acmr[0] << " -> " << acmr[2] << " (FIFO 16), " << acmr[1] << " -> " << acmr[3] << " (FIFO 32), ATVR "
+			<< atvr[1] << " -> " << atvr[3] << std::endl;
+	}
+
+	if (m_options.Use16BitIndices && m_options.Split16BitIndices) {
+		size_t before = meshes.size();
+		MeshOptimizer::SplitFor16BitIndices(meshes);
+		if (meshes.size() != before)
+			std::cout << "ModelLoader: split large meshes for 16 bit indices, " << before << " -> " << meshes.size() << " meshes" << std::endl;
+	}
+
+	if (m_options.LodCount > 0) {
+		// Per mesh stats merged afterwards, the levels only depend on their own mesh
+		std::vector<MeshLodStats> lodStats(meshes.size());
+		auto lodStart = std::chrono::high_resolution_clock::now();
+		ThreadPool::Default().ParallelFor(meshes.size(), [&](size_t i) {
+			MeshSimplifier::BuildLodChain(meshes[i], m_options.LodCount, m_options.LodReduction, lodStats[i]);
+		});
+		double lodMs = ElapsedMs(lodStart);
+
+		MeshLodStats& total = m_stats.Lods;
+		total.Triangles.assign(m_options.LodCount + 1, 0);
+		for (auto& stats : lodStats) {
+			for (size_t lod = 0; lod < stats.Triangles.size(); ++lod)
+				total.Triangles[lod] += stats.Triangles[lod];
+			total.InputTriangles += stats.InputTriangles;
+			total.SimplifyMs += stats.SimplifyMs;
+		}
+
+		std::cout << "ModelLoader: LOD chain in " << lodMs << " ms, " << total.InputTriangles / 1000.0 / (std::max)(lodMs, 1e-3)
+			<< " M input triangles/s (" << total.InputTriangles / 1000.0 / (std::max)(total.SimplifyMs, 1e-3)
+			<< " per thread), triangles per level";
+		for (size_t lod = 0; lod < total.Triangles.size(); ++lod)
+			std::cout << (lod == 0 ? " " : " / ") << total.Triangles[lod];
+		std::cout << std::endl;
+	}
+
+	// Last, the passes above reorder and merge vertices
+	if (m_options.Format == VertexFormat::FullTangent) {
+		TangentStats& tangents = m_stats.Tangents;
+		TangentGenerator::GenerateMeshes(meshes, tangents);
+		std::cout << "ModelLoader: tangent frames for " << tangents.Vertices << " vertices in " << tangents.GenerateMs << " ms";
+		if (tangents.AssimpMs > 0.0)
+			std::cout << " (aiProcess_CalcTangentSpace " << tangents.AssimpMs << " ms)";
+		std::cout << ", " << tangents.DegenerateTriangles << " of " << tangents.Triangles << " triangles without texture space, "
+			<< tangents.FallbackVertices << " vertices with a fallback frame" << std::endl;
+	}
+
+	m_stats.PostPassMs = ElapsedMs(start);
+}
+
+void ModelLoader::ReleaseScratch()
+{
+	m_stats.Scratch = m_scratch.GetStats();
+	m_scratch.Release();
+}
+
+void ModelLoader::PrintMemoryReport() const
+{
+	const ScratchArenaStats& scratch = m_stats.Scratch;
+	if (scratch.Allocations > 0) {
+		std::cout << "ModelLoader: scratch arena served " << scratch.Allocations << " allocations ("
+			<< scratch.BytesRequested / (1024 * 1024) << " MB) with " << scratch.BlockAllocations << " heap allocations, "
+			<< double(scratch.BlockAllocations) / (std::max)(m_stats.MeshCount, 1u) << " per mesh, peak "
+			<< scratch.PeakBytes / 1024 << " KB" << std::endl;
+	}
+
+	if (m_stats.IndexBytes32 > 0) {
+		std::cout << "ModelLoader: " << m_stats.ShortIndexMeshes << " of " << m_stats.MeshCount << " meshes use 16 bit indices, "
+			<< m_stats.IndexBytes / 1024 << " KB of indices (" << m_stats.IndexBytes32 / 1024 << " KB as 32 bit)" << std::endl;
+	}
+
+	if (m_stats.MeshletCount > 0) {
+		std::cout << "ModelLoader: " << m_stats.MeshletCount << " meshlets in " << m_stats.MeshletMs << " ms, "
+			<< double(m_stats.MeshletVertices) / m_stats.MeshletCount << " vertices and "
+			<< double(m_stats.MeshletTriangles) / m_stats.MeshletCount << " triangles on average, "
+			<< m_stats.MeshletCount * sizeof(Meshlet) / 1024 << " KB of bounds" << std::endl;
+	}
+
+	const VertexCompressionStats& c = m_stats.Compression;
+	if (m_options.Format == VertexFormat::Full || c.BytesBefore == 0)
+		return;
+
+	std::cout << "ModelLoader: compact vertices " << c.BytesBefore / 1024 << " KB -> " << c.BytesAfter / 1024
+		<< " KB (" << 100.0 - 100.0 * c.BytesAfter / c.BytesBefore << "% saved) in " << c.EncodeMs
+		<< " ms, max error position " << c.MaxPositionError << ", normal " << c.MaxNormalErrorDeg
+		<< " deg, texcoord " << c.MaxTexCoordError << std::endl;
+}
+
+bool ModelLoader::UseObjParser(const std::string& filename) const
+{
+	if (!m_options.UseNativeObjParser || filename.size() < 4)
+		return false;
+	std::string extension = filename.substr(filename.size() - 4);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == ".obj";
+}
+
+bool ModelLoader::ImportWithAssimp(const std::string& filename, unsigned int loadFlag, std::vector<MeshData>& meshes,
+	SceneHierarchy& hierarchy)
 {
 	Assimp::Importer m_importer;
 	const aiScene* pScene = m_importer.ReadFile(filename, loadFlag);
-	
+
 	if (!pScene || pScene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !pScene->mRootNode) {
 		std::cout << "ERROR::ASSIMP:: " << m_importer.GetErrorString() << std::endl;
 		return false;
 	}
 
+	// Meshes referenced by several nodes are converted once and instanced
+	std::vector<UINT> workItems;
+	std::vector<std::vector<MeshInstance>> meshNodes(pScene->mNumMeshes);
+	bool result;
+	result = ProcessNode(pScene->mRootNode, pScene, SceneHierarchy::kRoot, SceneHierarchy::kRoot, MeshInstance().Transform,
+		hierarchy, workItems, meshNodes);
+
+	// Every work item owns its slot, so the order in Model::Meshes doesn't depend on scheduling
+	meshes.resize(workItems.size());
+	for (size_t i = 0; i < workItems.size(); ++i)
+		meshes[i].Instances = meshNodes[workItems[i]];
+	auto convert = [&](size_t i) {
+		MeshData& mesh = meshes[i];
+		ProcessMesh(pScene->mMeshes[workItems[i]], pScene, mesh);
+		// A mesh placed once carries its static transform in the vertices, merging only takes untransformed ones
+		if (mesh.Instances.size() == 1) {
+			if (!IsIdentity(mesh.Instances[0].Transform)) {
+				BakeTransform(mesh.Instances[0].Transform, mesh);
+				mesh.Instances[0].Transform = MeshInstance().Transform;
+			}
+			if (mesh.Instances[0].Node == SceneHierarchy::kRoot)
+				mesh.Instances.clear();
+		}
+	};
+	if (m_options.ParallelProcessing) {
+		ThreadPool::Default().ParallelFor(workItems.size(), convert);
+	}
+	else {
+		for (size_t i = 0; i < workItems.size(); ++i)
+			convert(i);
+	}
 
-	model.Directory = filename.substr(0, filename.find_last_of('/'));
-	m_modelDic = model.Directory;
-
-	m_indexInTextureLoader = 0;
+	if (m_options.Format == VertexFormat::FullTangent && m_options.TimeAssimpTangents) {
+		// The result is thrown away, our frames are built after the post passes
+		auto start = std::chrono::high_resolution_clock::now();
+		m_importer.ApplyPostProcessing(aiProcess_CalcTangentSpace);
+		m_stats.Tangents.AssimpMs = ElapsedMs(start);
+	}
 
-	bool result;
-	result = ProcessNode(pScene->mRootNode, pScene, model);
+	std::ifstream source(filename, std::ios::binary | std::ios::ate);
+	if (source)
+		m_stats.SourceBytes = static_cast<UINT64>(source.tellg());
 
 	return result;
 }
 
+bool ModelLoader::ImportWithObjParser(const std::string& filename, unsigned int loadFlag, std::vector<MeshData>& meshes)
+{
+	ObjParser parser(loadFlag);
+	if (!parser.Parse(filename, meshes))
+		return false;
 
+	const ObjParseStats& stats = parser.GetStats();
+	m_stats.SourceBytes = stats.Bytes;
+	std::cout << "ObjParser: " << stats.ChunkCount << " chunks, parse " << stats.ParseMs << " ms ("
+		<< Throughput(stats.Bytes, stats.ParseMs) << " MB/s), build " << stats.BuildMs << " ms" << std::endl;
+	return true;
+}
 
-bool ModelLoader::ProcessNode(aiNode* ai_node, const aiScene* ai_scene, Model& model)
+bool ModelLoader::LoadFromCache(const std::string& cacheName, const MeshCacheKey& key, Model& model)
 {
-	for (UINT i = 0; i < ai_node->mNumMeshes; i++){
-		aiMesh* ai_mesh = ai_scene->mMeshes[ai_node->mMeshes[i]];
-		ProcessMesh(ai_mesh, ai_scene, model);
+	auto start = std::chrono::high_resolution_clock::now();
+
+	MeshCache cache;
+	if (!cache.Open(cacheName, key))
+		return false;
+	m_stats.ImportMs += ElapsedMs(start);
+
+	// Every entry is decoded before anything is created: a corrupted one leaves the model, the command list
+	// and the texture loader untouched and the caller imports the source file instead. The arrays go to
+	// scratch memory, they are only read while the upload heaps are filled.
+	start = std::chrono::high_resolution_clock::now();
+	const std::vector<MeshCache::Entry>& entries = cache.GetEntries();
+	std::vector<const Vertex_Model*> vertices(entries.size());
+	std::vector<const UINT*> indices(entries.size());
+	std::vector<const XMFLOAT4*> tangents(entries.size());
+	ScratchScope scratchScope(m_scratch);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const MeshCache::Entry& entry = entries[i];
+		if (!cache.IsCompressed()) {
+			vertices[i] = entry.Vertices;
+			indices[i] = entry.Indices;
+			tangents[i] = entry.Tangents;
+			continue;
+		}
+
+		auto decodeStart = std::chrono::high_resolution_clock::now();
+		Vertex_Model* decodedVertices = m_scratch.AllocateArray<Vertex_Model>(entry.VertexCount);
+		UINT* decodedIndices = m_scratch.AllocateArray<UINT>(entry.IndexCount);
+		XMFLOAT4* decodedTangents = entry.HasTangents ? m_scratch.AllocateArray<XMFLOAT4>(entry.VertexCount) : nullptr;
+		if (!MeshCache::Decode(entry, decodedVertices, decodedIndices, decodedTangents)) {
+			std::cout << "ModelLoader: corrupted geometry in mesh cache " << cacheName << std::endl;
+			m_stats.Codec = GeometryCodecStats();
+			return false;
+		}
+		m_stats.Codec.DecodedBytes += sizeof(Vertex_Model) * entry.VertexCount + sizeof(UINT) * entry.IndexCount +
+			(entry.HasTangents ? sizeof(XMFLOAT4) * entry.VertexCount : 0);
+		m_stats.Codec.DecodeMs += ElapsedMs(decodeStart);
+		vertices[i] = decodedVertices;
+		indices[i] = decodedIndices;
+		tangents[i] = decodedTangents;
 	}
 
-	for (UINT i = 0; i < ai_node->mNumChildren; i++){
-		ProcessNode(ai_node->mChildren[i], ai_scene, model);
+	// Buffer creation copies into the upload heaps, the mapping can go once we return
+	model.Directory = cache.GetDirectory();
+	m_modelDic = model.Directory;
+	model.Hierarchy = cache.GetHierarchy();
+	PreloadTextures(entries);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const MeshCache::Entry& entry = entries[i];
+		CreateMesh(vertices[i], entry.VertexCount, tangents[i], indices[i], entry.IndexCount, entry.Textures, entry.Submeshes, entry.Lods, entry.Instances, model);
+	}
+	m_stats.UploadMs = ElapsedMs(start);
+	if (cache.IsCompressed()) {
+		const GeometryCodecStats& codec = m_stats.Codec;
+		std::cout << "ModelLoader: decoded " << codec.DecodedBytes / 1024 << " KB of cached geometry in " << codec.DecodeMs << " ms ("
+			<< Throughput(codec.DecodedBytes, codec.DecodeMs) << " MB/s), part of the upload" << std::endl;
 	}
+	m_stats.MeshCount = static_cast<UINT>(cache.GetEntries().size());
+	for (auto& entry : cache.GetEntries())
+		m_stats.SourceMeshCount += (std::max)(1u, static_cast<UINT>(entry.Submeshes.size()));
+	m_stats.FromCache = true;
 
 	return true;
 }
 
-bool ModelLoader::ProcessMesh(aiMesh* ai_mesh, const aiScene* ai_scene, Model& model)
+bool ModelLoader::OpenPaged(const std::string& filename, Model& model, GeometryStore& store, unsigned int loadFlag)
 {
-	// Data to fill
-	std::vector<Vertex_Model> vertices;
-	std::vector<UINT> indices;
-	//std::vector<Texture> textures;
-
-	// Walk through each of the mesh's vertices
-	for (UINT i = 0; i < ai_mesh->mNumVertices; i++)
-	{
-		Vertex_Model vertex;
+	auto start = std::chrono::high_resolution_clock::now();
+	m_stats = ModelLoadStats();
+	m_scratch.ResetStats();
+	model.Format = m_options.Format;
+	m_indexInTextureLoader = 0;
 
-		vertex.Position.x = ai_mesh->mVertices[i].x ;
-		vertex.Position.y = ai_mesh->mVertices[i].y ;
-		vertex.Position.z = ai_mesh->mVertices[i].z ;
+	const bool nativeObj = UseObjParser(filename);
+	MeshCacheKey cacheKey = GetCacheKey(filename, loadFlag, nativeObj);
+	if (cacheKey.SourceHash == 0) {
+		std::cout << "ModelLoader: paged loading needs the mesh cache, " << filename << " can't be read or the cache is off" << std::endl;
+		return false;
+	}
 
-		if (ai_mesh->HasNormals()){
-			vertex.Normal.x = ai_mesh->mNormals[i].x;
-			vertex.Normal.y = ai_mesh->mNormals[i].y;
-			vertex.Normal.z = ai_mesh->mNormals[i].z;
+	const std::string cacheName = filename + ".meshcache";
+	if (!store.Open(cacheName, cacheKey)) {
+		// First run, the source is imported once to write the page file and none of it is kept
+		std::vector<MeshData> meshes;
+		SceneHierarchy hierarchy;
+		if (!ImportSource(filename, loadFlag, nativeObj, cacheKey, filename.substr(0, filename.find_last_of('/')), meshes, hierarchy)) {
+			ReleaseScratch();
+			return false;
 		}
-
-		if (ai_mesh->HasTextureCoords(0))
-		{
-			vertex.TexCoord.x = (float)ai_mesh->mTextureCoords[0][i].x;
-			vertex.TexCoord.y = (float)ai_mesh->mTextureCoords[0][i].y;
+		meshes.clear();
+		if (!store.Open(cacheName, cacheKey)) {
+			std::cout << "ModelLoader: failed to open page file " << cacheName << std::endl;
+			ReleaseScratch();
+			return false;
 		}
+	}
 
-		vertices.push_back(vertex);
+	const MeshCache& cache = store.GetCache();
+	model.Directory = cache.GetDirectory();
+	m_modelDic = model.Directory;
+	model.Hierarchy = cache.GetHierarchy();
+
+	// Every page gets its slot with textures, placements and bounds, the buffers come with UploadPage
+	PreloadTextures(cache.GetEntries());
+	UINT64 geometryBytes = 0;
+	for (UINT i = 0; i < cache.GetEntries().size(); ++i) {
+		ScratchScope scratchScope(m_scratch);
+		const MeshCache::Entry& entry = cache.GetEntries()[i];
+		std::unique_ptr<Mesh> mesh = std::make_unique<Mesh>();
+		DescribeMesh(entry.VertexCount, entry.HasTangents, entry.IndexCount, entry.Submeshes, entry.Lods, entry.Instances, *mesh);
+		mesh->BoundsMin = entry.BoundsMin;
+		mesh->BoundsMax = entry.BoundsMax;
+		mesh->BoundsCenter = XMFLOAT3((entry.BoundsMin.x + entry.BoundsMax.x) * 0.5f, (entry.BoundsMin.y + entry.BoundsMax.y) * 0.5f,
+			(entry.BoundsMin.z + entry.BoundsMax.z) * 0.5f);
+		mesh->BoundsRadius = entry.BoundsRadius;
+		store.SetPageBytes(i, UINT64(mesh->VertexBufferByteSize) + mesh->IndexBufferByteSize);
+		geometryBytes += UINT64(mesh->VertexBufferByteSize) + mesh->IndexBufferByteSize;
+		AddToModel(std::move(mesh), entry.Textures, model);
+		m_stats.SourceMeshCount += (std::max)(1u, static_cast<UINT>(entry.Submeshes.size()));
 	}
+	m_stats.MeshCount = static_cast<UINT>(cache.GetEntries().size());
+	m_stats.FromCache = true;
+	m_stats.ImportMs = ElapsedMs(start);
+	ReleaseScratch();
 
-	//index
-	for (UINT i = 0; i < ai_mesh->mNumFaces; i++){
-		aiFace ai_face = ai_mesh->mFaces[i];
+	std::cout << "ModelLoader: " << filename << " paged, " << m_stats.MeshCount << " pages with " << geometryBytes / (1024 * 1024)
+		<< " MB of buffers, " << model.Textures.size() << " textures resident, " << m_stats.ImportMs << " ms" << std::endl;
+	return true;
+}
+
+void ModelLoader::UploadPage(const GeometryPageData& page, Mesh& mesh)
+{
+	UploadGeometry(page.Vertices.data(), page.Tangents.empty() ? nullptr : page.Tangents.data(), page.Indices.data(),
+		static_cast<UINT>(page.Indices.size()), mesh);
+	m_stats.Scratch = m_scratch.GetStats();
+}
+
+bool ModelLoader::ProcessNode(aiNode* ai_node, const aiScene* ai_scene, UINT parent, UINT meshNode, const XMFLOAT4X4& transform,
+	SceneHierarchy& hierarchy, std::vector<UINT>& meshOrder, std::vector<std::vector<MeshInstance>>& meshNodes)
+{
+	// assimp stores column vector matrices, the renderer uses row vectors
+	XMFLOAT4X4 local;
+	XMStoreFloat4x4(&local, XMMatrixTranspose(XMLoadFloat4x4(reinterpret_cast<const XMFLOAT4X4*>(&ai_node->mTransformation.a1))));
+	UINT node = hierarchy.AddNode(parent, local);
+
+	// A node that never moves hands its meshes to meshNode and its transform to theirs
+	MeshInstance placement;
+	placement.Node = node;
+	if (m_options.StaticScene || m_options.StaticNodes.count(ai_node->mName.C_Str()) != 0) {
+		placement.Node = meshNode;
+		XMStoreFloat4x4(&placement.Transform, XMLoadFloat4x4(&local) * XMLoadFloat4x4(&transform));
+	}
 
-		for (UINT j = 0; j < ai_face.mNumIndices; j++)
-			indices.push_back(ai_face.mIndices[j]);
+	for (UINT i = 0; i < ai_node->mNumMeshes; i++){
+		std::vector<MeshInstance>& nodes = meshNodes[ai_node->mMeshes[i]];
+		if (nodes.empty())
+			meshOrder.push_back(ai_node->mMeshes[i]);
+		nodes.push_back(placement);
 	}
 
+	for (UINT i = 0; i < ai_node->mNumChildren; i++){
+		ProcessNode(ai_node->mChildren[i], ai_scene, node, placement.Node, placement.Transform, hierarchy, meshOrder, meshNodes);
+	}
 
-	std::unique_ptr<Mesh> mesh = std::make_unique<Mesh>();;
-	const UINT vertexBufferSize = sizeof(Vertex_Model) * vertices.size();
-	mesh->VertexBufferByteSize = vertexBufferSize;
-	mesh->VertexByteStride = sizeof(Vertex_Model);
-	mesh->VertexCount = vertices.size();
-	mesh->VertexBufferGPU = helper::CreateDefaultBuffer(m_device, m_cmdList, vertices.data(), vertexBufferSize, mesh->VertexBufferUploader);
+	return true;
+}
 
-	const UINT indexBufferSize = static_cast<UINT>(indices.size()) * sizeof(UINT32);
-	mesh->IndexBufferByteSize = indexBufferSize;
-	mesh->IndexCount = indices.size();
-	mesh->IndexBufferGPU = helper::CreateDefaultBuffer(m_device, m_cmdList, indices.data(), indexBufferSize, mesh->IndexBufferUploader);
+bool ModelLoader::ProcessMesh(aiMesh* ai_mesh, const aiScene* ai_scene, MeshData& data)
+{
+	const size_t vertexCount = ai_mesh->mNumVertices;
+	const aiVector3D* normals = ai_mesh->HasNormals() ? ai_mesh->mNormals : nullptr;
+	const aiVector3D* texCoords = ai_mesh->HasTextureCoords(0) ? ai_mesh->mTextureCoords[0] : nullptr;
+
+	data.Vertices.resize(vertexCount);
+	if (vertexCount > 0) {
+		// Large scans are split across the pool, this runs inline when meshes are already converted in parallel
+		size_t taskCount = (vertexCount + kVerticesPerTask - 1) / kVerticesPerTask;
+		auto convert = [&](size_t task) {
+			size_t begin = task * kVerticesPerTask;
+			size_t end = (std::min)(begin + kVerticesPerTask, vertexCount);
+			ConvertVertices(ai_mesh->mVertices, normals, texCoords, begin, end, vertexCount, data.Vertices.data());
+		};
+		if (m_options.ParallelProcessing) {
+			ThreadPool::Default().ParallelFor(taskCount, convert);
+		}
+		else {
+			for (size_t task = 0; task < taskCount; ++task)
+				convert(task);
+		}
+	}
 
-	std::vector<UINT> indexInModelTextures{};
+	//index
+	FlattenFaces(ai_mesh->mFaces, ai_mesh->mNumFaces, data.Indices);
 
 	if (ai_mesh->mMaterialIndex >= 0)
 	{
@@ -109,68 +793,203 @@ bool ModelLoader::ProcessMesh(aiMesh* ai_mesh, const aiScene* ai_scene, Model& m
 		//if (m_textureType.empty())
 		//	m_textureType = DetermineTextureType(ai_scene, ai_material);
 
-		std::vector<std::shared_ptr<Texture>> diffuseMaps;
-		LoadMaterialTextures(ai_material,aiTextureType_DIFFUSE, "texture_diffuse", ai_scene, diffuseMaps);
-		model.Textures.insert(model.Textures.end(),diffuseMaps.begin(),diffuseMaps.end());
-		for (int i = 0; i < diffuseMaps.size(); i++) {
-			indexInModelTextures.push_back(m_indexInTextureLoader++);
-		}
+		CollectMaterialTextures(ai_material, aiTextureType_DIFFUSE, "texture_diffuse", data.Textures);
+		CollectMaterialTextures(ai_material, aiTextureType_SPECULAR, "texture_specular", data.Textures);
+	}
+
+	return true;
+}
+
+void ModelLoader::CreateMesh(const Vertex_Model* vertices, UINT vertexCount, const XMFLOAT4* tangents, const UINT* indices, UINT indexCount,
+	const std::vector<TextureRef>& textureRefs, const std::vector<SubmeshGeometry>& submeshes,
+	const std::vector<MeshLod>& lods, const std::vector<MeshInstance>& instances, Model& model)
+{
+	// Everything the upload needs only until the data is in the upload heaps comes from the scratch arena
+	ScratchScope scratchScope(m_scratch);
+
+	std::unique_ptr<Mesh> mesh = std::make_unique<Mesh>();
+	DescribeMesh(vertexCount, tangents != nullptr, indexCount, submeshes, lods, instances, *mesh);
+	UploadGeometry(vertices, tangents, indices, indexCount, *mesh);
+	AddToModel(std::move(mesh), textureRefs, model);
+}
+
+void ModelLoader::DescribeMesh(UINT vertexCount, bool hasTangents, UINT indexCount, const std::vector<SubmeshGeometry>& submeshes,
+	const std::vector<MeshLod>& lods, const std::vector<MeshInstance>& instances, Mesh& mesh) const
+{
+	// Meshes imported before the tangent pass existed have none, they keep the plain layout
+	const VertexFormat format = m_options.Format == VertexFormat::FullTangent && !hasTangents ? VertexFormat::Full : m_options.Format;
+	const UINT stride = VertexCompression::GetStride(format);
+	mesh.VertexBufferByteSize = stride * vertexCount;
+	mesh.VertexByteStride = stride;
+	mesh.VertexCount = vertexCount;
+	mesh.Format = format;
+
+	// 16 bit indices when every vertex is addressable, the buffer is padded to whole dwords
+	// because Hit.hlsl fetches the indices of a triangle with aligned 32 bit loads
+	const bool shortIndices = m_options.Use16BitIndices && vertexCount <= 65536;
+	mesh.IndexFormat = shortIndices ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+	mesh.IndexBufferByteSize = shortIndices ? ((indexCount + 1) & ~1u) * sizeof(UINT16) : indexCount * sizeof(UINT32);
+	mesh.IndexCount = lods.empty() ? indexCount : lods[0].IndexCount;
+	mesh.Lods = lods;
+	mesh.Instances = instances;
+	if (mesh.Instances.empty())
+		mesh.Instances.push_back(MeshInstance());
+
+	mesh.Submeshes = submeshes;
+	if (mesh.Submeshes.empty()) {
+		SubmeshGeometry whole;
+		whole.IndexCount = mesh.IndexCount;
+		whole.VertexCount = vertexCount;
+		mesh.Submeshes.push_back(whole);
+	}
+}
 
-		std::vector<std::shared_ptr<Texture>> specMaps;
-		LoadMaterialTextures(ai_material, aiTextureType_SPECULAR, "texture_specular", ai_scene, specMaps);
-		model.Textures.insert(model.Textures.end(), specMaps.begin(), specMaps.end());
-		for (int i = 0; i < specMaps.size(); i++) {
-			indexInModelTextures.push_back(m_indexInTextureLoader++);
+void ModelLoader::UploadGeometry(const Vertex_Model* vertices, const XMFLOAT4* tangents, const UINT* indices, UINT indexCount, Mesh& mesh)
+{
+	ScratchScope scratchScope(m_scratch);
+
+	const UINT vertexCount = mesh.VertexCount;
+	const VertexFormat format = mesh.Format;
+	const UINT stride = mesh.VertexByteStride;
+	const void* vertexData = vertices;
+	if (format == VertexFormat::FullTangent) {
+		UINT8* interleaved = m_scratch.AllocateArray<UINT8>(size_t(vertexCount) * stride);
+		VertexCompression::Encode(vertices, vertexCount, format, mesh.Quantization, interleaved, tangents);
+		vertexData = interleaved;
+	}
+	else if (format != VertexFormat::Full) {
+		auto start = std::chrono::high_resolution_clock::now();
+		if (format == VertexFormat::CompactQuantized)
+			mesh.Quantization = VertexCompression::ComputeQuantization(vertices, vertexCount);
+		UINT8* encoded = m_scratch.AllocateArray<UINT8>(size_t(vertexCount) * stride);
+		VertexCompression::Encode(vertices, vertexCount, format, mesh.Quantization, encoded);
+		m_stats.Compression.EncodeMs += ElapsedMs(start);
+		VertexCompression::Measure(vertices, vertexCount, encoded, format, mesh.Quantization, m_stats.Compression);
+		vertexData = encoded;
+	}
+	mesh.VertexBufferGPU = helper::CreateDefaultBuffer(m_device, m_cmdList, vertexData, mesh.VertexBufferByteSize, mesh.VertexBufferUploader);
+
+	const void* indexData = indices;
+	if (mesh.IndexFormat == DXGI_FORMAT_R16_UINT) {
+		const UINT paddedCount = (indexCount + 1) & ~1u;
+		UINT16* shortIndexData = m_scratch.AllocateArray<UINT16>(paddedCount);
+		for (UINT i = 0; i < indexCount; ++i)
+			shortIndexData[i] = static_cast<UINT16>(indices[i]);
+		if (paddedCount > indexCount)
+			shortIndexData[indexCount] = 0;
+		indexData = shortIndexData;
+		++m_stats.ShortIndexMeshes;
+	}
+	m_stats.IndexBytes += mesh.IndexBufferByteSize;
+	m_stats.IndexBytes32 += indexCount * sizeof(UINT32);
+	mesh.IndexBufferGPU = helper::CreateDefaultBuffer(m_device, m_cmdList, indexData, mesh.IndexBufferByteSize, mesh.IndexBufferUploader);
+
+	if (vertexCount > 0) {
+		XMFLOAT3 lo = vertices[0].Position, hi = lo;
+		for (UINT i = 1; i < vertexCount; ++i) {
+			const XMFLOAT3& p = vertices[i].Position;
+			lo = XMFLOAT3((std::min)(lo.x, p.x), (std::min)(lo.y, p.y), (std::min)(lo.z, p.z));
+			hi = XMFLOAT3((std::max)(hi.x, p.x), (std::max)(hi.y, p.y), (std::max)(hi.z, p.z));
 		}
+		XMFLOAT3 center((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+		float radiusSq = 0.0f;
+		for (UINT i = 0; i < vertexCount; ++i) {
+			const XMFLOAT3& p = vertices[i].Position;
+			float dx = p.x - center.x, dy = p.y - center.y, dz = p.z - center.z;
+			radiusSq = (std::max)(radiusSq, dx * dx + dy * dy + dz * dz);
+		}
+		mesh.BoundsMin = lo;
+		mesh.BoundsMax = hi;
+		mesh.BoundsCenter = center;
+		mesh.BoundsRadius = std::sqrt(radiusSq);
+	}
+
+	if (m_options.BuildMeshlets) {
+		auto start = std::chrono::high_resolution_clock::now();
+		MeshOptimizer::BuildMeshlets(vertices, vertexCount, indices, mesh.IndexCount, mesh.Meshlets);
+		m_stats.MeshletMs += ElapsedMs(start);
+		m_stats.MeshletCount += mesh.Meshlets.size();
+		m_stats.MeshletTriangles += mesh.IndexCount / 3;
+		for (auto& meshlet : mesh.Meshlets)
+			m_stats.MeshletVertices += meshlet.VertexCount;
+	}
+}
+
+void ModelLoader::AddToModel(std::unique_ptr<Mesh> mesh, const std::vector<TextureRef>& textureRefs, Model& model)
+{
+	std::vector<UINT> indexInModelTextures{};
 
+	std::vector<std::shared_ptr<Texture>> maps;
+	LoadMaterialTextures(textureRefs, maps);
+	model.Textures.insert(model.Textures.end(), maps.begin(), maps.end());
+	for (int i = 0; i < maps.size(); i++) {
+		indexInModelTextures.push_back(m_indexInTextureLoader++);
 	}
+
 	//model.Meshes[std::move(mesh)] = indexInModelTextures;
 	model.Meshes.push_back({ std::move(mesh),indexInModelTextures });
-
-	return true;
 }
 
-bool ModelLoader::LoadMaterialTextures(aiMaterial* ai_mat, aiTextureType ai_texType, 
-	std::string typeName, const aiScene* ai_scene, std::vector<std::shared_ptr<Texture>>& textures)
+void ModelLoader::CollectMaterialTextures(aiMaterial* ai_mat, aiTextureType ai_texType, std::string typeName,
+	std::vector<TextureRef>& textureRefs)
 {
-	bool result = false;
-	std::vector<std::shared_ptr<Texture>>& textureLoaded = m_textureLoader->GetTextureLoaded();
 	for (UINT i = 0; i < ai_mat->GetTextureCount(ai_texType); i++)
 	{
 		aiString str;
 		ai_mat->GetTexture(ai_texType, i, &str);
-		// Check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-		bool skip = false;
+		textureRefs.push_back({ typeName, std::string(str.C_Str()) });
+	}
+}
 
-		for (UINT j = 0; j < textureLoaded.size(); j++)
-		{
-			std::string tempstr = m_modelDic + "/" + std::string(str.C_Str());
-			if (std::strcmp(textureLoaded[j]->FileName.c_str(), tempstr.c_str()) == 0)
-			{
-				textures.push_back(textureLoaded[j]);
-				skip = true; // A texture with the same filepath has already been loaded, continue to next one. (optimization)
-				break;
-			}
-		}
+bool ModelLoader::LoadMaterialTextures(const std::vector<TextureRef>& textureRefs, std::vector<std::shared_ptr<Texture>>& textures)
+{
+	for (auto& ref : textureRefs)
+	{
+		// One path buffer for the whole session, it stops reallocating once it fits the longest name
+		m_texturePath.assign(m_modelDic).append("/").append(ref.FileName);
 
-		if (!skip)
+		// Check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
+		std::shared_ptr<Texture> texture = m_textureLoader->Find(m_texturePath);
+		if (!texture)
 		{   // If texture hasn't been loaded already, load it
-			std::shared_ptr<Texture> texture = std::make_shared<Texture>();
-			texture->Type = typeName;
-
-			std::string filename = std::string(str.C_Str());
-			filename = m_modelDic + "/" + filename;
+			texture = std::make_shared<Texture>();
+			texture->Type = ref.Type;
 
-			result = m_textureLoader->Load(filename,texture);
-			if (!result){
+			// The pixels only have to last until the copy is recorded, CreateMesh rewinds the arena
+			if (!m_textureLoader->Load(m_texturePath, texture, &m_scratch)){
 				return false;
 			}
-			textures.push_back(texture);
 		}
+		textures.push_back(texture);
 	}
 	return true;
 }
 
+template <typename MeshSource>
+void ModelLoader::PreloadTextures(const std::vector<MeshSource>& meshes)
+{
+	if (!m_options.ParallelTextureDecode)
+		return;
+
+	// Mesh order, so the textures land in the loader and the heap in the order the serial path uses
+	std::vector<TextureRequest> requests;
+	for (auto& mesh : meshes) {
+		for (auto& ref : mesh.Textures)
+			requests.push_back({ m_modelDic + "/" + ref.FileName, ref.Type });
+	}
+
+	std::unique_ptr<ThreadPool> ownPool;
+	if (m_options.TextureThreads != 0)
+		ownPool = std::make_unique<ThreadPool>(m_options.TextureThreads);
+	ThreadPool& pool = ownPool ? *ownPool : ThreadPool::Default();
+
+	TextureBatchStats& stats = m_stats.TextureBatch;
+	m_textureLoader->LoadBatch(requests, pool, &stats);
+	std::cout << "ModelLoader: " << stats.Decoded << " textures (" << stats.DecodedBytes / (1024 * 1024) << " MB) decoded on "
+		<< stats.Threads << " threads in " << stats.DecodeMs << " ms, uploads recorded in " << stats.UploadMs << " ms, "
+		<< stats.Reused << " shared, " << stats.Failed << " failed" << std::endl;
+}
+
 std::string ModelLoader::DetermineTextureType(const aiScene* ai_scene, aiMaterial* ai_mat)
 {
 	aiString textypeStr;
@@ -10,10 +10,102 @@
 #include "assimp/Importer.hpp"
 #include "assimp/scene.h"
 #include "assimp/postprocess.h"
+#include "VertexCompression.h"
+#include "MeshSimplifier.h"
+#include "MeshOptimizer.h"
+#include "ScratchArena.h"
+#include "VertexWelder.h"
+#include "TangentGenerator.h"
+#include "GeometryCodec.h"
+#include "TextureLoader.h"
+#include <unordered_set>
 
 struct Model;
 struct Mesh;
-class TextureLoader;
+struct MeshData;
+struct TextureRef;
+struct SubmeshGeometry;
+struct MeshLod;
+struct MeshInstance;
+struct Vertex_Model;
+struct MeshCacheKey;
+class SceneHierarchy;
+class GeometryStore;
+struct GeometryPageData;
+
+struct ModelLoadOptions
+{
+	// Reuse/write "<model>.meshcache" next to the source file
+	bool UseMeshCache = true;
+	// Store the cached geometry as GeometryCodec streams, decoded mesh by mesh right before upload
+	bool CompressMeshCache = true;
+	// Convert the collected meshes on the thread pool instead of during the node walk
+	bool ParallelProcessing = true;
+	// Decode every texture of the model with TextureLoader::LoadBatch before the meshes are created,
+	// on TextureThreads threads, 0 uses the shared pool
+	bool ParallelTextureDecode = true;
+	UINT TextureThreads = 0;
+	// Read .obj files with ObjParser instead of assimp
+	bool UseNativeObjParser = true;
+	// Weld with VertexWelder after the raw import, aiProcess_JoinIdenticalVertices is dropped from the load flags
+	bool WeldVertices = true;
+	WeldOptions Weld;
+	// Keep one copy of meshes that are translated/rotated duplicates and instance it
+	bool DeduplicateMeshes = true;
+	// Merge meshes sharing a texture set into one buffer with submesh ranges
+	bool MergeByMaterial = true;
+	// Forsyth triangle order and first use vertex order, prints ACMR/ATVR of the whole model
+	bool OptimizeVertexCache = true;
+	// GPU vertex layout, the compact ones are encoded during upload. FullTangent adds tangent frames,
+	// generated as the last post pass and stored in the mesh cache.
+	VertexFormat Format = VertexFormat::Full;
+	// Also runs aiProcess_CalcTangentSpace on assimp imports with FullTangent, only to compare the timings
+	bool TimeAssimpTangents = false;
+	// R16_UINT index buffers for meshes with at most 65536 vertices
+	bool Use16BitIndices = true;
+	// Split bigger meshes into pieces that fit 16 bit indices, costs extra draws and BLAS
+	bool Split16BitIndices = false;
+	// Meshlets with bounds for cluster culling, built during upload from the final index order
+	bool BuildMeshlets = true;
+	// Simplified levels per mesh, each with LodReduction of the previous triangle count, 0 disables
+	UINT LodCount = 3;
+	float LodReduction = 0.5f;
+	// Names of assimp nodes the application never moves. Meshes below static nodes are attached to the
+	// closest ancestor that isn't one, with the static transforms in between baked into the vertices of
+	// meshes placed once or kept as the instance transform of the others, so merging can group them.
+	// Every other mesh stays on its own node and follows it when it is animated.
+	std::unordered_set<std::string> StaticNodes;
+	// Every assimp node counts as static, only the hierarchy root above them can move
+	bool StaticScene = false;
+};
+
+struct ModelLoadStats
+{
+	bool	FromCache = false;
+	bool	NativeObj = false;
+	UINT	MeshCount = 0;
+	UINT	SourceMeshCount = 0;	// before merging, equals MeshCount without it
+	UINT64	SourceBytes = 0;
+	double	ImportMs = 0.0;		// assimp import or ObjParser + mesh conversion, or cache mapping
+	double	PostPassMs = 0.0;	// merging and optimization passes, part of ImportMs
+	double	UploadMs = 0.0;		// buffer creation and texture loading
+	TextureBatchStats TextureBatch;	// part of UploadMs, empty without ParallelTextureDecode
+	VertexCompressionStats Compression;
+	UINT	ShortIndexMeshes = 0;
+	UINT64	IndexBytes = 0;
+	UINT64	IndexBytes32 = 0;		// the same indices stored as 32 bit
+	UINT64	MeshletCount = 0;
+	UINT64	MeshletVertices = 0;	// sum over meshlets, vertices shared by two meshlets count twice
+	UINT64	MeshletTriangles = 0;
+	double	MeshletMs = 0.0;
+	MeshLodStats Lods;			// empty when the model came from the cache
+	MeshDedupeStats Dedupe;		// same
+	WeldStats Weld;				// same
+	TangentStats Tangents;		// same
+	GeometryCodecStats Codec;	// encoding when the cache was written, decoding when it was read
+	ScratchArenaStats Scratch;	// per mesh temporaries and decoded texture pixels
+};
+
 class ModelLoader
 {
 public:
@@ -24,10 +116,52 @@ public:
 	bool Load(std::string filename, Model& model,
 		unsigned int loadFlag = aiProcess_JoinIdenticalVertices | aiProcess_Triangulate | aiProcess_ConvertToLeftHanded);
 
+	// Load split for streaming. Import only does CPU work (mesh cache or source file, post passes) and may
+	// run on another thread, AddMesh creates the buffers and textures of one mesh on the command list.
+	bool Import(const std::string& filename, std::vector<MeshData>& meshes, SceneHierarchy& hierarchy, std::string& directory,
+		unsigned int loadFlag = aiProcess_JoinIdenticalVertices | aiProcess_Triangulate | aiProcess_ConvertToLeftHanded);
+	void AddMesh(const MeshData& data, Model& model);
+
+	// Out-of-core loading with the mesh cache as page file, imported from the source on the first run.
+	// Every mesh gets its slot in model with textures, placements and bounds but no buffers, UploadPage
+	// creates them when store pages the mesh in.
+	bool OpenPaged(const std::string& filename, Model& model, GeometryStore& store,
+		unsigned int loadFlag = aiProcess_JoinIdenticalVertices | aiProcess_Triangulate | aiProcess_ConvertToLeftHanded);
+	void UploadPage(const GeometryPageData& page, Mesh& mesh);
+
+	void SetOptions(const ModelLoadOptions& options) { m_options = options; }
+	const ModelLoadStats& GetLoadStats() const { return m_stats; }
+
 private:
 	// Process Assimp Scene Node and Mesh
-	bool ProcessNode(aiNode* ai_node, const aiScene* ai_scene, Model& model);
-	bool ProcessMesh(aiMesh* ai_mesh, const aiScene* ai_scene, Model& model);
+	// The node walk builds the hierarchy and collects the nodes of every mesh, ProcessMesh is safe to run concurrently.
+	// Meshes are attached to their own node, or to meshNode, the closest ancestor that isn't static, with
+	// transform, the static transforms from meshNode down to this node.
+	bool ProcessNode(aiNode* ai_node, const aiScene* ai_scene, UINT parent, UINT meshNode, const XMFLOAT4X4& transform,
+		SceneHierarchy& hierarchy, std::vector<UINT>& meshOrder, std::vector<std::vector<MeshInstance>>& meshNodes);
+	bool ProcessMesh(aiMesh* ai_mesh, const aiScene* ai_scene, MeshData& data);
+	bool ImportWithAssimp(const std::string& filename, unsigned int loadFlag, std::vector<MeshData>& meshes, SceneHierarchy& hierarchy);
+	bool ImportWithObjParser(const std::string& filename, unsigned int loadFlag, std::vector<MeshData>& meshes);
+	bool UseObjParser(const std::string& filename) const;
+	// CPU passes between import and upload, their output is what the mesh cache stores
+	void RunPostPasses(std::vector<MeshData>& meshes);
+	bool ImportSource(const std::string& filename, unsigned int loadFlag, bool nativeObj, const MeshCacheKey& cacheKey,
+		const std::string& directory, std::vector<MeshData>& meshes, SceneHierarchy& hierarchy);
+	uint32_t GetCacheOptions(bool nativeObj) const;
+	MeshCacheKey GetCacheKey(const std::string& filename, unsigned int loadFlag, bool nativeObj) const;
+	void PrintMemoryReport() const;
+	void ReleaseScratch();
+
+	bool LoadFromCache(const std::string& cacheName, const MeshCacheKey& key, Model& model);
+	void CreateMesh(const Vertex_Model* vertices, UINT vertexCount, const XMFLOAT4* tangents, const UINT* indices, UINT indexCount,
+		const std::vector<TextureRef>& textureRefs, const std::vector<SubmeshGeometry>& submeshes,
+		const std::vector<MeshLod>& lods, const std::vector<MeshInstance>& instances, Model& model);
+	// Layout, sizes and ranges of the buffers, everything known without the arrays
+	void DescribeMesh(UINT vertexCount, bool hasTangents, UINT indexCount, const std::vector<SubmeshGeometry>& submeshes,
+		const std::vector<MeshLod>& lods, const std::vector<MeshInstance>& instances, Mesh& mesh) const;
+	// Buffers, bounds and meshlets of a described mesh
+	void UploadGeometry(const Vertex_Model* vertices, const XMFLOAT4* tangents, const UINT* indices, UINT indexCount, Mesh& mesh);
+	void AddToModel(std::unique_ptr<Mesh> mesh, const std::vector<TextureRef>& textureRefs, Model& model);
 
 	ID3D12Device* m_device;
 	ID3D12GraphicsCommandList* m_cmdList;
@@ -35,10 +169,18 @@ private:
 	std::string m_textureType;
 	std::string m_modelDic;
 	int			m_indexInTextureLoader = 0;
+	ModelLoadOptions m_options;
+	ModelLoadStats	 m_stats;
+	// Temporaries of the load session, CreateMesh rewinds it for every mesh and Load releases it
+	ScratchArena	 m_scratch;
+	std::string		 m_texturePath;
 
-	bool LoadMaterialTextures(aiMaterial* ai_mat, aiTextureType ai_texType, std::string typeName, const aiScene* ai_scene, 
-		std::vector<std::shared_ptr<Texture>>& textures);
+	void CollectMaterialTextures(aiMaterial* ai_mat, aiTextureType ai_texType, std::string typeName,
+		std::vector<TextureRef>& textureRefs);
+	bool LoadMaterialTextures(const std::vector<TextureRef>& textureRefs, std::vector<std::shared_ptr<Texture>>& textures);
+	// Everything LoadMaterialTextures will ask for, decoded at once. MeshSource is MeshCache::Entry or MeshData.
+	template <typename MeshSource>
+	void PreloadTextures(const std::vector<MeshSource>& meshes);
 
 	std::string DetermineTextureType(const aiScene* ai_scene, aiMaterial* ai_mat);
 };
-
@@ -0,0 +1,149 @@
+#include "stdafx.h"
+#include "ModelStreamer.h"
+#include "ModelLoader.h"
+#include "ThreadPool.h"
+#include "TexturePathIndex.h"
+#include <chrono>
+#include <iostream>
+#include <unordered_set>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+}
+
+const size_t ModelStreamer::kQueueCapacity;
+
+ModelStreamer::ModelStreamer(ModelLoader* modelLoader, TextureLoader* textureLoader)
+	: m_modelLoader(modelLoader), m_textureLoader(textureLoader), m_queue(kQueueCapacity)
+{
+}
+
+ModelStreamer::~ModelStreamer()
+{
+	m_stop = true;
+	{
+		std::lock_guard<std::mutex> lock(m_spaceMutex);
+	}
+	m_space.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void ModelStreamer::Start(const std::string& filename)
+{
+	m_thread = std::thread(&ModelStreamer::Run, this, filename);
+}
+
+bool ModelStreamer::TryPop(std::unique_ptr<StreamedMesh>& mesh)
+{
+	if (!m_queue.TryPop(mesh))
+		return false;
+	// Taking the mutex orders the pop before the loader's check, so the wakeup can't be missed
+	{
+		std::lock_guard<std::mutex> lock(m_spaceMutex);
+	}
+	m_space.notify_one();
+	return true;
+}
+
+void ModelStreamer::Run(std::string filename)
+{
+	// WIC decoding needs COM on this thread as well
+	HRESULT com = CoInitializeEx(nullptr, COINITBASE_MULTITHREADED);
+	// Import and decode batches run on workers of their own, a ParallelFor of the render thread never
+	// waits behind them. Set for the rest of the thread, the pool goes with it.
+	ThreadPool pool;
+	ThreadPool::SetThreadDefault(&pool);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<MeshData> meshes;
+	if (!m_modelLoader->Import(filename, meshes, m_hierarchy, m_directory)) {
+		m_done.store(true, std::memory_order_release);
+		if (SUCCEEDED(com))
+			CoUninitialize();
+		return;
+	}
+	m_stats.ImportMs = ElapsedMs(start);
+
+	// Textures are counted and handed out by the key the loader looks them up with, so two spellings of
+	// one file are decoded once
+	const bool foldCase = m_textureLoader->GetFoldPathCase();
+	std::unordered_set<std::string> textures;
+	std::string canonical;
+	for (auto& data : meshes) {
+		for (auto& ref : data.Textures) {
+			TexturePathIndex::Canonicalize(m_directory + "/" + ref.FileName, foldCase, canonical);
+			textures.insert(canonical);
+		}
+	}
+	m_textureCount = static_cast<UINT>(textures.size());
+	m_imported.store(true, std::memory_order_release);
+
+	// Every texture goes with the first mesh that references it. Meshes are taken in groups with enough new
+	// textures to keep every worker busy, decoded together like TextureLoader::LoadBatch and pushed in order.
+	textures.clear();
+	std::vector<TextureRequest> requests;
+	std::vector<size_t> firstRequest;		// per mesh of the group, its textures follow
+	std::vector<DecodedTexture> decoded;
+	std::vector<UINT8> succeeded;
+	size_t next = 0;
+	while (next < meshes.size() && !m_stop) {
+		requests.clear();
+		firstRequest.clear();
+		size_t end = next;
+		while (end < meshes.size() && requests.size() < pool.GetThreadCount()) {
+			firstRequest.push_back(requests.size());
+			for (auto& ref : meshes[end].Textures) {
+				TextureRequest request;
+				request.FileName = m_directory + "/" + ref.FileName;
+				request.Type = ref.Type;
+				TexturePathIndex::Canonicalize(request.FileName, foldCase, canonical);
+				if (textures.insert(canonical).second)
+					requests.push_back(std::move(request));
+			}
+			++end;
+		}
+		firstRequest.push_back(requests.size());
+
+		start = std::chrono::high_resolution_clock::now();
+		m_textureLoader->DecodeBatch(requests, pool, decoded, succeeded);
+		m_stats.DecodeMs += ElapsedMs(start);
+
+		for (size_t i = next; i < end && !m_stop; ++i) {
+			std::unique_ptr<StreamedMesh> mesh = std::make_unique<StreamedMesh>();
+			for (size_t r = firstRequest[i - next]; r < firstRequest[i - next + 1]; ++r) {
+				// Without a texture under the path AddMesh would load the file again on the render thread
+				if (!succeeded[r]) {
+					std::cout << "ModelStreamer: failed to decode " << requests[r].FileName << ", using a placeholder" << std::endl;
+					++m_stats.FailedTextures;
+					const TextureUsage usage = BlockCompressor::GetUsage(requests[r].Type, requests[r].FileName);
+					if (!m_textureLoader->DecodePlaceholder(requests[r].FileName, usage, decoded[r]))
+						continue;
+				}
+				StreamedTexture texture;
+				texture.Type = requests[r].Type;
+				texture.Decoded = std::move(decoded[r]);
+				mesh->Textures.push_back(std::move(texture));
+			}
+			m_stats.TextureCount += static_cast<UINT>(mesh->Textures.size());
+			mesh->Data = std::move(meshes[i]);
+
+			if (!m_queue.TryPush(mesh)) {
+				start = std::chrono::high_resolution_clock::now();
+				std::unique_lock<std::mutex> lock(m_spaceMutex);
+				m_space.wait(lock, [&] { return m_queue.TryPush(mesh) || m_stop; });
+				m_stats.StallMs += ElapsedMs(start);
+			}
+			++m_stats.MeshCount;
+		}
+		next = end;
+	}
+
+	m_done.store(true, std::memory_order_release);
+	if (SUCCEEDED(com))
+		CoUninitialize();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+#include "SpscQueue.h"
+#include "TextureLoader.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class ModelLoader;
+
+struct StreamedTexture
+{
+	std::string Type;
+	DecodedTexture Decoded;
+};
+
+// One mesh ready for upload, with the textures it is the first to reference already decoded
+struct StreamedMesh
+{
+	MeshData Data;
+	std::vector<StreamedTexture> Textures;
+};
+
+struct ModelStreamStats
+{
+	double	ImportMs = 0.0;		// mesh cache or source file and post passes
+	double	DecodeMs = 0.0;		// texture decoding
+	double	StallMs = 0.0;		// blocked until the render thread makes room in the queue
+	UINT	MeshCount = 0;
+	UINT	TextureCount = 0;
+	UINT	FailedTextures = 0;	// replaced by placeholders, part of TextureCount
+};
+
+// Loads a model on a background thread. The thread imports the meshes with ModelLoader::Import, then
+// decodes the textures of a few meshes at a time on a pool of its own and hands the meshes over in order
+// through a lock-free queue. The render
+// thread pops finished meshes each frame and uploads them with ModelLoader::AddMesh and TextureLoader::Upload.
+// Post passes need every mesh, so the first mesh arrives once the import is done.
+class ModelStreamer
+{
+public:
+	// Meshes decoded ahead of the render thread, bounds the memory held by decoded textures
+	static const size_t kQueueCapacity = 16;
+
+	ModelStreamer(ModelLoader* modelLoader, TextureLoader* textureLoader);
+	ModelStreamer(const ModelStreamer&) = delete;
+	ModelStreamer& operator=(const ModelStreamer&) = delete;
+	// Stops after the mesh being decoded and waits for the thread
+	~ModelStreamer();
+
+	void Start(const std::string& filename);
+
+	// Render thread only
+	// The hierarchy, directory and texture count are valid once this is true, before the first mesh
+	bool IsImported() const { return m_imported.load(std::memory_order_acquire); }
+	bool TryPop(std::unique_ptr<StreamedMesh>& mesh);
+	// Every mesh was popped, or the import failed
+	bool IsFinished() const { return m_done.load(std::memory_order_acquire) && m_queue.Empty(); }
+	bool Failed() const { return IsFinished() && !IsImported(); }
+
+	const SceneHierarchy& GetHierarchy() const { return m_hierarchy; }
+	const std::string& GetDirectory() const { return m_directory; }
+	// Unique textures of the whole model, to size the descriptor heap up front
+	UINT GetTextureCount() const { return m_textureCount; }
+	// Valid once IsFinished
+	const ModelStreamStats& GetStats() const { return m_stats; }
+
+private:
+	void Run(std::string filename);
+
+	ModelLoader*		m_modelLoader;
+	TextureLoader*		m_textureLoader;
+	std::thread			m_thread;
+	SpscQueue<std::unique_ptr<StreamedMesh>> m_queue;
+	std::atomic<bool>	m_imported{ false };
+	std::atomic<bool>	m_done{ false };
+	std::atomic<bool>	m_stop{ false };
+	// The loader thread sleeps on m_space while the queue is full, pops and the destructor wake it
+	std::mutex			m_spaceMutex;
+	std::condition_variable m_space;
+
+	// Written by the loader thread before m_imported is set
+	SceneHierarchy		m_hierarchy;
+	std::string			m_directory;
+	UINT				m_textureCount = 0;
+	ModelStreamStats	m_stats;
+};
@@ -0,0 +1,548 @@
+#include "stdafx.h"
+#include "ObjParser.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "assimp/postprocess.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace
+{
+	// Face corners are stored as v/vt/vn triplets. Positive OBJ indices are global and stored 0-based,
+	// negative ones are relative to the chunk and biased below zero until the chunk bases are known.
+	const int32_t kMissingIndex = INT32_MIN;
+	const int32_t kRelativeBias = 1 << 30;
+	const size_t kMinChunkBytes = 256 * 1024;
+
+	enum ObjEventType { EventMaterial, EventGroup, EventMaterialLib };
+
+	struct ObjEvent
+	{
+		size_t Face;		// first face the event applies to
+		ObjEventType Type;
+		std::string Name;
+	};
+
+	struct ObjChunk
+	{
+		const char* Begin = nullptr;
+		const char* End = nullptr;
+
+		std::vector<XMFLOAT3> Positions;
+		std::vector<XMFLOAT2> TexCoords;
+		std::vector<XMFLOAT3> Normals;
+		std::vector<int32_t>  Corners;
+		std::vector<uint32_t> FaceStarts;	// first corner of every face, plus one past the end
+		std::vector<ObjEvent> Events;
+
+		size_t PositionBase = 0;
+		size_t TexCoordBase = 0;
+		size_t NormalBase = 0;
+		bool   Valid = true;
+	};
+
+	struct ObjSegment
+	{
+		size_t Chunk;
+		size_t FaceBegin;
+		size_t FaceEnd;
+	};
+
+	struct ObjRun
+	{
+		std::string Material;
+		std::vector<ObjSegment> Segments;
+	};
+
+	inline bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+	inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+	const char* SkipSpaces(const char* p, const char* end)
+	{
+		while (p < end && IsSpace(*p))
+			++p;
+		return p;
+	}
+
+	// keyword followed by a space
+	bool MatchKeyword(const char* p, const char* end, const char* keyword)
+	{
+		for (; *keyword; ++keyword, ++p) {
+			if (p >= end || *p != *keyword)
+				return false;
+		}
+		return p < end && IsSpace(*p);
+	}
+
+	std::string RestOfLine(const char* p, const char* end)
+	{
+		p = SkipSpaces(p, end);
+		while (end > p && (IsSpace(end[-1]) || end[-1] == '\r'))
+			--end;
+		return std::string(p, end);
+	}
+
+	const double kPow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	// Decimal mantissa up to 19 digits scaled by an exact power of ten, no locale and no strtod
+	const char* ParseFloat(const char* p, const char* end, float& out)
+	{
+		p = SkipSpaces(p, end);
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = *p == '-';
+			++p;
+		}
+
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		int digits = 0;
+		for (; p < end && IsDigit(*p); ++p) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) ++digits;
+			}
+			else {
+				++exponent;
+			}
+		}
+		if (p < end && *p == '.') {
+			for (++p; p < end && IsDigit(*p); ++p) {
+				if (digits < 19) {
+					mantissa = mantissa * 10 + (*p - '0');
+					if (mantissa) ++digits;
+					--exponent;
+				}
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			++p;
+			bool expNegative = false;
+			if (p < end && (*p == '-' || *p == '+')) {
+				expNegative = *p == '-';
+				++p;
+			}
+			int e = 0;
+			for (; p < end && IsDigit(*p); ++p) {
+				if (e < 10000) e = e * 10 + (*p - '0');
+			}
+			exponent += expNegative ? -e : e;
+		}
+
+		double value = static_cast<double>(mantissa);
+		if (exponent < 0)
+			value = exponent >= -22 ? value / kPow10[-exponent] : value * std::pow(10.0, exponent);
+		else if (exponent > 0)
+			value = exponent <= 22 ? value * kPow10[exponent] : value * std::pow(10.0, exponent);
+
+		out = static_cast<float>(negative ? -value : value);
+		return p;
+	}
+
+	const char* ParseInt(const char* p, const char* end, int64_t& out)
+	{
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = *p == '-';
+			++p;
+		}
+		int64_t value = 0;
+		for (; p < end && IsDigit(*p); ++p)
+			value = value * 10 + (*p - '0');
+		out = negative ? -value : value;
+		return p;
+	}
+
+	int32_t EncodeIndex(int64_t value, size_t localCount)
+	{
+		if (value > 0)
+			return static_cast<int32_t>(value - 1);
+		if (value < 0)
+			return static_cast<int32_t>(int64_t(localCount) + value) - kRelativeBias;
+		return kMissingIndex;
+	}
+
+	int32_t DecodeIndex(int32_t value, size_t base, size_t total)
+	{
+		if (value == kMissingIndex)
+			return -1;
+		int64_t absolute = value >= 0 ? value : int64_t(base) + value + kRelativeBias;
+		return (absolute >= 0 && absolute < int64_t(total)) ? static_cast<int32_t>(absolute) : -2;
+	}
+
+	// v, v/vt, v//vn or v/vt/vn
+	const char* ParseCorner(const char* p, const char* end, ObjChunk& chunk)
+	{
+		int32_t corner[3] = { kMissingIndex, kMissingIndex, kMissingIndex };
+		const size_t counts[3] = { chunk.Positions.size(), chunk.TexCoords.size(), chunk.Normals.size() };
+		for (int k = 0; k < 3; ++k) {
+			if (p < end && (IsDigit(*p) || *p == '-' || *p == '+')) {
+				int64_t value;
+				p = ParseInt(p, end, value);
+				corner[k] = EncodeIndex(value, counts[k]);
+			}
+			if (k < 2 && p < end && *p == '/')
+				++p;
+			else
+				break;
+		}
+		chunk.Corners.insert(chunk.Corners.end(), corner, corner + 3);
+		return p;
+	}
+
+	void ParseChunk(ObjChunk& chunk)
+	{
+		const char* p = chunk.Begin;
+		const char* end = chunk.End;
+
+		while (p < end) {
+			const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+			if (!lineEnd)
+				lineEnd = end;
+
+			const char* q = SkipSpaces(p, lineEnd);
+			if (MatchKeyword(q, lineEnd, "v")) {
+				XMFLOAT3 v;
+				q = ParseFloat(q + 1, lineEnd, v.x);
+				q = ParseFloat(q, lineEnd, v.y);
+				ParseFloat(q, lineEnd, v.z);
+				chunk.Positions.push_back(v);
+			}
+			else if (MatchKeyword(q, lineEnd, "vt")) {
+				XMFLOAT2 vt;
+				q = ParseFloat(q + 2, lineEnd, vt.x);
+				ParseFloat(q, lineEnd, vt.y);
+				chunk.TexCoords.push_back(vt);
+			}
+			else if (MatchKeyword(q, lineEnd, "vn")) {
+				XMFLOAT3 vn;
+				q = ParseFloat(q + 2, lineEnd, vn.x);
+				q = ParseFloat(q, lineEnd, vn.y);
+				ParseFloat(q, lineEnd, vn.z);
+				chunk.Normals.push_back(vn);
+			}
+			else if (MatchKeyword(q, lineEnd, "f")) {
+				uint32_t first = static_cast<uint32_t>(chunk.Corners.size() / 3);
+				uint32_t count = 0;
+				q += 1;
+				for (;;) {
+					q = SkipSpaces(q, lineEnd);
+					if (q >= lineEnd || *q == '\r' || *q == '#')
+						break;
+					const char* before = q;
+					q = ParseCorner(q, lineEnd, chunk);
+					++count;
+					if (q == before)
+						break;
+					while (q < lineEnd && !IsSpace(*q) && *q != '\r')
+						++q;
+				}
+				if (count >= 3)
+					chunk.FaceStarts.push_back(first);
+				else
+					chunk.Corners.resize(size_t(first) * 3);	// points and lines are not rendered
+			}
+			else if (MatchKeyword(q, lineEnd, "usemtl")) {
+				chunk.Events.push_back({ chunk.FaceStarts.size(), EventMaterial, RestOfLine(q + 6, lineEnd) });
+			}
+			else if (MatchKeyword(q, lineEnd, "o") || MatchKeyword(q, lineEnd, "g")) {
+				chunk.Events.push_back({ chunk.FaceStarts.size(), EventGroup, RestOfLine(q + 1, lineEnd) });
+			}
+			else if (MatchKeyword(q, lineEnd, "mtllib")) {
+				chunk.Events.push_back({ chunk.FaceStarts.size(), EventMaterialLib, RestOfLine(q + 6, lineEnd) });
+			}
+
+			p = lineEnd + 1;
+		}
+		chunk.FaceStarts.push_back(static_cast<uint32_t>(chunk.Corners.size() / 3));
+	}
+
+	// Open addressing map from a v/vt/vn triplet to the output vertex
+	class CornerTable
+	{
+	public:
+		explicit CornerTable(size_t corners)
+		{
+			size_t size = 16;
+			while (size < corners * 2)
+				size <<= 1;
+			m_mask = size - 1;
+			m_slots.resize(size);
+		}
+
+		// returns true if the triplet was inserted, vertex receives the stored index either way
+		bool FindOrInsert(const int32_t* corner, UINT candidate, UINT& vertex)
+		{
+			uint32_t hash = uint32_t(corner[0]) * 73856093u ^ uint32_t(corner[1]) * 19349663u ^ uint32_t(corner[2]) * 83492791u;
+			for (size_t i = (hash ^ (hash >> 15)) & m_mask;; i = (i + 1) & m_mask) {
+				Slot& slot = m_slots[i];
+				if (slot.Vertex == UINT_MAX) {
+					slot.Key[0] = corner[0];
+					slot.Key[1] = corner[1];
+					slot.Key[2] = corner[2];
+					slot.Vertex = vertex = candidate;
+					return true;
+				}
+				if (slot.Key[0] == corner[0] && slot.Key[1] == corner[1] && slot.Key[2] == corner[2]) {
+					vertex = slot.Vertex;
+					return false;
+				}
+			}
+		}
+
+	private:
+		struct Slot
+		{
+			int32_t Key[3];
+			UINT Vertex = UINT_MAX;
+		};
+		std::vector<Slot> m_slots;
+		size_t m_mask;
+	};
+
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+}
+
+ObjParser::ObjParser(unsigned int loadFlags)
+	: m_makeLeftHanded((loadFlags & aiProcess_MakeLeftHanded) != 0),
+	m_flipUVs((loadFlags & aiProcess_FlipUVs) != 0),
+	m_flipWinding((loadFlags & aiProcess_FlipWindingOrder) != 0)
+{
+}
+
+bool ObjParser::Parse(const std::string& filename, std::vector<MeshData>& meshes)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	m_stats = ObjParseStats();
+	m_materials.clear();
+
+	MappedFile file;
+	if (!file.Open(filename)) {
+		std::cout << "ERROR::OBJ:: can't open " << filename << std::endl;
+		return false;
+	}
+	const char* data = reinterpret_cast<const char*>(file.Data());
+	const size_t size = file.Size();
+	m_stats.Bytes = size;
+
+	// Line aligned chunks, a few per thread so uneven chunks still balance
+	ThreadPool& pool = ThreadPool::Default();
+	size_t chunkCount = (std::max)(size_t(1), (std::min)(size / kMinChunkBytes, size_t(pool.GetThreadCount()) * 4));
+	std::vector<ObjChunk> chunks(chunkCount);
+	const char* chunkBegin = data;
+	for (size_t i = 0; i < chunkCount; ++i) {
+		const char* chunkEnd = data + size;
+		if (i + 1 < chunkCount) {
+			chunkEnd = (std::max)(chunkBegin, data + size * (i + 1) / chunkCount);
+			const char* newline = static_cast<const char*>(memchr(chunkEnd, '\n', data + size - chunkEnd));
+			chunkEnd = newline ? newline + 1 : data + size;
+		}
+		chunks[i].Begin = chunkBegin;
+		chunks[i].End = chunkEnd;
+		chunkBegin = chunkEnd;
+	}
+	m_stats.ChunkCount = static_cast<UINT>(chunkCount);
+
+	pool.ParallelFor(chunkCount, [&](size_t i) { ParseChunk(chunks[i]); });
+
+	// Chunk bases turn chunk relative indices into global ones
+	size_t positionCount = 0, texCoordCount = 0, normalCount = 0;
+	for (auto& chunk : chunks) {
+		chunk.PositionBase = positionCount;
+		chunk.TexCoordBase = texCoordCount;
+		chunk.NormalBase = normalCount;
+		positionCount += chunk.Positions.size();
+		texCoordCount += chunk.TexCoords.size();
+		normalCount += chunk.Normals.size();
+	}
+
+	std::vector<XMFLOAT3> positions(positionCount);
+	std::vector<XMFLOAT2> texCoords(texCoordCount);
+	std::vector<XMFLOAT3> normals(normalCount);
+	pool.ParallelFor(chunkCount, [&](size_t i) {
+		ObjChunk& chunk = chunks[i];
+		std::copy(chunk.Positions.begin(), chunk.Positions.end(), positions.begin() + chunk.PositionBase);
+		std::copy(chunk.TexCoords.begin(), chunk.TexCoords.end(), texCoords.begin() + chunk.TexCoordBase);
+		std::copy(chunk.Normals.begin(), chunk.Normals.end(), normals.begin() + chunk.NormalBase);
+		std::vector<XMFLOAT3>().swap(chunk.Positions);
+		std::vector<XMFLOAT2>().swap(chunk.TexCoords);
+		std::vector<XMFLOAT3>().swap(chunk.Normals);
+
+		for (size_t c = 0; c < chunk.Corners.size(); c += 3) {
+			int32_t v = DecodeIndex(chunk.Corners[c], chunk.PositionBase, positionCount);
+			int32_t vt = DecodeIndex(chunk.Corners[c + 1], chunk.TexCoordBase, texCoordCount);
+			int32_t vn = DecodeIndex(chunk.Corners[c + 2], chunk.NormalBase, normalCount);
+			if (v < 0 || vt < -1 || vn < -1)
+				chunk.Valid = false;
+			chunk.Corners[c] = v;
+			chunk.Corners[c + 1] = vt;
+			chunk.Corners[c + 2] = vn;
+		}
+	});
+
+	for (auto& chunk : chunks) {
+		if (!chunk.Valid) {
+			std::cout << "ERROR::OBJ:: face index out of range in " << filename << std::endl;
+			return false;
+		}
+	}
+
+	// Split the face stream into (object, material) runs, in file order
+	std::vector<ObjRun> runs;
+	std::vector<std::string> materialLibs;
+	std::string material;
+	bool breakPending = true;
+	auto addSegment = [&](size_t chunk, size_t faceBegin, size_t faceEnd) {
+		if (faceBegin >= faceEnd)
+			return;
+		if (breakPending || runs.empty()) {
+			runs.push_back({ material, {} });
+			breakPending = false;
+		}
+		runs.back().Segments.push_back({ chunk, faceBegin, faceEnd });
+	};
+
+	for (size_t c = 0; c < chunkCount; ++c) {
+		size_t face = 0;
+		for (auto& event : chunks[c].Events) {
+			addSegment(c, face, event.Face);
+			face = event.Face;
+			if (event.Type == EventMaterial && event.Name != material) {
+				material = event.Name;
+				breakPending = true;
+			}
+			else if (event.Type == EventGroup) {
+				breakPending = true;
+			}
+			else if (event.Type == EventMaterialLib) {
+				materialLibs.push_back(event.Name);
+			}
+		}
+		addSegment(c, face, chunks[c].FaceStarts.size() - 1);
+	}
+
+	std::string directory = filename.substr(0, filename.find_last_of('/'));
+	for (auto& lib : materialLibs) {
+		if (!ParseMaterialLib(directory + "/" + lib))
+			std::cout << "ERROR::OBJ:: can't read material library " << lib << std::endl;
+	}
+	m_stats.ParseMs = ElapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	meshes.clear();
+	meshes.resize(runs.size());
+	pool.ParallelFor(runs.size(), [&](size_t r) {
+		const ObjRun& run = runs[r];
+		MeshData& mesh = meshes[r];
+
+		size_t cornerCount = 0, triangleCount = 0;
+		for (auto& segment : run.Segments) {
+			const std::vector<uint32_t>& starts = chunks[segment.Chunk].FaceStarts;
+			cornerCount += starts[segment.FaceEnd] - starts[segment.FaceBegin];
+			triangleCount += starts[segment.FaceEnd] - starts[segment.FaceBegin] - 2 * (segment.FaceEnd - segment.FaceBegin);
+		}
+
+		CornerTable table(cornerCount);
+		mesh.Vertices.reserve(cornerCount);
+		mesh.Indices.reserve(triangleCount * 3);
+		std::vector<UINT> faceVertices;
+
+		const float zSign = m_makeLeftHanded ? -1.0f : 1.0f;
+		for (auto& segment : run.Segments) {
+			const ObjChunk& chunk = chunks[segment.Chunk];
+			for (size_t f = segment.FaceBegin; f < segment.FaceEnd; ++f) {
+				faceVertices.clear();
+				for (uint32_t c = chunk.FaceStarts[f]; c < chunk.FaceStarts[f + 1]; ++c) {
+					const int32_t* corner = &chunk.Corners[size_t(c) * 3];
+					UINT vertex;
+					if (table.FindOrInsert(corner, static_cast<UINT>(mesh.Vertices.size()), vertex)) {
+						Vertex_Model v = {};
+						const XMFLOAT3& p = positions[corner[0]];
+						v.Position = XMFLOAT3(p.x, p.y, p.z * zSign);
+						if (corner[2] >= 0) {
+							const XMFLOAT3& n = normals[corner[2]];
+							v.Normal = XMFLOAT3(n.x, n.y, n.z * zSign);
+						}
+						if (corner[1] >= 0) {
+							const XMFLOAT2& t = texCoords[corner[1]];
+							v.TexCoord = XMFLOAT2(t.x, m_flipUVs ? 1.0f - t.y : t.y);
+						}
+						mesh.Vertices.push_back(v);
+					}
+					faceVertices.push_back(vertex);
+				}
+
+				// Fan triangulation
+				for (size_t i = 1; i + 1 < faceVertices.size(); ++i) {
+					mesh.Indices.push_back(faceVertices[0]);
+					mesh.Indices.push_back(faceVertices[m_flipWinding ? i + 1 : i]);
+					mesh.Indices.push_back(faceVertices[m_flipWinding ? i : i + 1]);
+				}
+			}
+		}
+
+		auto found = m_materials.find(run.Material);
+		if (found != m_materials.end())
+			mesh.Textures = found->second;
+	});
+	m_stats.BuildMs = ElapsedMs(start);
+
+	return true;
+}
+
+bool ObjParser::ParseMaterialLib(const std::string& filename)
+{
+	std::ifstream file(filename);
+	if (!file)
+		return false;
+
+	std::vector<TextureRef>* current = nullptr;
+	std::string line;
+	while (std::getline(file, line)) {
+		const char* p = SkipSpaces(line.data(), line.data() + line.size());
+		const char* end = line.data() + line.size();
+
+		if (MatchKeyword(p, end, "newmtl")) {
+			current = &m_materials[RestOfLine(p + 6, end)];
+			current->clear();
+			continue;
+		}
+		if (!current)
+			continue;
+
+		const char* type = nullptr;
+		if (MatchKeyword(p, end, "map_Kd"))
+			type = "texture_diffuse";
+		else if (MatchKeyword(p, end, "map_Ks"))
+			type = "texture_specular";
+		if (!type)
+			continue;
+
+		// Options such as "-bm 1.0" come before the file name
+		std::string path = RestOfLine(p + 6, end);
+		if (!path.empty() && path[0] == '-')
+			path = path.substr(path.find_last_of(" \t") + 1);
+
+		TextureRef ref{ type, path };
+		// Keep the diffuse maps ahead of the specular ones like ProcessMesh
+		if (ref.Type == "texture_diffuse") {
+			auto firstSpecular = std::find_if(current->begin(), current->end(),
+				[](const TextureRef& t) { return t.Type != "texture_diffuse"; });
+			current->insert(firstSpecular, ref);
+		}
+		else {
+			current->push_back(ref);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct ObjParseStats
+{
+	uint64_t	Bytes = 0;
+	UINT		ChunkCount = 0;
+	double		ParseMs = 0.0;		// chunk parsing and pool merge
+	double		BuildMs = 0.0;		// vertex dedupe and triangulation
+};
+
+// Fast path for Wavefront OBJ/MTL files that bypasses assimp.
+// The file is mapped and split into line aligned chunks parsed on the thread pool,
+// then the v/vt/vn pools are merged and every (object, material) run becomes one MeshData,
+// the same split assimp's OBJ importer does. Polygons are fan triangulated.
+class ObjParser
+{
+public:
+	// Honors aiProcess_MakeLeftHanded, aiProcess_FlipUVs and aiProcess_FlipWindingOrder
+	explicit ObjParser(unsigned int loadFlags);
+	ObjParser(const ObjParser&) = delete;
+	ObjParser& operator=(const ObjParser&) = delete;
+
+	bool Parse(const std::string& filename, std::vector<MeshData>& meshes);
+
+	const ObjParseStats& GetStats() const { return m_stats; }
+
+private:
+	bool ParseMaterialLib(const std::string& filename);
+
+	bool m_makeLeftHanded;
+	bool m_flipUVs;
+	bool m_flipWinding;
+	ObjParseStats m_stats;
+
+	// material name -> textures, diffuse first
+	std::unordered_map<std::string, std::vector<TextureRef>> m_materials;
+};
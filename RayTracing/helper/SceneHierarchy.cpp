@@ -0,0 +1,162 @@
+#include "stdafx.h"
+#include "SceneHierarchy.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+
+using namespace DirectX;
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	XMFLOAT4X4 IdentityMatrix()
+	{
+		XMFLOAT4X4 identity;
+		XMStoreFloat4x4(&identity, XMMatrixIdentity());
+		return identity;
+	}
+}
+
+const UINT SceneHierarchy::kRoot;
+const UINT SceneHierarchy::kNoParent;
+
+SceneHierarchy::SceneHierarchy()
+{
+	Clear();
+}
+
+void SceneHierarchy::Clear()
+{
+	m_parents.assign(1, kNoParent);
+	m_subtreeEnds.assign(1, 1);
+	m_locals.resize(1);
+	m_worlds.resize(1);
+	XMStoreFloat4x4A(&m_locals[0], XMMatrixIdentity());
+	XMStoreFloat4x4A(&m_worlds[0], XMMatrixIdentity());
+	m_dirty.assign(1, 0);
+	m_dirtyNodes.clear();
+	m_stats = SceneUpdateStats();
+	m_stats.Nodes = 1;
+}
+
+UINT SceneHierarchy::AddNode(UINT parent, const XMFLOAT4X4& local)
+{
+	const UINT node = GetNodeCount();
+	// Only the nodes on the path to the last added one still have their subtree open
+	if (parent >= node || m_subtreeEnds[parent] != node)
+		return kNoParent;
+
+	for (UINT ancestor = parent; ancestor != kNoParent; ancestor = m_parents[ancestor])
+		m_subtreeEnds[ancestor] = node + 1;
+
+	m_parents.push_back(parent);
+	m_subtreeEnds.push_back(node + 1);
+	m_locals.emplace_back();
+	m_worlds.emplace_back();
+	XMStoreFloat4x4A(&m_locals[node], XMLoadFloat4x4(&local));
+	XMStoreFloat4x4A(&m_worlds[node], XMMatrixMultiply(XMLoadFloat4x4(&local), XMLoadFloat4x4A(&m_worlds[parent])));
+	m_dirty.push_back(0);
+	m_stats.Nodes = node + 1;
+	return node;
+}
+
+void SceneHierarchy::SetLocal(UINT node, const XMFLOAT4X4& local)
+{
+	XMStoreFloat4x4A(&m_locals[node], XMLoadFloat4x4(&local));
+	if (!m_dirty[node]) {
+		m_dirty[node] = 1;
+		m_dirtyNodes.push_back(node);
+	}
+}
+
+UINT SceneHierarchy::Update()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	m_stats.DirtyNodes = static_cast<UINT>(m_dirtyNodes.size());
+	m_stats.UpdatedNodes = 0;
+
+	// Ancestors sort before their descendants, a dirty node inside a range that was just
+	// recomputed is already up to date
+	std::sort(m_dirtyNodes.begin(), m_dirtyNodes.end());
+	UINT covered = 0;
+	for (UINT node : m_dirtyNodes) {
+		m_dirty[node] = 0;
+		if (node < covered)
+			continue;
+		covered = m_subtreeEnds[node];
+		UpdateRange(node, covered);
+		m_stats.UpdatedNodes += covered - node;
+	}
+	m_dirtyNodes.clear();
+
+	m_stats.UpdateMs = ElapsedMs(start);
+	return m_stats.UpdatedNodes;
+}
+
+void SceneHierarchy::UpdateRange(UINT begin, UINT end)
+{
+	// The parent of every node in the range is either before it in the range or outside the subtree
+	// and unchanged, so one forward pass is enough
+	const UINT* parents = m_parents.data();
+	const XMFLOAT4X4A* locals = m_locals.data();
+	XMFLOAT4X4A* worlds = m_worlds.data();
+	for (UINT i = begin; i < end; ++i) {
+		XMMATRIX local = XMLoadFloat4x4A(&locals[i]);
+		if (parents[i] != kNoParent)
+			local = XMMatrixMultiply(local, XMLoadFloat4x4A(&worlds[parents[i]]));
+		XMStoreFloat4x4A(&worlds[i], local);
+	}
+}
+
+void SceneHierarchy::RunBenchmark(UINT nodeCount, float dirtyFraction)
+{
+	const UINT kMaxDepth = 12;
+	std::mt19937 random(12345);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	// Depth first construction: the new node hangs below the last one or one of its ancestors
+	SceneHierarchy hierarchy;
+	std::vector<UINT> path(1, kRoot);
+	for (UINT i = 1; i < nodeCount; ++i) {
+		while (path.size() > 1 && (path.size() >= kMaxDepth || unit(random) < 0.5f))
+			path.pop_back();
+		XMFLOAT4X4 local;
+		XMStoreFloat4x4(&local, XMMatrixRotationY(unit(random) * XM_2PI) *
+			XMMatrixTranslation(unit(random), unit(random), unit(random)));
+		path.push_back(hierarchy.AddNode(path.back(), local));
+	}
+	hierarchy.Update();
+
+	std::vector<UINT> nodes(hierarchy.GetNodeCount() - 1);
+	for (UINT i = 0; i < nodes.size(); ++i)
+		nodes[i] = i + 1;
+	std::shuffle(nodes.begin(), nodes.end(), random);
+	nodes.resize(static_cast<size_t>(nodes.size() * dirtyFraction));
+
+	// Best of a few runs, every run marks the same nodes dirty
+	const int kRuns = 5;
+	double partialMs = 1e30, fullMs = 1e30;
+	UINT updated = 0;
+	for (int run = 0; run < kRuns; ++run) {
+		for (UINT node : nodes) {
+			XMFLOAT4X4 local;
+			XMStoreFloat4x4(&local, XMLoadFloat4x4A(&hierarchy.GetLocal(node)) * XMMatrixRotationY(0.01f));
+			hierarchy.SetLocal(node, local);
+		}
+		updated = hierarchy.Update();
+		partialMs = (std::min)(partialMs, hierarchy.GetUpdateStats().UpdateMs);
+
+		hierarchy.SetLocal(kRoot, IdentityMatrix());
+		hierarchy.Update();
+		fullMs = (std::min)(fullMs, hierarchy.GetUpdateStats().UpdateMs);
+	}
+
+	std::cout << "SceneHierarchy: " << hierarchy.GetNodeCount() << " nodes, " << nodes.size() << " dirty, "
+		<< updated << " world matrices updated in " << partialMs << " ms, full update " << fullMs << " ms ("
+		<< hierarchy.GetNodeCount() / 1000.0 / (std::max)(fullMs, 1e-6) << " M nodes/s)" << std::endl;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "stdafx.h"
+
+struct SceneUpdateStats
+{
+	UINT	Nodes = 0;
+	UINT	DirtyNodes = 0;		// SetLocal calls since the last update, a node counts once
+	UINT	UpdatedNodes = 0;	// world matrices recomputed, dirty nodes and their descendants
+	double	UpdateMs = 0.0;
+};
+
+// Node transforms flattened in depth first order, so a parent always comes before its children and
+// every subtree is a contiguous range. Parents, local and world matrices are separate arrays that the
+// update walks front to back. Matrices are row vector transforms, world = local * parent world.
+class SceneHierarchy
+{
+public:
+	static const UINT kRoot = 0;
+	static const UINT kNoParent = UINT_MAX;
+
+	SceneHierarchy();
+
+	// Drops every node and adds an identity root
+	void Clear();
+
+	// Appends a node below parent and returns its index. Nodes have to be added in depth first order:
+	// parent is the last added node or one of its ancestors. Returns kNoParent if it isn't.
+	UINT AddNode(UINT parent, const DirectX::XMFLOAT4X4& local);
+
+	// Marks the node dirty, its world matrix and the ones below it are recomputed by the next Update
+	void SetLocal(UINT node, const DirectX::XMFLOAT4X4& local);
+
+	// Recomputes the subtrees of the dirty nodes and returns the number of world matrices written
+	UINT Update();
+
+	UINT GetNodeCount() const { return static_cast<UINT>(m_parents.size()); }
+	UINT GetParent(UINT node) const { return m_parents[node]; }
+	// One past the last node of the subtree rooted at node
+	UINT GetSubtreeEnd(UINT node) const { return m_subtreeEnds[node]; }
+	const DirectX::XMFLOAT4X4A& GetLocal(UINT node) const { return m_locals[node]; }
+	// As of the last Update, added nodes get theirs right away
+	const DirectX::XMFLOAT4X4A& GetWorld(UINT node) const { return m_worlds[node]; }
+	const SceneUpdateStats& GetUpdateStats() const { return m_stats; }
+
+	// Builds a random tree of nodeCount nodes, marks dirtyFraction of them dirty and times the update,
+	// printing the result. Scales with the subtree sizes, not the total node count.
+	static void RunBenchmark(UINT nodeCount, float dirtyFraction);
+
+private:
+	void UpdateRange(UINT begin, UINT end);
+
+	std::vector<UINT>					m_parents;
+	std::vector<UINT>					m_subtreeEnds;
+	std::vector<DirectX::XMFLOAT4X4A>	m_locals;
+	std::vector<DirectX::XMFLOAT4X4A>	m_worlds;
+	std::vector<char>					m_dirty;
+	std::vector<UINT>					m_dirtyNodes;
+	SceneUpdateStats					m_stats;
+};
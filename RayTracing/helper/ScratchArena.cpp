@@ -0,0 +1,80 @@
+#include "stdafx.h"
+#include "ScratchArena.h"
+
+ScratchArena::ScratchArena(size_t blockSize)
+	: m_blockSize(blockSize)
+{
+}
+
+void* ScratchArena::Allocate(size_t bytes, size_t alignment)
+{
+	++m_stats.Allocations;
+	m_stats.BytesRequested += bytes;
+
+	// Block memory comes from new[], which is aligned for any fundamental type, so aligning the
+	// offset is enough for alignments up to that
+	auto fits = [&](const Block& block, size_t& offset) {
+		offset = (block.Used + alignment - 1) & ~(alignment - 1);
+		return offset + bytes <= block.Size;
+	};
+
+	size_t offset = 0;
+	if (m_blocks.empty() || !fits(m_blocks[m_current], offset)) {
+		// The blocks after the current one are empty, take the first that is big enough
+		size_t next = m_blocks.empty() ? 0 : m_current + 1;
+		size_t skipped = m_blocks.empty() ? 0 : m_blocks[m_current].Used;
+		while (next < m_blocks.size() && m_blocks[next].Size < bytes)
+			++next;
+		if (next == m_blocks.size()) {
+			Block block;
+			block.Size = (std::max)(m_blockSize, bytes);
+			block.Memory.reset(new uint8_t[block.Size]);
+			m_blocks.push_back(std::move(block));
+			++m_stats.BlockAllocations;
+			m_stats.ReservedBytes += m_blocks.back().Size;
+		}
+		// Skipped empty blocks stay in place and are used after the next Rewind
+		m_fullBytes += skipped;
+		m_current = next;
+		offset = 0;
+	}
+
+	Block& block = m_blocks[m_current];
+	block.Used = offset + bytes;
+	m_stats.PeakBytes = (std::max)(m_stats.PeakBytes, static_cast<uint64_t>(GetUsedBytes()));
+	return block.Memory.get() + offset;
+}
+
+void ScratchArena::Rewind(const Marker& marker)
+{
+	if (m_blocks.empty())
+		return;
+	for (size_t i = marker.Block + 1; i <= m_current; ++i)
+		m_blocks[i].Used = 0;
+	m_blocks[marker.Block].Used = marker.Offset;
+	m_current = marker.Block;
+
+	m_fullBytes = 0;
+	for (size_t i = 0; i < m_current; ++i)
+		m_fullBytes += m_blocks[i].Used;
+}
+
+void ScratchArena::Release()
+{
+	m_blocks.clear();
+	m_current = 0;
+	m_fullBytes = 0;
+	m_stats.ReservedBytes = 0;
+}
+
+void ScratchArena::ResetStats()
+{
+	uint64_t reserved = m_stats.ReservedBytes;
+	m_stats = ScratchArenaStats();
+	m_stats.ReservedBytes = reserved;
+}
+
+size_t ScratchArena::GetUsedBytes() const
+{
+	return m_blocks.empty() ? 0 : m_fullBytes + m_blocks[m_current].Used;
+}
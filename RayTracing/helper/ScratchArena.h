@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct ScratchArenaStats
+{
+	uint64_t	Allocations = 0;		// requests served
+	uint64_t	BytesRequested = 0;
+	uint64_t	BlockAllocations = 0;	// calls into the heap, the rest came out of existing blocks
+	uint64_t	PeakBytes = 0;			// most bytes in use at once
+	uint64_t	ReservedBytes = 0;		// size of all blocks
+};
+
+// Monotonic allocator for the temporaries of a load session. Memory is handed out from large blocks
+// and never freed one allocation at a time: Rewind drops everything allocated after a marker and keeps
+// the blocks for the next allocations, Release gives all blocks back to the heap. Not thread-safe,
+// every thread that needs scratch memory uses its own arena.
+class ScratchArena
+{
+public:
+	struct Marker
+	{
+		size_t Block = 0;
+		size_t Offset = 0;
+	};
+
+	// Requests larger than blockSize get a block of their own
+	explicit ScratchArena(size_t blockSize = 1 << 20);
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+	void* Allocate(size_t bytes, size_t alignment = 16);
+	template <typename T>
+	T* AllocateArray(size_t count) { return static_cast<T*>(Allocate(count * sizeof(T), alignof(T) < 16 ? 16 : alignof(T))); }
+
+	Marker GetMarker() const { return { m_current, m_blocks.empty() ? 0 : m_blocks[m_current].Used }; }
+	void Rewind(const Marker& marker);
+	void Release();
+
+	const ScratchArenaStats& GetStats() const { return m_stats; }
+	void ResetStats();
+
+private:
+	struct Block
+	{
+		std::unique_ptr<uint8_t[]> Memory;
+		size_t Size = 0;
+		size_t Used = 0;
+	};
+
+	size_t GetUsedBytes() const;
+
+	size_t				m_blockSize;
+	std::vector<Block>	m_blocks;
+	size_t				m_current = 0;	// blocks after this one are empty
+	size_t				m_fullBytes = 0;	// used bytes of the blocks before m_current
+	ScratchArenaStats	m_stats;
+};
+
+// Rewinds the arena when the scope ends
+class ScratchScope
+{
+public:
+	explicit ScratchScope(ScratchArena& arena) : m_arena(arena), m_marker(arena.GetMarker()) {}
+	ScratchScope(const ScratchScope&) = delete;
+	ScratchScope& operator=(const ScratchScope&) = delete;
+	~ScratchScope() { m_arena.Rewind(m_marker); }
+
+private:
+	ScratchArena&			m_arena;
+	ScratchArena::Marker	m_marker;
+};
+
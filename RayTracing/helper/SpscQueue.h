@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue between exactly one producer and one consumer thread.
+// Each side only writes its own index, the acquire/release pair on the other index
+// publishes the slot contents. One slot stays empty to tell a full queue from an empty one.
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity) : m_slots(capacity + 1) {}
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	// Producer thread. Leaves item untouched and returns false when the queue is full.
+	bool TryPush(T& item)
+	{
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		const size_t next = Next(tail);
+		if (next == m_head.load(std::memory_order_acquire))
+			return false;
+		m_slots[tail] = std::move(item);
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer thread. Returns false when the queue is empty.
+	bool TryPop(T& item)
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(m_slots[head]);
+		m_slots[head] = T();
+		m_head.store(Next(head), std::memory_order_release);
+		return true;
+	}
+
+	// Only exact when called from one of the two threads while the other is idle
+	bool Empty() const
+	{
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	}
+
+private:
+	size_t Next(size_t index) const { return index + 1 == m_slots.size() ? 0 : index + 1; }
+
+	std::vector<T>		m_slots;
+	// Kept on separate cache lines so the two threads don't bounce one line between them
+	alignas(64) std::atomic<size_t> m_head{ 0 };
+	alignas(64) std::atomic<size_t> m_tail{ 0 };
+};
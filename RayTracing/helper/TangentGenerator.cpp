@@ -0,0 +1,184 @@
+#include "stdafx.h"
+#include "TangentGenerator.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <xmmintrin.h>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Below this the texture mapping of a triangle is treated as collapsed
+	const float kMinTexCoordArea = 1e-12f;
+
+	// Length of (x, y, z) for 4 vectors at once, 0 stays 0
+	__m128 Length(__m128 x, __m128 y, __m128 z)
+	{
+		return _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+	}
+
+	// scale / length where length > 0, otherwise 0
+	__m128 SafeScale(__m128 scale, __m128 length)
+	{
+		__m128 valid = _mm_cmpgt_ps(length, _mm_setzero_ps());
+		return _mm_and_ps(valid, _mm_div_ps(scale, _mm_or_ps(length, _mm_andnot_ps(valid, _mm_set1_ps(1.0f)))));
+	}
+
+	struct FaceFrame
+	{
+		__m128 Tangent;		// xyz, w unused
+		__m128 Bitangent;
+	};
+
+	// Weighted texture space directions of 4 triangles starting at index first, missing triangles
+	// of the last group count as degenerate. Returns how many of them were degenerate.
+	UINT SetupFaces(const Vertex_Model* vertices, const UINT* indices, size_t first, size_t triangleCount, FaceFrame* faces)
+	{
+		alignas(16) float p[3][3][4], uv[3][2][4];
+		for (int t = 0; t < 4; ++t) {
+			for (int corner = 0; corner < 3; ++corner) {
+				// Missing triangles repeat the first one and are masked below
+				size_t triangle = first + t < triangleCount ? first + t : first;
+				const Vertex_Model& v = vertices[indices[triangle * 3 + corner]];
+				p[corner][0][t] = v.Position.x;
+				p[corner][1][t] = v.Position.y;
+				p[corner][2][t] = v.Position.z;
+				uv[corner][0][t] = v.TexCoord.x;
+				uv[corner][1][t] = v.TexCoord.y;
+			}
+		}
+
+		__m128 e1[3], e2[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 p0 = _mm_load_ps(p[0][axis]);
+			e1[axis] = _mm_sub_ps(_mm_load_ps(p[1][axis]), p0);
+			e2[axis] = _mm_sub_ps(_mm_load_ps(p[2][axis]), p0);
+		}
+		const __m128 u0 = _mm_load_ps(uv[0][0]), v0 = _mm_load_ps(uv[0][1]);
+		const __m128 du1 = _mm_sub_ps(_mm_load_ps(uv[1][0]), u0), dv1 = _mm_sub_ps(_mm_load_ps(uv[1][1]), v0);
+		const __m128 du2 = _mm_sub_ps(_mm_load_ps(uv[2][0]), u0), dv2 = _mm_sub_ps(_mm_load_ps(uv[2][1]), v0);
+
+		// The sign of the texture space area flips the directions of mirrored triangles
+		const __m128 det = _mm_sub_ps(_mm_mul_ps(du1, dv2), _mm_mul_ps(du2, dv1));
+		const __m128 sign = _mm_and_ps(det, _mm_set1_ps(-0.0f));
+		const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+
+		__m128 s[3], b[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			s[axis] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(e1[axis], dv2), _mm_mul_ps(e2[axis], dv1)), sign);
+			b[axis] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(e2[axis], du1), _mm_mul_ps(e1[axis], du2)), sign);
+		}
+
+		// Twice the triangle area as the weight
+		const __m128 area = Length(_mm_sub_ps(_mm_mul_ps(e1[1], e2[2]), _mm_mul_ps(e1[2], e2[1])),
+			_mm_sub_ps(_mm_mul_ps(e1[2], e2[0]), _mm_mul_ps(e1[0], e2[2])),
+			_mm_sub_ps(_mm_mul_ps(e1[0], e2[1]), _mm_mul_ps(e1[1], e2[0])));
+		__m128 valid = _mm_and_ps(_mm_cmpgt_ps(absDet, _mm_set1_ps(kMinTexCoordArea)), _mm_cmpgt_ps(area, _mm_setzero_ps()));
+		const __m128 sScale = _mm_and_ps(valid, SafeScale(area, Length(s[0], s[1], s[2])));
+		const __m128 bScale = _mm_and_ps(valid, SafeScale(area, Length(b[0], b[1], b[2])));
+
+		alignas(16) float out[6][4];
+		for (int axis = 0; axis < 3; ++axis) {
+			_mm_store_ps(out[axis], _mm_mul_ps(s[axis], sScale));
+			_mm_store_ps(out[3 + axis], _mm_mul_ps(b[axis], bScale));
+		}
+		const int validMask = _mm_movemask_ps(valid);
+
+		UINT degenerate = 0;
+		for (int t = 0; t < 4 && first + t < triangleCount; ++t) {
+			faces[t].Tangent = _mm_setr_ps(out[0][t], out[1][t], out[2][t], 0.0f);
+			faces[t].Bitangent = _mm_setr_ps(out[3][t], out[4][t], out[5][t], 0.0f);
+			if (!(validMask & (1 << t)))
+				++degenerate;
+		}
+		return degenerate;
+	}
+
+	float Dot(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		return a.x * b.x + a.y * b.y + a.z * b.z;
+	}
+
+	XMFLOAT3 Cross(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		return XMFLOAT3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+	}
+}
+
+void TangentGenerator::Generate(const Vertex_Model* vertices, size_t vertexCount, const UINT* indices, size_t indexCount,
+	XMFLOAT4* tangents, TangentStats& stats)
+{
+	const size_t triangleCount = indexCount / 3;
+	stats.Vertices += vertexCount;
+	stats.Triangles += triangleCount;
+
+	// Sums of the tangent and bitangent directions per vertex
+	std::vector<FaceFrame> sums(vertexCount, FaceFrame{ _mm_setzero_ps(), _mm_setzero_ps() });
+	FaceFrame faces[4];
+	for (size_t first = 0; first < triangleCount; first += 4) {
+		stats.DegenerateTriangles += SetupFaces(vertices, indices, first, triangleCount, faces);
+		const size_t count = (std::min)(size_t(4), triangleCount - first);
+		for (size_t t = 0; t < count; ++t) {
+			for (int corner = 0; corner < 3; ++corner) {
+				UINT index = indices[(first + t) * 3 + corner];
+				sums[index].Tangent = _mm_add_ps(sums[index].Tangent, faces[t].Tangent);
+				sums[index].Bitangent = _mm_add_ps(sums[index].Bitangent, faces[t].Bitangent);
+			}
+		}
+	}
+
+	UINT64 fallback = 0;
+	for (size_t i = 0; i < vertexCount; ++i) {
+		alignas(16) float s[4], b[4];
+		_mm_store_ps(s, sums[i].Tangent);
+		_mm_store_ps(b, sums[i].Bitangent);
+
+		XMFLOAT3 n = vertices[i].Normal;
+		float nLength = std::sqrt(Dot(n, n));
+		n = nLength > 0.0f ? XMFLOAT3(n.x / nLength, n.y / nLength, n.z / nLength) : XMFLOAT3(0.0f, 0.0f, 1.0f);
+
+		// Gram-Schmidt against the normal
+		XMFLOAT3 t(s[0], s[1], s[2]);
+		float d = Dot(n, t);
+		t = XMFLOAT3(t.x - n.x * d, t.y - n.y * d, t.z - n.z * d);
+		float tLength = std::sqrt(Dot(t, t));
+		if (!(tLength > 1e-20f)) {
+			// Any direction in the tangent plane, from the axis least aligned with the normal
+			XMFLOAT3 axis = std::fabs(n.x) < 0.9f ? XMFLOAT3(1.0f, 0.0f, 0.0f) : XMFLOAT3(0.0f, 1.0f, 0.0f);
+			t = Cross(axis, n);
+			tLength = std::sqrt(Dot(t, t));
+			++fallback;
+		}
+		t = XMFLOAT3(t.x / tLength, t.y / tLength, t.z / tLength);
+
+		float w = Dot(Cross(n, t), XMFLOAT3(b[0], b[1], b[2])) < 0.0f ? -1.0f : 1.0f;
+		tangents[i] = XMFLOAT4(t.x, t.y, t.z, w);
+	}
+	stats.FallbackVertices += fallback;
+}
+
+void TangentGenerator::GenerateMeshes(std::vector<MeshData>& meshes, TangentStats& stats)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<TangentStats> meshStats(meshes.size());
+	ThreadPool::Default().ParallelFor(meshes.size(), [&](size_t i) {
+		MeshData& mesh = meshes[i];
+		// The LOD ranges reuse the vertices, only the base level shapes the frames
+		const size_t indexCount = mesh.Lods.empty() ? mesh.Indices.size() : mesh.Lods[0].IndexCount;
+		mesh.Tangents.resize(mesh.Vertices.size());
+		Generate(mesh.Vertices.data(), mesh.Vertices.size(), mesh.Indices.data(), indexCount, mesh.Tangents.data(), meshStats[i]);
+	});
+
+	for (auto& s : meshStats) {
+		stats.Vertices += s.Vertices;
+		stats.Triangles += s.Triangles;
+		stats.DegenerateTriangles += s.DegenerateTriangles;
+		stats.FallbackVertices += s.FallbackVertices;
+	}
+	stats.GenerateMs += ElapsedMs(start);
+}
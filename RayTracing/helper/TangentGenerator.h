@@ -0,0 +1,28 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct TangentStats
+{
+	UINT64	Vertices = 0;
+	UINT64	Triangles = 0;
+	UINT64	DegenerateTriangles = 0;	// no area in position or texture space, they don't contribute
+	UINT64	FallbackVertices = 0;		// no usable triangle, the tangent is any direction orthogonal to the normal
+	double	GenerateMs = 0.0;
+	double	AssimpMs = 0.0;				// aiProcess_CalcTangentSpace on the same import, 0 when not timed
+};
+
+// Per vertex tangent frames for Vertex_Tangent, our replacement for aiProcess_CalcTangentSpace.
+// Every triangle contributes its texture space directions, normalized and weighted by the triangle
+// area, to its three corners. The sum is made orthogonal to the vertex normal, the handedness
+// goes into w: bitangent = cross(normal, tangent.xyz) * tangent.w.
+class TangentGenerator
+{
+public:
+	// tangents receives vertexCount entries. Triangles are set up 4 at a time with SSE.
+	static void Generate(const Vertex_Model* vertices, size_t vertexCount, const UINT* indices, size_t indexCount,
+		XMFLOAT4* tangents, TangentStats& stats);
+	// Fills MeshData::Tangents of every mesh from its base level, meshes in parallel
+	static void GenerateMeshes(std::vector<MeshData>& meshes, TangentStats& stats);
+};
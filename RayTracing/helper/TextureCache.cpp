@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "TextureCache.h"
+#include <cstdio>
+#include <fstream>
+
+namespace
+{
+	struct TextureCacheHeader
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint64_t PathHash;
+		uint64_t SourceTime;
+		uint64_t SourceSize;
+		uint32_t Options;
+		uint32_t Format;
+		uint32_t Width;
+		uint32_t Height;
+		uint32_t LevelCount;
+		uint32_t Reserved;
+		uint64_t PayloadOffset;
+		uint64_t PayloadBytes;
+		uint64_t FileSize;
+	};
+
+	// D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT, the payload starts where a placed footprint could
+	const uint64_t kPayloadAlignment = 512;
+
+	// FNV-1a
+	uint64_t HashString(const std::string& text)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (char c : text)
+			hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+		return hash;
+	}
+}
+
+bool TextureCache::GetKey(const std::string& source, uint32_t options, TextureCacheKey& key)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	std::wstring wstrname = std::wstring(source.begin(), source.end());
+	if (!GetFileAttributesExW(wstrname.c_str(), GetFileExInfoStandard, &attributes))
+		return false;
+
+	key.PathHash = HashString(source);
+	key.SourceTime = (uint64_t(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+	key.SourceSize = (uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	key.Options = options;
+	return true;
+}
+
+bool TextureCache::Write(const std::string& cacheName, const TextureCacheKey& key, DXGI_FORMAT format, uint32_t width, uint32_t height,
+	const std::vector<TextureCacheLevel>& levels, const uint8_t* payload, uint64_t payloadBytes)
+{
+	const uint64_t headerBytes = sizeof(TextureCacheHeader) + sizeof(TextureCacheLevel) * levels.size();
+
+	TextureCacheHeader header = {};
+	header.Magic = kMagic;
+	header.Version = kVersion;
+	header.PathHash = key.PathHash;
+	header.SourceTime = key.SourceTime;
+	header.SourceSize = key.SourceSize;
+	header.Options = key.Options;
+	header.Format = static_cast<uint32_t>(format);
+	header.Width = width;
+	header.Height = height;
+	header.LevelCount = static_cast<uint32_t>(levels.size());
+	header.PayloadOffset = (headerBytes + kPayloadAlignment - 1) & ~(kPayloadAlignment - 1);
+	header.PayloadBytes = payloadBytes;
+	header.FileSize = header.PayloadOffset + payloadBytes;
+
+	std::ofstream out(cacheName, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+
+	static const char zeros[kPayloadAlignment] = {};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(levels.data()), sizeof(TextureCacheLevel) * levels.size());
+	out.write(zeros, static_cast<std::streamsize>(header.PayloadOffset - headerBytes));
+	out.write(reinterpret_cast<const char*>(payload), static_cast<std::streamsize>(payloadBytes));
+
+	if (!out.good()) {
+		out.close();
+		std::remove(cacheName.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool TextureCache::Open(const std::string& cacheName, const TextureCacheKey& key)
+{
+	Close();
+	if (!m_file.Open(cacheName))
+		return false;
+
+	const uint8_t* data = m_file.Data();
+	const uint64_t size = m_file.Size();
+	if (size < sizeof(TextureCacheHeader)) {
+		Close();
+		return false;
+	}
+
+	TextureCacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (header.Magic != kMagic || header.Version != kVersion || header.FileSize != size ||
+		header.PathHash != key.PathHash || header.SourceTime != key.SourceTime || header.SourceSize != key.SourceSize ||
+		header.Options != key.Options || header.LevelCount == 0 || header.LevelCount > 16 ||
+		sizeof(TextureCacheHeader) + sizeof(TextureCacheLevel) * uint64_t(header.LevelCount) > header.PayloadOffset ||
+		header.PayloadOffset + header.PayloadBytes != size) {
+		Close();
+		return false;
+	}
+
+	m_levels.resize(header.LevelCount);
+	memcpy(m_levels.data(), data + sizeof(TextureCacheHeader), sizeof(TextureCacheLevel) * m_levels.size());
+	for (auto& level : m_levels) {
+		if (level.Offset + uint64_t(level.RowPitch) * level.Rows > header.PayloadBytes + level.RowPitch) {
+			Close();
+			return false;
+		}
+	}
+
+	m_format = static_cast<DXGI_FORMAT>(header.Format);
+	m_width = header.Width;
+	m_height = header.Height;
+	m_payload = data + header.PayloadOffset;
+	m_payloadBytes = header.PayloadBytes;
+	return true;
+}
+
+void TextureCache::Close()
+{
+	m_file.Close();
+	m_levels.clear();
+	m_format = DXGI_FORMAT_UNKNOWN;
+	m_width = m_height = 0;
+	m_payload = nullptr;
+	m_payloadBytes = 0;
+}
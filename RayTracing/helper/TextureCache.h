@@ -0,0 +1,63 @@
+#pragma once
+
+#include "stdafx.h"
+#include "helper/MappedFile.h"
+#include <vector>
+
+// Everything a cooked texture depends on. A cache whose key differs is cooked again.
+struct TextureCacheKey
+{
+	uint64_t PathHash = 0;
+	uint64_t SourceTime = 0;	// last write time of the source file
+	uint64_t SourceSize = 0;
+	uint32_t Options = 0;		// processing: block format choice, mips, usage
+};
+
+// Where one mip level sits in the payload
+struct TextureCacheLevel
+{
+	uint64_t Offset;
+	uint32_t RowPitch;
+	uint32_t Rows;
+};
+
+// Versioned binary file holding one texture after decoding, mip generation and block compression.
+// A header with the key, format, size and level layout is followed by the payload of every level,
+// laid out like the copy footprint of the resource (GetCopyableFootprints). A warm load maps the file
+// and copies the payload into the upload buffer in one piece, nothing is decoded.
+class TextureCache
+{
+public:
+	static const uint32_t kMagic = 0x43545452; // "RTTC"
+	static const uint32_t kVersion = 2;
+
+	TextureCache() = default;
+	TextureCache(const TextureCache&) = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+
+	// Key of the source file as it is now, false if it can't be found
+	static bool GetKey(const std::string& source, uint32_t options, TextureCacheKey& key);
+	static bool Write(const std::string& cacheName, const TextureCacheKey& key, DXGI_FORMAT format, uint32_t width, uint32_t height,
+		const std::vector<TextureCacheLevel>& levels, const uint8_t* payload, uint64_t payloadBytes);
+
+	// Fails if the file is missing, corrupted or was cooked with another key
+	bool Open(const std::string& cacheName, const TextureCacheKey& key);
+	void Close();
+
+	DXGI_FORMAT GetFormat() const { return m_format; }
+	uint32_t GetWidth() const { return m_width; }
+	uint32_t GetHeight() const { return m_height; }
+	const std::vector<TextureCacheLevel>& GetLevels() const { return m_levels; }
+	// Points into the mapping, valid until Close
+	const uint8_t* GetPayload() const { return m_payload; }
+	uint64_t GetPayloadBytes() const { return m_payloadBytes; }
+
+private:
+	MappedFile						m_file;
+	DXGI_FORMAT						m_format = DXGI_FORMAT_UNKNOWN;
+	uint32_t						m_width = 0;
+	uint32_t						m_height = 0;
+	std::vector<TextureCacheLevel>	m_levels;
+	const uint8_t*					m_payload = nullptr;
+	uint64_t						m_payloadBytes = 0;
+};
@@ -1,7 +1,54 @@
 #include "stdafx.h"
 #include "TextureLoader.h"
 #include "DXSampleHelper.h"
+#include "ImageDecoder.h"
+#include "MappedFile.h"
 #include "WICTextureLoader12.h"
+#include <chrono>
+#include <iostream>
+#include <unordered_set>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Pool threads never joined the MTA themselves, WIC decoding needs it
+	struct ComScope
+	{
+		ComScope() : Result(CoInitializeEx(nullptr, COINITBASE_MULTITHREADED)) {}
+		~ComScope() { if (SUCCEEDED(Result)) CoUninitialize(); }
+		HRESULT Result;
+	};
+
+	// From scratch when given, otherwise owned by the caller
+	uint8_t* AllocateBytes(size_t bytes, ScratchArena* scratch, std::unique_ptr<uint8_t[]>& owned)
+	{
+		if (scratch)
+			return scratch->AllocateArray<uint8_t>(bytes);
+		owned.reset(new (std::nothrow) uint8_t[bytes]);
+		return owned.get();
+	}
+
+	size_t AlignPitch(size_t bytes)
+	{
+		return (bytes + D3D12_TEXTURE_DATA_PITCH_ALIGNMENT - 1) & ~size_t(D3D12_TEXTURE_DATA_PITCH_ALIGNMENT - 1);
+	}
+
+	DXGI_FORMAT GetDxgiFormat(BlockFormat format, bool srgb)
+	{
+		switch (format) {
+		case BlockFormat::BC1: return srgb ? DXGI_FORMAT_BC1_UNORM_SRGB : DXGI_FORMAT_BC1_UNORM;
+		case BlockFormat::BC3: return srgb ? DXGI_FORMAT_BC3_UNORM_SRGB : DXGI_FORMAT_BC3_UNORM;
+		case BlockFormat::BC4: return DXGI_FORMAT_BC4_UNORM;
+		case BlockFormat::BC5: return DXGI_FORMAT_BC5_UNORM;
+		case BlockFormat::BC7: return srgb ? DXGI_FORMAT_BC7_UNORM_SRGB : DXGI_FORMAT_BC7_UNORM;
+		default: return srgb ? DXGI_FORMAT_R8G8B8A8_UNORM_SRGB : DXGI_FORMAT_R8G8B8A8_UNORM;
+		}
+	}
+}
 
 void TextureLoader::Initialize(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList)
 {
@@ -10,49 +57,442 @@ void TextureLoader::Initialize(ID3D12Device* device, ID3D12GraphicsCommandList*
 	ThrowIfFailed(CoInitializeEx(nullptr, COINITBASE_MULTITHREADED));
 }
 
-bool TextureLoader::Load(std::string filename,std::shared_ptr<Texture> texture)
+bool TextureLoader::Load(std::string filename,std::shared_ptr<Texture>& texture, ScratchArena* scratch)
+{
+	DecodedTexture decoded;
+	if (!Decode(filename, decoded, scratch, BlockCompressor::GetUsage(texture->Type, filename)))
+		return false;
+	return Upload(decoded, texture);
+}
+
+bool TextureLoader::Decode(const std::string& filename, DecodedTexture& decoded, ScratchArena* scratch, TextureUsage usage) const
 {
-	ComPtr<ID3D12Resource>		loadedTexture;
-	std::unique_ptr<uint8_t[]>	decodedData;
-	D3D12_SUBRESOURCE_DATA		subresource;
+	return Decode(filename, decoded, scratch, usage, m_textureCache);
+}
 
-	//std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+bool TextureLoader::Decode(const std::string& filename, DecodedTexture& decoded, ScratchArena* scratch, TextureUsage usage,
+	bool textureCache) const
+{
+	decoded.FileName = filename;
+	if (m_portableDecode && textureCache && LoadCooked(filename, usage, decoded))
+		return true;
+	if (m_portableDecode && DecodePortable(filename, decoded, scratch, usage)) {
+		if (textureCache)
+			WriteCooked(filename, usage, decoded);
+		return true;
+	}
 
-	texture->FileName = filename;
 	std::wstring wstrname = std::wstring(filename.begin(), filename.end());
 	TextureInfo info;
-	ThrowIfFailed(LoadWICTextureFromFile(m_device, wstrname.c_str(),
-		loadedTexture.ReleaseAndGetAddressOf(), decodedData, subresource, info));
+	decoded.Subresources.resize(1);
+	HRESULT hr = LoadWICTextureFromFileEx(m_device, wstrname.c_str(), 0, D3D12_RESOURCE_FLAG_NONE, WIC_LOADER_DEFAULT,
+		decoded.Resource.ReleaseAndGetAddressOf(), decoded.Data, decoded.Subresources[0], info, scratch);
+	if (FAILED(hr)) {
+		std::cout << "TextureLoader: failed to decode " << filename << " (hr 0x" << std::hex << hr << std::dec << ")" << std::endl;
+		return false;
+	}
+	return true;
+}
 
+bool TextureLoader::DecodePortable(const std::string& filename, DecodedTexture& decoded, ScratchArena* scratch, TextureUsage usage) const
+{
+	MappedFile file;
+	ImageInfo info;
+	if (!file.Open(filename) || !ImageDecoder::ReadInfo(file.Data(), file.Size(), info))
+		return false;
+
+	// Rows at the pitch of the copy footprint, UpdateSubresources copies the image in one piece
+	const size_t rowPitch = AlignPitch(size_t(info.Width) * 4);
+	uint8_t* pixels = AllocateBytes(rowPitch * info.Height, scratch, decoded.Data);
+	if (!pixels || !ImageDecoder::Decode(file.Data(), file.Size(), info, pixels, rowPitch)) {
+		std::cout << "TextureLoader: " << filename << ": " << (pixels ? ImageDecoder::GetLastError() : "out of memory")
+			<< ", decoding with WIC" << std::endl;
+		decoded.Data.reset();
+		return false;
+	}
+
+	// Same format WIC picks for these files, unless the image gets block compressed. Color textures are
+	// sRGB whether or not the file says so, the mips are filtered in linear light and sampled through an
+	// _SRGB format that matches.
+	const BlockFormat blockFormat = m_blockCompression
+		? BlockCompressor::ChooseFormat(usage, m_blockQuality, pixels, rowPitch, info.Width, info.Height) : BlockFormat::None;
+	const bool srgb = info.SRGB || usage == TextureUsage::Color;
+	const UINT16 levels = static_cast<UINT16>(m_mipGeneration ? MipGenerator::GetLevelCount(info.Width, info.Height) : 1);
+	CD3DX12_RESOURCE_DESC desc = CD3DX12_RESOURCE_DESC::Tex2D(GetDxgiFormat(blockFormat, srgb), info.Width, info.Height, 1, levels);
+	if (blockFormat == BlockFormat::None && levels == 1) {
+		decoded.Subresources.assign(1, { pixels, static_cast<LONG_PTR>(rowPitch), static_cast<LONG_PTR>(rowPitch * info.Height) });
+		decoded.Payload = pixels;
+		m_device->GetCopyableFootprints(&desc, 0, 1, 0, nullptr, nullptr, nullptr, &decoded.PayloadBytes);
+	}
+	else if (!BuildLevels(desc, blockFormat, srgb, pixels, rowPitch, decoded, scratch)) {
+		std::cout << "TextureLoader: " << filename << ": out of memory, decoding with WIC" << std::endl;
+		decoded.Data.reset();
+		return false;
+	}
 
-	const UINT64 texBufferSize = GetRequiredIntermediateSize(loadedTexture.Get(), 0, 1);
+	HRESULT hr = m_device->CreateCommittedResource(&helper::kDefaultHeapProps, D3D12_HEAP_FLAG_NONE, &desc, D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr, IID_PPV_ARGS(decoded.Resource.ReleaseAndGetAddressOf()));
+	if (FAILED(hr)) {
+		decoded.Data.reset();
+		decoded.Subresources.clear();
+		return false;
+	}
+	return true;
+}
+
+// Every level in the copy footprint of the resource, in one buffer the upload copies in one pass. The mips
+// are filtered from the RGBA8 top level on the default pool, then block compressed when the format is.
+bool TextureLoader::BuildLevels(const D3D12_RESOURCE_DESC& desc, BlockFormat blockFormat, bool srgb, uint8_t* pixels, size_t rowPitch,
+	DecodedTexture& decoded, ScratchArena* scratch) const
+{
+	const UINT levels = desc.MipLevels;
+	std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> layouts(levels);
+	std::vector<UINT> rows(levels);
+	std::vector<UINT64> rowBytes(levels);
+	UINT64 totalBytes = 0;
+	m_device->GetCopyableFootprints(&desc, 0, levels, 0, layouts.data(), rows.data(), rowBytes.data(), &totalBytes);
+
+	std::unique_ptr<uint8_t[]> payloadOwned, chainOwned;
+	uint8_t* payload = AllocateBytes(static_cast<size_t>(totalBytes), scratch, payloadOwned);
+	if (!payload)
+		return false;
+
+	// RGBA8 levels for the filter: the payload itself, or a chain next to it that gets compressed
+	const UINT width = static_cast<UINT>(desc.Width), height = desc.Height;
+	std::vector<MipLevel> chain(levels);
+	chain[0] = { pixels, rowPitch, width, height };
+	if (blockFormat == BlockFormat::None) {
+		for (UINT level = 0; level < levels; ++level) {
+			chain[level] = { payload + layouts[level].Offset, layouts[level].Footprint.RowPitch,
+				MipGenerator::GetLevelSize(width, level), MipGenerator::GetLevelSize(height, level) };
+		}
+		for (UINT y = 0; y < height; ++y)
+			memcpy(chain[0].Data + y * chain[0].RowPitch, pixels + y * rowPitch, size_t(width) * 4);
+	}
+	else if (levels > 1) {
+		size_t chainBytes = 0;
+		for (UINT level = 1; level < levels; ++level)
+			chainBytes += size_t(MipGenerator::GetLevelSize(width, level)) * 4 * MipGenerator::GetLevelSize(height, level);
+		uint8_t* data = AllocateBytes(chainBytes, scratch, chainOwned);
+		if (!data)
+			return false;
+		for (UINT level = 1; level < levels; ++level) {
+			const UINT levelWidth = MipGenerator::GetLevelSize(width, level), levelHeight = MipGenerator::GetLevelSize(height, level);
+			chain[level] = { data, size_t(levelWidth) * 4, levelWidth, levelHeight };
+			data += size_t(levelWidth) * 4 * levelHeight;
+		}
+	}
+
+	ThreadPool& pool = ThreadPool::Default();
+	MipGenerator::Generate(chain.data(), levels, srgb, m_mipFilter, pool);
+	if (blockFormat != BlockFormat::None) {
+		for (UINT level = 0; level < levels; ++level) {
+			BlockCompressor::Compress(chain[level].Data, chain[level].RowPitch, chain[level].Width, chain[level].Height, blockFormat,
+				m_blockQuality, payload + layouts[level].Offset, layouts[level].Footprint.RowPitch, pool);
+		}
+	}
+
+	decoded.Subresources.resize(levels);
+	for (UINT level = 0; level < levels; ++level) {
+		const LONG_PTR pitch = static_cast<LONG_PTR>(layouts[level].Footprint.RowPitch);
+		decoded.Subresources[level] = { payload + layouts[level].Offset, pitch, pitch * rows[level] };
+	}
+	decoded.Payload = payload;
+	decoded.PayloadBytes = totalBytes;
+	if (payloadOwned)
+		decoded.Data = std::move(payloadOwned);
+	return true;
+}
+
+bool TextureLoader::GetCacheKey(const std::string& filename, TextureUsage usage, TextureCacheKey& key) const
+{
+	// Everything that changes the payload
+	uint32_t options = static_cast<uint32_t>(usage);
+	options |= (m_blockCompression ? 1u : 0u) << 2;
+	options |= static_cast<uint32_t>(m_blockQuality) << 3;
+	options |= (m_mipGeneration ? 1u : 0u) << 4;
+	options |= static_cast<uint32_t>(m_mipFilter) << 5;
+	return TextureCache::GetKey(filename, options, key);
+}
+
+bool TextureLoader::LoadCooked(const std::string& filename, TextureUsage usage, DecodedTexture& decoded) const
+{
+	TextureCacheKey key;
+	std::unique_ptr<TextureCache> cooked = std::make_unique<TextureCache>();
+	if (!GetCacheKey(filename, usage, key) || !cooked->Open(filename + ".texcache", key))
+		return false;
+
+	// The payload is only usable as it is if this device lays the levels out the same way
+	const std::vector<TextureCacheLevel>& levels = cooked->GetLevels();
+	const UINT count = static_cast<UINT>(levels.size());
+	CD3DX12_RESOURCE_DESC desc = CD3DX12_RESOURCE_DESC::Tex2D(cooked->GetFormat(), cooked->GetWidth(), cooked->GetHeight(), 1,
+		static_cast<UINT16>(count));
+	std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> layouts(count);
+	std::vector<UINT> rows(count);
+	UINT64 totalBytes = 0;
+	m_device->GetCopyableFootprints(&desc, 0, count, 0, layouts.data(), rows.data(), nullptr, &totalBytes);
+	if (totalBytes != cooked->GetPayloadBytes())
+		return false;
+	for (UINT level = 0; level < count; ++level) {
+		if (layouts[level].Offset != levels[level].Offset || layouts[level].Footprint.RowPitch != levels[level].RowPitch ||
+			rows[level] != levels[level].Rows)
+			return false;
+	}
+
+	HRESULT hr = m_device->CreateCommittedResource(&helper::kDefaultHeapProps, D3D12_HEAP_FLAG_NONE, &desc, D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr, IID_PPV_ARGS(decoded.Resource.ReleaseAndGetAddressOf()));
+	if (FAILED(hr))
+		return false;
+
+	decoded.Subresources.resize(count);
+	for (UINT level = 0; level < count; ++level) {
+		const LONG_PTR pitch = static_cast<LONG_PTR>(levels[level].RowPitch);
+		decoded.Subresources[level] = { cooked->GetPayload() + levels[level].Offset, pitch, pitch * levels[level].Rows };
+	}
+	decoded.Payload = cooked->GetPayload();
+	decoded.PayloadBytes = cooked->GetPayloadBytes();
+	decoded.Cooked = std::move(cooked);
+	return true;
+}
+
+void TextureLoader::WriteCooked(const std::string& filename, TextureUsage usage, const DecodedTexture& decoded) const
+{
+	TextureCacheKey key;
+	if (!decoded.Payload || !GetCacheKey(filename, usage, key))
+		return;
+
+	const D3D12_RESOURCE_DESC desc = decoded.Resource->GetDesc();
+	const UINT count = desc.MipLevels;
+	std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> layouts(count);
+	std::vector<UINT> rows(count);
+	m_device->GetCopyableFootprints(&desc, 0, count, 0, layouts.data(), rows.data(), nullptr, nullptr);
+	std::vector<TextureCacheLevel> levels(count);
+	for (UINT level = 0; level < count; ++level)
+		levels[level] = { layouts[level].Offset, layouts[level].Footprint.RowPitch, rows[level] };
+
+	if (!TextureCache::Write(filename + ".texcache", key, desc.Format, static_cast<uint32_t>(desc.Width), desc.Height, levels,
+		decoded.Payload, decoded.PayloadBytes)) {
+		std::cout << "TextureLoader: failed to write " << filename << ".texcache" << std::endl;
+	}
+}
+
+bool TextureLoader::Upload(DecodedTexture& decoded, std::shared_ptr<Texture>& texture)
+{
+	ID3D12Resource* loadedTexture = decoded.Resource.Get();
+	texture->FileName = decoded.FileName;
+
+	// Another load of the same file got here first
+	std::shared_ptr<Texture> registered = m_index.Insert(decoded.FileName, texture);
+	if (registered != texture) {
+		texture = registered;
+		decoded.Data.reset();
+		decoded.Cooked.reset();
+		return true;
+	}
+
+	// Every mip level goes through one upload buffer, copied in a single pass
+	const UINT levels = static_cast<UINT>(decoded.Subresources.size());
+	const UINT64 texBufferSize = GetRequiredIntermediateSize(loadedTexture, 0, levels);
 	texture->UploadResource = helper::CreateBuffer(m_device, texBufferSize, 
 		D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ, helper::kUploadHeapProps);
 
-	UpdateSubresources(m_cmdList, loadedTexture.Get(), texture->UploadResource.Get(),0, 0, 1, &subresource);
-	CD3DX12_RESOURCE_BARRIER barr = CD3DX12_RESOURCE_BARRIER::Transition(loadedTexture.Get(),
+	if (decoded.Payload && decoded.PayloadBytes == texBufferSize) {
+		// Already laid out like the footprint, one memcpy instead of one per row
+		std::vector<D3D12_PLACED_SUBRESOURCE_FOOTPRINT> layouts(levels);
+		const D3D12_RESOURCE_DESC desc = loadedTexture->GetDesc();
+		m_device->GetCopyableFootprints(&desc, 0, levels, 0, layouts.data(), nullptr, nullptr, nullptr);
+		void* mapped = nullptr;
+		ThrowIfFailed(texture->UploadResource->Map(0, nullptr, &mapped));
+		memcpy(mapped, decoded.Payload, static_cast<size_t>(decoded.PayloadBytes));
+		texture->UploadResource->Unmap(0, nullptr);
+		for (UINT level = 0; level < levels; ++level) {
+			CD3DX12_TEXTURE_COPY_LOCATION dst(loadedTexture, level);
+			CD3DX12_TEXTURE_COPY_LOCATION src(texture->UploadResource.Get(), layouts[level]);
+			m_cmdList->CopyTextureRegion(&dst, 0, 0, 0, &src, nullptr);
+		}
+	}
+	else {
+		UpdateSubresources(m_cmdList, loadedTexture, texture->UploadResource.Get(), 0, 0, levels, decoded.Subresources.data());
+	}
+	CD3DX12_RESOURCE_BARRIER barr = CD3DX12_RESOURCE_BARRIER::Transition(loadedTexture,
 		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
 	m_cmdList->ResourceBarrier(1, &barr);
 
-	texture->Resource = loadedTexture;
+	texture->Resource = decoded.Resource;
+	decoded.Data.reset();
+	decoded.Cooked.reset();
 
 	m_textureLoaded.push_back(texture);
 
 	return true;
 }
 
-ID3D12DescriptorHeap* TextureLoader::GenerateHeap()
+bool TextureLoader::DecodePlaceholder(const std::string& filename, TextureUsage usage, DecodedTexture& decoded) const
+{
+	decoded = DecodedTexture();
+	decoded.FileName = filename;
+	const size_t rowPitch = AlignPitch(4);
+	uint8_t* pixels = AllocateBytes(rowPitch, nullptr, decoded.Data);
+	if (!pixels)
+		return false;
+	const uint8_t white[4] = { 255, 255, 255, 255 }, flatNormal[4] = { 128, 128, 255, 255 };
+	memcpy(pixels, usage == TextureUsage::Normal ? flatNormal : white, 4);
+
+	CD3DX12_RESOURCE_DESC desc = CD3DX12_RESOURCE_DESC::Tex2D(GetDxgiFormat(BlockFormat::None, false), 1, 1, 1, 1);
+	decoded.Subresources.assign(1, { pixels, static_cast<LONG_PTR>(rowPitch), static_cast<LONG_PTR>(rowPitch) });
+	decoded.Payload = pixels;
+	m_device->GetCopyableFootprints(&desc, 0, 1, 0, nullptr, nullptr, nullptr, &decoded.PayloadBytes);
+	HRESULT hr = m_device->CreateCommittedResource(&helper::kDefaultHeapProps, D3D12_HEAP_FLAG_NONE, &desc, D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr, IID_PPV_ARGS(decoded.Resource.ReleaseAndGetAddressOf()));
+	if (FAILED(hr)) {
+		decoded = DecodedTexture();
+		return false;
+	}
+	return true;
+}
+
+bool TextureLoader::LoadBatch(const std::vector<TextureRequest>& requests, ThreadPool& pool, TextureBatchStats* stats)
+{
+	TextureBatchStats batch;
+	batch.Requested = static_cast<UINT>(requests.size());
+	batch.Threads = pool.GetThreadCount();
+
+	// First request of every file not loaded yet, in request order
+	std::vector<TextureRequest> pending;
+	std::unordered_set<std::string> seen;
+	std::string canonical;
+	for (auto& request : requests) {
+		TexturePathIndex::Canonicalize(request.FileName, m_index.GetFoldCase(), canonical);
+		if (m_index.Find(request.FileName) || !seen.insert(canonical).second) {
+			++batch.Reused;
+			continue;
+		}
+		pending.push_back(request);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<DecodedTexture> decoded;
+	std::vector<UINT8> succeeded;
+	DecodeBatch(pending, pool, decoded, succeeded);
+	batch.DecodeMs = ElapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < pending.size(); ++i) {
+		if (!succeeded[i]) {
+			++batch.Failed;
+			continue;
+		}
+		batch.DecodedBytes += decoded[i].Subresources[0].SlicePitch;
+		std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+		texture->Type = pending[i].Type;
+		Upload(decoded[i], texture);
+		++batch.Decoded;
+	}
+	batch.UploadMs = ElapsedMs(start);
+
+	if (stats)
+		*stats = batch;
+	return batch.Failed == 0;
+}
+
+void TextureLoader::DecodeBatch(const std::vector<TextureRequest>& requests, ThreadPool& pool, std::vector<DecodedTexture>& decoded,
+	std::vector<UINT8>& succeeded) const
 {
-	if (m_textureLoaded.empty()) return nullptr;
+	// Every decode owns its slot, nothing is shared but the device
+	decoded.clear();
+	decoded.resize(requests.size());
+	succeeded.assign(requests.size(), 0);
+	pool.ParallelFor(requests.size(), [&](size_t i) {
+		ComScope com;
+		const TextureUsage usage = BlockCompressor::GetUsage(requests[i].Type, requests[i].FileName);
+		succeeded[i] = Decode(requests[i].FileName, decoded[i], nullptr, usage) ? 1 : 0;
+	});
+}
 
-	ID3D12DescriptorHeap*  m_srvTexHeap = helper::CreateDescriptorHeap(m_device, m_textureLoaded.size(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true);
+void TextureLoader::RunBenchmark(const std::vector<UINT>& threadCounts) const
+{
+	if (m_textureLoaded.empty())
+		return;
+
+	for (UINT threads : threadCounts) {
+		// The resources are released unused, the copies were never recorded
+		ThreadPool pool(threads);
+		std::vector<DecodedTexture> decoded(m_textureLoaded.size());
+		auto start = std::chrono::high_resolution_clock::now();
+		pool.ParallelFor(decoded.size(), [&](size_t i) {
+			ComScope com;
+			Decode(m_textureLoaded[i]->FileName, decoded[i], nullptr,
+				BlockCompressor::GetUsage(m_textureLoaded[i]->Type, m_textureLoaded[i]->FileName), false);
+		});
+		double ms = ElapsedMs(start);
+
+		UINT64 bytes = 0;
+		for (auto& texture : decoded) {
+			if (!texture.Subresources.empty())
+				bytes += texture.Subresources[0].SlicePitch;
+		}
+		std::cout << "TextureLoader benchmark: " << decoded.size() << " textures, " << bytes / (1024 * 1024) << " MB decoded with "
+			<< threads << (threads == 1 ? " thread in " : " threads in ") << ms << " ms" << std::endl;
+	}
+}
+
+void TextureLoader::RunCacheBenchmark() const
+{
+	if (m_textureLoaded.empty() || !m_portableDecode || !m_textureCache)
+		return;
+
+	// The copy stands in for the one into the upload buffer, the mapped pages are first read there
+	std::vector<uint8_t> upload;
+	auto measure = [&](bool cooked) {
+		UINT count = 0;
+		UINT64 bytes = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (auto& texture : m_textureLoaded) {
+			DecodedTexture decoded;
+			const TextureUsage usage = BlockCompressor::GetUsage(texture->Type, texture->FileName);
+			const bool loaded = cooked ? LoadCooked(texture->FileName, usage, decoded) : DecodePortable(texture->FileName, decoded, nullptr, usage);
+			if (!loaded || !decoded.Payload)
+				continue;
+			upload.resize(static_cast<size_t>(decoded.PayloadBytes));
+			memcpy(upload.data(), decoded.Payload, upload.size());
+			bytes += decoded.PayloadBytes;
+			++count;
+		}
+		double ms = ElapsedMs(start);
+		std::cout << "TextureLoader cache benchmark: " << count << " textures, " << bytes / (1024 * 1024) << " MB "
+			<< (cooked ? "mapped from the cache in " : "decoded from the source in ") << ms << " ms" << std::endl;
+	};
+	measure(false);
+	measure(true);
+}
+
+ID3D12DescriptorHeap* TextureLoader::GenerateHeap(UINT capacity)
+{
+	m_heapCapacity = (std::max)(capacity, static_cast<UINT>(m_textureLoaded.size()));
+	m_heapCount = 0;
+	if (m_heapCapacity == 0) return nullptr;
+
+	ID3D12DescriptorHeap*  m_srvTexHeap = helper::CreateDescriptorHeap(m_device, m_heapCapacity, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true);
+	UpdateHeap(m_srvTexHeap);
+
+	return m_srvTexHeap;
+}
+
+void TextureLoader::UpdateHeap(ID3D12DescriptorHeap* heap)
+{
+	if (!heap) return;
 
 	UINT cbvSrvUavDescriptorSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-	CD3DX12_CPU_DESCRIPTOR_HANDLE handle(m_srvTexHeap->GetCPUDescriptorHandleForHeapStart());
-	int srvheapIndex = 0;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE handle(heap->GetCPUDescriptorHandleForHeapStart(), m_heapCount, cbvSrvUavDescriptorSize);
 
-	for (auto& text : m_textureLoaded) {
-		text->SrvHeapIndex = srvheapIndex++;
+	for (; m_heapCount < m_textureLoaded.size(); ++m_heapCount) {
+		if (m_heapCount == m_heapCapacity) {
+			std::cout << "TextureLoader: descriptor heap full, " << m_textureLoaded.size() - m_heapCount
+				<< " textures are not bound" << std::endl;
+			return;
+		}
+		auto& text = m_textureLoaded[m_heapCount];
+		text->SrvHeapIndex = m_heapCount;
 
 		D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc{};
 		srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
@@ -65,8 +505,6 @@ ID3D12DescriptorHeap* TextureLoader::GenerateHeap()
 
 		handle.Offset(1, cbvSrvUavDescriptorSize);
 	}
-
-	return m_srvTexHeap;
 }
 
 std::vector<std::shared_ptr<Texture>>& TextureLoader::GetTextureLoaded()
@@ -1,8 +1,50 @@
 #pragma once
 
 #include "core/D3DUtility.h"
+#include "BlockCompressor.h"
+#include "MipGenerator.h"
+#include "ScratchArena.h"
+#include "TextureCache.h"
+#include "TexturePathIndex.h"
+#include "ThreadPool.h"
 
 using namespace Microsoft::WRL;
+
+// CPU half of a texture load: the decoded pixels and the resource they will be copied into, one
+// subresource per mip level. Pixels decoded into a scratch arena leave Data empty and are only valid
+// until the arena is rewound.
+struct DecodedTexture
+{
+	std::string FileName;
+	ComPtr<ID3D12Resource> Resource;
+	std::unique_ptr<uint8_t[]> Data;
+	std::vector<D3D12_SUBRESOURCE_DATA> Subresources;
+	// Set when every level sits in one block laid out like the copy footprint of Resource, Upload
+	// then copies it into the upload buffer in one piece
+	const uint8_t* Payload = nullptr;
+	UINT64 PayloadBytes = 0;
+	// Mapped cooked texture Payload points into
+	std::unique_ptr<TextureCache> Cooked;
+};
+
+struct TextureRequest
+{
+	std::string FileName;
+	std::string Type;
+};
+
+struct TextureBatchStats
+{
+	UINT	Requested = 0;
+	UINT	Decoded = 0;
+	UINT	Reused = 0;			// loaded before, or requested twice in the batch
+	UINT	Failed = 0;
+	UINT	Threads = 0;
+	UINT64	DecodedBytes = 0;	// top level pixels
+	double	DecodeMs = 0.0;		// wall clock of the parallel decode
+	double	UploadMs = 0.0;		// recording the copies
+};
+
 class TextureLoader
 {
 public:
@@ -12,15 +54,88 @@ public:
 
 	void Initialize(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList);
 	//Load resource to your texture,you need make_shared first
-	bool Load(std::string filename,std::shared_ptr<Texture> texture);
+	// The decoded pixels come from scratch when given, the copy is recorded before Load returns
+	bool Load(std::string filename,std::shared_ptr<Texture>& texture, ScratchArena* scratch = nullptr);
+	// Load in two steps. Decode only uses the device and can run on any thread that joined
+	// the MTA, Upload records the copy on the command list. When the file was uploaded before,
+	// texture is replaced by the texture already loaded from it. Usage picks the block format.
+	bool Decode(const std::string& filename, DecodedTexture& decoded, ScratchArena* scratch = nullptr,
+		TextureUsage usage = TextureUsage::Color) const;
+	bool Upload(DecodedTexture& decoded, std::shared_ptr<Texture>& texture);
+	// 1x1 stand-in for a file that failed to decode, white or a flat normal for usage. It is uploaded
+	// under filename, so later lookups of the file find it instead of loading it again.
+	bool DecodePlaceholder(const std::string& filename, TextureUsage usage, DecodedTexture& decoded) const;
+	// Decodes the files that aren't loaded yet concurrently on pool, then records their uploads in one
+	// pass in request order, so SrvHeapIndex doesn't depend on which decode finished first. Files that
+	// fail are reported and skipped, the result is false if any did. Every decoded image is held until
+	// the upload pass.
+	bool LoadBatch(const std::vector<TextureRequest>& requests, ThreadPool& pool, TextureBatchStats* stats = nullptr);
+	// Decode step of LoadBatch: every request concurrently on pool into decoded[i], succeeded[i] is 0 for
+	// the ones that failed. Requests are decoded as given, duplicates twice.
+	void DecodeBatch(const std::vector<TextureRequest>& requests, ThreadPool& pool, std::vector<DecodedTexture>& decoded,
+		std::vector<UINT8>& succeeded) const;
 
-	ID3D12DescriptorHeap* GenerateHeap();
+	// Texture loaded from filename, or null. Any spelling of the path finds it, see TexturePathIndex.
+	std::shared_ptr<Texture> Find(const std::string& filename) const { return m_index.Find(filename); }
+	// Case-insensitive path matching, set before loading
+	void SetFoldPathCase(bool foldCase) { m_index.SetFoldCase(foldCase); }
+	bool GetFoldPathCase() const { return m_index.GetFoldCase(); }
+	// PNG, JPEG and TGA files go through ImageDecoder unless disabled, everything else and the files
+	// it can't decode through WIC
+	void SetPortableDecode(bool portable) { m_portableDecode = portable; }
+	// Images ImageDecoder decoded are block compressed before the upload unless disabled, in the format
+	// BlockCompressor picks for the texture type. Sizes that aren't multiples of 4 stay RGBA8.
+	void SetBlockCompression(bool enabled, BlockQuality quality = BlockQuality::Fast)
+	{
+		m_blockCompression = enabled;
+		m_blockQuality = quality;
+	}
+	// Full mip chains for the images ImageDecoder decoded unless disabled. Color textures are filtered
+	// in linear light and get an _SRGB format, they are authored in sRGB whether or not the file says so.
+	void SetMipGeneration(bool enabled, MipFilter filter = MipFilter::Box)
+	{
+		m_mipGeneration = enabled;
+		m_mipFilter = filter;
+	}
+	// Images ImageDecoder decoded are cooked into "<texture>.texcache" next to the source unless
+	// disabled, later loads map that file instead while the source and the settings above are unchanged
+	void SetTextureCache(bool enabled) { m_textureCache = enabled; }
+
+	// At least capacity descriptors, UpdateHeap fills in textures loaded after this call
+	ID3D12DescriptorHeap* GenerateHeap(UINT capacity = 0);
+	void UpdateHeap(ID3D12DescriptorHeap* heap);
 	std::vector<std::shared_ptr<Texture>>& GetTextureLoaded();
 
+	// Wall clock of decoding every loaded file again with each thread count, nothing is uploaded.
+	// Always from the source files, the texture cache is bypassed.
+	void RunBenchmark(const std::vector<UINT>& threadCounts) const;
+	// Startup cost of every loaded file decoded from its source against loaded from its cooked copy,
+	// up to the payload copied out once as the upload would
+	void RunCacheBenchmark() const;
+
 private:
+	// Decode with the cooked textures used and written only when textureCache is set
+	bool Decode(const std::string& filename, DecodedTexture& decoded, ScratchArena* scratch, TextureUsage usage, bool textureCache) const;
+	bool DecodePortable(const std::string& filename, DecodedTexture& decoded, ScratchArena* scratch, TextureUsage usage) const;
+	bool BuildLevels(const D3D12_RESOURCE_DESC& desc, BlockFormat blockFormat, bool srgb, uint8_t* pixels, size_t rowPitch,
+		DecodedTexture& decoded, ScratchArena* scratch) const;
+	// Cooked texture handling, "<filename>.texcache" keyed on the source and the settings for usage
+	bool GetCacheKey(const std::string& filename, TextureUsage usage, TextureCacheKey& key) const;
+	bool LoadCooked(const std::string& filename, TextureUsage usage, DecodedTexture& decoded) const;
+	void WriteCooked(const std::string& filename, TextureUsage usage, const DecodedTexture& decoded) const;
+
 	ID3D12Device* m_device;
 	ID3D12GraphicsCommandList* m_cmdList;
 
 	std::vector<std::shared_ptr<Texture>>	m_textureLoaded;
+	TexturePathIndex						m_index;
+	UINT									m_heapCapacity = 0;
+	UINT									m_heapCount = 0;	// textures with a descriptor
+	bool									m_portableDecode = true;
+	bool									m_blockCompression = true;
+	BlockQuality							m_blockQuality = BlockQuality::Fast;
+	bool									m_mipGeneration = true;
+	MipFilter								m_mipFilter = MipFilter::Box;
+	bool									m_textureCache = true;
 };
 
@@ -0,0 +1,156 @@
+#include "stdafx.h"
+#include "TexturePathIndex.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+namespace
+{
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Lookups canonicalize into this buffer, it stops allocating once it fits the longest path
+	thread_local std::string t_canonical;
+}
+
+void TexturePathIndex::SetFoldCase(bool foldCase)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_foldCase = foldCase;
+}
+
+std::shared_ptr<Texture> TexturePathIndex::Find(const std::string& path) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Canonicalize(path, m_foldCase, t_canonical);
+	auto found = m_textures.find(t_canonical);
+	return found != m_textures.end() ? found->second : nullptr;
+}
+
+std::shared_ptr<Texture> TexturePathIndex::Insert(const std::string& path, const std::shared_ptr<Texture>& texture)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Canonicalize(path, m_foldCase, t_canonical);
+	return m_textures.emplace(t_canonical, texture).first->second;
+}
+
+size_t TexturePathIndex::GetCount() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_textures.size();
+}
+
+void TexturePathIndex::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_textures.clear();
+}
+
+void TexturePathIndex::Canonicalize(const std::string& path, bool foldCase, std::string& out)
+{
+	out.clear();
+	const bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\');
+	if (absolute)
+		out.push_back('/');
+
+	// Segments that can't be resolved, leading ".." of a relative path
+	size_t fixed = out.size();
+	size_t begin = 0;
+	while (begin < path.size()) {
+		size_t end = begin;
+		while (end < path.size() && path[end] != '/' && path[end] != '\\')
+			++end;
+		const size_t length = end - begin;
+
+		const bool parent = length == 2 && path[begin] == '.' && path[begin + 1] == '.';
+		if (length == 0 || (length == 1 && path[begin] == '.') || (parent && absolute && out.size() == fixed)) {
+			// Repeated separator, "." or ".." above the root
+		}
+		else if (parent && out.size() > fixed) {
+			// Drop the last segment and its separator
+			size_t last = out.find_last_of('/');
+			out.resize(last == std::string::npos || last < fixed ? fixed : last);
+		}
+		else {
+			if (out.size() > (absolute ? 1u : 0u))
+				out.push_back('/');
+			for (size_t i = begin; i < end; ++i) {
+				char c = path[i];
+				if (foldCase && c >= 'A' && c <= 'Z')
+					c = static_cast<char>(c - 'A' + 'a');
+				out.push_back(c);
+			}
+			if (parent)
+				fixed = out.size();
+		}
+		begin = end + 1;
+	}
+}
+
+void TexturePathIndex::RunBenchmark(UINT materialCount, UINT textureCount)
+{
+	std::mt19937 random(12345);
+	const std::string directory = "Resource/Model/benchmark";
+
+	// Every material references a diffuse and a specular map, spelled the way exporters do
+	std::vector<std::string> files(textureCount);
+	for (UINT i = 0; i < textureCount; ++i)
+		files[i] = "textures/material_" + std::to_string(i) + ".png";
+	std::vector<std::string> refs(size_t(materialCount) * 2);
+	for (auto& ref : refs) {
+		const std::string& file = files[random() % textureCount];
+		switch (random() % 3) {
+		case 0: ref = file; break;
+		case 1: ref = "./" + file; break;
+		default: ref = "textures\\" + file.substr(9); break;
+		}
+	}
+
+	// The old lookup: a concatenated path per comparison against every texture loaded so far. It only
+	// matches identical spellings, so it loads more textures than there are files. Quadratic, so it
+	// only runs on the first references and the cost per lookup is compared.
+	const size_t scanCount = (std::min)(refs.size(), size_t(2000));
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<std::shared_ptr<Texture>> loaded;
+	for (size_t i = 0; i < scanCount; ++i) {
+		const std::string& ref = refs[i];
+		bool skip = false;
+		for (UINT j = 0; j < loaded.size(); j++) {
+			std::string tempstr = directory + "/" + ref;
+			if (std::strcmp(loaded[j]->FileName.c_str(), tempstr.c_str()) == 0) {
+				skip = true;
+				break;
+			}
+		}
+		if (!skip) {
+			std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+			texture->FileName = directory + "/" + ref;
+			loaded.push_back(texture);
+		}
+	}
+	double scanMs = ElapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	TexturePathIndex index;
+	std::string path;
+	UINT hits = 0;
+	for (auto& ref : refs) {
+		path.assign(directory).append("/").append(ref);
+		if (index.Find(path)) {
+			++hits;
+			continue;
+		}
+		std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+		texture->FileName = path;
+		index.Insert(path, texture);
+	}
+	double indexMs = ElapsedMs(start);
+
+	std::cout << "TexturePathIndex: " << materialCount << " materials, " << refs.size() << " references to " << textureCount
+		<< " files: hash index " << indexMs << " ms (" << indexMs * 1000.0 / refs.size() << " us per reference, "
+		<< index.GetCount() << " textures, " << hits << " hits), linear scan over the first " << scanCount << " references "
+		<< scanMs << " ms (" << scanMs * 1000.0 / scanCount << " us per reference, " << loaded.size() << " textures)" << std::endl;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+#include <mutex>
+#include <unordered_map>
+
+// Loaded textures by canonical file path. Paths are compared after turning '\' into '/', collapsing
+// repeated separators and resolving "." and ".." segments, optionally case-folded. Every canonical
+// path is stored once as the key of its texture. Find and Insert lock, so loaders on several threads
+// share one entry per file.
+class TexturePathIndex
+{
+public:
+	explicit TexturePathIndex(bool foldCase = false) : m_foldCase(foldCase) {}
+	TexturePathIndex(const TexturePathIndex&) = delete;
+	TexturePathIndex& operator=(const TexturePathIndex&) = delete;
+
+	// Only takes effect for textures inserted afterwards
+	void SetFoldCase(bool foldCase);
+	bool GetFoldCase() const { return m_foldCase; }
+
+	std::shared_ptr<Texture> Find(const std::string& path) const;
+	// Registers texture under path, unless another texture already has it. Returns the registered one.
+	std::shared_ptr<Texture> Insert(const std::string& path, const std::shared_ptr<Texture>& texture);
+	size_t GetCount() const;
+	void Clear();
+
+	static void Canonicalize(const std::string& path, bool foldCase, std::string& out);
+
+	// materialCount materials with a diffuse and a specular map out of textureCount files, spelled
+	// with mixed separators, against the linear scan over the loaded list this replaces
+	static void RunBenchmark(UINT materialCount, UINT textureCount);
+
+private:
+	mutable std::mutex	m_mutex;
+	std::unordered_map<std::string, std::shared_ptr<Texture>> m_textures;
+	bool				m_foldCase;
+};
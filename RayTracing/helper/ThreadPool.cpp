@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace
+{
+	thread_local bool t_insideJob = false;
+	thread_local ThreadPool* t_default = nullptr;
+}
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+{
+	if (threadCount == 0)
+		threadCount = (std::max)(1u, std::thread::hardware_concurrency());
+
+	for (unsigned int i = 1; i < threadCount; ++i)
+		m_threads.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+ThreadPool& ThreadPool::Default()
+{
+	if (t_default)
+		return *t_default;
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::SetThreadDefault(ThreadPool* pool)
+{
+	t_default = pool;
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+	if (count == 0)
+		return;
+
+	// Nested calls and tiny batches are not worth a wake up
+	if (t_insideJob || count == 1 || m_threads.empty()) {
+		for (size_t i = 0; i < count; ++i)
+			func(i);
+		return;
+	}
+
+	Batch batch;
+	batch.Job = &func;
+	batch.Count = count;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_batches.push_back(&batch);
+	}
+	m_wake.notify_all();
+
+	RunItems(batch);
+
+	// Every item is claimed, no worker joins anymore, wait for the ones still running an item
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_batches.erase(std::find(m_batches.begin(), m_batches.end(), &batch));
+	m_done.wait(lock, [&] { return batch.Workers == 0; });
+
+	if (batch.Error)
+		std::rethrow_exception(batch.Error);
+}
+
+void ThreadPool::RunItems(Batch& batch)
+{
+	t_insideJob = true;
+	for (size_t i = batch.Next++; i < batch.Count; i = batch.Next++) {
+		try {
+			(*batch.Job)(i);
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!batch.Error)
+				batch.Error = std::current_exception();
+		}
+	}
+	t_insideJob = false;
+}
+
+ThreadPool::Batch* ThreadPool::FindBatch() const
+{
+	for (Batch* batch : m_batches) {
+		if (batch->Next.load() < batch->Count)
+			return batch;
+	}
+	return nullptr;
+}
+
+void ThreadPool::WorkerLoop()
+{
+	for (;;) {
+		Batch* batch = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_stop || (batch = FindBatch()) != nullptr; });
+			if (m_stop)
+				return;
+			++batch->Workers;
+		}
+
+		RunItems(*batch);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--batch->Workers;
+		}
+		m_done.notify_all();
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads used by the loaders to spread independent work items.
+// ParallelFor blocks until every item ran; calls made from inside a job run serially.
+// Several threads can submit at once, each call is its own batch and the workers take items from
+// the oldest one that has any left. The lock is only held to add or remove a batch.
+class ThreadPool
+{
+public:
+	// 0 uses one thread per hardware core
+	explicit ThreadPool(unsigned int threadCount = 0);
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool();
+
+	// Runs func(i) for every i in [0, count), the calling thread helps.
+	// The first exception thrown by a job is rethrown once all items are done.
+	void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+	// Workers plus the calling thread
+	unsigned int GetThreadCount() const { return static_cast<unsigned int>(m_threads.size()) + 1; }
+
+	// Shared pool, or the one set with SetThreadDefault on the calling thread
+	static ThreadPool& Default();
+	// Background threads give themselves their own workers, so their batches don't take the shared
+	// ones from the render thread. nullptr goes back to the shared pool.
+	static void SetThreadDefault(ThreadPool* pool);
+
+private:
+	// One ParallelFor call, lives on the stack of the caller
+	struct Batch
+	{
+		const std::function<void(size_t)>* Job = nullptr;
+		size_t				Count = 0;
+		std::atomic<size_t>	Next{ 0 };
+		unsigned int		Workers = 0;	// workers running items of this batch, guarded by m_mutex
+		std::exception_ptr	Error;
+	};
+
+	void WorkerLoop();
+	void RunItems(Batch& batch);
+	// Oldest batch with items left, m_mutex must be held
+	Batch* FindBatch() const;
+
+	std::vector<std::thread>	m_threads;
+	std::mutex					m_mutex;
+	std::condition_variable		m_wake;
+	std::condition_variable		m_done;
+	std::vector<Batch*>			m_batches;	// in submission order, removed by their caller
+	bool						m_stop = false;
+};
@@ -249,6 +249,14 @@ void TopLevelASGenerator::Generate(
   commandList->ResourceBarrier(1, &uavBarrier);
 }
 
+//--------------------------------------------------------------------------------------------------
+//
+// Remove all instances before rebuilding the structure with a new instance set
+void TopLevelASGenerator::Reset()
+{
+  m_instances.clear();
+}
+
 //--------------------------------------------------------------------------------------------------
 //
 //
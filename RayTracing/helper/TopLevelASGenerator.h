@@ -131,6 +131,11 @@ public:
                                                /// if an iterative update is requested
   );
 
+  /// Remove all instances, so the structure can be rebuilt from scratch with a
+  /// different instance set. The instance transforms are held by reference, the
+  /// instances have to be added again whenever their storage moves
+  void Reset();
+
 private:
   /// nv_helpers_dx12 struct storing the instance data
   struct Instance
@@ -0,0 +1,195 @@
+#include "stdafx.h"
+#include "VertexCompression.h"
+#include "ThreadPool.h"
+#include <DirectXPackedVector.h>
+#include <chrono>
+#include <cmath>
+
+using namespace DirectX::PackedVector;
+
+namespace
+{
+	const size_t kVerticesPerTask = 64 * 1024;
+
+	INT16 ToSnorm16(float v)
+	{
+		v = (std::max)(-1.0f, (std::min)(1.0f, v));
+		return static_cast<INT16>(std::lround(v * 32767.0f));
+	}
+
+	// Same conversion as the SNORM formats, -32768 clamps to -1
+	float FromSnorm16(INT16 v)
+	{
+		return (std::max)(-1.0f, v / 32767.0f);
+	}
+
+	float SafeInverse(float v)
+	{
+		return v > 0.0f ? 1.0f / v : 0.0f;
+	}
+
+	void EncodeRange(const Vertex_Model* vertices, const XMFLOAT4* tangents, size_t begin, size_t end, VertexFormat format,
+		const VertexQuantization& q, UINT8* out)
+	{
+		if (format == VertexFormat::Compact) {
+			Vertex_Compact* dst = reinterpret_cast<Vertex_Compact*>(out);
+			for (size_t i = begin; i < end; ++i) {
+				const Vertex_Model& v = vertices[i];
+				dst[i].Position = v.Position;
+				VertexCompression::OctEncode(v.Normal, dst[i].Normal);
+				dst[i].TexCoord[0] = XMConvertFloatToHalf(v.TexCoord.x);
+				dst[i].TexCoord[1] = XMConvertFloatToHalf(v.TexCoord.y);
+			}
+		}
+		else if (format == VertexFormat::CompactQuantized) {
+			const XMFLOAT3 scale(SafeInverse(q.Extent.x), SafeInverse(q.Extent.y), SafeInverse(q.Extent.z));
+			Vertex_Quantized* dst = reinterpret_cast<Vertex_Quantized*>(out);
+			for (size_t i = begin; i < end; ++i) {
+				const Vertex_Model& v = vertices[i];
+				dst[i].Position[0] = ToSnorm16((v.Position.x - q.Center.x) * scale.x);
+				dst[i].Position[1] = ToSnorm16((v.Position.y - q.Center.y) * scale.y);
+				dst[i].Position[2] = ToSnorm16((v.Position.z - q.Center.z) * scale.z);
+				dst[i].Position[3] = 32767;
+				VertexCompression::OctEncode(v.Normal, dst[i].Normal);
+				dst[i].TexCoord[0] = XMConvertFloatToHalf(v.TexCoord.x);
+				dst[i].TexCoord[1] = XMConvertFloatToHalf(v.TexCoord.y);
+			}
+		}
+		else if (format == VertexFormat::FullTangent) {
+			Vertex_Tangent* dst = reinterpret_cast<Vertex_Tangent*>(out);
+			for (size_t i = begin; i < end; ++i) {
+				memcpy(&dst[i], &vertices[i], sizeof(Vertex_Model));
+				dst[i].Tangent = tangents[i];
+			}
+		}
+		else {
+			memcpy(out + begin * sizeof(Vertex_Model), vertices + begin, (end - begin) * sizeof(Vertex_Model));
+		}
+	}
+}
+
+UINT VertexCompression::GetStride(VertexFormat format)
+{
+	switch (format) {
+	case VertexFormat::Compact:				return sizeof(Vertex_Compact);
+	case VertexFormat::CompactQuantized:	return sizeof(Vertex_Quantized);
+	case VertexFormat::FullTangent:			return sizeof(Vertex_Tangent);
+	default:								return sizeof(Vertex_Model);
+	}
+}
+
+DXGI_FORMAT VertexCompression::GetPositionFormat(VertexFormat format)
+{
+	return format == VertexFormat::CompactQuantized ? DXGI_FORMAT_R16G16B16A16_SNORM : DXGI_FORMAT_R32G32B32_FLOAT;
+}
+
+VertexQuantization VertexCompression::ComputeQuantization(const Vertex_Model* vertices, size_t count)
+{
+	VertexQuantization q;
+	if (count == 0)
+		return q;
+
+	XMFLOAT3 lo = vertices[0].Position, hi = vertices[0].Position;
+	for (size_t i = 1; i < count; ++i) {
+		const XMFLOAT3& p = vertices[i].Position;
+		lo = XMFLOAT3((std::min)(lo.x, p.x), (std::min)(lo.y, p.y), (std::min)(lo.z, p.z));
+		hi = XMFLOAT3((std::max)(hi.x, p.x), (std::max)(hi.y, p.y), (std::max)(hi.z, p.z));
+	}
+	q.Center = XMFLOAT3((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+	q.Extent = XMFLOAT3((hi.x - lo.x) * 0.5f, (hi.y - lo.y) * 0.5f, (hi.z - lo.z) * 0.5f);
+	return q;
+}
+
+void VertexCompression::Encode(const Vertex_Model* vertices, size_t count, VertexFormat format,
+	const VertexQuantization& quantization, UINT8* out, const XMFLOAT4* tangents)
+{
+	size_t taskCount = (count + kVerticesPerTask - 1) / kVerticesPerTask;
+	ThreadPool::Default().ParallelFor(taskCount, [&](size_t task) {
+		size_t begin = task * kVerticesPerTask;
+		size_t end = (std::min)(begin + kVerticesPerTask, count);
+		EncodeRange(vertices, tangents, begin, end, format, quantization, out);
+	});
+}
+
+Vertex_Model VertexCompression::Decode(const void* vertices, size_t index, VertexFormat format, const VertexQuantization& q)
+{
+	Vertex_Model v;
+	if (format == VertexFormat::Compact) {
+		const Vertex_Compact& src = static_cast<const Vertex_Compact*>(vertices)[index];
+		v.Position = src.Position;
+		v.Normal = OctDecode(src.Normal);
+		v.TexCoord = XMFLOAT2(XMConvertHalfToFloat(src.TexCoord[0]), XMConvertHalfToFloat(src.TexCoord[1]));
+	}
+	else if (format == VertexFormat::CompactQuantized) {
+		const Vertex_Quantized& src = static_cast<const Vertex_Quantized*>(vertices)[index];
+		v.Position = XMFLOAT3(q.Center.x + q.Extent.x * FromSnorm16(src.Position[0]),
+			q.Center.y + q.Extent.y * FromSnorm16(src.Position[1]),
+			q.Center.z + q.Extent.z * FromSnorm16(src.Position[2]));
+		v.Normal = OctDecode(src.Normal);
+		v.TexCoord = XMFLOAT2(XMConvertHalfToFloat(src.TexCoord[0]), XMConvertHalfToFloat(src.TexCoord[1]));
+	}
+	else if (format == VertexFormat::FullTangent) {
+		memcpy(&v, static_cast<const Vertex_Tangent*>(vertices) + index, sizeof(Vertex_Model));
+	}
+	else {
+		v = static_cast<const Vertex_Model*>(vertices)[index];
+	}
+	return v;
+}
+
+void VertexCompression::Measure(const Vertex_Model* vertices, size_t count, const UINT8* encoded,
+	VertexFormat format, const VertexQuantization& quantization, VertexCompressionStats& stats)
+{
+	stats.BytesBefore += count * sizeof(Vertex_Model);
+	stats.BytesAfter += count * GetStride(format);
+
+	for (size_t i = 0; i < count; ++i) {
+		const Vertex_Model& a = vertices[i];
+		Vertex_Model b = Decode(encoded, i, format, quantization);
+
+		float dp = (std::max)(std::fabs(a.Position.x - b.Position.x),
+			(std::max)(std::fabs(a.Position.y - b.Position.y), std::fabs(a.Position.z - b.Position.z)));
+		float dt = (std::max)(std::fabs(a.TexCoord.x - b.TexCoord.x), std::fabs(a.TexCoord.y - b.TexCoord.y));
+		stats.MaxPositionError = (std::max)(stats.MaxPositionError, dp);
+		stats.MaxTexCoordError = (std::max)(stats.MaxTexCoordError, dt);
+
+		// Missing normals are stored as zero and can't be compared
+		float length = std::sqrt(a.Normal.x * a.Normal.x + a.Normal.y * a.Normal.y + a.Normal.z * a.Normal.z);
+		if (length > 1e-6f) {
+			float cosAngle = (a.Normal.x * b.Normal.x + a.Normal.y * b.Normal.y + a.Normal.z * b.Normal.z) / length;
+			cosAngle = (std::max)(-1.0f, (std::min)(1.0f, cosAngle));
+			stats.MaxNormalErrorDeg = (std::max)(stats.MaxNormalErrorDeg, std::acos(cosAngle) * 180.0f / XM_PI);
+		}
+	}
+}
+
+void VertexCompression::OctEncode(const XMFLOAT3& n, INT16 out[2])
+{
+	float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+	if (l1 <= 0.0f) {
+		out[0] = out[1] = 0;
+		return;
+	}
+	float x = n.x / l1;
+	float y = n.y / l1;
+	if (n.z < 0.0f) {
+		float fx = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float fy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	out[0] = ToSnorm16(x);
+	out[1] = ToSnorm16(y);
+}
+
+XMFLOAT3 VertexCompression::OctDecode(const INT16 in[2])
+{
+	float x = FromSnorm16(in[0]);
+	float y = FromSnorm16(in[1]);
+	float z = 1.0f - std::fabs(x) - std::fabs(y);
+	float t = (std::max)(-z, 0.0f);
+	x += x >= 0.0f ? -t : t;
+	y += y >= 0.0f ? -t : t;
+	float length = std::sqrt(x * x + y * y + z * z);
+	return XMFLOAT3(x / length, y / length, z / length);
+}
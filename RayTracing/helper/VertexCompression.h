@@ -0,0 +1,40 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct VertexCompressionStats
+{
+	UINT64	BytesBefore = 0;
+	UINT64	BytesAfter = 0;
+	float	MaxPositionError = 0.0f;	// model units
+	float	MaxNormalErrorDeg = 0.0f;
+	float	MaxTexCoordError = 0.0f;
+	double	EncodeMs = 0.0;
+};
+
+// Encoders and decoders for the compact vertex layouts.
+// Decoding mirrors what the input assembler and Hit.hlsl do on the GPU.
+class VertexCompression
+{
+public:
+	static UINT GetStride(VertexFormat format);
+	// Position format for the input layout and the BLAS geometry
+	static DXGI_FORMAT GetPositionFormat(VertexFormat format);
+
+	// Quantization parameters for a set of positions, from its bounding box
+	static VertexQuantization ComputeQuantization(const Vertex_Model* vertices, size_t count);
+
+	// out receives count * GetStride(format) bytes, tangents is only read for VertexFormat::FullTangent
+	static void Encode(const Vertex_Model* vertices, size_t count, VertexFormat format,
+		const VertexQuantization& quantization, UINT8* out, const XMFLOAT4* tangents = nullptr);
+
+	static Vertex_Model Decode(const void* vertices, size_t index, VertexFormat format, const VertexQuantization& quantization);
+
+	// Decodes everything back and measures the error against the source
+	static void Measure(const Vertex_Model* vertices, size_t count, const UINT8* encoded,
+		VertexFormat format, const VertexQuantization& quantization, VertexCompressionStats& stats);
+
+	static void OctEncode(const XMFLOAT3& normal, INT16 out[2]);
+	static XMFLOAT3 OctDecode(const INT16 in[2]);
+};
@@ -0,0 +1,237 @@
+#include "stdafx.h"
+#include "VertexWelder.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+namespace
+{
+	const size_t kVerticesPerTask = 64 * 1024;
+	// Cells are a few epsilons wide, so most vertices are far enough from every face of their cell
+	// that only their own cell has to be searched
+	const float kCellsPerEpsilon = 4.0f;
+	const UINT kNoVertex = UINT_MAX;
+
+	double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	static_assert(sizeof(Vertex_Model) == 8 * sizeof(float), "the comparison loads a vertex as two float4");
+
+	// Cell of a vertex and the neighbours it is within epsilon of, bit 2 * axis for the lower one
+	// and 2 * axis + 1 for the upper one
+	struct WeldCell
+	{
+		int32_t Coord[3];
+		uint32_t Near;
+	};
+
+	uint32_t HashCell(int32_t x, int32_t y, int32_t z)
+	{
+		uint32_t hash = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(z) * 83492791u;
+		return hash ^ (hash >> 15);
+	}
+
+	int32_t ToCell(float value, float invCellSize)
+	{
+		double cell = std::floor(double(value) * invCellSize);
+		return static_cast<int32_t>((std::max)((std::min)(cell, double(INT_MAX)), double(INT_MIN)));
+	}
+
+	uint32_t FloatBits(float value)
+	{
+		// -0 and 0 land in the same cell
+		value += 0.0f;
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	class VertexMatcher
+	{
+	public:
+		VertexMatcher(const WeldOptions& options)
+			: m_eps0(_mm_setr_ps(options.PositionEpsilon, options.PositionEpsilon, options.PositionEpsilon, options.NormalEpsilon)),
+			m_eps1(_mm_setr_ps(options.NormalEpsilon, options.NormalEpsilon, options.TexCoordEpsilon, options.TexCoordEpsilon)),
+			m_abs(_mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)))
+		{
+		}
+
+		// |a - b| <= epsilon for all eight components, position.xyz normal.x and normal.yz texcoord.xy
+		bool operator()(const Vertex_Model& a, const Vertex_Model& b) const
+		{
+			const float* pa = &a.Position.x;
+			const float* pb = &b.Position.x;
+			__m128 d0 = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(pa), _mm_loadu_ps(pb)), m_abs);
+			__m128 d1 = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(pa + 4), _mm_loadu_ps(pb + 4)), m_abs);
+			return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(d0, m_eps0), _mm_cmple_ps(d1, m_eps1))) == 0xF;
+		}
+
+	private:
+		__m128 m_eps0;
+		__m128 m_eps1;
+		__m128 m_abs;
+	};
+
+	template <typename Func>
+	void ForEachRange(size_t count, Func func)
+	{
+		size_t taskCount = (count + kVerticesPerTask - 1) / kVerticesPerTask;
+		ThreadPool::Default().ParallelFor(taskCount, [&](size_t task) {
+			size_t begin = task * kVerticesPerTask;
+			func(begin, (std::min)(begin + kVerticesPerTask, count));
+		});
+	}
+}
+
+void VertexWelder::Weld(MeshData& mesh, const WeldOptions& options, WeldStats& stats)
+{
+	const size_t vertexCount = mesh.Vertices.size();
+	stats.VerticesBefore += vertexCount;
+	stats.TrianglesBefore += mesh.Indices.size() / 3;
+	if (!mesh.Submeshes.empty() || vertexCount == 0 || vertexCount >= kNoVertex) {
+		stats.VerticesAfter += vertexCount;
+		stats.SkippedMeshes += mesh.Submeshes.empty() ? 0 : 1;
+		return;
+	}
+
+	const Vertex_Model* vertices = mesh.Vertices.data();
+	const float epsilon = options.PositionEpsilon;
+	const bool exact = !(epsilon > 0.0f);
+	const float invCellSize = exact ? 0.0f : 1.0f / (epsilon * kCellsPerEpsilon);
+
+	// Cells in parallel, they only depend on their own vertex
+	std::vector<WeldCell> cells(vertexCount);
+	ForEachRange(vertexCount, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const float* p = &vertices[i].Position.x;
+			WeldCell& cell = cells[i];
+			cell.Near = 0;
+			for (int axis = 0; axis < 3; ++axis) {
+				if (exact) {
+					cell.Coord[axis] = static_cast<int32_t>(FloatBits(p[axis]));
+					continue;
+				}
+				cell.Coord[axis] = ToCell(p[axis], invCellSize);
+				// Position inside the cell in units of cells, compared against epsilon in the same units
+				double inside = double(p[axis]) * invCellSize - cell.Coord[axis];
+				const double reach = 1.0 / kCellsPerEpsilon;
+				if (inside <= reach)
+					cell.Near |= 1u << (2 * axis);
+				if (inside >= 1.0 - reach)
+					cell.Near |= 1u << (2 * axis + 1);
+			}
+		}
+	});
+
+	// Chains of kept vertices per hash slot, different cells may share a slot
+	size_t tableSize = 16;
+	while (tableSize < vertexCount * 2)
+		tableSize <<= 1;
+	const size_t mask = tableSize - 1;
+	std::vector<UINT> heads(tableSize, kNoVertex);
+	std::vector<UINT> next(vertexCount, kNoVertex);
+	std::vector<UINT> remap(vertexCount);
+
+	const VertexMatcher matches(options);
+	UINT kept = 0;
+	for (size_t i = 0; i < vertexCount; ++i) {
+		const WeldCell& cell = cells[i];
+		UINT found = kNoVertex;
+
+		// The own cell first, then every combination of the neighbours the vertex is close to
+		int32_t offsets[3][2];
+		int counts[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			counts[axis] = 1;
+			offsets[axis][0] = 0;
+			if (cell.Near & (1u << (2 * axis)))
+				offsets[axis][counts[axis]++] = -1;
+			else if (cell.Near & (1u << (2 * axis + 1)))
+				offsets[axis][counts[axis]++] = 1;
+		}
+		for (int x = 0; x < counts[0] && found == kNoVertex; ++x) {
+			for (int y = 0; y < counts[1] && found == kNoVertex; ++y) {
+				for (int z = 0; z < counts[2] && found == kNoVertex; ++z) {
+					uint32_t hash = HashCell(cell.Coord[0] + offsets[0][x], cell.Coord[1] + offsets[1][y], cell.Coord[2] + offsets[2][z]);
+					for (UINT candidate = heads[hash & mask]; candidate != kNoVertex; candidate = next[candidate]) {
+						if (matches(vertices[candidate], vertices[i])) {
+							found = candidate;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		if (found != kNoVertex) {
+			remap[i] = remap[found];
+			continue;
+		}
+		remap[i] = kept++;
+		size_t slot = HashCell(cell.Coord[0], cell.Coord[1], cell.Coord[2]) & mask;
+		next[i] = heads[slot];
+		heads[slot] = static_cast<UINT>(i);
+	}
+
+	// Kept vertices get consecutive slots in order and only move down, a vertex is kept if its slot
+	// is the next one
+	UINT written = 0;
+	for (size_t i = 0; i < vertexCount; ++i) {
+		if (remap[i] == written)
+			mesh.Vertices[written++] = mesh.Vertices[i];
+	}
+	mesh.Vertices.resize(kept);
+	stats.VerticesAfter += kept;
+
+	std::vector<UINT>& indices = mesh.Indices;
+	ForEachRange(indices.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			indices[i] = remap[indices[i]];
+	});
+
+	if (options.RemoveDegenerates) {
+		size_t write = 0;
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			UINT a = indices[i], b = indices[i + 1], c = indices[i + 2];
+			if (a == b || b == c || a == c) {
+				++stats.DegenerateTriangles;
+				continue;
+			}
+			indices[write++] = a;
+			indices[write++] = b;
+			indices[write++] = c;
+		}
+		indices.resize(write);
+	}
+}
+
+void VertexWelder::WeldMeshes(std::vector<MeshData>& meshes, const WeldOptions& options, WeldStats& stats)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<WeldStats> meshStats(meshes.size());
+	// Inside a pool job the passes of Weld run serially, so meshes big enough to split are welded one
+	// at a time with every thread on their ranges and only the others are spread over the pool
+	std::vector<size_t> small, large;
+	for (size_t i = 0; i < meshes.size(); ++i)
+		(meshes[i].Vertices.size() > kVerticesPerTask ? large : small).push_back(i);
+	ThreadPool::Default().ParallelFor(small.size(), [&](size_t i) {
+		Weld(meshes[small[i]], options, meshStats[small[i]]);
+	});
+	for (size_t i : large)
+		Weld(meshes[i], options, meshStats[i]);
+
+	for (auto& s : meshStats) {
+		stats.VerticesBefore += s.VerticesBefore;
+		stats.VerticesAfter += s.VerticesAfter;
+		stats.TrianglesBefore += s.TrianglesBefore;
+		stats.DegenerateTriangles += s.DegenerateTriangles;
+		stats.SkippedMeshes += s.SkippedMeshes;
+	}
+	stats.WeldMs += ElapsedMs(start);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "stdafx.h"
+#include "core/D3DUtility.h"
+
+struct WeldOptions
+{
+	// Largest difference per component for two vertices to become one, 0 only merges exact copies
+	float	PositionEpsilon = 1e-5f;
+	float	NormalEpsilon = 1e-3f;
+	float	TexCoordEpsilon = 1e-5f;
+	// Drops triangles with two corners on the same vertex after welding
+	bool	RemoveDegenerates = true;
+};
+
+struct WeldStats
+{
+	UINT64	VerticesBefore = 0;
+	UINT64	VerticesAfter = 0;
+	UINT64	TrianglesBefore = 0;
+	UINT64	DegenerateTriangles = 0;
+	UINT	SkippedMeshes = 0;		// meshes with submeshes, welding would break their vertex ranges
+	double	WeldMs = 0.0;
+};
+
+// Merges vertices whose position, normal and texture coordinate are within the epsilons, our
+// replacement for aiProcess_JoinIdenticalVertices. A spatial hash on the position finds the candidates
+// in the vertex's cell and the neighbouring cells it is close to, the attribute comparison is two SSE
+// compares per pair. Each vertex merges into the first earlier vertex that matches and the kept
+// vertices stay in their original order, so the result doesn't depend on the thread count.
+class VertexWelder
+{
+public:
+	static void Weld(MeshData& mesh, const WeldOptions& options, WeldStats& stats);
+	// Small meshes in parallel, meshes larger than one task one after another with their hash and remap in parallel
+	static void WeldMeshes(std::vector<MeshData>& meshes, const WeldOptions& options, WeldStats& stats);
+};
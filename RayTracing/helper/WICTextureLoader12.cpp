@@ -23,6 +23,7 @@
 
 #include "stdafx.h"
 #include "WICTextureLoader12.h"
+#include "ScratchArena.h"
 
 #include <assert.h>
 #include <algorithm>
@@ -270,7 +271,8 @@ namespace
         _Outptr_ ID3D12Resource** texture,
         std::unique_ptr<uint8_t[]>& decodedData,
         D3D12_SUBRESOURCE_DATA& subresource,
-		TextureInfo& texInfo)
+		TextureInfo& texInfo,
+        ScratchArena* scratch)
     {
         UINT width, height;
         HRESULT hr = frame->GetSize(&width, &height);
@@ -397,9 +399,19 @@ namespace
         auto rowPitch = static_cast<size_t>(rowBytes);
         auto imageSize = static_cast<size_t>(numBytes);
 
-        decodedData.reset(new (std::nothrow) uint8_t[imageSize]);
-        if (!decodedData)
-            return E_OUTOFMEMORY;
+        // With a scratch arena the pixels live until the caller rewinds it, decodedData stays empty
+        uint8_t* pixels = nullptr;
+        if (scratch)
+        {
+            pixels = scratch->AllocateArray<uint8_t>(imageSize);
+        }
+        else
+        {
+            decodedData.reset(new (std::nothrow) uint8_t[imageSize]);
+            if (!decodedData)
+                return E_OUTOFMEMORY;
+            pixels = decodedData.get();
+        }
 
         // Load image data
         if (memcmp(&convertGUID, &pixelFormat, sizeof(GUID)) == 0
@@ -407,7 +419,7 @@ namespace
             && theight == height)
         {
             // No format conversion or resize needed
-            hr = frame->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), decodedData.get());
+            hr = frame->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), pixels);
             if (FAILED(hr))
                 return hr;
         }
@@ -435,7 +447,7 @@ namespace
             if (memcmp(&convertGUID, &pfScaler, sizeof(GUID)) == 0)
             {
                 // No format conversion needed
-                hr = scaler->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), decodedData.get());
+                hr = scaler->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), pixels);
                 if (FAILED(hr))
                     return hr;
             }
@@ -457,7 +469,7 @@ namespace
                 if (FAILED(hr))
                     return hr;
 
-                hr = FC->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), decodedData.get());
+                hr = FC->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), pixels);
                 if (FAILED(hr))
                     return hr;
             }
@@ -485,7 +497,7 @@ namespace
             if (FAILED(hr))
                 return hr;
 
-            hr = FC->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), decodedData.get());
+            hr = FC->CopyPixels(nullptr, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), pixels);
             if (FAILED(hr))
                 return hr;
         }
@@ -523,7 +535,7 @@ namespace
 
         _Analysis_assume_(tex != nullptr);
 
-        subresource.pData = decodedData.get();
+        subresource.pData = pixels;
         subresource.RowPitch = rowPitch;
         subresource.SlicePitch = imageSize;
 
@@ -618,7 +630,7 @@ HRESULT DirectX::LoadWICTextureFromMemoryEx(
     hr = CreateTextureFromWIC( d3dDevice,
                                frame.Get(), maxsize,
                                resFlags, loadFlags,
-                               texture, decodedData, subresource, texInfo);
+                               texture, decodedData, subresource, texInfo, nullptr);
     if ( FAILED(hr)) 
         return hr;
 
@@ -664,7 +676,8 @@ HRESULT DirectX::LoadWICTextureFromFileEx(
     ID3D12Resource** texture,
     std::unique_ptr<uint8_t[]>& decodedData,
     D3D12_SUBRESOURCE_DATA& subresource,
-	TextureInfo& texInfo)
+	TextureInfo& texInfo,
+    ScratchArena* scratch)
 {
     if ( texture )
     {
@@ -691,7 +704,7 @@ HRESULT DirectX::LoadWICTextureFromFileEx(
 
     hr = CreateTextureFromWIC( d3dDevice, frame.Get(), maxsize,
                                resFlags, loadFlags,
-                               texture, decodedData, subresource, texInfo);
+                               texture, decodedData, subresource, texInfo, scratch);
 
 #if !defined(NO_D3D12_DEBUG_NAME) && ( defined(_DEBUG) || defined(PROFILE) )
     if ( SUCCEEDED(hr) )
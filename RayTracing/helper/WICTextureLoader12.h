@@ -24,6 +24,8 @@
 #include <stdint.h>
 #include <memory>
 
+class ScratchArena;
+
 struct TextureInfo
 {
 	UINT width;
@@ -74,6 +76,7 @@ namespace DirectX
         D3D12_SUBRESOURCE_DATA& subresource,
 		TextureInfo& texInfo);
 
+    // With scratch the decoded pixels are allocated from the arena instead of decodedData
     HRESULT __cdecl LoadWICTextureFromFileEx(
         _In_ ID3D12Device* d3dDevice,
         _In_z_ const wchar_t* szFileName,
@@ -83,5 +86,6 @@ namespace DirectX
         _Outptr_ ID3D12Resource** texture,
         std::unique_ptr<uint8_t[]>& decodedData,
         D3D12_SUBRESOURCE_DATA& subresource,
-		TextureInfo& texInfo);
+		TextureInfo& texInfo,
+        ScratchArena* scratch = nullptr);
 }
\ No newline at end of file
@@ -1,29 +1,128 @@
 #include "Common.hlsl"
 
+#if defined(COMPACT_VERTEX)
+// Vertex_Compact
+struct STriVertex {
+	float3 position;
+	uint normal;		// octahedral, 2 x snorm16
+	uint texCoord;		// 2 x half
+};
+#elif defined(QUANTIZED_VERTEX)
+// Vertex_Quantized
+struct STriVertex {
+	uint2 position;		// 4 x snorm16 inside the mesh bounds
+	uint normal;
+	uint texCoord;
+};
+#elif defined(TANGENT_VERTEX)
+// Vertex_Tangent
+struct STriVertex {
+	float3 position;
+	float3 normal;
+	float2 texCoord;
+	float4 tangent;		// bitangent = cross(normal, tangent.xyz) * tangent.w
+};
+#else
 struct STriVertex {
 	float3 position;
 	float3 normal;
 	float2 texCoord;
 };
+#endif
 
 StructuredBuffer<STriVertex> BTriVertex : register(t0);
-StructuredBuffer<int> indices : register(t1);
+ByteAddressBuffer indices : register(t1);
+
+cbuffer IndexFormat : register(b0)
+{
+	uint indexSize;		// 2 or 4 bytes
+}
+
+uint3 LoadTriangle(uint primitive)
+{
+	if (indexSize == 2) {
+		// 6 bytes per triangle, the index buffer is padded to whole dwords
+		uint offset = primitive * 6;
+		uint aligned = offset & ~3;
+		uint2 words = indices.Load2(aligned);
+		if (offset == aligned)
+			return uint3(words.x & 0xffff, words.x >> 16, words.y & 0xffff);
+		return uint3(words.x >> 16, words.y & 0xffff, words.y >> 16);
+	}
+	return indices.Load3(primitive * 12);
+}
+
+float2 VertexTexCoord(uint index)
+{
+#if defined(COMPACT_VERTEX) || defined(QUANTIZED_VERTEX)
+	uint packed = BTriVertex[index].texCoord;
+	return float2(f16tof32(packed), f16tof32(packed >> 16));
+#else
+	return BTriVertex[index].texCoord;
+#endif
+}
+
+float3 VertexPosition(uint index)
+{
+#if defined(QUANTIZED_VERTEX)
+	// The instance transform scales [-1, 1] back to the mesh bounds
+	uint2 packed = BTriVertex[index].position;
+	int3 v = int3(int(packed.x << 16) >> 16, int(packed.x) >> 16, int(packed.y << 16) >> 16);
+	return max(float3(v) / 32767.0, -1.0);
+#else
+	return BTriVertex[index].position;
+#endif
+}
+
 Texture2D tex : register(t2);
-SamplerState gsamLinear  : register(s0);
+SamplerState gsamLinear  : register(s2);	// linear wrap, trilinear between the mips TextureLod picks
+
+// Vertical field of view of the camera, 45 degrees
+static const float kTanHalfFovY = 0.41421356;
+
+// Mip level from the footprint of the pixel's ray cone on the triangle: texels per world area of the
+// triangle, the cone width at the hit and how oblique the surface is. Primary rays only, no derivatives
+// in a hit shader.
+float TextureLod(uint3 tri, float2 uv0, float2 uv1, float2 uv2)
+{
+	float3 p0 = mul(ObjectToWorld3x4(), float4(VertexPosition(tri.x), 1.0));
+	float3 p1 = mul(ObjectToWorld3x4(), float4(VertexPosition(tri.y), 1.0));
+	float3 p2 = mul(ObjectToWorld3x4(), float4(VertexPosition(tri.z), 1.0));
+	float3 normal = cross(p1 - p0, p2 - p0);
+	float worldArea = length(normal);
+	if (worldArea <= 0.0)
+		return 0.0;
+
+	uint width, height, levels;
+	tex.GetDimensions(0, width, height, levels);
+	float2 e1 = uv1 - uv0;
+	float2 e2 = uv2 - uv0;
+	float texelArea = abs(e1.x * e2.y - e2.x * e1.y) * width * height;
+
+	float3 direction = WorldRayDirection();
+	float distance = RayTCurrent() * length(direction);
+	float coneWidth = 2.0 * kTanHalfFovY / DispatchRaysDimensions().y * distance;
+	float cosine = max(abs(dot(normal / worldArea, normalize(direction))), 1e-3);
+	return 0.5 * log2(max(texelArea / worldArea, 1e-20)) + log2(coneWidth / cosine);
+}
 
 [shader("closesthit")] void ClosestHit(inout HitInfo payload, Attributes attrib) {
 	float3 barycentrics = float3(1.f - attrib.bary.x - attrib.bary.y, attrib.bary.x, attrib.bary.y);
 	uint vertId = 3 * PrimitiveIndex();
+	uint3 tri = LoadTriangle(PrimitiveIndex());
 	
 	//float3 hitColor = float3(0.3, 0.8, 0.6);
 	//hitColor =	BTriVertex[indices[vertId + 0]].normal * barycentrics.x +
 	//			BTriVertex[indices[vertId + 1]].normal * barycentrics.y +
 	//			BTriVertex[indices[vertId + 2]].normal * barycentrics.z;
 
-	float2 hitTexCoord = BTriVertex[indices[vertId + 0]].texCoord * barycentrics.x +
-						 BTriVertex[indices[vertId + 1]].texCoord * barycentrics.y +
-						 BTriVertex[indices[vertId + 2]].texCoord * barycentrics.z;
-	float4 reColor = tex.SampleLevel(gsamLinear, hitTexCoord,0.0);
+	float2 uv0 = VertexTexCoord(tri.x);
+	float2 uv1 = VertexTexCoord(tri.y);
+	float2 uv2 = VertexTexCoord(tri.z);
+	float2 hitTexCoord = uv0 * barycentrics.x +
+						 uv1 * barycentrics.y +
+						 uv2 * barycentrics.z;
+	float4 reColor = tex.SampleLevel(gsamLinear, hitTexCoord, TextureLod(tri, uv0, uv1, uv2));
 	payload.colorAndDistance = float4(reColor.xyz , RayTCurrent());
 	//payload.colorAndDistance = float4(hitColor, RayTCurrent());
 	//payload.colorAndDistance = float4(hitTexCoord,1.0, RayTCurrent());
@@ -6,7 +6,7 @@
 //};
 
 Texture2D    gDiffuseMap : register(t0);//ͼ
-SamplerState gsamLinear  : register(s0);
+SamplerState gsamAnisotropic : register(s4);	// anisotropic wrap
 
 
 struct PSInput {
@@ -26,8 +26,38 @@ cbuffer CameraParams : register(b0)
 	float4x4 projection;
 }
 
+#ifdef QUANTIZED_POSITION
+// Root constants, position = center + extent * snorm position
+cbuffer MeshConstants : register(b2)
+{
+	float3 dequantCenter;
+	float  pad0;
+	float3 dequantExtent;
+	float  pad1;
+}
+#endif
+
+#ifdef COMPACT_VERTEX
+float3 OctDecode(float2 e)
+{
+	float3 n = float3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+#endif
+
 //PSInput VSMain(float4 position : POSITION, float4 color : COLOR) {
+#ifdef COMPACT_VERTEX
+PSInput VSMain(float4 position : POSITION, float2 octNormal : NORMAL, float2 texCoord: TEXCOORD) {
+  float3 normal = OctDecode(octNormal);
+#ifdef QUANTIZED_POSITION
+  position = float4(dequantCenter + dequantExtent * position.xyz, 1.0);
+#endif
+#else
 PSInput VSMain(float4 position : POSITION, float3 normal : NORMAL, float2 texCoord: TEXCOORD) {
+#endif
   PSInput result;
 
   float4 pos = position; 
@@ -44,5 +74,5 @@ PSInput VSMain(float4 position : POSITION, float3 normal : NORMAL, float2 texCoo
 
 float4 PSMain(PSInput input) : SV_TARGET { 
 	
-	return gDiffuseMap.SampleLevel(gsamLinear, input.texCoord,0.0);
+	return gDiffuseMap.Sample(gsamAnisotropic, input.texCoord);
 }